@@ -14,7 +14,8 @@ data_en =
   (see @building.html@building@ for details).</p>
   <p><span class="warning">NOTE:</span> TCP/IP support is $experimental$ in eLua. While functional, it's still slow and suffers from a number of
   other issues. It will most likely change a lot in the future, so expect major changes to this module as well.</p>
-  <p><span class="warning">NOTE:</span> currently, only TCP sockets are supported by eLua.]],
+  <p><span class="warning">NOTE:</span> UDP sockets are limited by the ARP implementation of uIP: the first datagram sent to a host that is not yet in the ARP
+  table is replaced by an ARP request and thus lost.]],
 
   -- Structures
   structures =
@@ -76,14 +77,42 @@ argument. The IP is given as a string.]],
 
 
     { sig = "ip = #net.lookup#( hostname )",
-      desc = "Does a DNS lookup.",
+      desc = [[Does a DNS lookup. Answers are cached for the time-to-live sent by the DNS server and failed lookups are remembered for a
+short time, so only names that are not in the cache generate a query (see $ELUA_NET_DNS_CACHE_SIZE$ in @building.html@building eLua@).]],
       args = "$hostname$ - the name of the computer.",
-      ret = "The IP address of the computer."
+      ret = "The IP address of the computer, or 0 if the name could not be resolved."
     },
 
-    { sig = "socket = #net.socket#( type )",
-      desc = "Create a socket for TCP/IP communication.",
-      args = [[$type$ - can be either $net.SOCK_STREAM$ for TCP sockets or $net.SOCK_DGRAM$ for UDP sockets (<span class="warning">not yet supported</span>).]],
+    { sig = "stats = #net.stats#( [reset] )",
+      desc = [[Returns statistics about the TCP/IP stack, useful for measuring the interrupt latency it adds (see $ELUA_NET_DEFERRED$ in 
+@building.html@building eLua@) and the processing time of each received frame. Times are in microseconds and they are 0 if the 
+@arch_platform_timers.html#the_system_timer@system timer@ is not available.]],
+      args = "$reset (optional)$ - if $true$, the statistics are reset after they are returned.",
+      ret = [[A table with these fields: $isrmax$ (the longest run of the Ethernet interrupt handler), $isrcount$ (the number of calls to the
+interrupt handler), $rxframes$ (the number of received frames processed) and $rxtime$ (the total time spent processing them).]]
+    },
+
+    { sig = "handle = #net.lookup_async#( hostname )",
+      desc = [[Starts a DNS lookup without waiting for the answer. Use @#net.lookup_poll@net.lookup_poll@ to get the result.]],
+      args = "$hostname$ - the name of the computer.",
+      ret = "A handle for @#net.lookup_poll@net.lookup_poll@."
+    },
+
+    { sig = "ip = #net.lookup_poll#( handle )",
+      desc = "Checks the result of a lookup started with @#net.lookup_async@net.lookup_async@.",
+      args = "$handle$ - the handle returned by @#net.lookup_async@net.lookup_async@.",
+      ret = "$nil$ if the lookup is still in progress, otherwise the IP address of the computer or 0 if the name could not be resolved."
+    },
+
+    { sig = "socket = #net.socket#( type, [rxbufsize] )",
+      desc = [[Create a socket for TCP/IP communication. Data received on the socket is kept in a receive buffer until it is read with 
+@#net.recv@net.recv@, so the remote system can keep sending data even when the socket is not being read.]],
+      args = 
+      {
+        [[$type$ - can be either $net.SOCK_STREAM$ for TCP sockets or $net.SOCK_DGRAM$ for UDP sockets.]],
+        [[$rxbufsize (optional)$ - the size of the receive buffer in bytes (for UDP sockets each queued datagram also uses 8 bytes of this buffer; datagrams that
+don't fit are dropped), at most 32767. If not specified the default size (set at build time with $ELUA_NET_RX_BUF_SIZE$) is used.]]
+      },
       ret = "The socket that will be used in subsequent operations."
     },
 
@@ -104,6 +133,21 @@ argument. The IP is given as a string.]],
       ret = "$err$ - the error code, as defined @#error_codes@here@."
     },
 
+    { sig = "res = #net.listen#( port )",
+      desc = [[Start listening on a port. Connections to this port are established and queued (up to $ELUA_NET_ACCEPT_BACKLOG$ connections, see 
+@building.html@building@) until they are returned by @#net.accept@net.accept@; when the queue is full new connections are reset. 
+@#net.accept@net.accept@ calls this function automatically, so it's needed only for queueing connections before the first $accept$.
+Several ports can listen at the same time.]],
+      args = "$port$ - the port.",
+      ret = "$res$ - 0 for success, -1 for error."
+    },
+
+    { sig = "res = #net.unlisten#( port )",
+      desc = "Stop listening on a port. The connections that were queued but not accepted are closed.",
+      args = "$port$ - the port.",
+      ret = "$res$ - 0 for success, -1 if the port wasn't listening."
+    },
+
     { sig = "socket, remoteip, err = #net.accept#( port, [timer_id, timeout] )",
       desc = "Accept a connection from a remote system with an optional timeout.",
       args =
@@ -111,23 +155,29 @@ argument. The IP is given as a string.]],
         "$port$ - the port to wait for connections from the remote system.",
         [[$timer_id (optional)$ - the ID of the timer used for measuring the timeout. Use $nil$ or $tmr.SYS_TIMER$ to specify the @arch_platform_timers.html#the_system_timer@system timer@.]],
        [[$timeout (optional)$ - timeout of the operation, can be either $net.NO_TIMEOUT$ or 0 for non-blocking operation, $net.INF_TIMEOUT$ for 
-blocking operation, or a positive number that specifies the timeout in microseconds. The default value of this argument is $unet.INF_TIMEOUT$.]],
+blocking operation, or a positive number that specifies the timeout in microseconds. The default value of this argument is $net.INF_TIMEOUT$.]],
 
       },
       ret =
       {
-        "$socket$ - the socket created after accepting the remote connection.",
+        [[$socket$ - the socket created after accepting the remote connection, or -1 if no connection was accepted. The port keeps listening after 
+this function returns (see @#net.listen@net.listen@), so connections that arrive later are returned by the next calls to $net.accept$ on the same port.]],
         "$remoteip$ - the IP of the remote system.",
         "$err$ - an error code, as defined @#error_codes@here@."
       }
     },
 
-    { sig = "res, err = #net.send#( sock, str )",
-      desc = "Send data to a socket.",
+    { sig = "res, err = #net.send#( sock, str, [async] )",
+      desc = [[Send data to a socket. By default the function returns after all the data was acknowledged by the remote system. In asynchronous
+mode the function returns immediately and the data is sent directly from $str$ (which is kept referenced by the socket until the next send
+or until the socket is closed); if the previous send on the socket is still in progress it returns 0 and $net.ERR_TIMEDOUT$ instead (use 
+@#net.select@net.select@ to find out when the socket is ready). An asynchronous send handles at most 16KB, so for larger strings it returns
+the number of bytes that will be sent and the rest must be sent separately.]],
       args = 
       {
         "$sock$ - the socket.",
-        "$str$ - the data to send."
+        "$str$ - the data to send.",
+        "$async (optional)$ - $true$ to return without waiting for the data to be acknowledged, $false$ by default."
       },
       ret = 
       {
@@ -137,7 +187,8 @@ blocking operation, or a positive number that specifies the timeout in microseco
     },
 
     { sig = "res, err = #net.recv#( sock, format, [timer_id, timeout] )",
-      desc = "Read data from a socket.",
+      desc = [[Read data from a socket. When reading a number of bytes, the function returns as soon as some data is available (up to the requested size).
+When reading a line, it waits until the end of the line is received.]],
       args = 
       {
         "$sock$ - the socket.",
@@ -155,6 +206,74 @@ blocking operation, or a positive number that specifies the timeout in microseco
         "$res$ - the number of bytes read.",
         "$err$ - the error code, as defined @#error_codes@here@."
       }
+    },
+
+    { sig = "res = #net.bind#( sock, port )",
+      desc = "Bind an UDP socket to a local port, so that it can receive datagrams sent to that port.",
+      args = 
+      {
+        "$sock$ - an UDP socket obtained from @#net.socket@net.socket@.",
+        "$port$ - the local port."
+      },
+      ret = "$res$ - 0 for success, -1 if the port is already in use or $sock$ is not an UDP socket."
+    },
+
+    { sig = "res, err = #net.sendto#( sock, str, remoteip, port )",
+      desc = "Send a datagram on an UDP socket.",
+      args = 
+      {
+        "$sock$ - an UDP socket obtained from @#net.socket@net.socket@.",
+        "$str$ - the data to send. It must fit in a single uIP buffer, otherwise $net.ERR_OVERFLOW$ is returned.",
+        "$remoteip$ - the IP of the destination, as returned by @#net.packip@net.packip@ or @#net.lookup@net.lookup@.",
+        "$port$ - the destination port."
+      },
+      ret =
+      {
+        "$res$ - the number of bytes sent, or -1 for error.",
+        "$err$ - the error code, as defined @#error_codes@here@."
+      }
+    },
+
+    { sig = "data, remoteip, port, err = #net.recvfrom#( sock, maxsize, [timer_id, timeout] )",
+      desc = [[Read a datagram from an UDP socket. If the datagram is larger than $maxsize$ it is truncated, the rest of it is discarded and
+$net.ERR_OVERFLOW$ is returned.]],
+      args = 
+      {
+        "$sock$ - an UDP socket obtained from @#net.socket@net.socket@.",
+        "$maxsize$ - the maximum number of bytes to read.",
+        [[$timer_id (optional)$ - the ID of the timer used for measuring the timeout. Use $nil$ or $tmr.SYS_TIMER$ to specify the @arch_platform_timers.html#the_system_timer@system timer@.]],
+        [[$timeout (optional)$ - timeout of the operation, can be either $net.NO_TIMEOUT$ or 0 for non-blocking operation, $net.INF_TIMEOUT$ for 
+blocking operation, or a positive number that specifies the timeout in microseconds. The default value of this argument is $net.INF_TIMEOUT$.]],
+      },
+      ret =
+      {
+        "$data$ - the datagram data.",
+        "$remoteip$ - the IP of the sender.",
+        "$port$ - the port of the sender.",
+        "$err$ - the error code, as defined @#error_codes@here@."
+      }
+    },
+
+    { sig = "rsocks, wsocks, ports = #net.select#( rsocks, [wsocks], [ports], [timer_id, timeout] )",
+      desc = [[Wait until at least one socket is ready, so that a single program can serve many connections. A socket is ready for reading when 
+@#net.recv@net.recv@ (or @#net.recvfrom@net.recvfrom@) has data to return, and ready for writing when an asynchronous @#net.send@net.send@ 
+won't fail because of a previous send. Closed sockets are always returned as ready for both reading and writing. A port is ready when 
+@#net.accept@net.accept@ has a connection to return.]],
+      args =
+      {
+        "$rsocks$ - array of sockets to check for reading (can be $nil$).",
+        "$wsocks (optional)$ - array of sockets to check for writing.",
+        "$ports (optional)$ - array of local ports to check for new connections (they start listening if needed).",
+        [[$timer_id (optional)$ - the ID of the timer used for measuring the timeout. Use $nil$ or $tmr.SYS_TIMER$ to specify the @arch_platform_timers.html#the_system_timer@system timer@.]],
+        [[$timeout (optional)$ - timeout of the operation, can be either $net.NO_TIMEOUT$ or 0 for non-blocking operation, $net.INF_TIMEOUT$ for 
+blocking operation, or a positive number that specifies the timeout in microseconds. The default value of this argument is $net.INF_TIMEOUT$.]],
+      },
+      ret =
+      {
+        "$rsocks$ - array with the sockets that are ready for reading.",
+        "$wsocks$ - array with the sockets that are ready for writing.",
+        "$ports$ - array with the ports that have a connection waiting."
+      }
     }
   },
 }
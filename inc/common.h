@@ -29,6 +29,7 @@ void cmn_systimer_periodic();
 timer_data_type cmn_systimer_get();
 
 void cmn_uart_setup_sermux();
+void cmn_uart_sermux_periodic();
 
 unsigned int intlog2( unsigned int v );
 const char* cmn_str64( u64 x );
@@ -35,6 +35,12 @@ typedef struct
 // C interrupt handlers
 typedef void( *elua_int_c_handler )( elua_int_resnum resnum );
 
+// Deferred C functions (called from the Lua hook, see elua_int_defer)
+typedef void( *elua_int_p_deferred )( void );
+
+// Maximum number of different deferred C functions
+#define ELUA_INT_MAX_DEFERRED           4
+
 // Handler key in the registry
 #define LUA_INT_HANDLER_KEY             ( int )&elua_int_add
 
@@ -44,6 +50,7 @@ typedef void( *elua_int_c_handler )( elua_int_resnum resnum );
 
 // Function prototypes
 int elua_int_add( elua_int_id inttype, elua_int_resnum resnum );
+int elua_int_defer( elua_int_p_deferred pfunc );
 void elua_int_enable( elua_int_id inttype );
 void elua_int_disable( elua_int_id inttype );
 int elua_int_is_enabled( elua_int_id inttype );
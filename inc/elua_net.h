@@ -9,6 +9,7 @@
 
 // eLua network typedefs
 typedef s16 elua_net_size;
+#define ELUA_NET_MAX_SIZE     0x7FFF
 
 // eLua net error codes
 enum
@@ -38,17 +39,55 @@ typedef union
 // 'no lastchar' for read to char (recv)
 #define ELUA_NET_NO_LASTCHAR          ( -1 )
 
+// Socket readiness events (elua_net_poll)
+#define ELUA_NET_EV_READ              1
+#define ELUA_NET_EV_WRITE             2
+#define ELUA_NET_EV_ACCEPT            4
+#define ELUA_NET_EV_CLOSED            8
+
+// Hostname lookup status (elua_net_lookup_status)
+#define ELUA_NET_LOOKUP_PENDING       0
+#define ELUA_NET_LOOKUP_DONE          1
+#define ELUA_NET_LOOKUP_ERROR         2
+
+typedef struct
+{
+  int sock;                           // socket (or local port for ELUA_NET_EV_ACCEPT)
+  u8 events, revents;
+} elua_net_pollfd;
+
+// Network statistics (times in microseconds)
+typedef struct
+{
+  timer_data_type isr_max;            // longest run of the Ethernet interrupt handler
+  u32 isr_count;                      // number of calls to the interrupt handler
+  u32 rx_frames;                      // number of received frames processed
+  timer_data_type rx_time;            // total time spent processing them
+} elua_net_stats;
+
 // eLua TCP/IP functions
-int elua_net_socket( int type );
+int elua_net_socket( int type, elua_net_size rxsize );
 int elua_net_close( int s );
 elua_net_size elua_net_recvbuf( int s, luaL_Buffer *buf, elua_net_size maxsize, s16 readto, unsigned timer_id, timer_data_type to_us );
 elua_net_size elua_net_recv( int s, void *buf, elua_net_size maxsize, s16 readto, unsigned timer_id, timer_data_type to_us );
 elua_net_size elua_net_send( int s, const void* buf, elua_net_size len );
+elua_net_size elua_net_send_async( int s, const void* buf, elua_net_size len );
+elua_net_size elua_net_telnet_write( const void* buf, elua_net_size len );
 int elua_accept( u16 port, unsigned timer_id, timer_data_type to_us, elua_net_ip* pfrom );
+int elua_net_listen( u16 port );
+int elua_net_unlisten( u16 port );
 int elua_net_connect( int s, elua_net_ip addr, u16 port );
+int elua_net_bind( int s, u16 port );
+elua_net_size elua_net_sendto( int s, const void* buf, elua_net_size len, elua_net_ip addr, u16 port );
+elua_net_size elua_net_recvfrom( int s, void *buf, elua_net_size maxsize, elua_net_ip *pfrom, u16 *pport, unsigned timer_id, timer_data_type to_us );
+elua_net_size elua_net_recvfrombuf( int s, luaL_Buffer *buf, elua_net_size maxsize, elua_net_ip *pfrom, u16 *pport, unsigned timer_id, timer_data_type to_us );
 elua_net_ip elua_net_lookup( const char* hostname );
+int elua_net_lookup_async( const char* hostname );
+int elua_net_lookup_status( int handle, elua_net_ip *pres );
+int elua_net_poll( elua_net_pollfd *fds, unsigned nfds, unsigned timer_id, timer_data_type to_us );
 
 int elua_net_get_last_err( int s );
 int elua_net_get_telnet_socket();
+void elua_net_get_stats( elua_net_stats *pstats, int reset );
 
 #endif
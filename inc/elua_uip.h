@@ -12,8 +12,6 @@ enum
 {
   ELUA_UIP_STATE_IDLE = 0,
   ELUA_UIP_STATE_SEND,
-  ELUA_UIP_STATE_RECV,
-  ELUA_UIP_STATE_RECV_2,
   ELUA_UIP_STATE_CONNECT,
   ELUA_UIP_STATE_CLOSE
 };
@@ -24,15 +22,20 @@ struct elua_uip_state
   u8                state, res;
   char*             ptr; 
   elua_net_size     len;
-  s16               readto;
+  // Receive ring (filled by the UIP application, emptied by recv)
+  u8*               rxbuf;
+  elua_net_size     rxsize, rxhead, rxcount;
+  u8                rxstatus, rxupdate;
 };
 
 struct uip_eth_addr;
+struct uip_conn;
 
 // Helper functions
 void elua_uip_appcall();
 void elua_uip_udp_appcall();
 void elua_uip_init( const struct uip_eth_addr* paddr );
 void elua_uip_mainloop();
+u16 elua_uip_rx_window( struct uip_conn *conn );
 
 #endif
@@ -28,6 +28,25 @@
 #define   ELUARPC_SMALL_READ_BUF_OFFSET ( ELUARPC_START_OFFSET + ELUARPC_START_SIZE + ELUARPC_RESPONSE_SIZE + ELUARPC_SMALL_PTR_HEADER_SIZE )
 #define   ELUARPC_WRITE_REQUEST_EXTRA ( ELUARPC_START_OFFSET + ELUARPC_START_SIZE + ELUARPC_OP_ID_SIZE + ELUARPC_U32_SIZE + ELUARPC_PTR_HEADER_SIZE + ELUARPC_END_SIZE )
 
+// Datagram transport constants
+// On unreliable datagram transports (UDP) every packet is prefixed with a 
+// sequence header. A response carries the sequence number of its request and
+// acts as its acknowledgement; a request with an already seen sequence number
+// is a retransmission and is answered from the last response, not executed.
+#define   ELUARPC_SEQ_HEADER_SIZE ( 1 + ELUARPC_U32_SIZE )
+#define   ELUARPC_RTO_INITIAL     500000UL  // initial retransmission timeout (us)
+#define   ELUARPC_RTO_MIN         20000UL   // minimum retransmission timeout (us)
+#define   ELUARPC_RTO_MAX         4000000UL // maximum retransmission timeout (us)
+#define   ELUARPC_MAX_RETRIES     8
+
+// Adaptive retransmission timeout state (RFC 6298 estimator)
+typedef struct
+{
+  u32 srtt;                       // smoothed RTT (us), 0 if no sample yet
+  u32 rttvar;                     // RTT variation (us)
+  u32 rto;                        // current retransmission timeout (us)
+} ELUARPC_RTO_DATA;
+
 // Public interface
 // Get request ID
 int eluarpc_get_request_id( const u8 *p, u8 *pid );
@@ -62,4 +81,14 @@ void eluarpc_gen_write( u8 *p, const char *fmt, ... );
 //             P - ptr (returned as ptr, len, len is an u16)
 int eluarpc_gen_read( const u8 *p, const char *fmt, ... );
 
+// Datagram sequence header
+void eluarpc_write_seq( u8 *p, u32 seq );
+int eluarpc_read_seq( const u8 *p, u32 *pseq );
+int eluarpc_has_seq( const u8 *p );
+
+// Adaptive retransmission timeout
+void eluarpc_rto_init( ELUARPC_RTO_DATA *pd );
+void eluarpc_rto_sample( ELUARPC_RTO_DATA *pd, u32 rtt );
+void eluarpc_rto_backoff( ELUARPC_RTO_DATA *pd );
+
 #endif
@@ -9,6 +9,8 @@
 
 #define MAX_LINK_ERRS ( 2 ) // Maximum number of framing errors before connection reset
 
+#define MAX_ASYNC_CALLS ( 16 ) // Maximum number of outstanding async calls per handle
+
 #define LUARPC_MODE "elua"
 
 // a kind of silly way to get the maximum int, but oh well ...
@@ -89,6 +91,11 @@ struct _Transport
          net_little: 1,               // Network is little endian?
          net_intnum: 1;               // Network is integer only?
   u8     lnum_bytes;
+  u8     *wbuf;                       // outgoing frame buffer
+  u32    wlen, wsize;                 // outgoing frame length / allocated size
+  u8     *rbuf;                       // incoming frame buffer
+  u32    rpos, rlen, rsize;           // read position / frame length / allocated size
+  int    paths_ref;                   // server: registry ref to table of cached paths (by ID)
 };
 
 typedef struct _Handle Handle;
@@ -98,6 +105,29 @@ struct _Handle
   int error_handler;                  // function reference
   int async;                          // nonzero if async mode being used
   int read_reply_count;               // number of async call return values to read
+  u32 next_id;                        // request ID of the next async call
+  int pending_ref;                    // registry ref to table of pending futures (by ID)
+  u32 next_path_id;                   // ID of the next path cached on the server
+  u32 path_gen;                       // cache generation, incremented on invalidation
+  u32 value_gen;                      // read-only values generation, incremented on invalidation and assignment
+  int cache_ref;                      // registry ref to table of helpers (by path)
+};
+
+// Future state
+enum
+{
+  RPC_FUTURE_PENDING = 0,
+  RPC_FUTURE_DONE,
+  RPC_FUTURE_ERROR
+};
+
+typedef struct _Future Future;
+struct _Future {
+  Handle *handle;                     // handle used for the call
+  int href;                           // handle reference in registry
+  u32 id;                             // request ID
+  int state;                          // RPC_FUTURE_xxx
+  int rref;                           // registry ref to results table (or error message)
 };
 
 typedef struct _Helper Helper;
@@ -107,6 +137,10 @@ struct _Helper {
   int pref;                           // Parent reference idx in registry
   u8 nparents;                        // number of parents
   char funcname[NUM_FUNCNAME_CHARS];  // name of the function
+  u32 path_id;                        // ID of the path cached on the server (0 if none)
+  u32 path_gen;                       // cache generation of path_id
+  int vref;                           // registry ref to cached read-only value
+  u32 vgen;                           // read-only values generation of vref
 };
 
 typedef struct _ServerHandle ServerHandle;
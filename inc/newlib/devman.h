@@ -33,6 +33,27 @@
 // Directory entry flags
 #define DM_DIRENT_FLAG_DIR        1
 
+// Device flags
+// The content of the device changes only through the device manager (so a file that
+// was not found remains missing until something is written to the device). The device
+// manager remembers the files that were not found on these devices
+#define DM_DEVICE_FLAG_CACHE_MISSING  1
+
+// Longest file name (without the device name) that can be cached
+#define DM_PATH_CACHE_MAX_PATH    ( DM_MAX_DEV_NAME + DM_MAX_FNAME_LENGTH + 1 )
+
+// Device specific requests (dm_ioctl)
+// DM_IOCTL_MAP: get the memory mapping of a file opened in read mode ('arg' is
+// a DM_MAP_INFO*). The data is directly accessible by the CPU, doesn't change
+// while the FS is mounted and is followed by a '\0' byte (not part of the file),
+// so it can be used as a read-only Lua string without copying it to RAM.
+#define DM_IOCTL_MAP              1
+
+typedef struct {
+  const char *addr;
+  u32 size;
+} DM_MAP_INFO;
+
 // Our platform independent "dirent" structure (for opendir/readdir)
 struct dm_dirent {
   u32 fsize;
@@ -60,6 +81,8 @@ typedef struct
   int ( *p_closedir_r )( struct _reent *r, void* dir, void *pdata );
   const char* ( *p_getaddr_r )( struct _reent *r, int fd, void *pdata );
   int ( *p_mkdir_r )( struct _reent *r, const char *pathname, mkdir_mode_t mode, void *pdata );
+  int ( *p_ioctl_r )( struct _reent *r, int fd, int req, void *arg, void *pdata );
+  u8 flags;
 } DM_DEVICE;
 
 // Additional registration data for each FS (per FS instance)
@@ -97,14 +120,22 @@ const DM_DEVICE* dm_get_device_at( int idx );
 const DM_INSTANCE_DATA* dm_get_instance_at( int idx );
 // Returns the number of registered devices
 int dm_get_num_devices();
+// Find a device from the first 'len' chars of its name
+int dm_find_device( const char *name, unsigned len );
 // Initialize device manager
 int dm_init();
 
+// Cache of missing files
+int dm_pcache_is_missing( int devid, const char *path );
+void dm_pcache_add_missing( int devid, const char *path );
+void dm_pcache_invalidate( int devid );
+
 // DM specific functions (uniform over all the installed filesystems)
 DM_DIR *dm_opendir( const char* dirname );
 struct dm_dirent* dm_readdir( DM_DIR *d );
 int dm_closedir( DM_DIR *d );
 const char* dm_getaddr( int fd );
+int dm_ioctl( int fd, int req, void *arg );
 
 #endif
 
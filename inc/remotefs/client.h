@@ -16,6 +16,7 @@ typedef u32 ( *p_rfsc_recv )( u8 *p, u32 size, timer_data_type timeout );
 
 // Public interface
 void rfsc_setup( u8 *pbuf, p_rfsc_send rfsc_send_func, p_rfsc_recv rfsc_recv_func, timer_data_type timeout );
+void rfsc_setup_datagram( u8 *ptxbuf, u8 *prxbuf, u32 size, p_rfsc_send rfsc_send_func, p_rfsc_recv rfsc_recv_func );
 void rfsc_set_timeout( timer_data_type timeout );
 int rfsc_open( const char* pathname, int flags, int mode );
 s32 rfsc_write( int fd, const void *buf, u32 count );
@@ -14,16 +14,49 @@ Filename: ASCIIZ, max length is DM_MAX_FNAME_LENGTH, first byte is 0xFF if last
 File size: (4 bytes), aligned to ROMFS_ALIGN bytes 
 File data: (file size bytes)
 
+The ROMFS image can start with a directory index, used to find files without
+scanning the whole image:
+
+Magic: (4 bytes) 0x00, 'I', 'D', 'X' or 0x00, 'I', 'D', 'Z' (a file name never
+       starts with 0x00)
+Number of entries: (4 bytes)
+Entries: (8 bytes each, sorted by hash) name hash (4 bytes), offset of the file
+         name in the image (4 bytes)
+
+With the 'Z' magic, the data of each file is followed by a '\0' byte that is
+not part of the file (not counted in its size). Files from such an image can be
+mapped in memory as read-only Lua strings (io.mapfile) without copying them to
+RAM, since a Lua string must end with a '\0'.
+
+All numbers are little endian. The name hash is h = h * 31 + tolower( c ) over
+the characters of the file name, modulo 2^32. Images without the magic are
+scanned linearly. WOFS keeps an equivalent index in RAM, built at startup.
+
 The WOFS (Write Once File System) uses much of the ROMFS functions, thuss it is
 also implemented in romfs.c. It resides in a contiguous zone of memory, with a
 structure that is quite similar with ROMFS' structure (repeated for each file):
 
 Filename: ASCIIZ, max length is DM_MAX_FNAME_LENGTH, first byte is 0xFF if last file.
           WOFS filenames always begin at an address which is a multiple of ROMFS_ALIGN.
-File deleted flag: (WOFS_DEL_FIELD_SIZE bytes), aligned to ROMFS_ALIGN bytes
+File deleted flag: (WOFS_DEL_FIELD_SIZE bytes), aligned to ROMFS_ALIGN bytes. The
+                   first byte is the flag (deleted, or deleted after a power
+                   failure), the next 3 bytes can hold the end of the space
+                   reserved for a file opened in write mode
 File size: (4 bytes), aligned to ROMFS_ALIGN bytes
 File data: (file size bytes)
 
+Several WOFS files can be written at the same time. The space reserved for a
+file that was not fully used when the file is closed is marked as a deleted
+file with an empty name.
+
+If WOFS_ENABLE_COMPACTION is defined, the last sectors of WOFS are reserved for
+compaction (the space used by deleted files is reclaimed when needed): the
+very last sector is the swap sector, the sectors before it hold the compaction
+journal. Files are moved towards the beginning of WOFS one sector at a time.
+The new content of a sector is first built in the swap sector and recorded in
+the journal, then the sector is erased and written from the swap sector, so an
+interrupted compaction is completed when WOFS is initialized again.
+
 *******************************************************************************/
 
 enum
@@ -35,6 +68,8 @@ enum
 // ROMFS/WOFS functions
 typedef u32 ( *p_fs_read )( void *to, u32 fromaddr, u32 size, const void *pdata );
 typedef u32 ( *p_fs_write )( const void *from, u32 toaddr, u32 size, const void *pdata );
+typedef int ( *p_fs_erase )( u32 addr, const void *pdata );
+typedef u32 ( *p_fs_sector )( u32 addr, u32 *pstart, u32 *psize, const void *pdata );
 
 // File flags
 #define ROMFS_FILE_FLAG_READ      0x01
@@ -48,8 +83,18 @@ typedef struct
   u32 offset;
   u32 size;
   u8 flags;
+  u8 *pwbuf;                      // write buffer (WOFS only, NULL if not buffered)
+  u32 flushed;                    // number of bytes already written to the FS (WOFS only)
+  u32 resend;                     // end of the space reserved for a file opened in write mode (WOFS only)
 } FD;
 
+// An entry in the directory index
+typedef struct
+{
+  u32 hash;
+  u32 addr;
+} ROMFS_INDEX_ENTRY;
+
 // WOFS constants
 // The miminum size we need in order to create another file
 // This size will be added to the size of the filename when creating a new file
@@ -63,7 +108,11 @@ typedef struct
 // Filesystem flags
 #define ROMFS_FS_FLAG_DIRECT      0x01    // direct mode (the file is mapped in a memory area directly accesible by the CPU)
 #define ROMFS_FS_FLAG_WO          0x02    // this FS is actually a WO (Write-Once) FS
-#define ROMFS_FS_FLAG_WRITING     0x04    // for WO only: there is already a file opened in write mode
+#define ROMFS_FS_FLAG_WRITING     0x04    // for WO only: there are files opened in write mode
+#define ROMFS_FS_FLAG_INDEX       0x08    // the FS has a directory index (in the image for ROMFS, in RAM for WOFS)
+#define ROMFS_FS_FLAG_COMPACT     0x10    // for WO only: the space used by deleted files can be reclaimed
+#define ROMFS_FS_FLAG_COMPACTING  0x20    // for WO only: a compaction is in progress
+#define ROMFS_FS_FLAG_ZEROTERM    0x40    // for RO only: the data of each file is followed by a '\0' byte
 
 // File system descriptor
 typedef struct
@@ -72,7 +121,17 @@ typedef struct
   u8 flags;                       // flags (see above)
   p_fs_read readf;                // pointer to read function (for non-direct mode FS)
   p_fs_write writef;              // pointer to write function (only for ROMFS_FS_FLAG_WO)
+  p_fs_erase erasef;              // pointer to sector erase function (only for ROMFS_FS_FLAG_WO)
+  p_fs_sector sectorf;            // pointer to function that returns the sector of an address (only for ROMFS_FS_FLAG_WO)
   u32 max_size;                   // maximum size of the FS (in bytes)
+  u32 first;                      // address of the first file (after the directory index)
+  u32 nindex;                     // number of entries in the directory index
+  ROMFS_INDEX_ENTRY *pindex;      // directory index in RAM (only for ROMFS_FS_FLAG_WO)
+  u32 indexsize;                  // number of entries allocated in 'pindex'
+  u32 journal;                    // address of the compaction journal (only for ROMFS_FS_FLAG_COMPACT)
+  u32 swap;                       // address of the swap sector (only for ROMFS_FS_FLAG_COMPACT)
+  u32 nwriters;                   // number of files opened in write mode (only for ROMFS_FS_FLAG_WO)
+  u32 wend;                       // end of the files opened in write mode (only for ROMFS_FS_FLAG_WRITING)
 } FSDATA;
 
 #define romfs_fs_set_flag( p, f )     p->flags |= ( f )
@@ -82,6 +141,7 @@ typedef struct
 // FS functions
 int romfs_init();
 int wofs_format();
+void wofs_get_stats( u32 *pwritten, u32 *pprogram );
 
 #endif
 
@@ -13,6 +13,7 @@
 #define   TYPE_OP_ID      0x07
 #define   TYPE_SMALL_PTR  0x08
 #define   TYPE_PKT_SIZE   0xA5
+#define   TYPE_SEQ        0xA6
                                     
 #endif
 
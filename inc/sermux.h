@@ -3,6 +3,8 @@
 #ifndef __SERMUX_H__
 #define __SERMUX_H__
 
+#include "type.h"
+
 #define SERMUX_SERVICE_ID_FIRST  0xD0
 #define SERMUX_SERVICE_ID_LAST   0xD7
 #define SERMUX_SERVICE_MAX       ( SERMUX_SERVICE_ID_LAST - SERMUX_SERVICE_ID_FIRST + 1 )
@@ -13,4 +15,46 @@
 #define SERMUX_ESCAPE_XOR_MASK   0x20
 #define SERMUX_ESC_MASK          0x100
 
+// Packet mode commands. They follow SERMUX_ESCAPE_CHAR and are chosen so that
+// they can't be mistaken for an escaped char.
+#define SERMUX_CMD_PACKET_REQ    0x50
+#define SERMUX_CMD_PACKET_ACK    0x51
+#define SERMUX_CMD_FRAME         0x52
+
+// Packet mode frame: ESC, SERMUX_CMD_FRAME, service ID, length, data, CRC16 (MSB first)
+// The CRC (CCITT) covers the service ID, the length and the data
+#define SERMUX_FRAME_MAX_SIZE    128
+#define SERMUX_FRAME_HEADER_SIZE 4
+#define SERMUX_FRAME_OVERHEAD    ( SERMUX_FRAME_HEADER_SIZE + 2 )
+#define SERMUX_CRC_INIT          0xFFFF
+
+// Frame receiver results
+enum
+{
+  SERMUX_RX_NONE,
+  SERMUX_RX_FRAME,
+  SERMUX_RX_REQ,
+  SERMUX_RX_ACK,
+  SERMUX_RX_RAW,
+  SERMUX_RX_ERROR,
+  SERMUX_RX_CRC_ERROR
+};
+
+// Frame receiver state
+typedef struct
+{
+  u8 state;
+  u8 sid;
+  u8 len;
+  u8 pos;
+  u16 crc;
+  u16 rxcrc;
+  u8 data[ SERMUX_FRAME_MAX_SIZE ];
+} SERMUX_FRAME_RX;
+
+u16 sermux_crc16( u16 crc, const u8 *p, unsigned size );
+unsigned sermux_frame_header( u8 *phdr, u8 sid, unsigned size );
+void sermux_rx_init( SERMUX_FRAME_RX *prx );
+int sermux_rx_byte( SERMUX_FRAME_RX *prx, u8 data );
+
 #endif
@@ -19,10 +19,18 @@
 #define XMODEM_ERROR_OUTOFSYNC        (-2)
 #define XMODEM_ERROR_RETRYEXCEED      (-3)
 #define XMODEM_ERROR_OUTOFMEM         (-4)
+#define XMODEM_ERROR_WRITE            (-5)
+#define XMODEM_ERROR_STREAM           (-6)
+
+// xmodem_receive_stream flags
+#define XMODEM_FLAG_STREAMING         1
 
 typedef void ( *p_xm_send_func )( u8 );
 typedef int ( *p_xm_recv_func )( timer_data_type );
+// Data sink: receives the data of the file as it arrives, returns 0 or an error code
+typedef int ( *p_xm_sink_func )( const u8 *pdata, unsigned size, void *psink );
 long xmodem_receive( char** dest );
+long xmodem_receive_stream( p_xm_sink_func sink, void *psink, int flags );
 void xmodem_init( p_xm_send_func send_func, p_xm_recv_func recv_func );
 
 #endif // #ifndef __XMODEM_H__
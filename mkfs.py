@@ -9,6 +9,14 @@ _bytecnt = 0
 _fcnt = 0
 maxlen = 30
 alignment = 4
+idxmagic = [ 0, ord( 'I' ), ord( 'D' ), ord( 'Z' ) ] # index, file data followed by a '\0'
+
+# Name hash used by the directory index (must match romfsh_hash in src/romfs.c)
+def _hash( fname ):
+  h = 0
+  for c in fname.lower():
+    h = ( h * 31 + ord( c ) ) & 0xFFFFFFFF
+  return h
 
 # Line output function
 def _add_data( data, outfile, moredata = True ):
@@ -25,6 +33,11 @@ def _add_data( data, outfile, moredata = True ):
     _crtline = '  '
     _numdata = 0
 
+# Write a 32-bit little endian number
+def _add_u32( data, outfile ):
+  for i in range( 4 ):
+    _add_data( ( data >> ( 8 * i ) ) & 0xFF, outfile )
+
 # dirname - the directory where the files are located.
 # outname - the name of the C output
 # flist - list of files
@@ -47,6 +60,7 @@ def mkfs( dirname, outname, flist, mode, compcmd ):
   _crtline = '  '
   _numdata = 0
   _bytecnt = 0
+  files = []
   # Generate headers
   outfile.write( "// Generated by mkfs.py\n// DO NOT MODIFY\n\n" )
   outfile.write( "#ifndef __%s_H__\n#define __%s_H__\n\n" % ( outname.upper(), outname.upper() ) )
@@ -108,26 +122,40 @@ def mkfs( dirname, outname, flist, mode, compcmd ):
     if fextpart == ".lua" and mode != "verbatim":
       os.remove( newname )
 
-    # Write name, size, id, numpars
+    files.append( ( fname, filedata ) )
+
+  # Compute the offset of each file header, then write the directory index
+  # (magic, number of entries, then (hash, offset) pairs sorted by hash)
+  offset = len( idxmagic ) + 4 + 8 * len( files )
+  index = []
+  for fname, filedata in files:
+    index.append( ( _hash( fname ), offset ) )
+    offset = offset + len( fname ) + 1
+    offset = ( offset + alignment - 1 ) & ~( alignment - 1 )
+    offset = offset + 4 + len( filedata ) + 1
+  index.sort()
+  for c in idxmagic:
+    _add_data( c, outfile )
+  _add_u32( len( index ), outfile )
+  for h, o in index:
+    _add_u32( h, outfile )
+    _add_u32( o, outfile )
+
+  # Write the files: name, size, data
+  for fname, filedata in files:
     _fcnt = 0
     for c in fname:
       _add_data( ord( c ), outfile )
     _add_data( 0, outfile ) # ASCIIZ
-    size_ll = len( filedata ) & 0xFF
-    size_lh = ( len( filedata ) >> 8 ) & 0xFF
-    size_hl = ( len( filedata ) >> 16 ) & 0xFF
-    size_hh = ( len( filedata ) >> 24 ) & 0xFF
      # Round to a multiple of 4
     while _bytecnt & ( alignment - 1 ) != 0:
       _add_data( 0, outfile )
     # Write size
-    _add_data( size_ll, outfile )
-    _add_data( size_lh, outfile )
-    _add_data( size_hl, outfile )
-    _add_data( size_hh, outfile )
+    _add_u32( len( filedata ), outfile )
     # Then write the rest of the file
     for c in filedata:
       _add_data( ord( c ), outfile )
+    _add_data( 0, outfile ) # terminator (not part of the file)
     
     # Report
     print "Encoded file %s (%d bytes real size, %d bytes encoded size)" % ( fname, len( filedata ), _fcnt )
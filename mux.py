@@ -18,7 +18,7 @@ else:
 output = "mux%s" % exeprefix
 
 rfs_full_files = " " + " ".join( [ "rfs_server_src/%s" % name for name in rfs_flist.split() ] )
-full_files = " " + " ".join( [ "mux_src/%s" % name for name in flist.split() ] ) + rfs_full_files + " src/remotefs/remotefs.c src/eluarpc.c"
+full_files = " " + " ".join( [ "mux_src/%s" % name for name in flist.split() ] ) + rfs_full_files + " src/remotefs/remotefs.c src/eluarpc.c src/sermux.c"
 local_include = "-Imux_src -Irfs_server_src -Iinc -Iinc/remotefs"
 
 # Compiler/linker options
@@ -26,6 +26,9 @@
 
 #define RFS_PSEUDO_SELIDX     0xFF
 
+#define TRANSPORT_RX_BUF_SIZE 512
+#define NEGOTIATE_TIMEOUT_MS  500
+
 // Send/receive/init function pointers
 typedef u32 ( *p_recv_func )( u8 *p, u32 size );
 typedef u32 ( *p_send_func )( const u8 *p, u32 size );
@@ -59,6 +62,14 @@ static int mux_mode;
 static int verbose_mode;
 static int rfs_service_id = -1, service_offset;
 
+// Packet mode data
+static int packet_mode;
+static SERMUX_FRAME_RX packet_rx;
+
+// Data received from the transport, but not yet processed
+static u8 transport_rx_buf[ TRANSPORT_RX_BUF_SIZE ];
+static u32 transport_rx_pos, transport_rx_len;
+
 // ***************************************************************************
 // Serial transport implementation
 
@@ -97,6 +108,105 @@ static void transport_send_byte( u8 data )
   transport_send( &data, 1 );
 }
 
+static void transport_send_cmd( u8 cmd )
+{
+  u8 data[ 2 ] = { SERMUX_ESCAPE_CHAR, cmd };
+
+  transport_send( data, 2 );
+}
+
+// Send data to the given service as a sequence of frames (packet mode)
+static void packet_send_data( int sid, const u8 *p, u32 size )
+{
+  u8 frame[ SERMUX_FRAME_OVERHEAD + SERMUX_FRAME_MAX_SIZE ];
+  u32 chunk;
+  u16 crc;
+
+  while( size > 0 )
+  {
+    chunk = size > SERMUX_FRAME_MAX_SIZE ? SERMUX_FRAME_MAX_SIZE : size;
+    sermux_frame_header( frame, sid, chunk );
+    memcpy( frame + SERMUX_FRAME_HEADER_SIZE, p, chunk );
+    crc = sermux_crc16( SERMUX_CRC_INIT, frame + 2, chunk + 2 );
+    frame[ SERMUX_FRAME_HEADER_SIZE + chunk ] = crc >> 8;
+    frame[ SERMUX_FRAME_HEADER_SIZE + chunk + 1 ] = crc & 0xFF;
+    transport_send( frame, chunk + SERMUX_FRAME_OVERHEAD );
+    p += chunk;
+    size -= chunk;
+  }
+}
+
+// Ask the target to switch to packet mode. Targets that don't answer in time
+// are handled in the byte oriented mode.
+static void packet_negotiate()
+{
+  int c;
+  SERMUX_FRAME_RX rx;
+
+  sermux_rx_init( &rx );
+  transport_send_cmd( SERMUX_CMD_PACKET_REQ );
+  while( ( c = ser_read_byte( transport_hnd, NEGOTIATE_TIMEOUT_MS ) ) != -1 )
+    if( sermux_rx_byte( &rx, ( u8 )c ) == SERMUX_RX_ACK )
+    {
+      packet_mode = 1;
+      sermux_rx_init( &packet_rx );
+      log_msg( "Using packet mode (frames of up to %d bytes)\n", SERMUX_FRAME_MAX_SIZE );
+      return;
+    }
+  log_msg( "Target doesn't support packet mode, using byte mode\n" );
+}
+
+// Handle a byte from the transport in packet mode
+// Returns 1 if the byte was consumed, 0 if it must be handled in byte mode
+static int packet_handle_byte( u8 c )
+{
+  int i;
+
+  switch( sermux_rx_byte( &packet_rx, c ) )
+  {
+    case SERMUX_RX_FRAME:
+      if( packet_rx.sid < SERMUX_SERVICE_ID_FIRST || packet_rx.sid >= SERMUX_SERVICE_ID_FIRST + vport_num + service_offset )
+      {
+        log_err( "Protocol error: got frame for invalid service ID %d(%X)\n", packet_rx.sid, packet_rx.sid );
+        break;
+      }
+      if( packet_rx.sid == rfs_service_id ) // this request is for the RFS server
+      {
+        u16 rfs_size;
+        u8 *rfs_ptr;
+
+        for( i = 0; i < packet_rx.len; i ++ )
+        {
+          rfs_mem_read_request_packet( packet_rx.data[ i ] );
+          if( rfs_mem_has_response() ) // we have a response from the RFS server
+          {
+            rfs_mem_write_response( &rfs_size, &rfs_ptr );
+            packet_send_data( rfs_service_id, rfs_ptr, rfs_size );
+            rfs_mem_start_request(); // initialize the RFS server for a new request
+          }
+        }
+      }
+      else
+        ser_write( services[ packet_rx.sid - SERMUX_SERVICE_ID_FIRST - service_offset ].fd, packet_rx.data, packet_rx.len );
+      break;
+
+    case SERMUX_RX_RAW: // the target was reset, ask for packet mode again
+      log_msg( "Got byte mode data, switching to byte mode.\n" );
+      packet_mode = 0;
+      transport_send_cmd( SERMUX_CMD_PACKET_REQ );
+      return 0;
+
+    case SERMUX_RX_ERROR:
+      log_err( "Protocol error: invalid frame\n" );
+      break;
+
+    case SERMUX_RX_CRC_ERROR:
+      log_err( "Protocol error: CRC error in frame for service ID %d(%X)\n", packet_rx.sid, packet_rx.sid );
+      break;
+  }
+  return 1;
+}
+
 // Transport parser
 static int parse_transport( const char* s )
 {
@@ -162,6 +272,8 @@ int main( int argc, char **argv )
   int selidx;
   u16 rfs_size = 0;
   u8 *rfs_ptr;
+  u8 txbuf[ SERMUX_FRAME_MAX_SIZE ];
+  u32 txsize;
 
   // Interpret arguments
   setvbuf( stdout, NULL, _IONBF, 0 );  
@@ -258,6 +370,7 @@ int main( int argc, char **argv )
       return 1;
   }
 
+  packet_negotiate();
   log_msg( "Starting service multiplexer on %u port(s)\n", vport_num );
   
   // Main service thread
@@ -269,6 +382,11 @@ int main( int argc, char **argv )
       rfs_size --;
       selidx = RFS_PSEUDO_SELIDX;
     }
+    else if( transport_rx_pos < transport_rx_len ) // Data already read from the transport
+    {
+      c = transport_rx_buf[ transport_rx_pos ++ ];
+      selidx = HND_TRANSPORT_OFFSET;
+    }
     else
     {
       if( ( c = ser_select_byte( phandlers, vport_num + 1, SER_INF_TIMEOUT ) ) == -1 )
@@ -278,12 +396,28 @@ int main( int argc, char **argv )
       }
       selidx = c >> 8;
       c = c & 0xFF;
+      // Get everything else that is available on the transport with a single read
+      if( selidx == HND_TRANSPORT_OFFSET )
+      {
+        transport_rx_len = ser_read( transport_hnd, transport_rx_buf, TRANSPORT_RX_BUF_SIZE, SER_NO_TIMEOUT );
+        transport_rx_pos = 0;
+      }
     }
     //log_msg( "Got byte %d from idx %d\n", c, selidx );
+    if( selidx == HND_TRANSPORT_OFFSET && packet_mode && packet_handle_byte( c ) )
+      continue;
     if( selidx == HND_TRANSPORT_OFFSET ) // Got byte on transport interface
     {
       // Interpret byte
-      if( c != SERMUX_ESCAPE_CHAR )
+      if( got_esc && c == SERMUX_CMD_PACKET_ACK )
+      {
+        log_msg( "Target switched to packet mode.\n" );
+        packet_mode = 1;
+        sermux_rx_init( &packet_rx );
+        service_id_in = service_id_out = prev_sent = -1;
+        got_esc = 0;
+      }
+      else if( c != SERMUX_ESCAPE_CHAR )
       {
         if( c >= SERMUX_SERVICE_ID_FIRST && c <= SERMUX_SERVICE_ID_LAST )
         {
@@ -345,6 +479,14 @@ int main( int argc, char **argv )
       else
         got_esc = 1;                          
     }
+    else if( packet_mode && selidx != RFS_PSEUDO_SELIDX )
+    {
+      // Send everything available on the service port in a single frame
+      tservice = services + selidx - HND_FIRST_VOFFSET;
+      txbuf[ 0 ] = ( u8 )c;
+      txsize = 1 + ser_read( tservice->fd, txbuf + 1, SERMUX_FRAME_MAX_SIZE - 1, SER_NO_TIMEOUT );
+      packet_send_data( SERMUX_SERVICE_ID_FIRST + selidx - HND_FIRST_VOFFSET + service_offset, txbuf, txsize );
+    }
     else
     {
       // No byte to read, there must be something to send
@@ -116,41 +116,71 @@ const RFS_TRANSPORT_DATA ser_transport_data = { ser_read_request_packet, ser_sen
 static NET_SOCKET trans_socket = INVALID_SOCKET_VALUE;
 static struct sockaddr_in trans_from;
 
-// Helper: read (blocking) the specified number of bytes
-
-static void udp_read_helper( u8 *dest, u32 size )
-{
-  socklen_t fromlen;
-  int readbytes;
-
-  while( size )
-  {
-    fromlen = sizeof( trans_from );
-    readbytes = net_recvfrom( trans_socket, ( char* )dest, size, 0, ( struct sockaddr* )&trans_from, &fromlen, NET_INF_TIMEOUT );
-    size -= readbytes;
-    if( size == 0 )
-      break;
-    dest += readbytes;
-  }
-}
+// Reliability state: the whole datagram (sequence header + packet) is read in
+// a single receive call. The last response is kept so that a retransmitted
+// request (same sequence number from the same client address and port) is
+// answered without executing it again. A request from another address or
+// port starts a new session, so the last response is forgotten.
+static u8 udp_rx_buffer[ ELUARPC_SEQ_HEADER_SIZE + sizeof( rfs_buffer ) ];
+static u8 udp_tx_buffer[ ELUARPC_SEQ_HEADER_SIZE + sizeof( rfs_buffer ) ];
+static u32 udp_tx_size;
+static u32 udp_crt_seq;
+static int udp_crt_has_seq;
+static int udp_has_last_seq;
+static struct sockaddr_in udp_last_from;
 
 static void udp_read_request_packet()
 {
   u16 temp16;
+  u32 seq;
+  socklen_t fromlen;
+  int readbytes;
+  const u8 *p;
  
   while( 1 )
   {
-    // First read the length
-    udp_read_helper( rfs_buffer, ELUARPC_START_OFFSET );
+    fromlen = sizeof( trans_from );
+    readbytes = net_recvfrom( trans_socket, ( char* )udp_rx_buffer, sizeof( udp_rx_buffer ), 0, ( struct sockaddr* )&trans_from, &fromlen, NET_INF_TIMEOUT );
+    if( readbytes <= 0 )
+      continue;
+    p = udp_rx_buffer;
 
-    if( eluarpc_get_packet_size( rfs_buffer, &temp16 ) == ELUARPC_ERR )
+    // Sequenced (reliable) or legacy (raw packet) datagram?
+    if( ( udp_crt_has_seq = eluarpc_has_seq( p ) ) != 0 )
+    {
+      if( readbytes < ELUARPC_SEQ_HEADER_SIZE || eluarpc_read_seq( p, &seq ) == ELUARPC_ERR )
+      {
+        log_msg( "read_request_packet: ERROR reading sequence header.\n" );
+        continue;
+      }
+      if( udp_has_last_seq && ( trans_from.sin_addr.s_addr != udp_last_from.sin_addr.s_addr || trans_from.sin_port != udp_last_from.sin_port ) )
+      {
+        log_msg( "read_request_packet: new client session.\n" );
+        udp_has_last_seq = 0;
+      }
+      if( udp_has_last_seq && seq == udp_crt_seq )
+      {
+        // Our response was lost, send it again
+        log_msg( "read_request_packet: retransmitted request %u, resending response.\n", ( unsigned )seq );
+        net_sendto( trans_socket, ( char* )udp_tx_buffer, udp_tx_size, 0, ( struct sockaddr* )&trans_from, sizeof( trans_from ) );
+        continue;
+      }
+      udp_crt_seq = seq;
+      p += ELUARPC_SEQ_HEADER_SIZE;
+      readbytes -= ELUARPC_SEQ_HEADER_SIZE;
+    }
+
+    if( readbytes < ELUARPC_START_OFFSET || eluarpc_get_packet_size( p, &temp16 ) == ELUARPC_ERR )
     {
       log_msg( "read_request_packet: ERROR getting packet size.\n" );
       continue;
     }
-
-    // Then the rest of the data
-    udp_read_helper( rfs_buffer + ELUARPC_START_OFFSET, temp16 - ELUARPC_START_OFFSET );
+    if( temp16 != readbytes || temp16 > sizeof( rfs_buffer ) )
+    {
+      log_msg( "read_request_packet: ERROR invalid datagram, got %d bytes, expected %u bytes\n", readbytes, ( unsigned )temp16 );
+      continue;
+    }
+    memcpy( rfs_buffer, p, temp16 );
     break;
   }
 }
@@ -158,12 +188,23 @@ static void udp_read_request_packet()
 static void udp_send_response_packet()
 {
   u16 temp16;
+  u8 *p = udp_tx_buffer;
   
   // Send request
   if( eluarpc_get_packet_size( rfs_buffer, &temp16 ) != ELUARPC_ERR )
   {
     log_msg( "send_response_packet: sending response packet of %u bytes\n", ( unsigned )temp16 );
-    net_sendto( trans_socket, ( char* )rfs_buffer, temp16, 0, ( struct sockaddr* )&trans_from, sizeof( trans_from ) );
+    udp_tx_size = temp16;
+    if( udp_crt_has_seq )
+    {
+      eluarpc_write_seq( p, udp_crt_seq );
+      p += ELUARPC_SEQ_HEADER_SIZE;
+      udp_tx_size += ELUARPC_SEQ_HEADER_SIZE;
+    }
+    memcpy( p, rfs_buffer, temp16 );
+    udp_has_last_seq = udp_crt_has_seq;
+    udp_last_from = trans_from;
+    net_sendto( trans_socket, ( char* )udp_tx_buffer, udp_tx_size, 0, ( struct sockaddr* )&trans_from, sizeof( trans_from ) );
   }  
 }
 
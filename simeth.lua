@@ -0,0 +1,22 @@
+local args = { ... }
+local b = require "utils.build"
+local builder = b.new_builder( ".build/simeth" )
+local utils = b.utils
+builder:init( args )
+builder:set_build_mode( builder.BUILD_DIR_LINEARIZED )
+
+if utils.is_windows() then
+  print "simeth is only available on Linux"
+  return
+end
+
+local full_files = utils.prepend_path( "main.c", "simeth_src" )
+local compcmd = builder:compile_cmd{ flags = "-O0 -Wall -g", includes = "simeth_src" }
+local linkcmd = builder:link_cmd{}
+builder:set_compile_cmd( compcmd )
+builder:set_link_cmd( linkcmd )
+builder:set_exe_extension( "" )
+
+-- Build everyting
+builder:make_exe_target( "simeth", full_files )
+builder:build()
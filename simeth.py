@@ -0,0 +1,19 @@
+import os, sys, platform
+
+if platform.system() != "Linux":
+  print "simeth is only available on Linux"
+  Exit( 1 )
+
+flist = "main.c"
+full_files = " " + " ".join( [ "simeth_src/%s" % name for name in flist.split() ] )
+
+# Compiler/linker options
+cccom = "gcc -O0 -g -Wall -c $SOURCE -o $TARGET"
+linkcom = "gcc -o $TARGET $SOURCES"
+
+# Env for building the program
+comp = Environment( CCCOM = cccom,
+                    LINKCOM = linkcom,
+                    ENV = os.environ )
+Decider( 'MD5' )                  
+Default( comp.Program( "simeth", Split( full_files ) ) )
@@ -0,0 +1,416 @@
+// Network bridge and traffic generator for the eLua simulator (Linux only)
+//
+// "simeth run" starts the simulator with a datagram socket on fd 3 and bridges
+// the Ethernet frames sent/received on it to a host TAP interface.
+// "simeth bench" is a traffic generator for an echo server running on eLua
+// (test/netbench.lua) and reports the throughput and round trip times it sees.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+// ****************************************************************************
+// Data structures and local variables
+
+#define SIM_ETH_FD            3
+#define MAX_FRAME_SIZE        1600
+#define DEFAULT_TAP_NAME      "elua0"
+#define DEFAULT_HOST_IP       "192.168.10.1"
+#define DEFAULT_NETMASK       "255.255.255.0"
+#define DEFAULT_TCP_PORT      5000
+#define DEFAULT_UDP_PORT      5001
+#define DEFAULT_TELNET_PORT   23
+#define DEFAULT_SPAM_LINES    2000
+#define DEFAULT_CONNS         12
+#define MAX_CONNS             64
+#define CONNS_MSG_SIZE        32
+#define TELNET_PROMPT         "# "
+#define TELNET_SPAM_DONE      "conspam: done"
+#define BENCH_TCP_SIZE        ( 256 * 1024 )
+#define BENCH_UDP_SIZE        512
+#define BENCH_ROUNDS          200
+#define BENCH_TIMEOUT_MS      2000
+
+static unsigned long frames_to_sim, frames_from_sim;
+
+// ****************************************************************************
+// Helpers
+
+static double time_now()
+{
+  struct timeval tv;
+
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void fatal( const char *msg )
+{
+  perror( msg );
+  exit( 1 );
+}
+
+// ****************************************************************************
+// "run" mode: TAP bridge
+
+static int tap_open( const char *name, const char *ip )
+{
+  struct ifreq ifr;
+  struct sockaddr_in *sin = ( struct sockaddr_in* )&ifr.ifr_addr;
+  int fd, s;
+
+  if( ( fd = open( "/dev/net/tun", O_RDWR ) ) == -1 )
+    fatal( "/dev/net/tun" );
+  memset( &ifr, 0, sizeof( ifr ) );
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  strncpy( ifr.ifr_name, name, IFNAMSIZ - 1 );
+  if( ioctl( fd, TUNSETIFF, &ifr ) == -1 )
+    fatal( "TUNSETIFF" );
+  // Set the host address and bring the interface up
+  if( ( s = socket( AF_INET, SOCK_DGRAM, 0 ) ) == -1 )
+    fatal( "socket" );
+  sin->sin_family = AF_INET;
+  inet_aton( ip, &sin->sin_addr );
+  if( ioctl( s, SIOCSIFADDR, &ifr ) == -1 )
+    fatal( "SIOCSIFADDR" );
+  inet_aton( DEFAULT_NETMASK, &sin->sin_addr );
+  if( ioctl( s, SIOCSIFNETMASK, &ifr ) == -1 )
+    fatal( "SIOCSIFNETMASK" );
+  if( ioctl( s, SIOCGIFFLAGS, &ifr ) == -1 )
+    fatal( "SIOCGIFFLAGS" );
+  ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+  if( ioctl( s, SIOCSIFFLAGS, &ifr ) == -1 )
+    fatal( "SIOCSIFFLAGS" );
+  close( s );
+  return fd;
+}
+
+static int run_sim( const char *image, const char *tapname, const char *ip )
+{
+  u_char frame[ MAX_FRAME_SIZE ];
+  struct pollfd fds[ 2 ];
+  int sv[ 2 ], tap, status;
+  pid_t pid;
+  ssize_t len;
+
+  tap = tap_open( tapname, ip );
+  if( socketpair( AF_UNIX, SOCK_DGRAM, 0, sv ) == -1 )
+    fatal( "socketpair" );
+  if( ( pid = fork() ) == -1 )
+    fatal( "fork" );
+  if( pid == 0 )
+  {
+    // The simulator finds its end of the socket pair on SIM_ETH_FD
+    close( sv[ 0 ] );
+    close( tap );
+    if( dup2( sv[ 1 ], SIM_ETH_FD ) == -1 )
+      fatal( "dup2" );
+    execl( image, image, ( char* )NULL );
+    fatal( image );
+  }
+  close( sv[ 1 ] );
+  signal( SIGINT, SIG_IGN );
+  fprintf( stderr, "simeth: interface %s (%s), simulator pid %d\n", tapname, ip, ( int )pid );
+  fds[ 0 ].fd = tap;
+  fds[ 1 ].fd = sv[ 0 ];
+  fds[ 0 ].events = fds[ 1 ].events = POLLIN;
+  while( waitpid( pid, &status, WNOHANG ) == 0 )
+  {
+    if( poll( fds, 2, 100 ) <= 0 )
+      continue;
+    if( fds[ 0 ].revents & POLLIN )
+      if( ( len = read( tap, frame, sizeof( frame ) ) ) > 0 )
+      {
+        send( sv[ 0 ], frame, len, 0 );
+        frames_to_sim ++;
+      }
+    if( fds[ 1 ].revents & POLLIN )
+      if( ( len = recv( sv[ 0 ], frame, sizeof( frame ), 0 ) ) > 0 )
+      {
+        write( tap, frame, len );
+        frames_from_sim ++;
+      }
+  }
+  fprintf( stderr, "simeth: %lu frames sent to the simulator, %lu frames received\n", frames_to_sim, frames_from_sim );
+  return 0;
+}
+
+// ****************************************************************************
+// "bench" mode: traffic generator
+
+static void bench_report( const char *name, unsigned long bytes, double elapsed, double *rtt, unsigned n )
+{
+  double min = 0, max = 0, sum = 0;
+  unsigned i;
+
+  for( i = 0; i < n; i ++ )
+  {
+    if( i == 0 || rtt[ i ] < min )
+      min = rtt[ i ];
+    if( rtt[ i ] > max )
+      max = rtt[ i ];
+    sum += rtt[ i ];
+  }
+  printf( "%s: %lu bytes in %.3f s, %.1f KB/s", name, bytes, elapsed, bytes / elapsed / 1024 );
+  if( n > 0 )
+    printf( ", rtt min/avg/max %.2f/%.2f/%.2f ms", min * 1000, sum / n * 1000, max * 1000 );
+  printf( "\n" );
+}
+
+// Wait for 'fd' to become readable
+static int bench_wait( int fd )
+{
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  return poll( &pfd, 1, BENCH_TIMEOUT_MS ) == 1;
+}
+
+// TCP: throughput (data streamed to the echo server and read back) and
+// latency (single byte round trips)
+static int bench_tcp( struct sockaddr_in *addr, unsigned long total )
+{
+  static char buf[ 4096 ];
+  double rtt[ BENCH_ROUNDS ], start;
+  unsigned long sent = 0, recvd = 0;
+  struct pollfd pfd;
+  unsigned i;
+  ssize_t len;
+  int s, one = 1;
+
+  if( ( s = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 || connect( s, ( struct sockaddr* )addr, sizeof( *addr ) ) == -1 )
+    fatal( "connect" );
+  setsockopt( s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+  for( i = 0; i < BENCH_ROUNDS; i ++ )
+  {
+    start = time_now();
+    if( send( s, "x", 1, 0 ) != 1 || !bench_wait( s ) || recv( s, buf, 1, 0 ) != 1 )
+    {
+      fprintf( stderr, "simeth: TCP echo timeout\n" );
+      return 1;
+    }
+    rtt[ i ] = time_now() - start;
+  }
+  memset( buf, 'x', sizeof( buf ) );
+  fcntl( s, F_SETFL, fcntl( s, F_GETFL ) | O_NONBLOCK );
+  pfd.fd = s;
+  start = time_now();
+  while( recvd < total )
+  {
+    pfd.events = POLLIN | ( sent < total ? POLLOUT : 0 );
+    if( poll( &pfd, 1, BENCH_TIMEOUT_MS ) <= 0 )
+    {
+      fprintf( stderr, "simeth: TCP timeout after %lu bytes\n", recvd );
+      return 1;
+    }
+    if( ( pfd.revents & POLLOUT ) && ( len = send( s, buf, total - sent < sizeof( buf ) ? total - sent : sizeof( buf ), 0 ) ) > 0 )
+      sent += len;
+    if( pfd.revents & POLLIN )
+    {
+      if( ( len = recv( s, buf, sizeof( buf ), 0 ) ) <= 0 )
+      {
+        fprintf( stderr, "simeth: connection closed after %lu bytes\n", recvd );
+        return 1;
+      }
+      recvd += len;
+    }
+  }
+  bench_report( "TCP", recvd, time_now() - start, rtt, BENCH_ROUNDS );
+  close( s );
+  return 0;
+}
+
+// UDP: stop-and-wait datagram echo
+static int bench_udp( struct sockaddr_in *addr, unsigned size )
+{
+  static char buf[ MAX_FRAME_SIZE ];
+  double rtt[ BENCH_ROUNDS ], start, total_start;
+  unsigned i, n = 0, lost = 0;
+  int s;
+
+  if( size > sizeof( buf ) )
+    size = sizeof( buf );
+  if( ( s = socket( AF_INET, SOCK_DGRAM, 0 ) ) == -1 || connect( s, ( struct sockaddr* )addr, sizeof( *addr ) ) == -1 )
+    fatal( "connect" );
+  memset( buf, 'x', size );
+  total_start = time_now();
+  for( i = 0; i < BENCH_ROUNDS; i ++ )
+  {
+    start = time_now();
+    send( s, buf, size, 0 );
+    if( bench_wait( s ) && recv( s, buf, sizeof( buf ), 0 ) > 0 )
+      rtt[ n ++ ] = time_now() - start;
+    else
+      lost ++;
+  }
+  bench_report( "UDP", ( unsigned long )n * size * 2, time_now() - total_start, rtt, n );
+  if( lost )
+    printf( "UDP: %u of %u datagrams lost\n", lost, BENCH_ROUNDS );
+  close( s );
+  return 0;
+}
+
+// Many connections: open 'n' connections to the TCP echo server, then send a
+// small message on all of them and wait for all the echoes, BENCH_ROUNDS times
+static int bench_conns( struct sockaddr_in *addr, unsigned n )
+{
+  static char buf[ CONNS_MSG_SIZE ];
+  int s[ MAX_CONNS ], one = 1;
+  double start, elapsed;
+  unsigned i, r;
+  size_t got;
+  ssize_t len;
+
+  if( n > MAX_CONNS )
+    n = MAX_CONNS;
+  memset( buf, 'x', sizeof( buf ) );
+  for( i = 0; i < n; i ++ )
+  {
+    if( ( s[ i ] = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 || connect( s[ i ], ( struct sockaddr* )addr, sizeof( *addr ) ) == -1 )
+      fatal( "connect" );
+    setsockopt( s[ i ], IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    // Wait for an echo, so the server accepted this connection before the
+    // next one is opened (the accept backlog is small)
+    if( send( s[ i ], buf, 1, 0 ) != 1 || !bench_wait( s[ i ] ) || recv( s[ i ], buf, 1, 0 ) != 1 )
+    {
+      fprintf( stderr, "simeth: connection %u not accepted\n", i + 1 );
+      return 1;
+    }
+  }
+  start = time_now();
+  for( r = 0; r < BENCH_ROUNDS; r ++ )
+  {
+    for( i = 0; i < n; i ++ )
+      send( s[ i ], buf, sizeof( buf ), 0 );
+    for( i = 0; i < n; i ++ )
+      for( got = 0; got < sizeof( buf ); got += len )
+        if( !bench_wait( s[ i ] ) || ( len = recv( s[ i ], buf, sizeof( buf ) - got, 0 ) ) <= 0 )
+        {
+          fprintf( stderr, "simeth: timeout on connection %u\n", i + 1 );
+          return 1;
+        }
+  }
+  elapsed = time_now() - start;
+  printf( "CONNS: %u connections, %u messages of %u bytes in %.3f s, %.0f messages/s, %.2f ms per round\n", n, n * BENCH_ROUNDS, 
+          ( unsigned )sizeof( buf ), elapsed, n * BENCH_ROUNDS / elapsed, elapsed / BENCH_ROUNDS * 1000 );
+  for( i = 0; i < n; i ++ )
+    close( s[ i ] );
+  return 0;
+}
+
+// Read from 'fd' until 'marker' is received. Returns the number of bytes read
+// or -1 for timeout.
+static long bench_read_until( int fd, const char *marker )
+{
+  static char buf[ 4096 + 64 ];
+  size_t mlen = strlen( marker ), keep = 0, i;
+  long total = 0;
+  ssize_t len;
+
+  while( 1 )
+  {
+    if( !bench_wait( fd ) || ( len = recv( fd, buf + keep, sizeof( buf ) - keep, 0 ) ) <= 0 )
+      return -1;
+    total += len;
+    len += keep;
+    for( i = 0; i + mlen <= ( size_t )len; i ++ )
+      if( !memcmp( buf + i, marker, mlen ) )
+        return total;
+    // Keep the end of the data, the marker might be split between reads
+    keep = ( size_t )len < mlen ? ( size_t )len : mlen - 1;
+    memmove( buf, buf + len - keep, keep );
+  }
+}
+
+// TELNET console: run test/conspam.lua from the eLua shell and measure how
+// fast its output is received
+static int bench_telnet( struct sockaddr_in *addr, unsigned lines )
+{
+  char cmd[ 64 ];
+  double start, elapsed;
+  long total;
+  int s;
+
+  if( ( s = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 || connect( s, ( struct sockaddr* )addr, sizeof( *addr ) ) == -1 )
+    fatal( "connect" );
+  if( bench_read_until( s, TELNET_PROMPT ) == -1 )
+  {
+    fprintf( stderr, "simeth: no shell prompt\n" );
+    return 1;
+  }
+  snprintf( cmd, sizeof( cmd ), "lua /rom/conspam.lua %u\r\n", lines );
+  start = time_now();
+  send( s, cmd, strlen( cmd ), 0 );
+  if( ( total = bench_read_until( s, TELNET_SPAM_DONE ) ) == -1 )
+  {
+    fprintf( stderr, "simeth: TELNET timeout\n" );
+    return 1;
+  }
+  elapsed = time_now() - start;
+  bench_report( "TELNET", total, elapsed, NULL, 0 );
+  printf( "TELNET: %.0f lines/s\n", lines / elapsed );
+  close( s );
+  return 0;
+}
+
+// ****************************************************************************
+// Entry point
+
+static void usage( const char *name )
+{
+  fprintf( stderr, "Usage: %s run <simulator image> [<tap name> [<host ip>]]\n", name );
+  fprintf( stderr, "       %s bench <elua ip> tcp|udp [<port> [<size>]]\n", name );
+  fprintf( stderr, "       %s bench <elua ip> telnet [<port> [<lines>]]\n", name );
+  fprintf( stderr, "       %s bench <elua ip> conns [<port> [<connections>]]\n", name );
+  fprintf( stderr, "Defaults: tap name '%s', host ip %s, TCP port %d, UDP port %d, TELNET port %d\n", DEFAULT_TAP_NAME, DEFAULT_HOST_IP, 
+           DEFAULT_TCP_PORT, DEFAULT_UDP_PORT, DEFAULT_TELNET_PORT );
+}
+
+int main( int argc, char **argv )
+{
+  struct sockaddr_in addr;
+  int tcp, telnet, conns;
+
+  if( argc >= 3 && !strcmp( argv[ 1 ], "run" ) )
+    return run_sim( argv[ 2 ], argc > 3 ? argv[ 3 ] : DEFAULT_TAP_NAME, argc > 4 ? argv[ 4 ] : DEFAULT_HOST_IP );
+  if( argc >= 4 && !strcmp( argv[ 1 ], "bench" ) && ( !strcmp( argv[ 3 ], "tcp" ) || !strcmp( argv[ 3 ], "udp" ) || 
+                          !strcmp( argv[ 3 ], "telnet" ) || !strcmp( argv[ 3 ], "conns" ) ) )
+  {
+    conns = !strcmp( argv[ 3 ], "conns" );
+    tcp = conns || !strcmp( argv[ 3 ], "tcp" );
+    telnet = !strcmp( argv[ 3 ], "telnet" );
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( argc > 4 ? atoi( argv[ 4 ] ) : ( tcp ? DEFAULT_TCP_PORT : ( telnet ? DEFAULT_TELNET_PORT : DEFAULT_UDP_PORT ) ) );
+    if( inet_aton( argv[ 2 ], &addr.sin_addr ) == 0 )
+    {
+      fprintf( stderr, "Invalid IP address %s\n", argv[ 2 ] );
+      return 1;
+    }
+    if( conns )
+      return bench_conns( &addr, argc > 5 ? atoi( argv[ 5 ] ) : DEFAULT_CONNS );
+    if( telnet )
+      return bench_telnet( &addr, argc > 5 ? atoi( argv[ 5 ] ) : DEFAULT_SPAM_LINES );
+    if( tcp )
+      return bench_tcp( &addr, argc > 5 ? strtoul( argv[ 5 ], NULL, 10 ) : BENCH_TCP_SIZE );
+    return bench_udp( &addr, argc > 5 ? atoi( argv[ 5 ] ) : BENCH_UDP_SIZE );
+  }
+  usage( argv[ 0 ] );
+  return 1;
+}
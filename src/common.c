@@ -487,6 +487,11 @@ u32 platform_flash_get_sector_of_address( u32 addr )
   return flashh_find_sector( addr, NULL, NULL );
 }
 
+u32 platform_flash_get_sector_bounds( u32 addr, u32 *pstart, u32 *pend )
+{
+  return flashh_find_sector( addr, pstart, pend );
+}
+
 u32 platform_flash_get_num_sectors()
 {
 #ifdef INTERNAL_FLASH_SECTOR_SIZE
@@ -423,6 +423,9 @@ void cmn_systimer_set_interrupt_period_us( u32 period )
 void cmn_systimer_periodic()
 {
   cmn_systimer_counter += cmn_systimer_us_per_interrupt;
+#ifdef BUILD_SERMUX
+  cmn_uart_sermux_periodic();
+#endif
 }
 
 timer_data_type cmn_systimer_get()
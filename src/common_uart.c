@@ -15,11 +15,99 @@ int uart_service_id_in = -1;
 int uart_service_id_out = -1;
 u8 uart_got_esc = 0;
 int uart_last_sent = -1;
+// Packet mode (enabled when requested by the mux program)
+static u8 uart_packet_mode;
+static SERMUX_FRAME_RX uart_packet_rx;
+static u8 uart_packet_tx_sid;
+static u8 uart_packet_tx_len;
+static u8 uart_packet_tx_data[ SERMUX_FRAME_MAX_SIZE ];
+// Set while the main context sends a frame (or a byte mode sequence) on the
+// physical interface, the packet mode ACK is sent after it in this case
+static volatile u8 uart_tx_busy;
+static volatile u8 uart_packet_ack_pending;
+// Set by the system timer when the pending frame didn't grow for a whole period
+static volatile u8 uart_packet_tx_stale;
 // [TODO] add interrupt support for virtual UARTs
 #else // #ifdef BUILD_SERMUX
 #define SERMUX_PHYS_ID        ( 0xFFFF )
 #endif // #ifdef BUILD_SERMUX
 
+#ifdef BUILD_SERMUX
+// Send the packet mode ACK
+static void cmn_uart_packet_send_ack()
+{
+  platform_s_uart_send( SERMUX_PHYS_ID, SERMUX_ESCAPE_CHAR );
+  platform_s_uart_send( SERMUX_PHYS_ID, SERMUX_CMD_PACKET_ACK );
+}
+
+// The main context finished sending: send the ACK requested meanwhile (if any)
+static void cmn_uart_tx_done()
+{
+  int old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+
+  uart_tx_busy = 0;
+  if( uart_packet_ack_pending )
+  {
+    cmn_uart_packet_send_ack();
+    uart_packet_ack_pending = 0;
+  }
+  platform_cpu_set_global_interrupts( old_status );
+}
+
+// Send the pending packet mode frame (if any) on the physical interface
+// This runs only in the main context (also from the Lua hook, see
+// cmn_uart_sermux_periodic)
+static void cmn_uart_packet_flush()
+{
+  u8 hdr[ SERMUX_FRAME_HEADER_SIZE ];
+  unsigned i;
+  u16 crc;
+
+  if( uart_packet_tx_len == 0 )
+    return;
+  uart_tx_busy = 1;
+  sermux_frame_header( hdr, uart_packet_tx_sid, uart_packet_tx_len );
+  crc = sermux_crc16( SERMUX_CRC_INIT, hdr + 2, 2 );
+  crc = sermux_crc16( crc, uart_packet_tx_data, uart_packet_tx_len );
+  for( i = 0; i < SERMUX_FRAME_HEADER_SIZE; i ++ )
+    platform_s_uart_send( SERMUX_PHYS_ID, hdr[ i ] );
+  for( i = 0; i < uart_packet_tx_len; i ++ )
+    platform_s_uart_send( SERMUX_PHYS_ID, uart_packet_tx_data[ i ] );
+  platform_s_uart_send( SERMUX_PHYS_ID, crc >> 8 );
+  platform_s_uart_send( SERMUX_PHYS_ID, crc & 0xFF );
+  uart_packet_tx_len = 0;
+  cmn_uart_tx_done();
+}
+
+// Switch to packet mode after a request from the mux program (called from
+// the UART interrupt handler, the ACK can't be sent in the middle of a frame)
+static void cmn_uart_packet_start()
+{
+  if( uart_tx_busy )
+    uart_packet_ack_pending = 1;
+  else
+    cmn_uart_packet_send_ack();
+  sermux_rx_init( &uart_packet_rx );
+  uart_packet_mode = 1;
+  uart_got_esc = 0;
+  uart_last_sent = -1;
+}
+
+// Called from the system timer interrupt: a frame that didn't grow for a whole
+// timer period is sent from the Lua hook (output without a newline would stay
+// in the frame otherwise). If Lua is not running it's sent by the next write
+// or read on the virtual UART.
+void cmn_uart_sermux_periodic()
+{
+  if( !uart_packet_mode || uart_packet_tx_len == 0 || uart_tx_busy )
+    return;
+  if( uart_packet_tx_stale )
+    elua_int_defer( cmn_uart_packet_flush );
+  else
+    uart_packet_tx_stale = 1;
+}
+#endif // #ifdef BUILD_SERMUX
+
 // The platform UART functions
 int platform_uart_exists( unsigned id )
 {
@@ -51,6 +139,12 @@ static int cmn_recv_helper( unsigned id, timer_data_type timeout )
     return platform_usb_cdc_recv( timeout );
 #endif
 
+#ifdef BUILD_SERMUX
+  // Whoever waits for data has nothing more to send for now
+  if( uart_packet_mode && id >= SERMUX_SERVICE_ID_FIRST )
+    cmn_uart_packet_flush();
+#endif
+
 #ifdef BUF_ENABLE_UART
   if( buf_is_enabled( BUF_ID_UART, id ) )
   {
@@ -100,9 +194,36 @@ int platform_uart_recv( unsigned id, unsigned timer_id, timer_data_type timeout
 static void cmn_rx_handler( int usart_id, u8 data )
 {
 #ifdef BUILD_SERMUX
+  unsigned i;
+
+  if( usart_id == SERMUX_PHYS_ID && uart_packet_mode )
+  {
+    switch( sermux_rx_byte( &uart_packet_rx, data ) )
+    {
+      case SERMUX_RX_FRAME:
+        if( uart_packet_rx.sid >= SERMUX_SERVICE_ID_FIRST && uart_packet_rx.sid < SERMUX_SERVICE_ID_FIRST + SERMUX_NUM_VUART )
+          for( i = 0; i < uart_packet_rx.len; i ++ )
+            buf_write( BUF_ID_UART, uart_packet_rx.sid, ( t_buf_data* )( uart_packet_rx.data + i ) );
+        return;
+
+      case SERMUX_RX_REQ: // the mux program was restarted
+        cmn_uart_packet_start();
+        return;
+
+      case SERMUX_RX_RAW: // the mux program doesn't use packet mode anymore
+        uart_packet_mode = 0;
+        uart_service_id_out = -1;
+        break;
+
+      default: // corrupted frames are dropped
+        return;
+    }
+  }
   if( usart_id == SERMUX_PHYS_ID )
   {
-    if( data != SERMUX_ESCAPE_CHAR )
+    if( uart_got_esc && data == SERMUX_CMD_PACKET_REQ )
+      cmn_uart_packet_start();
+    else if( data != SERMUX_ESCAPE_CHAR )
     {
       if( ( data >= SERMUX_SERVICE_ID_FIRST ) && data < ( SERMUX_SERVICE_ID_FIRST + SERMUX_NUM_VUART ) )
         uart_service_id_in = data;
@@ -145,8 +266,21 @@ void platform_uart_send( unsigned id, u8 data )
     platform_usb_cdc_send( data );
 #endif
 #ifdef BUILD_SERMUX
-  if( id >= SERMUX_SERVICE_ID_FIRST && id < SERMUX_SERVICE_ID_FIRST + SERMUX_NUM_VUART )
+  if( id >= SERMUX_SERVICE_ID_FIRST && id < SERMUX_SERVICE_ID_FIRST + SERMUX_NUM_VUART && uart_packet_mode )
+  {
+    // Accumulate data in a frame, send it when it's full, when the service 
+    // changes, at the end of a line or when the service waits for data
+    if( id != uart_packet_tx_sid || uart_packet_tx_len == SERMUX_FRAME_MAX_SIZE )
+      cmn_uart_packet_flush();
+    uart_packet_tx_sid = id;
+    uart_packet_tx_data[ uart_packet_tx_len ++ ] = data;
+    uart_packet_tx_stale = 0;
+    if( data == '\n' )
+      cmn_uart_packet_flush();
+  }
+  else if( id >= SERMUX_SERVICE_ID_FIRST && id < SERMUX_SERVICE_ID_FIRST + SERMUX_NUM_VUART )
   {
+    uart_tx_busy = 1;
     if( id != uart_service_id_out )
       platform_s_uart_send( SERMUX_PHYS_ID, id );
     uart_last_sent = data;
@@ -159,6 +293,7 @@ void platform_uart_send( unsigned id, u8 data )
     else
       platform_s_uart_send( SERMUX_PHYS_ID, data );
     uart_service_id_out = id;
+    cmn_uart_tx_done();
   }
 #endif // #ifdef BUILD_SERMUX
   if( id < NUM_UART )
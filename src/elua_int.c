@@ -10,7 +10,20 @@
 #include <string.h>
 
 // ****************************************************************************
-// Lua handlers
+// Lua hook
+
+// All the code that needs to run from the Lua VM (the Lua interrupt handlers
+// and the deferred C functions, see elua_int_defer) shares this hook, which is
+// removed only when none of them has anything left to do. Note that the hook
+// runs only while the VM executes Lua code: if the Lua program replaces it
+// (debug.sethook) or blocks in C code (for example waiting for a line of input
+// in the interactive interpreter), the deferred work waits until the hook runs
+// again or until the deferred function is called directly (like the eLua
+// TCP/IP functions do while they wait for the network).
+
+// Deferred C functions and their "pending" flags (one bit per function)
+static elua_int_p_deferred elua_int_deferred_list[ ELUA_INT_MAX_DEFERRED ];
+static volatile u8 elua_int_deferred_pending;
 
 #ifdef BUILD_LUA_INT_HANDLERS
 
@@ -25,11 +38,12 @@ static u32 elua_int_flags[ LUA_INT_MAX_SOURCES / 32 ];
 #define INT_IDX_SHIFT                   ( PLATFORM_INT_QUEUE_LOG_SIZE )
 #define INT_IDX_MASK                    ( ( 1 << INT_IDX_SHIFT ) - 1 )
 
-// Our hook function (called by the Lua VM)
-static void elua_int_hook( lua_State *L, lua_Debug *ar )
+#define elua_int_queue_empty()          ( elua_int_queue[ elua_int_read_idx ].id == ELUA_INT_EMPTY_SLOT )
+
+// Call the Lua handler of the first interrupt in the queue
+static void elua_int_call_lua_handler( lua_State *L )
 {
   elua_int_element crt;
-  int old_status;
 
   // Get interrupt (and remove from queue)
   crt = elua_int_queue[ elua_int_read_idx ];
@@ -51,13 +65,70 @@ static void elua_int_hook( lua_State *L, lua_Debug *ar )
       lua_remove( L, -1 ); // inttable
     lua_remove( L, -1 );
   }
+}
+
+#else // #ifdef BUILD_LUA_INT_HANDLERS
 
+#define elua_int_queue_empty()          1
+
+#endif // #ifdef BUILD_LUA_INT_HANDLERS
+
+// Our hook function (called by the Lua VM)
+static void elua_int_hook( lua_State *L, lua_Debug *ar )
+{
+  int old_status;
+  unsigned i;
+  u8 pending;
+
+  // Run the deferred C functions (with interrupts enabled)
   old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
-  if( elua_int_queue[ elua_int_read_idx ].id == ELUA_INT_EMPTY_SLOT ) // no more interrupts in the queue, so clear the hook
+  pending = elua_int_deferred_pending;
+  elua_int_deferred_pending = 0;
+  platform_cpu_set_global_interrupts( old_status );
+  for( i = 0; i < ELUA_INT_MAX_DEFERRED; i ++ )
+    if( pending & ( 1 << i ) )
+      elua_int_deferred_list[ i ]();
+
+#ifdef BUILD_LUA_INT_HANDLERS
+  if( !elua_int_queue_empty() )
+    elua_int_call_lua_handler( L );
+#endif
+
+  old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+  if( elua_int_queue_empty() && elua_int_deferred_pending == 0 ) // nothing left to do, so clear the hook
     lua_sethook( L, NULL, 0, 0 );
   platform_cpu_set_global_interrupts( old_status );
 }
 
+// Schedule a call to the given function from the Lua hook (called from
+// interrupt handlers, the function will run later with interrupts enabled).
+// Returns PLATFORM_ERR if Lua is not running or if there's no room for the
+// function in the list; in this case the caller must do the work itself.
+int elua_int_defer( elua_int_p_deferred pfunc )
+{
+  lua_State *L;
+  unsigned i;
+
+  if( ( L = lua_getstate() ) == NULL )
+    return PLATFORM_ERR;
+  for( i = 0; i < ELUA_INT_MAX_DEFERRED; i ++ )
+    if( elua_int_deferred_list[ i ] == pfunc || elua_int_deferred_list[ i ] == NULL )
+      break;
+  if( i == ELUA_INT_MAX_DEFERRED )
+    return PLATFORM_ERR;
+  elua_int_deferred_list[ i ] = pfunc;
+  elua_int_deferred_pending |= 1 << i;
+
+  // Set the Lua hook (it's OK to set it even if it's already set)
+  lua_sethook( L, elua_int_hook, LUA_MASKCOUNT, 2 );
+  return PLATFORM_OK;
+}
+
+// ****************************************************************************
+// Lua handlers
+
+#ifdef BUILD_LUA_INT_HANDLERS
+
 // Queue an interrupt and set the Lua hook
 // Returns PLATFORM_OK or PLATFORM_ERR
 int elua_int_add( elua_int_id inttype, elua_int_resnum resnum )
@@ -9,6 +9,7 @@
 #if defined( BUILD_MMCFS ) && !defined( ELUA_SIMULATOR )
 #include "platform.h"
 #include "diskio.h"
+#include "ffconf.h"
 
 /* Definitions for MMC/SDC command */
 #define CMD0    (0x40+0)    /* GO_IDLE_STATE */
@@ -27,22 +28,43 @@
 #define CMD55    (0x40+55)    /* APP_CMD */
 #define CMD58    (0x40+58)    /* READ_OCR */
 
-#ifndef MMCFS_SPI_NUM
-  #error "MMC not supported on this board"
+// SPI interface and CS pin of each card. With more than one card
+// (MMCFS_NUM_CARDS > 1) they are given as arrays in platform_conf.h
+#ifndef MMCFS_SPI_NUM_ARRAY
+  #ifndef MMCFS_SPI_NUM
+    #error "MMC not supported on this board"
+  #endif
+  #if _DRIVES > 1
+    #error "Define MMCFS_SPI_NUM_ARRAY, MMCFS_CS_PORT_ARRAY and MMCFS_CS_PIN_ARRAY to use more than one card"
+  #endif
+  #define MMCFS_SPI_NUM_ARRAY   { MMCFS_SPI_NUM }
+  #define MMCFS_CS_PORT_ARRAY   { MMCFS_CS_PORT }
+  #define MMCFS_CS_PIN_ARRAY    { MMCFS_CS_PIN }
 #endif
 
+static const u8 mmc_spi_num[ _DRIVES ] = MMCFS_SPI_NUM_ARRAY;
+static const u8 mmc_cs_port[ _DRIVES ] = MMCFS_CS_PORT_ARRAY;
+static const u8 mmc_cs_pin[ _DRIVES ] = MMCFS_CS_PIN_ARRAY;
+
+// Card used by the low level functions below (set by the public functions)
+static BYTE CurDrv;
+
+#define MMC_SPI_NUM     mmc_spi_num[ CurDrv ]
+#define MMC_CS_PORT     mmc_cs_port[ CurDrv ]
+#define MMC_CS_PIN      mmc_cs_pin[ CurDrv ]
+
 // asserts the CS pin to the card
 static
 void SELECT (void)
 {
-    platform_pio_op( MMCFS_CS_PORT , ( ( u32 ) 1 << MMCFS_CS_PIN ), PLATFORM_IO_PIN_CLEAR );    
+    platform_pio_op( MMC_CS_PORT , ( ( u32 ) 1 << MMC_CS_PIN ), PLATFORM_IO_PIN_CLEAR );    
 }
 
 // de-asserts the CS pin to the card
 static
 void DESELECT (void)
 {
-    platform_pio_op( MMCFS_CS_PORT, ( ( u32 ) 1 << MMCFS_CS_PIN ), PLATFORM_IO_PIN_SET );
+    platform_pio_op( MMC_CS_PORT, ( ( u32 ) 1 << MMC_CS_PIN ), PLATFORM_IO_PIN_SET );
 }
 
 
@@ -53,19 +75,47 @@ void DESELECT (void)
 ---------------------------------------------------------------------------*/
 
 static volatile
-DSTATUS Stat = STA_NOINIT;    /* Disk status */
+DSTATUS Stat_[ _DRIVES ];     /* Disk status (set to STA_NOINIT by select_drive) */
 
 static volatile timer_data_type Timer1 = 0;
 static volatile timer_data_type Timer2 = 0;
 
 static
-BYTE TriesLeft = 2;
+BYTE TriesLeft_[ _DRIVES ];
 
 static
-BYTE CardType;            /* b0:MMC, b1:SDC, b2:Block addressing */
+BYTE CardType_[ _DRIVES ];    /* b0:MMC, b1:SDC, b2:Block addressing */
 
 static
-BYTE PowerFlag = 0;     /* indicates if "power" is on */
+BYTE PowerFlag_[ _DRIVES ];   /* indicates if "power" is on */
+
+static
+BYTE StateInit = 0;
+
+// State of the current card
+#define Stat            Stat_[ CurDrv ]
+#define TriesLeft       TriesLeft_[ CurDrv ]
+#define CardType        CardType_[ CurDrv ]
+#define PowerFlag       PowerFlag_[ CurDrv ]
+
+// Initialize the state of all the cards and select card 'drv'
+// Returns 0 if 'drv' is not a valid card number, 1 otherwise
+static
+int select_drive (BYTE drv)
+{
+    BYTE i;
+
+    if (drv >= _DRIVES) return 0;
+    if (!StateInit) {
+        for (i = 0; i < _DRIVES; i++) {
+            Stat_[i] = STA_NOINIT;
+            TriesLeft_[i] = 2;
+        }
+        StateInit = 1;
+    }
+    CurDrv = drv;
+    return 1;
+}
 
 
 /*-----------------------------------------------------------------------*/
@@ -76,7 +126,7 @@ BYTE PowerFlag = 0;     /* indicates if "power" is on */
 static
 void xmit_spi (BYTE dat)
 {
-    platform_spi_send_recv( MMCFS_SPI_NUM, dat );
+    platform_spi_send_recv( MMC_SPI_NUM, dat );
 }
 
 
@@ -89,7 +139,7 @@ BYTE rcvr_spi (void)
 {
     DWORD rcvdat;
 
-    rcvdat  = platform_spi_send_recv( MMCFS_SPI_NUM, 0xFF );
+    rcvdat  = platform_spi_send_recv( MMC_SPI_NUM, 0xFF );
 
     return ( BYTE )rcvdat;
 }
@@ -151,12 +201,12 @@ void power_on (void)
      */
     
     // Setup CS pin & deselect
-    platform_pio_op( MMCFS_CS_PORT, ( ( u32 ) 1 << MMCFS_CS_PIN ), PLATFORM_IO_PIN_DIR_OUTPUT );
-    //platform_pio_op( MMCFS_CS_PORT, ( ( u32 ) 1 << MMCFS_CS_PIN ), PLATFORM_IO_PIN_PULLUP );
+    platform_pio_op( MMC_CS_PORT, ( ( u32 ) 1 << MMC_CS_PIN ), PLATFORM_IO_PIN_DIR_OUTPUT );
+    //platform_pio_op( MMC_CS_PORT, ( ( u32 ) 1 << MMC_CS_PIN ), PLATFORM_IO_PIN_PULLUP );
     DESELECT();
     
     // Setup SPI
-    platform_spi_setup( MMCFS_SPI_NUM, PLATFORM_SPI_MASTER, 400000, 0, 0, 8 );
+    platform_spi_setup( MMC_SPI_NUM, PLATFORM_SPI_MASTER, 400000, 0, 0, 8 );
 
     /* Set DI and CS high and apply more than 74 pulses to SCLK for the card */
     /* to be able to accept a native command. */
@@ -177,7 +227,7 @@ void set_max_speed(void)
         i = 12500000;
 
     /* Configure the SPI port */
-    platform_spi_setup( MMCFS_SPI_NUM, PLATFORM_SPI_MASTER, i, 0, 0, 8 );
+    platform_spi_setup( MMC_SPI_NUM, PLATFORM_SPI_MASTER, i, 0, 0, 8 );
 }
 
 static
@@ -310,14 +360,14 @@ BYTE send_cmd (
 /* Initialize Disk Drive                                                 */
 /*-----------------------------------------------------------------------*/
 
-DSTATUS disk_initialize (
-    BYTE drv        /* Physical drive nmuber (0) */
+DSTATUS mmc_disk_initialize (
+    BYTE drv        /* Physical drive nmuber (0.._DRIVES-1) */
 )
 {
     BYTE n, ty, ocr[4];
 
 
-    if (drv) return STA_NOINIT;            /* Supports only single drive */
+    if (!select_drive(drv)) return STA_NOINIT;
     if (Stat & STA_NODISK) return Stat;    /* No card in the socket */
     
     do
@@ -380,10 +430,10 @@ DSTATUS disk_initialize (
 /*-----------------------------------------------------------------------*/
 
 DSTATUS disk_status (
-    BYTE drv        /* Physical drive nmuber (0) */
+    BYTE drv        /* Physical drive nmuber (0.._DRIVES-1) */
 )
 {
-    if (drv) return STA_NOINIT;        /* Supports only single drive */
+    if (!select_drive(drv)) return STA_NOINIT;
     return Stat;
 }
 
@@ -393,14 +443,14 @@ DSTATUS disk_status (
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_read (
-    BYTE drv,            /* Physical drive nmuber (0) */
+DRESULT mmc_disk_read (
+    BYTE drv,            /* Physical drive nmuber (0.._DRIVES-1) */
     BYTE *buff,            /* Pointer to the data buffer to store read data */
     DWORD sector,        /* Start sector number (LBA) */
     BYTE count            /* Sector count (1..255) */
 )
 {
-    if (drv || !count) return RES_PARERR;
+    if (!select_drive(drv) || !count) return RES_PARERR;
     if (Stat & STA_NOINIT) return RES_NOTRDY;
 
     if (!(CardType & 4)) sector *= 512;    /* Convert to byte address if needed */
@@ -435,14 +485,14 @@ DRESULT disk_read (
 /*-----------------------------------------------------------------------*/
 
 #if _READONLY == 0
-DRESULT disk_write (
-    BYTE drv,            /* Physical drive nmuber (0) */
+DRESULT mmc_disk_write (
+    BYTE drv,            /* Physical drive nmuber (0.._DRIVES-1) */
     const BYTE *buff,    /* Pointer to the data to be written */
     DWORD sector,        /* Start sector number (LBA) */
     BYTE count            /* Sector count (1..255) */
 )
 {
-    if (drv || !count) return RES_PARERR;
+    if (!select_drive(drv) || !count) return RES_PARERR;
     if (Stat & STA_NOINIT) return RES_NOTRDY;
     if (Stat & STA_PROTECT) return RES_WRPRT;
 
@@ -482,8 +532,8 @@ DRESULT disk_write (
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_ioctl (
-    BYTE drv,        /* Physical drive nmuber (0) */
+DRESULT mmc_disk_ioctl (
+    BYTE drv,        /* Physical drive nmuber (0.._DRIVES-1) */
     BYTE ctrl,        /* Control code */
     void *buff        /* Buffer to send/receive control data */
 )
@@ -493,7 +543,7 @@ DRESULT disk_ioctl (
     WORD csize;
 
 
-    if (drv) return RES_PARERR;
+    if (!select_drive(drv)) return RES_PARERR;
 
     res = RES_ERROR;
 
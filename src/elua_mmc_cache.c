@@ -0,0 +1,267 @@
+// Sector cache for the MMC/SD FatFs layer
+// This sits between FatFs and the MMC/SD driver (elua_mmc.c or elua_mmc_sim.c)
+// and implements the disk_read/disk_write/disk_ioctl functions used by FatFs.
+// The cache is made of lines of consecutive sectors. A read miss reads the rest
+// of the line with a single multi-block (CMD18) transfer (read-ahead), writes
+// are kept in the cache and written back with multi-block (CMD25) transfers
+// when the line is replaced or when FatFs syncs the disk (f_sync/f_close).
+// The cache of a drive is emptied when the drive is initialized (mount or card
+// change) or powered off.
+
+#include "platform_conf.h"
+#ifdef BUILD_MMCFS
+#include "type.h"
+#include "diskio.h"
+#include <string.h>
+
+#define MMC_SECTOR_SIZE         512
+
+// Number of cache lines (0 disables the cache)
+#ifndef MMCFS_CACHE_LINES
+#ifdef ELUA_SIMULATOR
+#define MMCFS_CACHE_LINES       8
+#else
+#define MMCFS_CACHE_LINES       0
+#endif
+#endif
+
+// Number of sectors in a cache line (this is also the read-ahead size)
+#ifndef MMCFS_CACHE_LINE_SECTORS
+#define MMCFS_CACHE_LINE_SECTORS  4
+#endif
+#if MMCFS_CACHE_LINE_SECTORS < 1 || MMCFS_CACHE_LINE_SECTORS > 8
+#error "MMCFS_CACHE_LINE_SECTORS must be between 1 and 8"
+#endif
+
+#if MMCFS_CACHE_LINES > 0
+
+typedef struct
+{
+  DWORD first;                    // first sector of the line
+  u32 lru;                        // last use "time" of the line
+  BYTE drv;                       // physical drive
+  u8 valid;                       // bit i is set if sector i of the line is cached
+  u8 dirty;                       // bit i is set if sector i was modified but not written yet
+  BYTE data[ MMCFS_CACHE_LINE_SECTORS * MMC_SECTOR_SIZE ];
+} MMC_CACHE_LINE;
+
+static MMC_CACHE_LINE mmc_cache[ MMCFS_CACHE_LINES ];
+static u32 mmc_cache_time;
+
+// Return the cache line that holds 'sector' or NULL if not found
+static MMC_CACHE_LINE* mmc_cache_find( BYTE drv, DWORD sector )
+{
+  MMC_CACHE_LINE *pl;
+  unsigned i;
+
+  for( i = 0, pl = mmc_cache; i < MMCFS_CACHE_LINES; i ++, pl ++ )
+    if( pl->valid && pl->drv == drv && sector >= pl->first && sector < pl->first + MMCFS_CACHE_LINE_SECTORS )
+      return pl;
+  return NULL;
+}
+
+// Write the modified sectors of a line to the card, using a single transfer
+// for each group of consecutive modified sectors
+static DRESULT mmc_cache_flush_line( MMC_CACHE_LINE *pl )
+{
+  unsigned i, j;
+  DRESULT res;
+
+  for( i = 0; i < MMCFS_CACHE_LINE_SECTORS; i = j )
+  {
+    for( ; i < MMCFS_CACHE_LINE_SECTORS && ( pl->dirty & ( 1 << i ) ) == 0; i ++ );
+    for( j = i; j < MMCFS_CACHE_LINE_SECTORS && ( pl->dirty & ( 1 << j ) ) != 0; j ++ );
+    if( i == j )
+      break;
+    if( ( res = mmc_disk_write( pl->drv, pl->data + i * MMC_SECTOR_SIZE, pl->first + i, j - i ) ) != RES_OK )
+      return res;
+  }
+  pl->dirty = 0;
+  return RES_OK;
+}
+
+// Write all the modified lines of a drive to the card
+static DRESULT mmc_cache_flush( BYTE drv )
+{
+  MMC_CACHE_LINE *pl;
+  unsigned i;
+  DRESULT res = RES_OK;
+
+  for( i = 0, pl = mmc_cache; i < MMCFS_CACHE_LINES; i ++, pl ++ )
+    if( pl->dirty && pl->drv == drv && mmc_cache_flush_line( pl ) != RES_OK )
+      res = RES_ERROR;
+  return res;
+}
+
+// Return the cache line that holds 'sector', allocating the least recently
+// used line if needed (returns NULL if the replaced line can't be written)
+static MMC_CACHE_LINE* mmc_cache_get( BYTE drv, DWORD sector )
+{
+  MMC_CACHE_LINE *pl, *pvictim = mmc_cache;
+  unsigned i;
+
+  if( ( pl = mmc_cache_find( drv, sector ) ) == NULL )
+  {
+    for( i = 0, pl = mmc_cache; i < MMCFS_CACHE_LINES; i ++, pl ++ )
+    {
+      if( !pl->valid )
+      {
+        pvictim = pl;
+        break;
+      }
+      if( pl->lru < pvictim->lru )
+        pvictim = pl;
+    }
+    pl = pvictim;
+    if( pl->dirty && mmc_cache_flush_line( pl ) != RES_OK )
+      return NULL;
+    pl->drv = drv;
+    pl->first = sector - sector % MMCFS_CACHE_LINE_SECTORS;
+    pl->valid = 0;
+  }
+  pl->lru = ++ mmc_cache_time;
+  return pl;
+}
+
+// Read sector 'i' of a line and the following sectors that are not cached yet
+static DRESULT mmc_cache_fill( MMC_CACHE_LINE *pl, unsigned i )
+{
+  unsigned j;
+
+  for( j = i + 1; j < MMCFS_CACHE_LINE_SECTORS && ( pl->valid & ( 1 << j ) ) == 0; j ++ );
+  // The read-ahead can fail at the end of the card, read only the requested sector then
+  if( mmc_disk_read( pl->drv, pl->data + i * MMC_SECTOR_SIZE, pl->first + i, j - i ) != RES_OK )
+  {
+    if( j == i + 1 || mmc_disk_read( pl->drv, pl->data + i * MMC_SECTOR_SIZE, pl->first + i, 1 ) != RES_OK )
+      return RES_ERROR;
+    j = i + 1;
+  }
+  for( ; i < j; i ++ )
+    pl->valid |= 1 << i;
+  return RES_OK;
+}
+
+// FatFs initializes the drive when it's mounted and after the card was removed,
+// so the cached sectors (even the modified ones) might belong to another card
+DSTATUS disk_initialize( BYTE drv )
+{
+  MMC_CACHE_LINE *pl;
+  unsigned i;
+
+  for( i = 0, pl = mmc_cache; i < MMCFS_CACHE_LINES; i ++, pl ++ )
+    if( pl->drv == drv )
+      pl->valid = pl->dirty = 0;
+  return mmc_disk_initialize( drv );
+}
+
+DRESULT disk_read( BYTE drv, BYTE *buff, DWORD sector, BYTE count )
+{
+  MMC_CACHE_LINE *pl;
+  unsigned i, j;
+  DRESULT res;
+
+  if( count >= MMCFS_CACHE_LINE_SECTORS )
+  {
+    // Large read: read directly from the card, then use the modified sectors from the cache
+    if( ( res = mmc_disk_read( drv, buff, sector, count ) ) != RES_OK )
+      return res;
+    for( i = 0, pl = mmc_cache; i < MMCFS_CACHE_LINES; i ++, pl ++ )
+      if( pl->dirty && pl->drv == drv )
+        for( j = 0; j < MMCFS_CACHE_LINE_SECTORS; j ++ )
+          if( ( pl->dirty & ( 1 << j ) ) && pl->first + j >= sector && pl->first + j < sector + count )
+            memcpy( buff + ( pl->first + j - sector ) * MMC_SECTOR_SIZE, pl->data + j * MMC_SECTOR_SIZE, MMC_SECTOR_SIZE );
+    return RES_OK;
+  }
+  for( ; count > 0; count --, sector ++, buff += MMC_SECTOR_SIZE )
+  {
+    if( ( pl = mmc_cache_get( drv, sector ) ) == NULL )
+      return RES_ERROR;
+    i = sector - pl->first;
+    if( ( pl->valid & ( 1 << i ) ) == 0 && ( res = mmc_cache_fill( pl, i ) ) != RES_OK )
+      return res;
+    memcpy( buff, pl->data + i * MMC_SECTOR_SIZE, MMC_SECTOR_SIZE );
+  }
+  return RES_OK;
+}
+
+#if _READONLY == 0
+DRESULT disk_write( BYTE drv, const BYTE *buff, DWORD sector, BYTE count )
+{
+  MMC_CACHE_LINE *pl;
+  unsigned i, j;
+  DRESULT res;
+
+  if( count >= MMCFS_CACHE_LINE_SECTORS )
+  {
+    // Large write: write directly to the card and update the cached sectors
+    if( ( res = mmc_disk_write( drv, buff, sector, count ) ) != RES_OK )
+      return res;
+    for( i = 0, pl = mmc_cache; i < MMCFS_CACHE_LINES; i ++, pl ++ )
+      if( pl->valid && pl->drv == drv )
+        for( j = 0; j < MMCFS_CACHE_LINE_SECTORS; j ++ )
+          if( ( pl->valid & ( 1 << j ) ) && pl->first + j >= sector && pl->first + j < sector + count )
+          {
+            memcpy( pl->data + j * MMC_SECTOR_SIZE, buff + ( pl->first + j - sector ) * MMC_SECTOR_SIZE, MMC_SECTOR_SIZE );
+            pl->dirty &= ~( 1 << j );
+          }
+    return RES_OK;
+  }
+  for( ; count > 0; count --, sector ++, buff += MMC_SECTOR_SIZE )
+  {
+    if( ( pl = mmc_cache_get( drv, sector ) ) == NULL )
+      return RES_ERROR;
+    i = sector - pl->first;
+    memcpy( pl->data + i * MMC_SECTOR_SIZE, buff, MMC_SECTOR_SIZE );
+    pl->valid |= 1 << i;
+    pl->dirty |= 1 << i;
+  }
+  return RES_OK;
+}
+#endif // #if _READONLY == 0
+
+DRESULT disk_ioctl( BYTE drv, BYTE ctrl, void *buff )
+{
+  MMC_CACHE_LINE *pl;
+  unsigned i;
+
+  // Write the modified sectors before syncing or powering off the card (the
+  // card might be replaced after a power off, so the cache is also emptied)
+  if( ctrl == CTRL_SYNC || ( ctrl == CTRL_POWER && *( BYTE* )buff == 0 ) )
+  {
+    if( mmc_cache_flush( drv ) != RES_OK )
+      return RES_ERROR;
+    if( ctrl == CTRL_POWER )
+      for( i = 0, pl = mmc_cache; i < MMCFS_CACHE_LINES; i ++, pl ++ )
+        if( pl->drv == drv )
+          pl->valid = 0;
+  }
+  return mmc_disk_ioctl( drv, ctrl, buff );
+}
+
+#else // #if MMCFS_CACHE_LINES > 0
+
+DSTATUS disk_initialize( BYTE drv )
+{
+  return mmc_disk_initialize( drv );
+}
+
+DRESULT disk_read( BYTE drv, BYTE *buff, DWORD sector, BYTE count )
+{
+  return mmc_disk_read( drv, buff, sector, count );
+}
+
+#if _READONLY == 0
+DRESULT disk_write( BYTE drv, const BYTE *buff, DWORD sector, BYTE count )
+{
+  return mmc_disk_write( drv, buff, sector, count );
+}
+#endif // #if _READONLY == 0
+
+DRESULT disk_ioctl( BYTE drv, BYTE ctrl, void *buff )
+{
+  return mmc_disk_ioctl( drv, ctrl, buff );
+}
+
+#endif // #if MMCFS_CACHE_LINES > 0
+
+#endif // #ifdef BUILD_MMCFS
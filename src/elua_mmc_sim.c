@@ -7,39 +7,61 @@
 #include "platform.h"
 #include "hostif.h"
 #include "diskio.h"
+#include "ffconf.h"
 #include <stdio.h>
+#include <string.h>
 
+// The image of the first card is "sdcard.img", the other cards use
+// "sdcard1.img", "sdcard2.img" ...
 #define SD_CARD_SIM_NAME                "sdcard.img"
+#define SD_CARD_SIM_NAME_N              "sdcard%d.img"
 
 /*--------------------------------------------------------------------------
    Module Private Functions
 ---------------------------------------------------------------------------*/
 
 static volatile
-DSTATUS Stat = STA_NOINIT;    /* Disk status */
+DSTATUS Stat[ _DRIVES ];    /* Disk status */
 
 static
-BYTE PowerFlag = 0;     /* indicates if "power" is on */
+BYTE PowerFlag[ _DRIVES ];  /* indicates if "power" is on */
 
-static int fd = -1;
-static long imgsize;
+static int fd[ _DRIVES ];   /* image file descriptors (-1 if not open) */
+static long imgsize[ _DRIVES ];
+static BYTE sim_init_done;
 
+// Called before the first access to a drive
 static
-void power_on (void)
+void sim_init (void)
 {
-  PowerFlag = 1;
+  BYTE i;
+
+  if( sim_init_done )
+    return;
+  for( i = 0; i < _DRIVES; i ++ )
+  {
+    Stat[ i ] = STA_NOINIT;
+    fd[ i ] = -1;
+  }
+  sim_init_done = 1;
 }
 
 static
-void power_off (void)
+void power_on (BYTE drv)
 {
-  PowerFlag = 0;
+  PowerFlag[ drv ] = 1;
 }
 
 static
-int chk_power(void)        /* Socket power state: 0=off, 1=on */
+void power_off (BYTE drv)
 {
-  return PowerFlag;
+  PowerFlag[ drv ] = 0;
+}
+
+static
+int chk_power(BYTE drv)        /* Socket power state: 0=off, 1=on */
+{
+  return PowerFlag[ drv ];
 }
 
 /*--------------------------------------------------------------------------
@@ -53,28 +75,35 @@ int chk_power(void)        /* Socket power state: 0=off, 1=on */
 /* Initialize Disk Drive                                                 */
 /*-----------------------------------------------------------------------*/
 
-DSTATUS disk_initialize (
-    BYTE drv        /* Physical drive nmuber (0) */
+DSTATUS mmc_disk_initialize (
+    BYTE drv        /* Physical drive nmuber (0.._DRIVES-1) */
 )
 {
-  if( drv )
+  char name[ 16 ];
+
+  if( drv >= _DRIVES )
     return STA_NOINIT;
+  sim_init();
 
-  if( fd != -1 )
-    return Stat;
+  if( fd[ drv ] != -1 )
+    return Stat[ drv ];
 
-  fd = hostif_open( SD_CARD_SIM_NAME, 2, 0666 );
+  if( drv == 0 )
+    strcpy( name, SD_CARD_SIM_NAME );
+  else
+    sprintf( name, SD_CARD_SIM_NAME_N, drv );
+  fd[ drv ] = hostif_open( name, 2, 0666 );
 
-  if( fd == -1 )
-    printf( "[SDSIM] Unable to open " SD_CARD_SIM_NAME "\n" );
+  if( fd[ drv ] == -1 )
+    printf( "[SDSIM] Unable to open %s\n", name );
   else
   {
-    Stat = 0;
-    imgsize = hostif_lseek( fd, 0, SEEK_END );
-    hostif_lseek( fd, 0, SEEK_SET );
-    printf( "[SDSIM] found SD card image, size=%ld bytes\n", imgsize );
+    Stat[ drv ] = 0;
+    imgsize[ drv ] = hostif_lseek( fd[ drv ], 0, SEEK_END );
+    hostif_lseek( fd[ drv ], 0, SEEK_SET );
+    printf( "[SDSIM] found SD card image %s, size=%ld bytes\n", name, imgsize[ drv ] );
   }
-  return Stat;
+  return Stat[ drv ];
 }
 
 /*-----------------------------------------------------------------------*/
@@ -83,30 +112,31 @@ DSTATUS disk_initialize (
 
 
 DSTATUS disk_status (
-    BYTE drv        /* Physical drive nmuber (0) */
+    BYTE drv        /* Physical drive nmuber (0.._DRIVES-1) */
 )
 {
-    if (drv) return STA_NOINIT;        /* Supports only single drive */
-    return Stat;
+    if (drv >= _DRIVES) return STA_NOINIT;
+    sim_init();
+    return Stat[drv];
 }
 
 /*-----------------------------------------------------------------------*/
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_read (
-    BYTE drv,            /* Physical drive nmuber (0) */
+DRESULT mmc_disk_read (
+    BYTE drv,            /* Physical drive nmuber (0.._DRIVES-1) */
     BYTE *buff,            /* Pointer to the data buffer to store read data */
     DWORD sector,        /* Start sector number (LBA) */
     BYTE count            /* Sector count (1..255) */
 )
 {
-  if (drv || !count) return RES_PARERR;
-  if (Stat & STA_NOINIT) return RES_NOTRDY;
+  if (drv >= _DRIVES || !count) return RES_PARERR;
+  if (Stat[drv] & STA_NOINIT) return RES_NOTRDY;
 
-  if( hostif_lseek( fd, sector * 512, SEEK_SET ) == -1 )
+  if( hostif_lseek( fd[ drv ], sector * 512, SEEK_SET ) == -1 )
     return RES_ERROR;
-  if( hostif_read( fd, buff, count * 512 ) != count * 512 )
+  if( hostif_read( fd[ drv ], buff, count * 512 ) != count * 512 )
     return RES_ERROR;
   return RES_OK;
 }
@@ -115,19 +145,19 @@ DRESULT disk_read (
 /* Write Sector(s)                                                       */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_write (
-    BYTE drv,            /* Physical drive nmuber (0) */
+DRESULT mmc_disk_write (
+    BYTE drv,            /* Physical drive nmuber (0.._DRIVES-1) */
     const BYTE *buff,    /* Pointer to the data to be written */
     DWORD sector,        /* Start sector number (LBA) */
     BYTE count            /* Sector count (1..255) */
 )
 {
-  if (drv || !count) return RES_PARERR;
-  if (Stat & STA_NOINIT) return RES_NOTRDY;
+  if (drv >= _DRIVES || !count) return RES_PARERR;
+  if (Stat[drv] & STA_NOINIT) return RES_NOTRDY;
 
-  if( hostif_lseek( fd, sector * 512, SEEK_SET ) == -1 )
+  if( hostif_lseek( fd[ drv ], sector * 512, SEEK_SET ) == -1 )
     return RES_ERROR;
-  if( hostif_write( fd, buff, count * 512 ) != count * 512 )
+  if( hostif_write( fd[ drv ], buff, count * 512 ) != count * 512 )
     return RES_ERROR;
   return RES_OK;
 }
@@ -136,8 +166,8 @@ DRESULT disk_write (
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_ioctl (
-    BYTE drv,        /* Physical drive nmuber (0) */
+DRESULT mmc_disk_ioctl (
+    BYTE drv,        /* Physical drive nmuber (0.._DRIVES-1) */
     BYTE ctrl,        /* Control code */
     void *buff        /* Buffer to send/receive control data */
 )
@@ -145,22 +175,22 @@ DRESULT disk_ioctl (
     DRESULT res;
     BYTE *ptr = buff;
 
-    if (drv) return RES_PARERR;
+    if (drv >= _DRIVES) return RES_PARERR;
     res = RES_ERROR;
 
     if (ctrl == CTRL_POWER) {
         switch (*ptr) {
         case 0:        /* Sub control code == 0 (POWER_OFF) */
-            if (chk_power())
-                power_off();        /* Power off */
+            if (chk_power(drv))
+                power_off(drv);        /* Power off */
             res = RES_OK;
             break;
         case 1:        /* Sub control code == 1 (POWER_ON) */
-            power_on();                /* Power on */
+            power_on(drv);                /* Power on */
             res = RES_OK;
             break;
         case 2:        /* Sub control code == 2 (POWER_GET) */
-            *(ptr+1) = (BYTE)chk_power();
+            *(ptr+1) = (BYTE)chk_power(drv);
             res = RES_OK;
             break;
         default :
@@ -168,11 +198,11 @@ DRESULT disk_ioctl (
         }
     }
     else {
-        if (Stat & STA_NOINIT) return RES_NOTRDY;
+        if (Stat[drv] & STA_NOINIT) return RES_NOTRDY;
 
         switch (ctrl) {
         case GET_SECTOR_COUNT :    /* Get number of sectors on the disk (DWORD) */
-            *(DWORD*)buff = imgsize / 512;
+            *(DWORD*)buff = imgsize[drv] / 512;
             res = RES_OK;
             break;
 
@@ -14,7 +14,9 @@
 #include "uip-split.h"
 #include "dhcpc.h"
 #include "resolv.h"
+#include "elua_int.h"
 #include <string.h>
+#include <stdlib.h>
 
 // UIP send buffer
 extern void* uip_sappdata;
@@ -26,14 +28,17 @@ static volatile u8 elua_uip_configured;
 // Platform independenet eLua UIP "main loop" implementation
 
 // Timers
-static u32 periodic_timer, arp_timer;
+static u32 periodic_timer, arp_timer, dns_timer;
 
 // Macro for accessing the Ethernet header information in the buffer.
 #define BUF                     ((struct uip_eth_hdr *)&uip_buf[0])
+// Macro for accessing the UDP/IP header information in the buffer.
+#define UDPBUF                  ((struct uip_udpip_hdr *)&uip_buf[UIP_LLH_LEN])
 
 // UIP Timers (in ms)
 #define UIP_PERIODIC_TIMER_MS   500
 #define UIP_ARP_TIMER_MS        10000
+#define UIP_DNS_TIMER_MS        1000
 
 #define IP_TCP_HEADER_LENGTH 40
 #define TOTAL_HEADER_LENGTH (IP_TCP_HEADER_LENGTH+UIP_LLH_LEN)
@@ -43,52 +48,88 @@ static void device_driver_send()
   platform_eth_send_packet( uip_buf, uip_len );
 }
 
-// This gets called on both Ethernet RX interrupts and timer requests,
-// but it's called only from the Ethernet interrupt handler
-void elua_uip_mainloop()
+// Called by uip_split_output for each half of a segment
+void tcpip_output()
 {
-  u32 temp, packet_len;
+  device_driver_send();
+}
 
-  // Increment uIP timers
-  temp = platform_eth_get_elapsed_time();
-  periodic_timer += temp;
-  arp_timer += temp;  
+// Only packets with more than half a MSS of TCP data are split
+#define ELUA_UIP_SPLIT_MIN_LEN  ( UIP_TCP_MSS / 2 + UIP_TCPIP_HLEN + UIP_LLH_LEN )
 
-  // Check for an RX packet and read it
-  if( ( packet_len = platform_eth_get_packet_nb( uip_buf, sizeof( uip_buf ) ) ) > 0 )
+// Send the packet generated by uIP. Large TCP segments are sent in two halves,
+// so the remote host acknowledges them immediately instead of delaying the ACK
+// while waiting for a second segment (uIP has only one segment in flight).
+// Smaller segments (interactive traffic) are sent as they are.
+static void elua_uip_output()
+{
+  uip_arp_out();
+  if( BUF->type == htons( UIP_ETHTYPE_IP ) && uip_len > ELUA_UIP_SPLIT_MIN_LEN )
+    uip_split_output();
+  else // ARP request or small segment
+    device_driver_send();
+}
+
+// Network statistics (elua_net_get_stats)
+static elua_net_stats elua_uip_stats;
+
+// Return the current system timer value (0 if not available)
+static timer_data_type elua_uip_now()
+{
+  return platform_timer_sys_available() ? platform_timer_read_sys() : 0;
+}
+
+static timer_data_type elua_uip_time_since( timer_data_type start )
+{
+  timer_data_type now = elua_uip_now();
+
+  return now >= start ? now - start : 0;
+}
+
+// Process the frame in uip_buf ('uip_len' bytes)
+static void elua_uip_input()
+{
+  timer_data_type tstart = elua_uip_now();
+
+  // Process incoming IP packets here.
+  if( BUF->type == htons( UIP_ETHTYPE_IP ) )
   {
-    // Set uip_len for uIP stack usage.
-    uip_len = ( unsigned short )packet_len;
+    uip_arp_ipin();
+    uip_input();
 
-    // Process incoming IP packets here.
-    if( BUF->type == htons( UIP_ETHTYPE_IP ) )
+    // If the above function invocation resulted in data that
+    // should be sent out on the network, the global variable
+    // uip_len is set to a value > 0.
+    if( uip_len > 0 )
     {
-      uip_arp_ipin();
-      uip_input();
-
-      // If the above function invocation resulted in data that
-      // should be sent out on the network, the global variable
-      // uip_len is set to a value > 0.
-      if( uip_len > 0 )
-      {
-        uip_arp_out();
-        device_driver_send();
-      }
+      elua_uip_output();
     }
+  }
 
-    // Process incoming ARP packets here.
-    else if( BUF->type == htons( UIP_ETHTYPE_ARP ) )
-    {
-      uip_arp_arpin();
+  // Process incoming ARP packets here.
+  else if( BUF->type == htons( UIP_ETHTYPE_ARP ) )
+  {
+    uip_arp_arpin();
 
-      // If the above function invocation resulted in data that
-      // should be sent out on the network, the global variable
-      // uip_len is set to a value > 0.
-      if( uip_len > 0 )
-        device_driver_send();
-    }
+    // If the above function invocation resulted in data that
+    // should be sent out on the network, the global variable
+    // uip_len is set to a value > 0.
+    if( uip_len > 0 )
+      device_driver_send();
   }
-  
+  elua_uip_stats.rx_frames ++;
+  elua_uip_stats.rx_time += elua_uip_time_since( tstart );
+}
+
+// Advance the uIP timers by 'elapsed' ms and poll the connections
+static void elua_uip_periodic( u32 elapsed )
+{
+  u32 temp;
+
+  periodic_timer += elapsed;
+  arp_timer += elapsed;  
+  dns_timer += elapsed;
+
   // Process TCP/IP Periodic Timer here.
   // Also process the "force interrupt" events (platform_eth_force_interrupt)
   if( periodic_timer >= UIP_PERIODIC_TIMER_MS )
@@ -107,8 +148,7 @@ void elua_uip_mainloop()
     // uip_len is set to a value > 0.
     if( uip_len > 0 )
     {
-      uip_arp_out();
-      device_driver_send();
+      elua_uip_output();
     }
   }
 
@@ -122,8 +162,7 @@ void elua_uip_mainloop()
       // uip_len is set to a value > 0.
       if( uip_len > 0 )
       {
-        uip_arp_out();
-        device_driver_send();
+        elua_uip_output();
       }
     }
 #endif // UIP_UDP
@@ -134,6 +173,111 @@ void elua_uip_mainloop()
     arp_timer = 0;
     uip_arp_timer();
   }  
+
+  // Age the DNS cache (the resolver counts in seconds)
+  while( dns_timer >= UIP_DNS_TIMER_MS )
+  {
+    dns_timer -= UIP_DNS_TIMER_MS;
+    resolv_timer();
+  }
+}
+
+#ifdef ELUA_NET_DEFERRED
+// Deferred processing: the Ethernet interrupt handler only moves the received
+// frames to a frame pool, the frames are processed later (with interrupts 
+// enabled) by elua_uip_process. This runs from the Lua hook (elua_int_defer)
+// and while the eLua TCP/IP functions wait for the network. When Lua is not
+// running, the interrupt handler processes the frames itself.
+
+#ifndef ELUA_NET_RX_FRAMES
+#define ELUA_NET_RX_FRAMES            4
+#endif
+
+static u8 elua_uip_rxf[ ELUA_NET_RX_FRAMES ][ UIP_BUFSIZE ];
+static u16 elua_uip_rxf_len[ ELUA_NET_RX_FRAMES ];
+static volatile u8 elua_uip_rxf_head, elua_uip_rxf_count;
+static volatile u8 elua_uip_pending, elua_uip_busy;
+static volatile u32 elua_uip_elapsed;
+
+static void elua_uip_process()
+{
+  int old_status;
+  u32 elapsed;
+
+  old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+  // Don't run again from the interrupt handler if the interrupted code was
+  // already processing the frames (the next interrupt will do it)
+  if( !elua_uip_pending || elua_uip_busy )
+  {
+    platform_cpu_set_global_interrupts( old_status );
+    return;
+  }
+  elua_uip_pending = 0;
+  elua_uip_busy = 1;
+  elapsed = elua_uip_elapsed;
+  elua_uip_elapsed = 0;
+  platform_cpu_set_global_interrupts( old_status );
+  // The interrupt handler only writes to the free frames
+  while( elua_uip_rxf_count > 0 )
+  {
+    uip_len = elua_uip_rxf_len[ elua_uip_rxf_head ];
+    memcpy( uip_buf, elua_uip_rxf[ elua_uip_rxf_head ], uip_len );
+    old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+    elua_uip_rxf_head = ( elua_uip_rxf_head + 1 ) % ELUA_NET_RX_FRAMES;
+    elua_uip_rxf_count --;
+    platform_cpu_set_global_interrupts( old_status );
+    elua_uip_input();
+  }
+  elua_uip_periodic( elapsed );
+  elua_uip_busy = 0;
+}
+
+// Called by the functions that wait for the network
+#define elua_uip_yield()              elua_uip_process()
+#else // #ifdef ELUA_NET_DEFERRED
+#define elua_uip_yield()
+#endif // #ifdef ELUA_NET_DEFERRED
+
+// This gets called on both Ethernet RX interrupts and timer requests,
+// but it's called only from the Ethernet interrupt handler
+void elua_uip_mainloop()
+{
+  timer_data_type tstart = elua_uip_now(), t;
+  u32 packet_len;
+#ifdef ELUA_NET_DEFERRED
+  u8 idx;
+#endif
+
+#ifdef ELUA_NET_DEFERRED
+  // Move the received frames to the pool (frames that don't fit are left
+  // in the Ethernet controller) and schedule the processing
+  elua_uip_elapsed += platform_eth_get_elapsed_time();
+  while( elua_uip_rxf_count < ELUA_NET_RX_FRAMES )
+  {
+    idx = ( elua_uip_rxf_head + elua_uip_rxf_count ) % ELUA_NET_RX_FRAMES;
+    if( ( packet_len = platform_eth_get_packet_nb( elua_uip_rxf[ idx ], UIP_BUFSIZE ) ) == 0 )
+      break;
+    elua_uip_rxf_len[ idx ] = ( u16 )packet_len;
+    elua_uip_rxf_count ++;
+  }
+  elua_uip_pending = 1;
+  // Without a running Lua program nothing would call the Lua hook, so process
+  // the frames now (like in the non-deferred mode)
+  if( elua_int_defer( elua_uip_process ) != PLATFORM_OK )
+    elua_uip_process();
+#else // #ifdef ELUA_NET_DEFERRED
+  // Check for an RX packet and read it
+  if( ( packet_len = platform_eth_get_packet_nb( uip_buf, sizeof( uip_buf ) ) ) > 0 )
+  {
+    // Set uip_len for uIP stack usage.
+    uip_len = ( unsigned short )packet_len;
+    elua_uip_input();
+  }
+  elua_uip_periodic( platform_eth_get_elapsed_time() );
+#endif // #ifdef ELUA_NET_DEFERRED
+  if( ( t = elua_uip_time_since( tstart ) ) > elua_uip_stats.isr_max )
+    elua_uip_stats.isr_max = t;
+  elua_uip_stats.isr_count ++;
 }
 
 // *****************************************************************************
@@ -161,19 +305,9 @@ void dhcpc_configured(const struct dhcpc_state *s)
 // DNS callback
 
 #ifdef BUILD_DNS
-volatile static int elua_resolv_req_done;
-static elua_net_ip elua_resolv_ip;
-
+// The answers are kept in the resolver cache and read with resolv_status()
 void resolv_found( char *name, u16_t *ipaddr )
 {
-  if( !ipaddr )
-    elua_resolv_ip.ipaddr = 0;
-  else
-  {
-    elua_resolv_ip.ipwords[ 0 ] = ipaddr[ 0 ];
-    elua_resolv_ip.ipwords[ 1 ] = ipaddr[ 1 ];
-  }
-  elua_resolv_req_done = 1;
 }
 #endif
 
@@ -190,84 +324,276 @@ void resolv_found( char *name, u16_t *ipaddr )
 #define TELNET_SE_CHAR         240
 #define TELNET_EOF             236
 
+// TELNET input parser states
+#define TELNET_RX_DATA         0
+#define TELNET_RX_IAC          1
+#define TELNET_RX_OPTION       2
+#define TELNET_RX_SB           3
+#define TELNET_RX_SB_IAC       4
+
+// Size of the TELNET output ring
+#ifndef ELUA_NET_TELNET_TXBUF_SIZE
+#define ELUA_NET_TELNET_TXBUF_SIZE    ( 2 * UIP_TCP_MSS )
+#endif
+
 // The telnet socket number
-static int elua_uip_telnet_socket = -1;
+static volatile int elua_uip_telnet_socket = -1;
 
-// Utility function for TELNET: parse input buffer, skipping over
-// TELNET specific sequences
-// Returns the length of the buffer after processing
-static void elua_uip_telnet_handle_input( volatile struct elua_uip_state* s )
+// Console output ring. The data is already translated ('\n' -> "\r\n").
+// 'txsent' bytes from the head of the ring are in flight (not yet acked).
+static u8 elua_uip_telnet_txbuf[ ELUA_NET_TELNET_TXBUF_SIZE ];
+static volatile elua_net_size elua_uip_telnet_txhead, elua_uip_telnet_txcount, elua_uip_telnet_txsent;
+static u8 elua_uip_telnet_rxstate;
+
+#endif // #ifdef BUILD_CON_TCP
+
+// *****************************************************************************
+// Socket receive buffers
+
+// Default receive buffer size for a socket
+#ifndef ELUA_NET_RX_BUF_SIZE
+#define ELUA_NET_RX_BUF_SIZE          ( 2 * UIP_TCP_MSS )
+#endif
+
+#ifdef BUILD_CON_TCP
+static u8 elua_uip_telnet_rxbuf[ UIP_TCP_MSS ];
+#endif
+
+// Copy data to/from a ring buffer, starting at position 'pos' (modulo 'size')
+static void elua_uip_ring_put( u8 *ring, elua_net_size size, unsigned pos, const void *src, elua_net_size len )
 {
-  u8 *dptr = ( u8* )uip_appdata;
-  char *orig = ( char* )s->ptr;
-  int skip;
-  elua_net_size maxsize = s->len;
-  
-  // Traverse the input buffer, skipping over TELNET sequences
-  while( ( dptr < ( u8* )uip_appdata + uip_datalen() ) && ( s->ptr - orig < s->len ) )
-  {
-    if( *dptr != TELNET_IAC_CHAR ) // regular char, copy it to buffer
-      *s->ptr ++ = *dptr ++;
-    else
-    {
-      // Control sequence: 2 or 3 bytes?
-      if( ( dptr[ 1 ] >= TELNET_IAC_3B_FIRST ) && ( dptr[ 1 ] <= TELNET_IAC_3B_LAST ) )
-        skip = 3;
-      else
-      {
-        // Check EOF indication
-        if( dptr[ 1 ] == TELNET_EOF )
-          *s->ptr ++ = STD_CTRLZ_CODE;
-        skip = 2;
-      }
-      dptr += skip;
-    }
-  } 
-  if( s->ptr > orig )
+  elua_net_size chunk;
+
+  pos %= size;
+  chunk = UMIN( len, size - pos );
+  memcpy( ring + pos, src, chunk );
+  memcpy( ring, ( const u8* )src + chunk, len - chunk );
+}
+
+static void elua_uip_ring_get( const u8 *ring, elua_net_size size, unsigned pos, void *dest, elua_net_size len )
+{
+  elua_net_size chunk;
+
+  pos %= size;
+  chunk = UMIN( len, size - pos );
+  memcpy( dest, ring + pos, chunk );
+  memcpy( ( u8* )dest + chunk, ring, len - chunk );
+}
+
+static void elua_uip_rx_attach( volatile struct elua_uip_state *s, u8 *buf, elua_net_size size )
+{
+  s->rxbuf = buf;
+  s->rxsize = size;
+  s->rxhead = s->rxcount = 0;
+  s->rxstatus = ELUA_NET_ERR_OK;
+  s->rxupdate = 0;
+}
+
+// Called by uIP to find the receive window of a connection
+u16 elua_uip_rx_window( struct uip_conn *conn )
+{
+  struct elua_uip_state *s = ( struct elua_uip_state* )&conn->appstate;
+
+  if( s->rxbuf == NULL )
+    return UIP_RECEIVE_WINDOW;
+  return s->rxsize - s->rxcount;
+}
+
+// Add the new data to the receive buffer (UIP application)
+static void elua_uip_rx_write( volatile struct elua_uip_state *s )
+{
+  elua_net_size len = UMIN( uip_datalen(), s->rxsize - s->rxcount );
+
+  elua_uip_ring_put( s->rxbuf, s->rxsize, s->rxhead + s->rxcount, uip_appdata, len );
+  s->rxcount += len;
+}
+
+// Remove 'len' bytes from the receive buffer (eLua side)
+static void elua_uip_rx_consume( int sock, elua_net_size len )
+{
+  volatile struct elua_uip_state *s = ( volatile struct elua_uip_state* )&( uip_conns[ sock ].appstate );
+  int old_status;
+  int closed = s->rxsize - s->rxcount < UIP_TCP_MSS;
+
+  old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+  s->rxhead = ( s->rxhead + len ) % s->rxsize;
+  s->rxcount -= len;
+  platform_cpu_set_global_interrupts( old_status );
+  // Tell the remote host about the new window if it was (almost) closed
+  if( closed && len > 0 )
   {
-    s->res = ELUA_NET_ERR_OK;
-    s->len = maxsize - ( s->ptr - orig );
-    uip_stop();
-    s->state = ELUA_UIP_STATE_IDLE;
+    s->rxupdate = 1;
+    platform_eth_force_interrupt();
   }
 }
 
-// Utility function for TELNET: prepend all '\n' with '\r' in buffer
-// Returns actual len
-// It is assumed that the buffer is "sufficiently smaller" than the UIP
-// buffer (which is true for the default configuration: 128 bytes buffer
-// in Newlib for stdin/stdout, more than 1024 bytes UIP buffer)
-static elua_net_size elua_uip_telnet_prep_send( const char* src, elua_net_size size )
+// *****************************************************************************
+// TELNET console (UIP application side)
+
+#ifdef BUILD_CON_TCP
+static void elua_uip_telnet_reset()
 {
-  elua_net_size actsize = size, i;
-  char* dest = ( char* )uip_sappdata;
-    
-  for( i = 0; i < size; i ++ )
+  elua_uip_telnet_txhead = elua_uip_telnet_txcount = elua_uip_telnet_txsent = 0;
+  elua_uip_telnet_rxstate = TELNET_RX_DATA;
+}
+
+// Write the received segment to the receive buffer, skipping the TELNET
+// commands. The parser state is kept between segments.
+static void elua_uip_telnet_rx_write( volatile struct elua_uip_state *s )
+{
+  const u8 *p = ( const u8* )uip_appdata;
+  elua_net_size len = uip_datalen();
+  u8 *pbuf = s->rxbuf;
+  elua_net_size size = s->rxsize, head = s->rxhead, count = s->rxcount;
+  u8 state = elua_uip_telnet_rxstate, c;
+
+  for( ; len > 0 && count < size; len -- )
   {
-    if( *src == '\n' )
+    c = *p ++;
+    switch( state )
     {
-      *dest ++ = '\r';
-      actsize ++;
-    } 
-    *dest ++ = *src ++;
+      case TELNET_RX_DATA:
+        if( c == TELNET_IAC_CHAR )
+          state = TELNET_RX_IAC;
+        else
+          pbuf[ ( head + count ++ ) % size ] = c;
+        break;
+
+      case TELNET_RX_IAC:
+        state = TELNET_RX_DATA;
+        if( c == TELNET_IAC_CHAR ) // escaped 255
+          pbuf[ ( head + count ++ ) % size ] = c;
+        else if( c >= TELNET_IAC_3B_FIRST && c <= TELNET_IAC_3B_LAST )
+          state = TELNET_RX_OPTION;
+        else if( c == TELNET_SB_CHAR )
+          state = TELNET_RX_SB;
+        else if( c == TELNET_EOF )
+          pbuf[ ( head + count ++ ) % size ] = STD_CTRLZ_CODE;
+        break;
+
+      case TELNET_RX_OPTION:
+        state = TELNET_RX_DATA;
+        break;
+
+      case TELNET_RX_SB: // skip everything up to IAC SE
+        if( c == TELNET_IAC_CHAR )
+          state = TELNET_RX_SB_IAC;
+        break;
+
+      case TELNET_RX_SB_IAC:
+        state = c == TELNET_SE_CHAR ? TELNET_RX_DATA : TELNET_RX_SB;
+        break;
+    }
   }
-  return actsize;
+  s->rxcount = count;
+  elua_uip_telnet_rxstate = state;
 }
 
+// Send data from the console output ring. Only one segment is in flight at
+// a time, so data written while waiting for an ACK is batched in the next
+// segment.
+static void elua_uip_telnet_send()
+{
+  elua_net_size len;
+
+  if( uip_acked() && elua_uip_telnet_txsent > 0 )
+  {
+    elua_uip_telnet_txhead = ( elua_uip_telnet_txhead + elua_uip_telnet_txsent ) % ELUA_NET_TELNET_TXBUF_SIZE;
+    elua_uip_telnet_txcount -= elua_uip_telnet_txsent;
+    elua_uip_telnet_txsent = 0;
+  }
+  if( uip_rexmit() )
+    len = elua_uip_telnet_txsent;
+  else if( elua_uip_telnet_txsent == 0 )
+    len = elua_uip_telnet_txsent = UMIN( elua_uip_telnet_txcount, uip_mss() );
+  else
+    return;
+  if( len > 0 )
+  {
+    elua_uip_ring_get( elua_uip_telnet_txbuf, ELUA_NET_TELNET_TXBUF_SIZE, elua_uip_telnet_txhead, uip_sappdata, len );
+    uip_send( uip_sappdata, len );
+  }
+}
 #endif // #ifdef BUILD_CON_TCP
 
 // *****************************************************************************
 // eLua UIP application (used to implement the eLua TCP/IP services)
 
-// Special handling for "accept"
-volatile static u8 elua_uip_accept_request;
-volatile static int elua_uip_accept_sock;
-volatile static elua_net_ip elua_uip_accept_remote;
+// Listening ports ("accept")
+// Each listener keeps a queue of connections that were established but not
+// yet accepted and a pool of receive buffers for them (allocated in advance,
+// since the UIP application can't allocate memory).
+#ifndef ELUA_NET_ACCEPT_BACKLOG
+#define ELUA_NET_ACCEPT_BACKLOG       2
+#endif
+
+struct elua_uip_listener
+{
+  u16               port;             // in network order, 0 if not used
+  u8                head, count, npool;
+  s8                socks[ ELUA_NET_ACCEPT_BACKLOG ];
+  u8*               rxpool[ ELUA_NET_ACCEPT_BACKLOG ];
+};
+
+static volatile struct elua_uip_listener elua_uip_listeners[ UIP_LISTENPORTS ];
+
+static volatile struct elua_uip_listener* elua_uip_find_listener( u16 port )
+{
+  unsigned i;
+
+  for( i = 0; i < UIP_LISTENPORTS; i ++ )
+    if( elua_uip_listeners[ i ].port == port )
+      return elua_uip_listeners + i;
+  return NULL;
+}
+
+// Queue a new connection on its listener, returns -1 if it can't be accepted
+static int elua_uip_listener_push( int sockno, volatile struct elua_uip_state *s )
+{
+  volatile struct elua_uip_listener *pl = elua_uip_find_listener( uip_conn->lport );
+
+  if( pl == NULL || pl->count == ELUA_NET_ACCEPT_BACKLOG )
+    return -1;
+  // Use a buffer from the pool (or reuse the one left by a previous socket)
+  if( s->rxbuf == NULL )
+  {
+    if( pl->npool == 0 )
+      return -1;
+    elua_uip_rx_attach( s, pl->rxpool[ -- pl->npool ], ELUA_NET_RX_BUF_SIZE );
+  }
+  else
+    elua_uip_rx_attach( s, s->rxbuf, s->rxsize );
+  pl->socks[ ( pl->head + pl->count ++ ) % ELUA_NET_ACCEPT_BACKLOG ] = sockno;
+  return 0;
+}
+
+// Remove a connection that was closed (or aborted) before it was accepted from 
+// the queue of its listener, since its slot can be reused by another connection.
+// Its receive buffer goes back to the pool of the listener if there's room
+// (otherwise it stays with the slot, see elua_uip_listener_push).
+static void elua_uip_listener_remove( int sockno, volatile struct elua_uip_state *s )
+{
+  volatile struct elua_uip_listener *pl = elua_uip_find_listener( uip_conn->lport );
+  unsigned i;
+
+  if( pl == NULL )
+    return;
+  for( i = 0; i < pl->count && pl->socks[ ( pl->head + i ) % ELUA_NET_ACCEPT_BACKLOG ] != sockno; i ++ );
+  if( i == pl->count )
+    return;
+  for( ; i + 1 < pl->count; i ++ )
+    pl->socks[ ( pl->head + i ) % ELUA_NET_ACCEPT_BACKLOG ] = pl->socks[ ( pl->head + i + 1 ) % ELUA_NET_ACCEPT_BACKLOG ];
+  pl->count --;
+  if( pl->npool < ELUA_NET_ACCEPT_BACKLOG && s->rxsize == ELUA_NET_RX_BUF_SIZE )
+  {
+    pl->rxpool[ pl->npool ++ ] = s->rxbuf;
+    s->rxbuf = NULL;
+  }
+}
 
 void elua_uip_appcall()
 {
   volatile struct elua_uip_state *s;
-  elua_net_size temp;
   int sockno;
   
   // If uIP is not yet configured (DHCP response not received), do nothing
@@ -275,11 +601,7 @@ void elua_uip_appcall()
     return;
     
   s = ( struct elua_uip_state* )&( uip_conn->appstate );
-  // Need to find the actual socket location, since UIP doesn't provide this ...
-  for( temp = 0; temp < UIP_CONNS; temp ++ )
-    if( uip_conns + temp == uip_conn )
-      break;
-  sockno = ( int )temp;
+  sockno = ( int )( uip_conn - uip_conns );
 
   if( uip_connected() )
   {
@@ -292,52 +614,86 @@ void elua_uip_appcall()
         return;
       }
       else
+      {
+        elua_uip_telnet_reset();
         elua_uip_telnet_socket = sockno;
+        elua_uip_rx_attach( s, elua_uip_telnet_rxbuf, sizeof( elua_uip_telnet_rxbuf ) );
+      }
     }
     else
 #endif
-    if( elua_uip_accept_request )
+    if( s->state == ELUA_UIP_STATE_CONNECT )
     {
-      elua_uip_accept_sock = sockno;
-      elua_uip_accept_remote.ipwords[ 0 ] = uip_conn->ripaddr[ 0 ];
-      elua_uip_accept_remote.ipwords[ 1 ] = uip_conn->ripaddr[ 1 ];      
-      elua_uip_accept_request = 0;
-    }
-    else if( s->state == ELUA_UIP_STATE_CONNECT )
       s->state = ELUA_UIP_STATE_IDLE;
-    uip_stop();
+      elua_uip_rx_attach( s, s->rxbuf, s->rxsize );
+    }
+    else if( elua_uip_listener_push( sockno, s ) == -1 ) // no listener or backlog full
+    {
+      uip_abort();
+      return;
+    }
+    if( s->rxbuf == NULL )
+      uip_stop();
     return;
   }
 
-  if( s->state == ELUA_UIP_STATE_IDLE )
-    return;
-    
-  // Do we need to read?
-  if( s->state == ELUA_UIP_STATE_RECV )
+  // Buffer received data, no matter what the socket is doing
+  if( uip_newdata() && s->rxbuf )
   {
-    // Re-enable data transfer on the socket and change state
-    s->state = ELUA_UIP_STATE_RECV_2;
-    uip_restart();
-    return;
+#ifdef BUILD_CON_TCP
+    if( sockno == elua_uip_telnet_socket )
+      elua_uip_telnet_rx_write( s );
+    else
+#endif
+      elua_uip_rx_write( s );
   }
-  
+
   if( uip_aborted() || uip_timedout() || uip_closed() )
   {
     // Signal this error
-    s->res = uip_aborted() ? ELUA_NET_ERR_ABORTED : ( uip_timedout() ? ELUA_NET_ERR_TIMEDOUT : ELUA_NET_ERR_CLOSED );
+    s->rxstatus = uip_aborted() ? ELUA_NET_ERR_ABORTED : ( uip_timedout() ? ELUA_NET_ERR_TIMEDOUT : ELUA_NET_ERR_CLOSED );
 #ifdef BUILD_CON_TCP    
     if( sockno == elua_uip_telnet_socket )
+    {
       elua_uip_telnet_socket = -1;      
+      elua_uip_telnet_reset();
+      // The static telnet buffer must not be reused by the next connection in this slot
+      s->rxbuf = NULL;
+    }
+    else
 #endif    
-    s->state = ELUA_UIP_STATE_IDLE;
+    if( s->rxbuf )
+      elua_uip_listener_remove( sockno, s );
+    if( s->state != ELUA_UIP_STATE_IDLE )
+    {
+      s->res = s->rxstatus;
+      s->state = ELUA_UIP_STATE_IDLE;
+    }
+    return;
+  }
+
+  // Send a window update if 'recv' freed space in an (almost) full buffer
+  if( uip_poll() && s->rxupdate )
+  {
+    s->rxupdate = 0;
+    uip_restart();
+  }
+
+#ifdef BUILD_CON_TCP
+  // The console output doesn't use the SEND state (see elua_net_telnet_write)
+  if( sockno == elua_uip_telnet_socket && s->state != ELUA_UIP_STATE_CLOSE )
+  {
+    elua_uip_telnet_send();
     return;
   }
+#endif
+
+  if( s->state == ELUA_UIP_STATE_IDLE )
+    return;
        
   // Handle data send  
   if( ( uip_acked() || uip_rexmit() || uip_poll() ) && ( s->state == ELUA_UIP_STATE_SEND ) )
   {
-    // Special translation for TELNET: prepend all '\n' with '\r'
-    // We write directly in UIP's buffer 
     if( uip_acked() )
     {
       elua_net_size minlen = UMIN( s->len, uip_mss() );    
@@ -347,17 +703,7 @@ void elua_uip_appcall()
         s->state = ELUA_UIP_STATE_IDLE;
     }
     if( s->len > 0 ) // need to (re)transmit?
-    {
-#ifdef BUILD_CON_TCP
-      if( sockno == elua_uip_telnet_socket )
-      {
-        temp = elua_uip_telnet_prep_send( s->ptr, s->len );
-        uip_send( uip_sappdata, temp );
-      }
-      else
-#endif      
-        uip_send( s->ptr, UMIN( s->len, uip_mss() ) );
-    }
+      uip_send( s->ptr, UMIN( s->len, uip_mss() ) );
     return;
   }
   
@@ -368,78 +714,6 @@ void elua_uip_appcall()
     s->state = ELUA_UIP_STATE_IDLE;
     return;
   }
-          
-  // Handle data receive  
-  if( uip_newdata() )
-  {
-    if( s->state == ELUA_UIP_STATE_RECV_2 )
-    {
-#ifdef BUILD_CON_TCP      
-      if( sockno == elua_uip_telnet_socket )
-      {
-        elua_uip_telnet_handle_input( s );
-        return;
-      }
-#endif   
-      int lastfound = 0;
-      
-      // Check end of transmission
-      if( uip_datalen() < UIP_RECEIVE_WINDOW )
-        lastfound = 1;
-      // Check overflow
-      if( s->len < uip_datalen() )
-      {
-        s->res = ELUA_NET_ERR_OVERFLOW;   
-        temp = s->len;
-      }
-      else
-        temp = uip_datalen();
-      
-      if( s->readto != ELUA_NET_NO_LASTCHAR )
-      {
-        char *tptr = ( char* )uip_appdata;
-        char *last = ( char* )uip_appdata + temp - 1;
-        luaL_Buffer *pbuf = ( luaL_Buffer* )s->ptr;
-        char* dest = ( char* )s->ptr;
-        
-        while( tptr <= last )
-        {
-          if( *tptr == s->readto )
-          {
-            lastfound = 1;
-            break;
-          }
-          if( *tptr != '\r' )
-          {
-            if( s->res )
-              luaL_addchar( pbuf, *tptr );
-            else
-              *dest ++ = *tptr;
-            s->len --;
-          }
-          tptr ++;
-        }
-      }
-      else
-      {
-        if( s->res )
-          luaL_addlstring( ( luaL_Buffer* )s->ptr, ( const char* )uip_appdata, temp );        
-        else
-          memcpy( ( char* )s->ptr, ( const char* )uip_appdata, temp );
-        s->len -= temp;
-      }
-        
-      // Do we need to read another packet?
-      if( s->len == 0 || lastfound )
-      {
-        uip_stop();
-        s->res = ELUA_NET_ERR_OK;
-        s->state = ELUA_UIP_STATE_IDLE;
-      }
-    }
-    else
-      uip_stop();
-  }
 }
 
 static void elua_uip_conf_static()
@@ -481,10 +755,77 @@ void elua_uip_init( const struct uip_eth_addr *paddr )
 }
 
 // *****************************************************************************
-// eLua UIP UDP application (used for the DHCP client and the DNS resolver)
+// eLua UIP UDP application (used for the DHCP client, the DNS resolver and
+// the eLua UDP sockets)
 
-void elua_uip_udp_appcall()
-{
+#if UIP_UDP
+
+// UDP sockets are numbered after the TCP sockets
+#define ELUA_UIP_UDP_SOCK_FIRST       UIP_CONNS
+#define ELUA_UIP_UDP_MAX_DATA         ( UIP_BUFSIZE - UIP_LLH_LEN - UIP_IPUDPH_LEN )
+
+// eLua UDP socket state
+struct elua_uip_udp_state
+{
+  u8                used, state, res;
+  const char*       ptr;
+  elua_net_size     len;
+  elua_net_ip       ip;
+  u16               port;
+  // Received datagrams (each one preceded by an ELUA_UIP_UDP_HDR)
+  u8*               rxbuf;
+  elua_net_size     rxsize, rxhead, rxcount;
+};
+
+// Header of a datagram in the receive buffer
+typedef struct
+{
+  u16               len, port;
+  elua_net_ip       ip;
+} ELUA_UIP_UDP_HDR;
+
+static volatile struct elua_uip_udp_state elua_uip_udp_sockets[ UIP_UDP_CONNS ];
+
+// Queue a datagram (it is dropped if it doesn't fit)
+static void elua_uip_udp_rx_write( volatile struct elua_uip_udp_state *s )
+{
+  ELUA_UIP_UDP_HDR hdr;
+
+  if( s->rxcount + sizeof( hdr ) + uip_datalen() > s->rxsize )
+    return;
+  hdr.len = uip_datalen();
+  hdr.port = ntohs( UDPBUF->srcport );
+  hdr.ip.ipwords[ 0 ] = UDPBUF->srcipaddr[ 0 ];
+  hdr.ip.ipwords[ 1 ] = UDPBUF->srcipaddr[ 1 ];
+  elua_uip_ring_put( s->rxbuf, s->rxsize, s->rxhead + s->rxcount, &hdr, sizeof( hdr ) );
+  elua_uip_ring_put( s->rxbuf, s->rxsize, s->rxhead + s->rxcount + sizeof( hdr ), uip_appdata, hdr.len );
+  s->rxcount += sizeof( hdr ) + hdr.len;
+}
+#endif // #if UIP_UDP
+
+void elua_uip_udp_appcall()
+{
+#if UIP_UDP
+  volatile struct elua_uip_udp_state *s = elua_uip_udp_sockets + ( uip_udp_conn - uip_udp_conns );
+  uip_ipaddr_t ipaddr;
+
+  if( s->used )
+  {
+    if( !elua_uip_configured )
+      return;
+    if( uip_newdata() )
+      elua_uip_udp_rx_write( s );
+    // Send the pending datagram (if any)
+    if( s->state == ELUA_UIP_STATE_SEND )
+    {
+      uip_ipaddr( ipaddr, s->ip.ipbytes[ 0 ], s->ip.ipbytes[ 1 ], s->ip.ipbytes[ 2 ], s->ip.ipbytes[ 3 ] );
+      memcpy( uip_appdata, s->ptr, s->len );
+      uip_udp_sendto( s->len, ipaddr, htons( s->port ) );
+      s->state = ELUA_UIP_STATE_IDLE;
+    }
+    return;
+  }
+#endif
   resolv_appcall();
   dhcpc_appcall();
 }
@@ -493,40 +834,108 @@ void elua_uip_udp_appcall()
 // eLua TCP/IP services (from elua_net.h)
 
 #define ELUA_UIP_IS_SOCK_OK( sock ) ( elua_uip_configured && sock >= 0 && sock < UIP_CONNS )
+#if UIP_UDP
+#define ELUA_UIP_IS_UDP_SOCK_OK( sock ) ( elua_uip_configured && sock >= ELUA_UIP_UDP_SOCK_FIRST && sock < ELUA_UIP_UDP_SOCK_FIRST + UIP_UDP_CONNS &&\
+                                          elua_uip_udp_sockets[ sock - ELUA_UIP_UDP_SOCK_FIRST ].used )
+#else
+#define ELUA_UIP_IS_UDP_SOCK_OK( sock ) 0
+#endif
 
-static void elua_prep_socket_state( volatile struct elua_uip_state *pstate, void* buf, elua_net_size len, s16 readto, u8 res, u8 state )
+static void elua_prep_socket_state( volatile struct elua_uip_state *pstate, void* buf, elua_net_size len, u8 res, u8 state )
 {  
   pstate->ptr = ( char* )buf;
   pstate->len = len;
   pstate->res = res;
-  pstate->readto = readto;
   pstate->state = state;
 }
 
-int elua_net_socket( int type )
+// Release the receive buffer of a socket
+static void elua_uip_rx_free( int s )
+{
+  volatile struct elua_uip_state *pstate = ( volatile struct elua_uip_state* )&( uip_conns[ s ].appstate );
+  int old_status;
+  u8 *buf;
+
+#ifdef BUILD_CON_TCP
+  if( pstate->rxbuf == elua_uip_telnet_rxbuf )
+    return;
+#endif
+  old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+  buf = pstate->rxbuf;
+  pstate->rxbuf = NULL;
+  platform_cpu_set_global_interrupts( old_status );
+  free( buf );
+}
+
+#if UIP_UDP
+// Create an UDP socket that can receive from (and send to) any host
+static int elua_uip_udp_socket( elua_net_size rxsize )
+{
+  volatile struct elua_uip_udp_state *pstate;
+  struct uip_udp_conn *pconn;
+  uip_ipaddr_t ipaddr;
+  int old_status;
+  u8 *rxbuf;
+
+  if( ( rxbuf = ( u8* )malloc( rxsize ) ) == NULL )
+    return -1;
+  uip_ipaddr( ipaddr, 0, 0, 0, 0 );
+  old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+  if( ( pconn = uip_udp_new( &ipaddr, 0 ) ) != NULL )
+  {
+    pstate = elua_uip_udp_sockets + ( pconn - uip_udp_conns );
+    pstate->rxbuf = rxbuf;
+    pstate->rxsize = rxsize;
+    pstate->rxhead = pstate->rxcount = 0;
+    pstate->state = ELUA_UIP_STATE_IDLE;
+    pstate->res = ELUA_NET_ERR_OK;
+    pstate->used = 1;
+  }
+  platform_cpu_set_global_interrupts( old_status );
+  if( pconn == NULL )
+  {
+    free( rxbuf );
+    return -1;
+  }
+  return ELUA_UIP_UDP_SOCK_FIRST + ( pconn - uip_udp_conns );
+}
+#endif // #if UIP_UDP
+
+int elua_net_socket( int type, elua_net_size rxsize )
 {
   int i;
-  struct uip_conn* pconn;
+  volatile struct elua_uip_state *pstate;
   int old_status;
   
-  // [TODO] add UDP support at some point.
+  if( rxsize <= 0 )
+    rxsize = ELUA_NET_RX_BUF_SIZE;
   if( type == ELUA_NET_SOCK_DGRAM )
+  {
+#if UIP_UDP
+    return elua_uip_udp_socket( rxsize );
+#else
     return -1;
+#endif
+  }
   
+  // Reserve a free connection for later use
   old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
-  // Iterate through the list of connections, looking for a free one
-  for( i = 0; i < UIP_CONNS; i ++ )
-  {
-    pconn = uip_conns + i;
-    if( pconn->tcpstateflags == UIP_CLOSED )
-    { 
-      // Found a free connection, reserve it for later use
-      uip_conn_reserve( i );
-      break;
-    }
-  }
+  i = uip_conn_reserve();
   platform_cpu_set_global_interrupts( old_status );
-  return i == UIP_CONNS ? -1 : i;
+  if( i == -1 )
+    return -1;
+  // Allocate its receive buffer (a reserved connection can't receive data yet)
+  pstate = ( volatile struct elua_uip_state* )&( uip_conns[ i ].appstate );
+  elua_uip_rx_free( i );
+  if( ( pstate->rxbuf = ( u8* )malloc( rxsize ) ) == NULL )
+  {
+    old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+    uip_conn_release( i );
+    platform_cpu_set_global_interrupts( old_status );
+    return -1;
+  }
+  elua_uip_rx_attach( pstate, pstate->rxbuf, rxsize );
+  return i;
 }
 
 // Send data
@@ -538,43 +947,175 @@ elua_net_size elua_net_send( int s, const void* buf, elua_net_size len )
     return -1;
   if( len == 0 )
     return 0;
-  elua_prep_socket_state( pstate, ( void* )buf, len, ELUA_NET_NO_LASTCHAR, ELUA_NET_ERR_OK, ELUA_UIP_STATE_SEND );
+#ifdef BUILD_CON_TCP
+  if( s == elua_uip_telnet_socket )
+    return elua_net_telnet_write( buf, len );
+#endif
+  // Wait for a previous asynchronous send to finish
+  while( pstate->state != ELUA_UIP_STATE_IDLE )
+    elua_uip_yield();
+  elua_prep_socket_state( pstate, ( void* )buf, len, ELUA_NET_ERR_OK, ELUA_UIP_STATE_SEND );
   platform_eth_force_interrupt();
-  while( pstate->state != ELUA_UIP_STATE_IDLE );
+  while( pstate->state != ELUA_UIP_STATE_IDLE )
+    elua_uip_yield();
   return len - pstate->len;
 }
 
+// Write console data to the TELNET socket ('\n' is sent as "\r\n"). The data
+// is copied to the output ring, so this only waits when the ring is full.
+// Output is discarded if there is no TELNET connection.
+elua_net_size elua_net_telnet_write( const void* buf, elua_net_size len )
+{
+#ifdef BUILD_CON_TCP
+  const char *src = ( const char* )buf;
+  elua_net_size i = 0, n, pos, avail;
+  int old_status, kick;
+
+  while( i < len && elua_uip_telnet_socket != -1 )
+  {
+    old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+    pos = elua_uip_telnet_txhead + elua_uip_telnet_txcount;
+    avail = ELUA_NET_TELNET_TXBUF_SIZE - elua_uip_telnet_txcount;
+    platform_cpu_set_global_interrupts( old_status );
+    // The free part of the ring is not touched by the UIP application
+    for( n = 0; i < len && n < avail; i ++ )
+    {
+      if( src[ i ] == '\n' )
+      {
+        if( n + 2 > avail )
+          break;
+        elua_uip_telnet_txbuf[ ( pos + n ++ ) % ELUA_NET_TELNET_TXBUF_SIZE ] = '\r';
+      }
+      elua_uip_telnet_txbuf[ ( pos + n ++ ) % ELUA_NET_TELNET_TXBUF_SIZE ] = src[ i ];
+    }
+    if( n == 0 ) // ring full, wait for an ACK
+    {
+      elua_uip_yield();
+      continue;
+    }
+    old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+    elua_uip_telnet_txcount += n;
+    // If a segment is in flight the data will be sent when it is acked
+    kick = elua_uip_telnet_txsent == 0;
+    platform_cpu_set_global_interrupts( old_status );
+    if( kick )
+      platform_eth_force_interrupt();
+  }
+#endif
+  return len;
+}
+
+// Start sending data without waiting for it to be acknowledged. The data is
+// sent directly from 'buf', which must not change until the socket is ready
+// for writing again (see elua_net_poll). Returns 0 (with a "timed out" error)
+// if the previous send on this socket is still in progress.
+elua_net_size elua_net_send_async( int s, const void* buf, elua_net_size len )
+{
+  volatile struct elua_uip_state *pstate = ( volatile struct elua_uip_state* )&( uip_conns[ s ].appstate );
+  
+  if( !ELUA_UIP_IS_SOCK_OK( s ) || !uip_conn_active( s ) )
+    return -1;
+  if( pstate->state != ELUA_UIP_STATE_IDLE )
+  {
+    pstate->res = ELUA_NET_ERR_TIMEDOUT;
+    return 0;
+  }
+  if( len == 0 )
+    return 0;
+  elua_prep_socket_state( pstate, ( void* )buf, len, ELUA_NET_ERR_OK, ELUA_UIP_STATE_SEND );
+  platform_eth_force_interrupt();
+  return len;
+}
+
+// Copy up to 'maxsize' bytes from the receive buffer to the destination, 
+// stopping after the 'readto' char (if any) which is not copied. Returns the
+// number of bytes written to the destination, the number of bytes read from
+// the buffer is returned in *pused.
+static elua_net_size elua_net_rx_copy( int s, char *dest, elua_net_size maxsize, s16 readto, elua_net_size *pused, int *pfound )
+{
+  volatile struct elua_uip_state *pstate = ( volatile struct elua_uip_state* )&( uip_conns[ s ].appstate );
+  elua_net_size avail = pstate->rxcount, head = pstate->rxhead, size = pstate->rxsize;
+  elua_net_size i = 0, total = 0;
+  const u8 *pbuf = pstate->rxbuf;
+  u8 c;
+
+  if( readto == ELUA_NET_NO_LASTCHAR )
+  {
+    // Plain copy
+    total = UMIN( avail, maxsize );
+    elua_uip_ring_get( pbuf, size, head, dest, total );
+    *pused = total;
+    return total;
+  }
+  while( i < avail && total < maxsize )
+  {
+    c = pbuf[ ( head + i ++ ) % size ];
+    if( c == readto )
+    {
+      *pfound = 1;
+      break;
+    }
+    if( c != '\r' )
+      dest[ total ++ ] = c;
+  }
+  *pused = i;
+  return total;
+}
+
 // Internal "read" function
 static elua_net_size elua_net_recv_internal( int s, void* buf, elua_net_size maxsize, s16 readto, unsigned timer_id, timer_data_type to_us, int with_buffer )
 {
   volatile struct elua_uip_state *pstate = ( volatile struct elua_uip_state* )&( uip_conns[ s ].appstate );
   timer_data_type tmrstart = 0;
-  int old_status;
+  elua_net_size total = 0, len, used;
+  int found = 0;
+  char *dest;
   
-  if( !ELUA_UIP_IS_SOCK_OK( s ) || !uip_conn_active( s ) )
+  if( !ELUA_UIP_IS_SOCK_OK( s ) || pstate->rxbuf == NULL )
     return -1;
   if( maxsize == 0 )
     return 0;
-  elua_prep_socket_state( pstate, buf, maxsize, readto, with_buffer, ELUA_UIP_STATE_RECV );
-  if( to_us > 0 )
+  pstate->res = ELUA_NET_ERR_OK;
+  if( to_us > 0 && to_us != PLATFORM_TIMER_INF_TIMEOUT )
     tmrstart = platform_timer_start( timer_id );
   while( 1 )
   {
-    if( pstate->state == ELUA_UIP_STATE_IDLE )
-      break;
-    if( to_us > 0 && platform_timer_get_diff_crt( timer_id, tmrstart ) >= to_us )
+    if( pstate->rxcount > 0 )
     {
-      old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
-      if( pstate->state != ELUA_UIP_STATE_IDLE )
-      { 
-        pstate->res = ELUA_NET_ERR_TIMEDOUT;
-        pstate->state = ELUA_UIP_STATE_IDLE;
+      // Copy directly to the destination (or to the Lua buffer)
+      if( with_buffer )
+      {
+        dest = luaL_prepbuffer( ( luaL_Buffer* )buf );
+        len = elua_net_rx_copy( s, dest, UMIN( maxsize - total, LUAL_BUFFERSIZE ), readto, &used, &found );
+        luaL_addsize( ( luaL_Buffer* )buf, len );
       }
-      platform_cpu_set_global_interrupts( old_status );
+      else
+        len = elua_net_rx_copy( s, ( char* )buf + total, maxsize - total, readto, &used, &found );
+      elua_uip_rx_consume( s, used );
+      total += len;
+    }
+    if( found || total == maxsize )
+    {
+      if( !found && readto != ELUA_NET_NO_LASTCHAR )
+        pstate->res = ELUA_NET_ERR_OVERFLOW;
+      break;
+    }
+    if( total > 0 && readto == ELUA_NET_NO_LASTCHAR )
+      break;
+    // Nothing more will be received after the connection was closed
+    if( pstate->rxcount == 0 && ( pstate->rxstatus != ELUA_NET_ERR_OK || !uip_conn_active( s ) ) )
+    {
+      pstate->res = pstate->rxstatus != ELUA_NET_ERR_OK ? pstate->rxstatus : ELUA_NET_ERR_CLOSED;
+      break;
+    }
+    if( to_us == 0 || ( to_us != PLATFORM_TIMER_INF_TIMEOUT && platform_timer_get_diff_crt( timer_id, tmrstart ) >= to_us ) )
+    {
+      pstate->res = ELUA_NET_ERR_TIMEDOUT;
       break;
     }
+    elua_uip_yield();
   }
-  return maxsize - pstate->len;
+  return total;
 }
 
 // Receive data in buf, upto "maxsize" bytes, or upto the 'readto' character if it's not -1
@@ -589,12 +1130,127 @@ elua_net_size elua_net_recvbuf( int s, luaL_Buffer* buf, elua_net_size maxsize,
   return elua_net_recv_internal( s, buf, maxsize, readto, timer_id, to_us, 1 );
 }
 
+// Bind an UDP socket to a local port
+int elua_net_bind( int s, u16 port )
+{
+#if UIP_UDP
+  unsigned i;
+
+  if( !ELUA_UIP_IS_UDP_SOCK_OK( s ) || port == 0 )
+    return -1;
+  for( i = 0; i < UIP_UDP_CONNS; i ++ )
+    if( uip_udp_conns[ i ].lport == htons( port ) )
+      return -1;
+  uip_udp_bind( uip_udp_conns + s - ELUA_UIP_UDP_SOCK_FIRST, htons( port ) );
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+// Send a datagram to the given host and port
+elua_net_size elua_net_sendto( int s, const void* buf, elua_net_size len, elua_net_ip addr, u16 port )
+{
+#if UIP_UDP
+  volatile struct elua_uip_udp_state *pstate = elua_uip_udp_sockets + s - ELUA_UIP_UDP_SOCK_FIRST;
+
+  if( !ELUA_UIP_IS_UDP_SOCK_OK( s ) )
+    return -1;
+  if( len < 0 || len > ELUA_UIP_UDP_MAX_DATA )
+  {
+    pstate->res = ELUA_NET_ERR_OVERFLOW;
+    return -1;
+  }
+  pstate->ptr = ( const char* )buf;
+  pstate->len = len;
+  pstate->ip = addr;
+  pstate->port = port;
+  pstate->res = ELUA_NET_ERR_OK;
+  pstate->state = ELUA_UIP_STATE_SEND;
+  platform_eth_force_interrupt();
+  while( pstate->state != ELUA_UIP_STATE_IDLE )
+    elua_uip_yield();
+  return len;
+#else
+  return -1;
+#endif
+}
+
+#if UIP_UDP
+// Internal "read datagram" function
+static elua_net_size elua_net_recvfrom_internal( int s, void *buf, elua_net_size maxsize, elua_net_ip *pfrom, u16 *pport, unsigned timer_id, timer_data_type to_us, int with_buffer )
+{
+  volatile struct elua_uip_udp_state *pstate = elua_uip_udp_sockets + s - ELUA_UIP_UDP_SOCK_FIRST;
+  timer_data_type tmrstart = 0;
+  ELUA_UIP_UDP_HDR hdr;
+  elua_net_size total, chunk;
+  int old_status;
+
+  if( !ELUA_UIP_IS_UDP_SOCK_OK( s ) )
+    return -1;
+  pstate->res = ELUA_NET_ERR_OK;
+  if( to_us > 0 && to_us != PLATFORM_TIMER_INF_TIMEOUT )
+    tmrstart = platform_timer_start( timer_id );
+  while( pstate->rxcount == 0 )
+  {
+    if( to_us == 0 || ( to_us != PLATFORM_TIMER_INF_TIMEOUT && platform_timer_get_diff_crt( timer_id, tmrstart ) >= to_us ) )
+    {
+      pstate->res = ELUA_NET_ERR_TIMEDOUT;
+      return 0;
+    }
+    elua_uip_yield();
+  }
+  // Get the datagram (truncate it if needed)
+  elua_uip_ring_get( pstate->rxbuf, pstate->rxsize, pstate->rxhead, &hdr, sizeof( hdr ) );
+  total = UMIN( hdr.len, maxsize );
+  if( total < hdr.len )
+    pstate->res = ELUA_NET_ERR_OVERFLOW;
+  if( with_buffer )
+    for( chunk = 0; chunk < total; chunk += LUAL_BUFFERSIZE )
+    {
+      elua_uip_ring_get( pstate->rxbuf, pstate->rxsize, pstate->rxhead + sizeof( hdr ) + chunk, luaL_prepbuffer( ( luaL_Buffer* )buf ), UMIN( total - chunk, LUAL_BUFFERSIZE ) );
+      luaL_addsize( ( luaL_Buffer* )buf, UMIN( total - chunk, LUAL_BUFFERSIZE ) );
+    }
+  else
+    elua_uip_ring_get( pstate->rxbuf, pstate->rxsize, pstate->rxhead + sizeof( hdr ), buf, total );
+  old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+  pstate->rxhead = ( pstate->rxhead + sizeof( hdr ) + hdr.len ) % pstate->rxsize;
+  pstate->rxcount -= sizeof( hdr ) + hdr.len;
+  platform_cpu_set_global_interrupts( old_status );
+  *pfrom = hdr.ip;
+  *pport = hdr.port;
+  return total;
+}
+#endif // #if UIP_UDP
+
+// Receive a datagram in buf (upto 'maxsize' bytes, the rest is discarded)
+elua_net_size elua_net_recvfrom( int s, void *buf, elua_net_size maxsize, elua_net_ip *pfrom, u16 *pport, unsigned timer_id, timer_data_type to_us )
+{
+#if UIP_UDP
+  return elua_net_recvfrom_internal( s, buf, maxsize, pfrom, pport, timer_id, to_us, 0 );
+#else
+  return -1;
+#endif
+}
+
+// Same thing, but with a Lua buffer as argument
+elua_net_size elua_net_recvfrombuf( int s, luaL_Buffer *buf, elua_net_size maxsize, elua_net_ip *pfrom, u16 *pport, unsigned timer_id, timer_data_type to_us )
+{
+#if UIP_UDP
+  return elua_net_recvfrom_internal( s, buf, maxsize, pfrom, pport, timer_id, to_us, 1 );
+#else
+  return -1;
+#endif
+}
+
 // Return the socket associated with the "telnet" application (or -1 if it does
 // not exist). The socket only exists if a client connected to the board.
 int elua_net_get_telnet_socket()
 {
   int res = -1;
   
+  // The console waits for the connection in a loop
+  elua_uip_yield();
 #ifdef BUILD_CON_TCP  
   if( elua_uip_telnet_socket != -1 )
     if( uip_conn_active( elua_uip_telnet_socket ) )
@@ -603,16 +1259,71 @@ int elua_net_get_telnet_socket()
   return res;
 }
 
+// Get the network statistics (times are 0 if the system timer is not 
+// available), optionally resetting them
+void elua_net_get_stats( elua_net_stats *pstats, int reset )
+{
+  int old_status;
+
+  old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+  *pstats = elua_uip_stats;
+  if( reset )
+    memset( &elua_uip_stats, 0, sizeof( elua_uip_stats ) );
+  platform_cpu_set_global_interrupts( old_status );
+}
+
 // Close socket
 int elua_net_close( int s )
 {
   volatile struct elua_uip_state *pstate = ( volatile struct elua_uip_state* )&( uip_conns[ s ].appstate );  
+  int old_status;
   
-  if( !ELUA_UIP_IS_SOCK_OK( s ) || !uip_conn_active( s ) )
+#if UIP_UDP
+  if( ELUA_UIP_IS_UDP_SOCK_OK( s ) )
+  {
+    volatile struct elua_uip_udp_state *pudp = elua_uip_udp_sockets + s - ELUA_UIP_UDP_SOCK_FIRST;
+    u8 *buf;
+
+    old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+    uip_udp_conns[ s - ELUA_UIP_UDP_SOCK_FIRST ].lport = 0;
+    pudp->used = 0;
+    buf = pudp->rxbuf;
+    pudp->rxbuf = NULL;
+    platform_cpu_set_global_interrupts( old_status );
+    free( buf );
+    return 0;
+  }
+#endif
+  if( !ELUA_UIP_IS_SOCK_OK( s ) )
     return -1;
-  elua_prep_socket_state( pstate, NULL, 0, ELUA_NET_NO_LASTCHAR, ELUA_NET_ERR_OK, ELUA_UIP_STATE_CLOSE );
+  // Let a pending asynchronous send finish first
+  while( pstate->state != ELUA_UIP_STATE_IDLE )
+    elua_uip_yield();
+#ifdef BUILD_CON_TCP
+  // Flush the console output
+  while( s == elua_uip_telnet_socket && elua_uip_telnet_txcount > 0 )
+    elua_uip_yield();
+#endif
+  if( uip_conn_is_reserved( s ) )
+  {
+    // Never connected, give the connection back to UIP
+    elua_uip_rx_free( s );
+    old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+    uip_conn_release( s );
+    platform_cpu_set_global_interrupts( old_status );
+    return 0;
+  }
+  if( !uip_conn_active( s ) )
+  {
+    // Already closed by the remote host, just release the buffer
+    elua_uip_rx_free( s );
+    return -1;
+  }
+  elua_prep_socket_state( pstate, NULL, 0, ELUA_NET_ERR_OK, ELUA_UIP_STATE_CLOSE );
   platform_eth_force_interrupt();
-  while( pstate->state != ELUA_UIP_STATE_IDLE );
+  while( pstate->state != ELUA_UIP_STATE_IDLE )
+    elua_uip_yield();
+  elua_uip_rx_free( s );
   return pstate->res == ELUA_NET_ERR_OK ? 0 : -1;
 }
 
@@ -621,43 +1332,170 @@ int elua_net_get_last_err( int s )
 {
   volatile struct elua_uip_state *pstate = ( volatile struct elua_uip_state* )&( uip_conns[ s ].appstate );  
   
+#if UIP_UDP
+  if( ELUA_UIP_IS_UDP_SOCK_OK( s ) )
+    return elua_uip_udp_sockets[ s - ELUA_UIP_UDP_SOCK_FIRST ].res;
+#endif
   if( !ELUA_UIP_IS_SOCK_OK( s ) )
     return -1;
   return pstate->res;
 }
 
-// Accept a connection on the given port, return its socket id (and the IP of the remote host by side effect)
-int elua_accept( u16 port, unsigned timer_id, timer_data_type to_us, elua_net_ip* pfrom )
+// Start listening on the given port (if needed) and refill the receive 
+// buffer pool of its listener
+static volatile struct elua_uip_listener* elua_uip_listen( u16 port )
 {
-  timer_data_type tmrstart = 0;
+  volatile struct elua_uip_listener *pl;
   int old_status;
-  
-  if( !elua_uip_configured )
-    return -1;
+  u8 *buf;
+
 #ifdef BUILD_CON_TCP
   if( port == ELUA_NET_TELNET_PORT )
-    return -1;
+    return NULL;
 #endif  
+  if( port == 0 )
+    return NULL;
+  if( ( pl = elua_uip_find_listener( htons( port ) ) ) == NULL )
+  {
+    if( ( pl = elua_uip_find_listener( 0 ) ) == NULL )
+      return NULL;
+    pl->head = pl->count = pl->npool = 0;
+    old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+    uip_listen( htons( port ) );
+    pl->port = htons( port );
+    platform_cpu_set_global_interrupts( old_status );
+  }
+  while( pl->npool + pl->count < ELUA_NET_ACCEPT_BACKLOG )
+  {
+    if( ( buf = ( u8* )malloc( ELUA_NET_RX_BUF_SIZE ) ) == NULL )
+      break;
+    old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+    pl->rxpool[ pl->npool ++ ] = buf;
+    platform_cpu_set_global_interrupts( old_status );
+  }
+  return pl;
+}
+
+// Listen on a port: the connections are queued until they are accepted
+int elua_net_listen( u16 port )
+{
+  if( !elua_uip_configured || elua_uip_listen( port ) == NULL )
+    return -1;
+  return 0;
+}
+
+// Stop listening on a port, closing all the connections that were not accepted
+int elua_net_unlisten( u16 port )
+{
+  volatile struct elua_uip_listener *pl;
+  int old_status;
+
+  if( !elua_uip_configured || port == 0 || ( pl = elua_uip_find_listener( htons( port ) ) ) == NULL )
+    return -1;
   old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
   uip_unlisten( htons( port ) );
-  uip_listen( htons( port ) );
+  pl->port = 0;
   platform_cpu_set_global_interrupts( old_status );
-  elua_uip_accept_sock = -1;
-  elua_uip_accept_request = 1;
-  if( to_us > 0 )
+  for( ; pl->count > 0; pl->count -- )
+  {
+    elua_net_close( pl->socks[ pl->head ] );
+    pl->head = ( pl->head + 1 ) % ELUA_NET_ACCEPT_BACKLOG;
+  }
+  while( pl->npool > 0 )
+    free( pl->rxpool[ -- pl->npool ] );
+  return 0;
+}
+
+// Accept a connection on the given port, return its socket id (and the IP of the remote host by side effect)
+int elua_accept( u16 port, unsigned timer_id, timer_data_type to_us, elua_net_ip* pfrom )
+{
+  volatile struct elua_uip_listener *pl;
+  timer_data_type tmrstart = 0;
+  int old_status, sock;
+  
+  if( !elua_uip_configured || ( pl = elua_uip_listen( port ) ) == NULL )
+    return -1;
+  if( to_us > 0 && to_us != PLATFORM_TIMER_INF_TIMEOUT )
     tmrstart = platform_timer_start( timer_id );
+  // The queue is checked with interrupts disabled, since a queued connection
+  // is removed if it's closed by the remote host (elua_uip_listener_remove)
   while( 1 )
   {
-    if( elua_uip_accept_request == 0 )
-      break;
-    if( to_us > 0 && platform_timer_get_diff_crt( timer_id, tmrstart ) >= to_us )
-    {
-      elua_uip_accept_request = 0;
+    old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+    if( pl->count > 0 )
       break;
-    }
-  }  
-  *pfrom = elua_uip_accept_remote;
-  return elua_uip_accept_sock;
+    platform_cpu_set_global_interrupts( old_status );
+    if( to_us == 0 || ( to_us != PLATFORM_TIMER_INF_TIMEOUT && platform_timer_get_diff_crt( timer_id, tmrstart ) >= to_us ) )
+      return -1;
+    elua_uip_yield();
+  }
+  sock = pl->socks[ pl->head ];
+  pl->head = ( pl->head + 1 ) % ELUA_NET_ACCEPT_BACKLOG;
+  pl->count --;
+  platform_cpu_set_global_interrupts( old_status );
+  // Replace the buffer used by this connection
+  elua_uip_listen( port );
+  pfrom->ipwords[ 0 ] = uip_conns[ sock ].ripaddr[ 0 ];
+  pfrom->ipwords[ 1 ] = uip_conns[ sock ].ripaddr[ 1 ];
+  return sock;
+}
+
+// Return the events that are ready on a socket (or on a listening port)
+static u8 elua_uip_get_events( int s, u8 events )
+{
+  volatile struct elua_uip_state *pstate = ( volatile struct elua_uip_state* )&( uip_conns[ s ].appstate );
+  u8 rev = 0;
+
+  if( events & ELUA_NET_EV_ACCEPT )
+  {
+    volatile struct elua_uip_listener *pl = elua_uip_find_listener( htons( s ) );
+
+    return s != 0 && pl != NULL && pl->count > 0 ? ELUA_NET_EV_ACCEPT : 0;
+  }
+#if UIP_UDP
+  if( ELUA_UIP_IS_UDP_SOCK_OK( s ) )
+  {
+    if( elua_uip_udp_sockets[ s - ELUA_UIP_UDP_SOCK_FIRST ].rxcount > 0 )
+      rev |= ELUA_NET_EV_READ;
+    return rev | ( ELUA_NET_EV_WRITE & events );
+  }
+#endif
+  if( !ELUA_UIP_IS_SOCK_OK( s ) || pstate->rxbuf == NULL )
+    return ELUA_NET_EV_CLOSED;
+  if( uip_conn_is_reserved( s ) ) // not connected yet
+    return 0;
+  if( pstate->rxcount > 0 )
+    rev |= ELUA_NET_EV_READ;
+  if( pstate->rxstatus != ELUA_NET_ERR_OK || !uip_conn_active( s ) )
+    rev |= ELUA_NET_EV_READ | ELUA_NET_EV_WRITE | ELUA_NET_EV_CLOSED;
+  else if( pstate->state == ELUA_UIP_STATE_IDLE )
+    rev |= ELUA_NET_EV_WRITE;
+  return rev & ( events | ELUA_NET_EV_CLOSED );
+}
+
+// Wait until at least one of the given sockets is ready, return the number of ready sockets
+int elua_net_poll( elua_net_pollfd *fds, unsigned nfds, unsigned timer_id, timer_data_type to_us )
+{
+  timer_data_type tmrstart = 0;
+  unsigned i;
+  int nready;
+
+  if( !elua_uip_configured )
+    return -1;
+  for( i = 0; i < nfds; i ++ )
+    if( fds[ i ].events & ELUA_NET_EV_ACCEPT )
+      elua_uip_listen( fds[ i ].sock );
+  if( to_us > 0 && to_us != PLATFORM_TIMER_INF_TIMEOUT )
+    tmrstart = platform_timer_start( timer_id );
+  while( 1 )
+  {
+    for( i = 0, nready = 0; i < nfds; i ++ )
+      if( ( fds[ i ].revents = elua_uip_get_events( fds[ i ].sock, fds[ i ].events ) ) != 0 )
+        nready ++;
+    if( nready > 0 || to_us == 0 || ( to_us != PLATFORM_TIMER_INF_TIMEOUT && platform_timer_get_diff_crt( timer_id, tmrstart ) >= to_us ) )
+      return nready;
+    elua_uip_yield();
+  }
 }
 
 // Connect to a specified machine
@@ -673,39 +1511,71 @@ int elua_net_connect( int s, elua_net_ip addr, u16 port )
     return -1;
   // Initiate the connect call  
   uip_ipaddr( ipaddr, addr.ipbytes[ 0 ], addr.ipbytes[ 1 ], addr.ipbytes[ 2 ], addr.ipbytes[ 3 ] );
-  elua_prep_socket_state( pstate, NULL, 0, ELUA_NET_NO_LASTCHAR, ELUA_NET_ERR_OK, ELUA_UIP_STATE_CONNECT );  
+  elua_prep_socket_state( pstate, NULL, 0, ELUA_NET_ERR_OK, ELUA_UIP_STATE_CONNECT );  
   if( uip_connect_socket( s, &ipaddr, htons( port ) ) == NULL )
     return -1;
   // And wait for it to finish
-  while( pstate->state != ELUA_UIP_STATE_IDLE );
+  while( pstate->state != ELUA_UIP_STATE_IDLE )
+    elua_uip_yield();
   return pstate->res == ELUA_NET_ERR_OK ? 0 : -1;
 }
 
+// Start a hostname lookup, return a handle for elua_net_lookup_status
+// (or -1 for error). Names found in the cache don't generate a new query.
+int elua_net_lookup_async( const char* hostname )
+{
+#ifdef BUILD_DNS
+  int old_status, handle;
+  u16_t ipaddr[ 2 ];
+
+  if( !elua_uip_configured )
+    return -1;
+  old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+  handle = resolv_query( ( char* )hostname );
+  if( handle != -1 && resolv_status( handle, ipaddr ) == RESOLV_STATUS_PENDING )
+    platform_eth_force_interrupt();
+  platform_cpu_set_global_interrupts( old_status );
+  return handle;
+#else
+  return -1;
+#endif
+}
+
+// Get the status of a lookup started with elua_net_lookup_async
+// The address is written in 'pres' when the lookup is done
+int elua_net_lookup_status( int handle, elua_net_ip *pres )
+{
+#ifdef BUILD_DNS
+  int old_status, res;
+  u16_t ipaddr[ 2 ];
+
+  pres->ipaddr = 0;
+  old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+  res = resolv_status( handle, ipaddr );
+  platform_cpu_set_global_interrupts( old_status );
+  if( res == RESOLV_STATUS_DONE )
+  {
+    pres->ipwords[ 0 ] = ipaddr[ 0 ];
+    pres->ipwords[ 1 ] = ipaddr[ 1 ];
+    return ELUA_NET_LOOKUP_DONE;
+  }
+  return res == RESOLV_STATUS_PENDING ? ELUA_NET_LOOKUP_PENDING : ELUA_NET_LOOKUP_ERROR;
+#else
+  pres->ipaddr = 0;
+  return ELUA_NET_LOOKUP_ERROR;
+#endif
+}
+
 // Hostname lookup (resolver)
 elua_net_ip elua_net_lookup( const char* hostname )
 {
   elua_net_ip res;
+  int handle;
   
   res.ipaddr = 0; 
-#ifdef BUILD_DNS
-  u16_t *data;
-  
-  if( ( data = resolv_lookup( ( char* )hostname ) ) != NULL )
-  {
-    // Name already saved locally
-    res.ipwords[ 0 ] = data[ 0 ];
-    res.ipwords[ 1 ] = data[ 1 ];
-  }
-  else
-  {
-    // Name not saved locally, must make request
-    elua_resolv_req_done = 0;
-    resolv_query( ( char* )hostname );
-    platform_eth_force_interrupt();
-    while( elua_resolv_req_done == 0 );
-    res = elua_resolv_ip;
-  }
-#endif
+  if( ( handle = elua_net_lookup_async( hostname ) ) != -1 )
+    while( elua_net_lookup_status( handle, &res ) == ELUA_NET_LOOKUP_PENDING )
+      elua_uip_yield();
   return res;  
 }
 
@@ -357,3 +357,70 @@ int eluarpc_gen_read( const u8 *p, const char *fmt, ... )
   eluarpc_match_packet_end( p );  
   return eluarpc_err_flag;
 }
+
+// *****************************************************************************
+// Datagram transport support: sequence header and adaptive RTO
+
+void eluarpc_write_seq( u8 *p, u32 seq )
+{
+  *p ++ = TYPE_SEQ;
+  eluarpc_write_u32( p, seq );
+}
+
+int eluarpc_read_seq( const u8 *p, u32 *pseq )
+{
+  eluarpc_err_flag = ELUARPC_OK;
+  p = eluarpc_read_expect( p, TYPE_SEQ );
+  eluarpc_read_u32( p, pseq );
+  return eluarpc_err_flag;
+}
+
+int eluarpc_has_seq( const u8 *p )
+{
+  return *p == TYPE_SEQ;
+}
+
+static void eluarpc_rto_clamp( ELUARPC_RTO_DATA *pd )
+{
+  if( pd->rto < ELUARPC_RTO_MIN )
+    pd->rto = ELUARPC_RTO_MIN;
+  else if( pd->rto > ELUARPC_RTO_MAX )
+    pd->rto = ELUARPC_RTO_MAX;
+}
+
+void eluarpc_rto_init( ELUARPC_RTO_DATA *pd )
+{
+  pd->srtt = pd->rttvar = 0;
+  pd->rto = ELUARPC_RTO_INITIAL;
+}
+
+// Feed a new RTT measurement (us) into the estimator. Following Karn's 
+// algorithm, the caller must not sample retransmitted requests.
+void eluarpc_rto_sample( ELUARPC_RTO_DATA *pd, u32 rtt )
+{
+  u32 delta;
+
+  if( pd->srtt == 0 )
+  {
+    pd->srtt = rtt ? rtt : 1;
+    pd->rttvar = rtt >> 1;
+  }
+  else
+  {
+    delta = rtt > pd->srtt ? rtt - pd->srtt : pd->srtt - rtt;
+    // rttvar = 3/4 * rttvar + 1/4 * |srtt - rtt|, srtt = 7/8 * srtt + 1/8 * rtt
+    pd->rttvar = pd->rttvar - ( pd->rttvar >> 2 ) + ( delta >> 2 );
+    pd->srtt = pd->srtt - ( pd->srtt >> 3 ) + ( rtt >> 3 );
+    if( pd->srtt == 0 )
+      pd->srtt = 1;
+  }
+  pd->rto = pd->srtt + ( pd->rttvar << 2 );
+  eluarpc_rto_clamp( pd );
+}
+
+// Exponential backoff after a retransmission
+void eluarpc_rto_backoff( ELUARPC_RTO_DATA *pd )
+{
+  pd->rto <<= 1;
+  eluarpc_rto_clamp( pd );
+}
@@ -35,6 +35,15 @@ DRESULT disk_write (BYTE, const BYTE*, DWORD, BYTE);
 #endif
 DRESULT disk_ioctl (BYTE, BYTE, void*);
 
+/* Low level MMC/SD driver functions (elua_mmc.c or elua_mmc_sim.c), used */
+/* by the sector cache (elua_mmc_cache.c) to implement the ones above     */
+DSTATUS mmc_disk_initialize (BYTE);
+DRESULT mmc_disk_read (BYTE, BYTE*, DWORD, BYTE);
+#if	_READONLY == 0
+DRESULT mmc_disk_write (BYTE, const BYTE*, DWORD, BYTE);
+#endif
+DRESULT mmc_disk_ioctl (BYTE, BYTE, void*);
+
 
 
 /* Disk Status Bits (DSTATUS) */
@@ -120,7 +120,11 @@
 / Physical Drive Configurations
 /----------------------------------------------------------------------------*/
 
-#define _DRIVES		1
+// eLua: one volume for each MMC/SD card (MMCFS_NUM_CARDS in platform_conf.h)
+#ifndef MMCFS_NUM_CARDS
+#define MMCFS_NUM_CARDS	1
+#endif
+#define _DRIVES		MMCFS_NUM_CARDS
 /* Number of volumes (logical drives) to be used. */
 
 
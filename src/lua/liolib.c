@@ -18,6 +18,9 @@
 #include "lauxlib.h"
 #include "lualib.h"
 #include "lrotable.h"
+#ifndef LUA_CROSS_COMPILER
+#include "devman.h"
+#endif
 
 
 #define IO_INPUT	1
@@ -356,6 +359,27 @@ static int read_chars (lua_State *L, FILE *f, size_t n) {
 }
 
 
+/*
+** push the rest of the file as a read-only string that points directly to
+** the file data, if the file can be mapped in memory (see DM_IOCTL_MAP);
+** returns 0 if the file can't be mapped
+*/
+static int read_mapped (lua_State *L, FILE *f) {
+#ifndef LUA_CROSS_COMPILER
+  DM_MAP_INFO map;
+  long pos;
+  if (dm_ioctl(fileno(f), DM_IOCTL_MAP, &map) != 0 ||
+      (pos = ftell(f)) < 0 || (u32)pos > map.size)
+    return 0;
+  lua_pushrolstring(L, map.addr + pos, map.size - pos);
+  fseek(f, 0, SEEK_END);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+
 static int g_read (lua_State *L, FILE *f, int first) {
   int nargs = lua_gettop(L) - 1;
   int success;
@@ -384,7 +408,8 @@ static int g_read (lua_State *L, FILE *f, int first) {
             success = read_line(L, f);
             break;
           case 'a':  /* file */
-            read_chars(L, f, ~((size_t)0));  /* read MAX_SIZE_T chars */
+            if (!read_mapped(L, f))
+              read_chars(L, f, ~((size_t)0));  /* read MAX_SIZE_T chars */
             success = 1; /* always success */
             break;
           default:
@@ -413,6 +438,27 @@ static int f_read (lua_State *L) {
 }
 
 
+/*
+** return the content of a file as a string; if the file can be mapped in
+** memory (ROMFS) the string points directly to the file data, otherwise
+** the file is read in RAM
+*/
+static int io_mapfile (lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  FILE **pf = newfile(L);
+  int ok;
+  *pf = fopen(filename, "rb");
+  if (*pf == NULL)
+    return pushresult(L, 0, filename);
+  if (!read_mapped(L, *pf))
+    read_chars(L, *pf, ~((size_t)0));
+  ok = !ferror(*pf);
+  fclose(*pf);
+  *pf = NULL;  /* mark file as closed */
+  return ok ? 1 : pushresult(L, 0, filename);
+}
+
+
 static int io_readline (lua_State *L) {
   FILE *f = *(FILE **)lua_touserdata(L, lua_upvalueindex(1));
   int sucess;
@@ -512,6 +558,7 @@ const LUA_REG_TYPE iolib[] = {
   {LSTRKEY("flush"), LFUNCVAL(io_flush)},
   {LSTRKEY("input"), LFUNCVAL(io_input)},
   {LSTRKEY("lines"), LFUNCVAL(io_lines)},
+  {LSTRKEY("mapfile"), LFUNCVAL(io_mapfile)},
   {LSTRKEY("open"), LFUNCVAL(io_open)},
   {LSTRKEY("output"), LFUNCVAL(io_output)},
   {LSTRKEY("popen"), LFUNCVAL(io_popen)},
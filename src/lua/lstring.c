@@ -121,8 +121,9 @@ TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
 }
 
 
+/* 'str' can hold embedded zeros, but it must be followed by a '\0' like all Lua strings */
 LUAI_FUNC TString *luaS_newrolstr (lua_State *L, const char *str, size_t l) {
-  if(l+1 > sizeof(char**) && l == strlen(str))
+  if(l+1 > sizeof(char**) && str[l] == '\0')
     return luaS_newlstr_helper(L, str, l, LUAS_READONLY_STRING);
   else // no point in creating a RO string, as it would actually be larger
     return luaS_newlstr_helper(L, str, l, LUAS_REGULAR_STRING);
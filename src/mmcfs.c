@@ -16,23 +16,52 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 
+// Maximum number of files open at the same time (on all the cards)
+#ifndef MMCFS_MAX_FDS
 #define MMCFS_MAX_FDS   4
+#endif
 static FIL mmcfs_fd_table[ MMCFS_MAX_FDS ];
 static int mmcfs_num_fd;
 
-// Data structures used by FatFs
-static FATFS mmc_fs;
-static FIL mmc_fileObject;
-//static DIR mmc_dir;
-//static FILINFO mmc_fileInfo;
+// Maximum length of a FatFs path ("N:" + path on the card + '\0')
+#ifndef MMCFS_PATH_BUF_SIZE
+#define MMCFS_PATH_BUF_SIZE   64
+#endif
+
+// Data structures used by FatFs (one volume for each card, the volume
+// is passed to the device functions as 'pdata')
+typedef struct
+{
+  FATFS fs;
+  BYTE drv;
+} MMCFS_VOLUME;
+static MMCFS_VOLUME mmcfs_volumes[ MMCFS_NUM_CARDS ];
+
 typedef struct
 {
   DIR *dir;
   struct dm_dirent *pdm;
 } MMCFS_DIRENT_DATA;
 
-#define PATH_BUF_SIZE   40
-static char mmc_pathBuf[PATH_BUF_SIZE];
+// Build the FatFs path of 'path' on the card of 'pdata' ("N:/path")
+// Returns 0 if the path is too long, 1 otherwise
+static int mmcfs_make_path( char *dest, const char *path, void *pdata )
+{
+  const MMCFS_VOLUME *pvol = ( const MMCFS_VOLUME* )pdata;
+
+  if( !path )
+    path = "";
+  if( strlen( path ) + 4 > MMCFS_PATH_BUF_SIZE )
+    return 0;
+  dest[ 0 ] = '0' + pvol->drv;
+  dest[ 1 ] = ':';
+  dest[ 2 ] = '\0';
+  // Default to top directory if none given
+  if( *path != '/' )
+    strcat( dest, "/" );
+  strcat( dest, path );
+  return 1;
+}
 
 static int mmcfs_find_empty_fd( void )
 {
@@ -48,6 +77,9 @@ static int mmcfs_open_r( struct _reent *r, const char *path, int flags, int mode
 {
   int fd;
   int mmc_mode;
+  char fpath[ MMCFS_PATH_BUF_SIZE ];
+  FIL *pFile;
+  FRESULT res;
 
   if (mmcfs_num_fd == MMCFS_MAX_FDS)
   {
@@ -55,11 +87,11 @@ static int mmcfs_open_r( struct _reent *r, const char *path, int flags, int mode
     return -1;
   }
 
-  // Default to top directory if none given
-  mmc_pathBuf[0] = 0;
-  if (strchr(path, '/') == NULL)
-    strcat(mmc_pathBuf, "/");
-  strcat(mmc_pathBuf, path);
+  if (!mmcfs_make_path(fpath, path, pdata))
+  {
+    r->_errno = ENAMETOOLONG;
+    return -1;
+  }
 
   // Scrub binary flag, if defined
 #ifdef O_BINARY
@@ -81,7 +113,7 @@ static int mmcfs_open_r( struct _reent *r, const char *path, int flags, int mode
     mmc_mode = FA_OPEN_EXISTING;
   else if ((flags & O_CREAT) == O_CREAT)
     mmc_mode = FA_OPEN_ALWAYS;
-  else if ((flags == O_RDONLY) || (flags == O_WRONLY) || (flags == O_RDWR))
+  else if (((flags & ~O_APPEND) == O_RDONLY) || ((flags & ~O_APPEND) == O_WRONLY) || ((flags & ~O_APPEND) == O_RDWR))
     mmc_mode = FA_OPEN_EXISTING;
   else
   {
@@ -102,17 +134,18 @@ static int mmcfs_open_r( struct _reent *r, const char *path, int flags, int mode
   }
 #endif  // _FS_READONLY
 
-  // Open the file for reading
-  if (f_open(&mmc_fileObject, mmc_pathBuf, mmc_mode) != FR_OK)
+  // Open the file directly in its descriptor
+  fd = mmcfs_find_empty_fd();
+  pFile = mmcfs_fd_table + fd;
+  if ((res = f_open(pFile, fpath, mmc_mode)) != FR_OK)
   {
-    r->_errno = ENOENT;
+    memset(pFile, 0, sizeof(FIL));
+    r->_errno = (res == FR_NO_FILE || res == FR_NO_PATH || res == FR_INVALID_NAME) ? ENOENT : EIO;
     return -1;
   }
 
-  if (mode & O_APPEND)
-    mmc_fileObject.fptr = mmc_fileObject.fsize;
-  fd = mmcfs_find_empty_fd();
-  memcpy(mmcfs_fd_table + fd, &mmc_fileObject, sizeof(FIL));
+  if (flags & O_APPEND)
+    f_lseek(pFile, pFile->fsize);
   mmcfs_num_fd ++;
   return fd;
 }
@@ -195,19 +228,19 @@ static off_t mmcfs_lseek_r( struct _reent *r, int fd, off_t off, int whence, voi
 static void* mmcfs_opendir_r( struct _reent *r, const char* dname, void *pdata )
 {
   void* res = NULL;
-  MMCFS_DIRENT_DATA *pd = ( MMCFS_DIRENT_DATA* )malloc( sizeof( MMCFS_DIRENT_DATA ) );
+  char fpath[ MMCFS_PATH_BUF_SIZE ];
+  MMCFS_DIRENT_DATA *pd;
 
-  if( !pd )
+  if( !mmcfs_make_path( fpath, dname, pdata ) )
+    return NULL;
+  if( ( pd = ( MMCFS_DIRENT_DATA* )malloc( sizeof( MMCFS_DIRENT_DATA ) ) ) == NULL )
     return NULL;
   memset( pd, 0, sizeof( MMCFS_DIRENT_DATA ) );
   if( ( pd->dir = ( DIR* )malloc( sizeof( DIR ) ) ) == NULL )
     goto out;
   if( ( pd->pdm = ( struct dm_dirent* )malloc( sizeof( struct dm_dirent ) ) ) == NULL )
     goto out;
-  if( !dname || strlen( dname ) == 0 )
-    res = f_opendir( pd->dir, "/" ) != FR_OK ? NULL : pd;
-  else
-    res = f_opendir( pd->dir, dname ) != FR_OK ? NULL : pd;
+  res = f_opendir( pd->dir, fpath ) != FR_OK ? NULL : pd;
 out:    
   if( res == NULL )
   {
@@ -272,10 +305,19 @@ static int mmcfs_closedir_r( struct _reent *r, void *d, void *pdata )
 
 static int mmcfs_mkdir_r( struct _reent *r, const char *name, mkdir_mode_t mode, void *pdata )
 {
-  return f_mkdir( name );
+  char fpath[ MMCFS_PATH_BUF_SIZE ];
+
+  if( !mmcfs_make_path( fpath, name, pdata ) )
+  {
+    r->_errno = ENAMETOOLONG;
+    return -1;
+  }
+  return f_mkdir( fpath );
 }
 
 // MMC device descriptor structure
+// The missing files are not cached (DM_DEVICE_FLAG_CACHE_MISSING), since the
+// card can be replaced or modified on another computer
 static const DM_DEVICE mmcfs_device =
 {
   mmcfs_open_r,         // open
@@ -287,15 +329,34 @@ static const DM_DEVICE mmcfs_device =
   mmcfs_readdir_r,      // readdir
   mmcfs_closedir_r,     // closedir
   NULL,                 // getaddr
-  mmcfs_mkdir_r         // mkdir
+  mmcfs_mkdir_r,        // mkdir
+  NULL,                 // ioctl
+  0                     // flags
 };
 
+// Device names (dm_register keeps a pointer to the name)
+static char mmcfs_names[ MMCFS_NUM_CARDS ][ DM_MAX_DEV_NAME + 1 ];
+
 int mmcfs_init()
 {
-  // Mount the MMC file system using logical disk 0
-  if ( f_mount( 0, &mmc_fs ) != FR_OK )
-    return DM_ERR_INIT;
-  return dm_register( "/mmc", NULL, &mmcfs_device );
+  int i, res = DM_OK;
+
+  // Mount a logical disk for each card and register it as "/mmc" (first card),
+  // "/mmc1", "/mmc2" ... (the other cards)
+  for( i = 0; i < MMCFS_NUM_CARDS; i ++ )
+  {
+    mmcfs_volumes[ i ].drv = i;
+    if( f_mount( i, &mmcfs_volumes[ i ].fs ) != FR_OK )
+      return DM_ERR_INIT;
+    if( i == 0 )
+      strcpy( mmcfs_names[ i ], "/mmc" );
+    else
+      sprintf( mmcfs_names[ i ], "/mmc%d", i );
+    // dm_register returns the index of the new device or a negative error code
+    if( ( res = dm_register( mmcfs_names[ i ], mmcfs_volumes + i, &mmcfs_device ) ) < 0 )
+      break;
+  }
+  return res;
 }
 
 #else // #ifdef BUILD_MMCFS
@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 #ifdef __MINGW32__
 void *alloca(size_t);
 #else
@@ -46,9 +47,11 @@ void *alloca(size_t);
 #ifdef LUA_OPTIMIZE_MEMORY
 #define LUA_ISCALLABLE( state, idx ) ( lua_isfunction( state, idx ) || lua_islightfunction( state, idx ) )
 #define LUA_ISATABLE( state, idx ) ( lua_istable( state, idx ) || lua_isrotable( state, idx ) )
+#define LUA_ISROTABLE( state, idx ) lua_isrotable( state, idx )
 #else
 #define LUA_ISCALLABLE( state, idx ) lua_isfunction( state, idx )
 #define LUA_ISATABLE( state, idx ) lua_istable( state, idx )
+#define LUA_ISROTABLE( state, idx ) 0
 #endif
 
 // Prototypes for Local Functions
@@ -109,7 +112,9 @@ enum
   RPC_CMD_CALL = 1,
   RPC_CMD_GET,
   RPC_CMD_CON,
-  RPC_CMD_NEWINDEX
+  RPC_CMD_NEWINDEX,
+  RPC_CMD_ACALL,
+  RPC_CMD_BATCH
 };
 
 // RPC Status Codes
@@ -120,7 +125,11 @@ enum
   RPC_DONE
 };
 
-enum { RPC_PROTOCOL_VERSION = 3 };
+enum { RPC_PROTOCOL_VERSION = 6 };
+
+// number of remote path IDs (1 to RPC_PATH_CACHE_SIZE) cached by the server
+// for each connection; the client starts over with new IDs after the last one
+#define RPC_PATH_CACHE_SIZE     64
 
 
 // return a string representation of an error number
@@ -142,18 +151,159 @@ static const char * errorString( int n )
 
 // **************************************************************************
 // transport layer generics
+//
+// Since protocol version 4 all data goes through a per-transport frame buffer:
+// writes are appended to the outgoing frame, which is sent with a single
+// transport_write_buffer call (prefixed with its 32-bit length) before the
+// next read or at the end of a server command. Reads consume a whole incoming
+// frame that is fetched with one transport_read_buffer call. Integers (string
+// lengths, argument counts, error codes) are sent as varints.
+
+#define RPC_FRAME_HEADER_SIZE   4
+#define RPC_FRAME_MIN_ALLOC     64
+
+// largest incoming frame accepted (a larger length is a protocol error)
+#ifndef RPC_MAX_FRAME_SIZE
+#ifdef LUA_CROSS_COMPILER
+#define RPC_MAX_FRAME_SIZE      ( 1024 * 1024 )
+#else
+#define RPC_MAX_FRAME_SIZE      ( 16 * 1024 )
+#endif
+#endif
+
+static void transport_buffers_init( Transport *tpt )
+{
+  tpt->wbuf = tpt->rbuf = NULL;
+  tpt->wlen = tpt->wsize = 0;
+  tpt->rpos = tpt->rlen = tpt->rsize = 0;
+}
+
+static void transport_buffers_free( Transport *tpt )
+{
+  free( tpt->wbuf );
+  free( tpt->rbuf );
+  transport_buffers_init( tpt );
+}
+
+// make sure that 'size' bytes can be stored in the given buffer
+static u8 *transport_buffer_reserve( u8 *buf, u32 *pbufsize, u32 size )
+{
+  struct exception e;
+  u32 newsize;
+  u8 *newbuf;
+
+  if( size <= *pbufsize )
+    return buf;
+  newsize = *pbufsize ? *pbufsize : RPC_FRAME_MIN_ALLOC;
+  while( newsize < size )
+    newsize <<= 1;
+  if( ( newbuf = ( u8 * )realloc( buf, newsize ) ) == NULL )
+  {
+    e.errnum = ENOMEM;
+    e.type = fatal;
+    Throw( e );
+  }
+  *pbufsize = newsize;
+  return newbuf;
+}
+
+// send the pending outgoing frame (if any)
+static void transport_flush( Transport *tpt )
+{
+  u32 len;
+
+  if( tpt->wlen <= RPC_FRAME_HEADER_SIZE )
+    return;
+  len = tpt->wlen - RPC_FRAME_HEADER_SIZE;
+  tpt->wbuf[ 0 ] = len & 0xFF;
+  tpt->wbuf[ 1 ] = ( len >> 8 ) & 0xFF;
+  tpt->wbuf[ 2 ] = ( len >> 16 ) & 0xFF;
+  tpt->wbuf[ 3 ] = ( len >> 24 ) & 0xFF;
+  tpt->wlen = 0;
+  transport_write_buffer( tpt, tpt->wbuf, len + RPC_FRAME_HEADER_SIZE );
+}
+
+// drop the rest of the current incoming frame (used after protocol errors)
+static void transport_discard( Transport *tpt )
+{
+  tpt->rpos = tpt->rlen = 0;
+  tpt->wlen = 0;
+}
+
+// read the next frame from the transport
+static void transport_read_frame( Transport *tpt )
+{
+  u8 header[ RPC_FRAME_HEADER_SIZE ];
+  u32 len;
+  struct exception e;
+
+  transport_flush( tpt );
+  transport_read_buffer( tpt, header, RPC_FRAME_HEADER_SIZE );
+  len = header[ 0 ] | ( ( u32 )header[ 1 ] << 8 ) | ( ( u32 )header[ 2 ] << 16 ) | ( ( u32 )header[ 3 ] << 24 );
+  // don't allocate a buffer for a bogus length, the stream can't be resynchronized
+  if( len > RPC_MAX_FRAME_SIZE )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = fatal;
+    Throw( e );
+  }
+  tpt->rbuf = transport_buffer_reserve( tpt->rbuf, &tpt->rsize, len );
+  transport_read_buffer( tpt, tpt->rbuf, len );
+  tpt->rpos = 0;
+  tpt->rlen = len;
+}
+
+// returns 1 if there is unread data in the current incoming frame
+static int transport_buffered( Transport *tpt )
+{
+  return tpt->rpos < tpt->rlen;
+}
+
+// read arbitrary length from the current frame(s)
+static void transport_read_bytes( Transport *tpt, u8 *buffer, int length )
+{
+  u32 chunk;
+  struct exception e;
+  TRANSPORT_VERIFY_OPEN;
+
+  while( length > 0 )
+  {
+    if( tpt->rpos == tpt->rlen )
+      transport_read_frame( tpt );
+    chunk = tpt->rlen - tpt->rpos;
+    if( chunk > ( u32 )length )
+      chunk = ( u32 )length;
+    memcpy( buffer, tpt->rbuf + tpt->rpos, chunk );
+    tpt->rpos += chunk;
+    buffer += chunk;
+    length -= chunk;
+  }
+}
+
+// append arbitrary length data to the outgoing frame
+static void transport_write_bytes( Transport *tpt, const u8 *buffer, int length )
+{
+  struct exception e;
+  TRANSPORT_VERIFY_OPEN;
+
+  if( tpt->wlen == 0 )
+    tpt->wlen = RPC_FRAME_HEADER_SIZE;
+  tpt->wbuf = transport_buffer_reserve( tpt->wbuf, &tpt->wsize, tpt->wlen + length );
+  memcpy( tpt->wbuf + tpt->wlen, buffer, length );
+  tpt->wlen += length;
+}
 
 // read arbitrary length from the transport into a string buffer.
 static void transport_read_string( Transport *tpt, const char *buffer, int length )
 {
-  transport_read_buffer( tpt, ( u8 * )buffer, length );
+  transport_read_bytes( tpt, ( u8 * )buffer, length );
 }
 
 
 // write arbitrary length string buffer to the transport
 static void transport_write_string( Transport *tpt, const char *buffer, int length )
 {
-  transport_write_buffer( tpt, ( u8 * )buffer, length );
+  transport_write_bytes( tpt, ( const u8 * )buffer, length );
 }
 
 
@@ -161,9 +311,10 @@ static void transport_write_string( Transport *tpt, const char *buffer, int leng
 static u8 transport_read_u8( Transport *tpt )
 {
   u8 b;
-  struct exception e;
-  TRANSPORT_VERIFY_OPEN;
-  transport_read_buffer( tpt, &b, 1 );
+
+  if( tpt->rpos < tpt->rlen )
+    return tpt->rbuf[ tpt->rpos ++ ];
+  transport_read_bytes( tpt, &b, 1 );
   return b;
 }
 
@@ -171,9 +322,7 @@ static u8 transport_read_u8( Transport *tpt )
 // write a u8 to the transport
 static void transport_write_u8( Transport *tpt, u8 x )
 {
-  struct exception e;
-  TRANSPORT_VERIFY_OPEN;
-  transport_write_buffer( tpt, &x, 1 );
+  transport_write_bytes( tpt, &x, 1 );
 }
 
 static void swap_bytes( uint8_t *number, size_t numbersize )
@@ -187,34 +336,43 @@ static void swap_bytes( uint8_t *number, size_t numbersize )
   }
 }
 
-union u32_bytes {
-  uint32_t i;
-  uint8_t  b[ 4 ];
-};
-
-// read a u32 from the transport
-static u32 transport_read_u32( Transport *tpt )
+// read a varint (7 bits per byte, LSB first) from the transport
+static u32 transport_read_varint( Transport *tpt )
 {
-  union u32_bytes ub;
   struct exception e;
-  TRANSPORT_VERIFY_OPEN;
-  transport_read_buffer ( tpt, ub.b, 4 );
-  if( tpt->net_little != tpt->loc_little )
-    swap_bytes( ( uint8_t * )ub.b, 4 );
-  return ub.i;
+  u32 x = 0;
+  unsigned shift = 0;
+  u8 b;
+
+  do
+  {
+    if( shift > 28 )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = nonfatal;
+      Throw( e );
+    }
+    b = transport_read_u8( tpt );
+    x |= ( u32 )( b & 0x7F ) << shift;
+    shift += 7;
+  } while( b & 0x80 );
+  return x;
 }
 
 
-// write a u32 to the transport
-static void transport_write_u32( Transport *tpt, u32 x )
+// write a varint to the transport
+static void transport_write_varint( Transport *tpt, u32 x )
 {
-  union u32_bytes ub;
-  struct exception e;
-  TRANSPORT_VERIFY_OPEN;
-  ub.i = ( uint32_t )x;
-  if( tpt->net_little != tpt->loc_little )
-    swap_bytes( ( uint8_t * )ub.b, 4 );
-  transport_write_buffer( tpt, ub.b, 4 );
+  u8 b[ 5 ];
+  int n = 0;
+
+  while( x >= 0x80 )
+  {
+    b[ n ++ ] = ( u8 )( x | 0x80 );
+    x >>= 7;
+  }
+  b[ n ++ ] = ( u8 )x;
+  transport_write_bytes( tpt, b, n );
 }
 
 // read a lua number from the transport
@@ -224,7 +382,7 @@ static lua_Number transport_read_number( Transport *tpt )
   u8 b[ tpt->lnum_bytes ];
   struct exception e;
   TRANSPORT_VERIFY_OPEN;
-  transport_read_buffer ( tpt, b, tpt->lnum_bytes );
+  transport_read_bytes( tpt, b, tpt->lnum_bytes );
 
   if( tpt->net_little != tpt->loc_little )
     swap_bytes( ( uint8_t * )b, tpt->lnum_bytes );
@@ -271,25 +429,25 @@ static void transport_write_number( Transport *tpt, lua_Number x )
     {
       case 1: {
         int8_t y = ( int8_t )x;
-        transport_write_buffer( tpt, ( u8 * )&y, 1 );
+        transport_write_bytes( tpt, ( u8 * )&y, 1 );
       } break;
       case 2: {
         int16_t y = ( int16_t )x;
         if( tpt->net_little != tpt->loc_little )
           swap_bytes( ( uint8_t * )&y, 2 );
-        transport_write_buffer( tpt, ( u8 * )&y, 2 );
+        transport_write_bytes( tpt, ( u8 * )&y, 2 );
       } break;
       case 4: {
         int32_t y = ( int32_t )x;
         if( tpt->net_little != tpt->loc_little )
           swap_bytes( ( uint8_t * )&y, 4 );
-        transport_write_buffer( tpt,( u8 * )&y, 4 );
+        transport_write_bytes( tpt,( u8 * )&y, 4 );
       } break;
       case 8: {
         int64_t y = ( int64_t )x;
         if( tpt->net_little != tpt->loc_little )
           swap_bytes( ( uint8_t * )&y, 8 );
-        transport_write_buffer( tpt, ( u8 * )&y, 8 );
+        transport_write_bytes( tpt, ( u8 * )&y, 8 );
       } break;
       default: lua_assert(0);
     }
@@ -298,7 +456,7 @@ static void transport_write_number( Transport *tpt, lua_Number x )
   {
     if( tpt->net_little != tpt->loc_little )
        swap_bytes( ( uint8_t * )&x, 8 );
-    transport_write_buffer( tpt, ( u8 * )&x, 8 );
+    transport_write_bytes( tpt, ( u8 * )&x, 8 );
   }
 }
 
@@ -452,7 +610,7 @@ static void write_variable( Transport *tpt, lua_State *L, int var_index )
       transport_write_u8( tpt, RPC_STRING );
       s = lua_tostring( L, var_index );
       len = ( u32 )lua_strlen( L, var_index );
-      transport_write_u32( tpt, len );
+      transport_write_varint( tpt, len );
       transport_write_string( tpt, s, len );
       break;
     }
@@ -532,16 +690,75 @@ static void read_function( Transport *tpt, lua_State *L )
   }
 }
 
+// read a remote path and push it onto the stack as a string. A path is sent
+// either literally (varint length + 1, the path, varint cache ID or 0) or as
+// 0 followed by the ID of a path cached earlier on this connection.
+static void read_path( Transport *tpt, lua_State *L )
+{
+  u32 len, id;
+
+  len = transport_read_varint( tpt );
+  if( len == 0 )
+  {
+    id = transport_read_varint( tpt );
+    if( tpt->paths_ref != LUA_NOREF )
+    {
+      lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->paths_ref );
+      lua_rawgeti( L, -1, id );
+      lua_remove( L, -2 );
+    }
+    else
+      lua_pushnil( L );
+    if( !lua_isstring( L, -1 ) ) // unknown ID, resolves to nil
+    {
+      lua_pop( L, 1 );
+      lua_pushliteral( L, "?" );
+    }
+    return;
+  }
+  len --;
+  if( tpt->rlen - tpt->rpos >= len )
+  {
+    lua_pushlstring( L, ( const char * )tpt->rbuf + tpt->rpos, len );
+    tpt->rpos += len;
+  }
+  else
+  {
+    char *path = ( char * )alloca( len + 1 );
+    transport_read_string( tpt, path, len );
+    lua_pushlstring( L, path, len );
+  }
+  if( ( id = transport_read_varint( tpt ) ) != 0 && id <= RPC_PATH_CACHE_SIZE )
+  {
+    if( tpt->paths_ref == LUA_NOREF )
+    {
+      lua_newtable( L );
+      tpt->paths_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+    }
+    lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->paths_ref );
+    lua_pushvalue( L, -2 );
+    lua_rawseti( L, -2, id );
+    lua_pop( L, 1 );
+  }
+}
+
+static void transport_paths_reset( lua_State *L, Transport *tpt )
+{
+  luaL_unref( L, LUA_REGISTRYINDEX, tpt->paths_ref );
+  tpt->paths_ref = LUA_NOREF;
+}
+
 static void read_index( Transport *tpt, lua_State *L )
 {
   u32 len;
   char *funcname;
   char *token = NULL;
 
-  len = transport_read_u32( tpt ); // variable name length
+  read_path( tpt, L );
+  len = ( u32 )lua_strlen( L, -1 );
   funcname = ( char * )alloca( len + 1 );
-  transport_read_string( tpt, funcname, len );
-  funcname[ len ] = 0;
+  memcpy( funcname, lua_tostring( L, -1 ), len + 1 );
+  lua_pop( L, 1 );
 
   token = strtok( funcname, "." );
   lua_getglobal( L, token );
@@ -579,11 +796,19 @@ static int read_variable( Transport *tpt, lua_State *L )
 
     case RPC_STRING:
     {
-      u32 len = transport_read_u32( tpt );
-      char *s = ( char * )alloca( len + 1 );
-      transport_read_string( tpt, s, len );
-      s[ len ] = 0;
-      lua_pushlstring( L, s, len );
+      u32 len = transport_read_varint( tpt );
+      if( tpt->rlen - tpt->rpos >= len ) // push directly from the frame
+      {
+        lua_pushlstring( L, ( const char * )tpt->rbuf + tpt->rpos, len );
+        tpt->rpos += len;
+      }
+      else
+      {
+        char *s = ( char * )alloca( len + 1 );
+        transport_read_string( tpt, s, len );
+        s[ len ] = 0;
+        lua_pushlstring( L, s, len );
+      }
       break;
     }
 
@@ -706,6 +931,10 @@ static void server_negotiate( Transport *tpt )
 
 static int generic_catch_handler(lua_State *L, Handle *handle, struct exception e )
 {
+  // the server may have missed cached path definitions, send them again
+  handle->path_gen ++;
+  handle->value_gen ++;
+  transport_discard( &handle->tpt );
   deal_with_error( L, handle, errorString( e.errnum ) );
   switch( e.type )
   {
@@ -715,6 +944,7 @@ static int generic_catch_handler(lua_State *L, Handle *handle, struct exception
       break;
     case fatal:
       transport_close( &handle->tpt );
+      transport_buffers_free( &handle->tpt );
       break;
     default: lua_assert( 0 );
   }
@@ -757,6 +987,12 @@ Handle *handle_create( lua_State *L )
   h->error_handler = LUA_NOREF;
   h->async = 0;
   h->read_reply_count = 0;
+  h->next_id = 0;
+  h->pending_ref = LUA_NOREF;
+  h->next_path_id = h->path_gen = h->value_gen = 0;
+  h->cache_ref = LUA_NOREF;
+  transport_buffers_init( &h->tpt );
+  h->tpt.paths_ref = LUA_NOREF;
   return h;
 }
 
@@ -772,14 +1008,87 @@ static Helper *helper_create( lua_State *L, Handle *handle, const char *funcname
   h->parent = NULL;
   h->nparents = 0;
   strncpy( h->funcname, funcname, NUM_FUNCNAME_CHARS );
+  h->path_id = h->path_gen = h->vgen = 0;
+  h->vref = LUA_NOREF;
   return h;
 }
 
 
+// __gc for client handles: release the frame buffers
+static int handle_gc( lua_State *L )
+{
+  Handle *h = ( Handle * )lua_touserdata( L, 1 );
+
+  transport_buffers_free( &h->tpt );
+  luaL_unref( L, LUA_REGISTRYINDEX, h->pending_ref );
+  h->pending_ref = LUA_NOREF;
+  luaL_unref( L, LUA_REGISTRYINDEX, h->cache_ref );
+  h->cache_ref = LUA_NOREF;
+  return 0;
+}
+
+// helpers are cached per handle by their full path, so that repeated
+// expressions like handle.pio.port.getval reuse the same helpers (and
+// thus their cached remote path IDs and read-only values). The cache has
+// weak values, so the helpers that are no longer used are still collected.
+
+// look up the helper cached under the path at the top of the stack. If found,
+// the path is replaced by the helper and 1 is returned, otherwise the path is
+// left on the stack and 0 is returned
+static int helper_cache_get( lua_State *L, Handle *handle )
+{
+  if( handle->cache_ref == LUA_NOREF )
+    return 0;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->cache_ref );
+  lua_pushvalue( L, -2 );
+  lua_rawget( L, -2 );
+  if( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 2 );
+    return 0;
+  }
+  lua_replace( L, -3 );
+  lua_pop( L, 1 );
+  return 1;
+}
+
+// cache the helper at the top of the stack under the path just below it,
+// the path is removed from the stack
+static void helper_cache_put( lua_State *L, Handle *handle )
+{
+  if( handle->cache_ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    lua_newtable( L );
+    lua_pushliteral( L, "v" );
+    lua_setfield( L, -2, "__mode" );
+    lua_setmetatable( L, -2 );
+    handle->cache_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->cache_ref );
+  lua_pushvalue( L, -3 );
+  lua_pushvalue( L, -3 );
+  lua_rawset( L, -3 );
+  lua_pop( L, 1 );
+  lua_remove( L, -2 );
+}
+
+// add the full (dotted) path of a helper to a buffer
+static void helper_add_path( luaL_Buffer *b, Helper *h )
+{
+  if( h->parent )
+  {
+    helper_add_path( b, h->parent );
+    luaL_addchar( b, '.' );
+  }
+  luaL_addstring( b, h->funcname );
+}
+
 // indexing a handle returns a helper
 static int handle_index (lua_State *L)
 {
   const char *s;
+  Handle *handle;
 
   check_num_args( L, 2 );
   lua_assert( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.handle" ) );
@@ -790,7 +1099,13 @@ static int handle_index (lua_State *L)
   if ( strlen( s ) > NUM_FUNCNAME_CHARS - 1 )
     return luaL_error( L, errorString( ERR_LONGFNAME ) );
 
-  helper_create( L, ( Handle * )lua_touserdata( L, 1 ), s );
+  handle = ( Handle * )lua_touserdata( L, 1 );
+  lua_pushvalue( L, 2 );
+  if( !helper_cache_get( L, handle ) )
+  {
+    helper_create( L, handle, s );
+    helper_cache_put( L, handle );
+  }
 
   // return the helper object
   return 1;
@@ -820,12 +1135,33 @@ static int handle_newindex( lua_State *L )
   return 0;
 }
 
-// replays series of indexes to remote side as a string
+// replays series of indexes to remote side as a string. The first time a
+// helper is sent the server caches its path under a new ID, later on only the
+// ID is sent.
 static void helper_remote_index( Helper *helper )
 {
   int i, len;
   Helper **hstack;
-  Transport *tpt = &helper->handle->tpt;
+  Handle *handle = helper->handle;
+  Transport *tpt = &handle->tpt;
+
+  if( helper->path_id != 0 && helper->path_gen == handle->path_gen )
+  {
+    transport_write_varint( tpt, 0 );
+    transport_write_varint( tpt, helper->path_id );
+    return;
+  }
+  if( helper->funcname[ 0 ] ) // don't cache the temporary helpers of handle_newindex
+  {
+    // all IDs were used, invalidate them so that the server cache doesn't grow
+    if( ++ handle->next_path_id > RPC_PATH_CACHE_SIZE )
+    {
+      handle->next_path_id = 1;
+      handle->path_gen ++;
+    }
+    helper->path_id = handle->next_path_id;
+    helper->path_gen = handle->path_gen;
+  }
 
   // get length of name & make stack of helpers
   len = ( u32 )strlen( helper->funcname );
@@ -841,7 +1177,7 @@ static void helper_remote_index( Helper *helper )
       len += strlen( hstack[ i - 1 ]->funcname ) + 1;
     }
 
-    transport_write_u32( tpt, len );
+    transport_write_varint( tpt, len + 1 );
 
     // replay helper key names
     for( i = 0 ; i < helper->nparents ; i ++ )
@@ -851,17 +1187,19 @@ static void helper_remote_index( Helper *helper )
     }
   }
   else // If helper has no parents, just use length of global
-    transport_write_u32( tpt, len );
+    transport_write_varint( tpt, len + 1 );
 
   transport_write_string( tpt, helper->funcname, ( int )strlen( helper->funcname ) );
+  transport_write_varint( tpt, helper->path_id );
 }
 
-static void helper_wait_ready( Transport *tpt, u8 cmd )
+// the command byte is sent in the same frame as the command data, the server
+// acknowledges it at the start of its response
+static void helper_wait_ready( Transport *tpt )
 {
   struct exception e;
   u8 cmdresp;
 
-  transport_write_u8( tpt, cmd );
   cmdresp = transport_read_u8( tpt );
   if( cmdresp != RPC_READY )
   {
@@ -872,17 +1210,31 @@ static void helper_wait_ready( Transport *tpt, u8 cmd )
 
 }
 
+static void helper_drain_async( lua_State *L, Handle *handle );
+
 static int helper_get( lua_State *L, Helper *helper )
 {
   struct exception e;
   int freturn = 0;
+  int readonly = 0;
   Transport *tpt = &helper->handle->tpt;
 
+  // read-only remote values (from rotables) are only fetched once (again after
+  // an assignment through the handle, an error or rpc.invalidate)
+  if( helper->vref != LUA_NOREF && helper->vgen == helper->handle->value_gen )
+  {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, helper->vref );
+    return 1;
+  }
+
   Try
   {
-    helper_wait_ready( tpt, RPC_CMD_GET );
+    helper_drain_async( L, helper->handle );
+    transport_write_u8( tpt, RPC_CMD_GET );
     helper_remote_index( helper );
 
+    helper_wait_ready( tpt );
+    readonly = transport_read_u8( tpt );
     read_variable( tpt, L );
 
     freturn = 1;
@@ -890,43 +1242,76 @@ static int helper_get( lua_State *L, Helper *helper )
   Catch( e )
   {
     freturn = generic_catch_handler( L, helper->handle, e );
+    readonly = 0;
+  }
+  if( readonly )
+  {
+    luaL_unref( L, LUA_REGISTRYINDEX, helper->vref );
+    lua_pushvalue( L, -1 );
+    helper->vref = luaL_ref( L, LUA_REGISTRYINDEX );
+    helper->vgen = helper->handle->value_gen;
   }
   return freturn;
 }
 
 
-// static int helper_async( lua_State *L )
-// {
-//     /* first read out any pending return values for old async calls */
-//     for (; h->handle->read_reply_count > 0; h->handle->read_reply_count--) {
-//       ret_code = transport_read_u8 (tpt);   /* return code */
-//       if( ret_code == 0 )
-//       {
-//         /* read return arguments, ignore everything we read */
-//         nret = transport_read_u32( tpt );
-//
-//         for (i=0; i < ( ( int ) nret ); i++)
-//           read_variable (tpt,L);
-//
-//         lua_pop (L,nret);
-//       }
-//       else
-//       {
-//         /* read error and handle it */
-//         u32 code = transport_read_u32( tpt );
-//         u32 len = transport_read_u32( tpt );
-//         char *err_string = ( char * )alloca( len + 1 );
-//         transport_read_string( tpt, err_string, len );
-//         err_string[ len ] = 0;
-//
-//         deal_with_error( L, h->handle, err_string );
-//         freturn = 0;
-//       }
-//     }
-// }
+// read the result of a remote call. on success the returned values are
+// pushed onto the stack and their number is returned, otherwise the error
+// message is pushed and -1 is returned.
+static int read_call_result( Transport *tpt, lua_State *L )
+{
+  int i;
+  u32 nret, len;
 
+  // read return code
+  if( transport_read_u8( tpt ) == 0 )
+  {
+    // read return arguments
+    nret = transport_read_varint( tpt );
+    for ( i = 0; i < ( ( int ) nret ); i ++ )
+      read_variable( tpt, L );
+    return ( int )nret;
+  }
+  else
+  {
+    // read error
+    transport_read_varint( tpt ); // read code (not being used here)
+    len = transport_read_varint( tpt );
+    if( tpt->rlen - tpt->rpos >= len )
+    {
+      lua_pushlstring( L, ( const char * )tpt->rbuf + tpt->rpos, len );
+      tpt->rpos += len;
+    }
+    else
+    {
+      char *err_string = ( char * )alloca( len + 1 );
+      transport_read_string( tpt, err_string, len );
+      lua_pushlstring( L, err_string, len );
+    }
+    return -1;
+  }
+}
 
+// write the function path and the arguments at stack positions first..last
+static void write_call( Transport *tpt, lua_State *L, Helper *h, int first, int last )
+{
+  int i;
+
+  helper_remote_index( h );
+  transport_write_varint( tpt, last >= first ? last - first + 1 : 0 );
+  for( i = first; i <= last; i ++ )
+    write_variable( tpt, L, i );
+}
 
+static void async_read_response( lua_State *L, Handle *handle );
+
+// read all outstanding async responses, needed before a synchronous
+// request since responses are returned in request order
+static void helper_drain_async( lua_State *L, Handle *handle )
+{
+  while( handle->read_reply_count > 0 )
+    async_read_response( L, handle );
+}
 
 static int helper_call (lua_State *L)
 {
@@ -950,51 +1335,20 @@ static int helper_call (lua_State *L)
   {
     Try
     {
-      int i,n;
-      u32 nret,ret_code;
+      int n;
 
-      // write function name
-      helper_wait_ready( tpt, RPC_CMD_CALL );
-      helper_remote_index( h );
+      helper_drain_async( L, h->handle );
 
-      // write number of arguments
+      // write function name and arguments
       n = lua_gettop( L );
-      transport_write_u32( tpt, n - 1 );
-
-      // write each argument
-      for( i = 2; i <= n; i ++ )
-        write_variable( tpt, L, i );
-
-      /* if we're in async mode, we're done */
-      /*if ( h->handle->async )
-      {
-        h->handle->read_reply_count++;
-        freturn = 0;
-      }*/
+      transport_write_u8( tpt, RPC_CMD_CALL );
+      write_call( tpt, L, h, 2, n );
 
-      // read return code
-      ret_code = transport_read_u8( tpt );
-
-      if ( ret_code == 0 )
-      {
-        // read return arguments
-        nret = transport_read_u32( tpt );
-
-        for ( i = 0; i < ( ( int ) nret ); i ++ )
-          read_variable( tpt, L );
-
-        freturn = ( int )nret;
-      }
-      else
+      // read results
+      helper_wait_ready( tpt );
+      if( ( freturn = read_call_result( tpt, L ) ) < 0 )
       {
-        // read error and handle it
-        transport_read_u32( tpt ); // read code (not being used here)
-        u32 len = transport_read_u32( tpt );
-        char *err_string = ( char * )alloca( len + 1 );
-        transport_read_string( tpt, err_string, len );
-        err_string[ len ] = 0;
-
-        deal_with_error( L, h->handle, err_string );
+        deal_with_error( L, h->handle, lua_tostring( L, -1 ) );
         freturn = 0;
       }
     }
@@ -1021,22 +1375,27 @@ static int helper_newindex( lua_State *L )
   luaL_checktype(L, -2, LUA_TSTRING );
 
   tpt = &h->handle->tpt;
+  // the assignment can replace a table that read-only values were read from
+  // (for example a global that referred to a rotable)
+  h->handle->value_gen ++;
 
   Try
   {
     // index destination on remote side
-    helper_wait_ready( tpt, RPC_CMD_NEWINDEX );
+    helper_drain_async( L, h->handle );
+    transport_write_u8( tpt, RPC_CMD_NEWINDEX );
     helper_remote_index( h );
 
     write_variable( tpt, L, lua_gettop( L ) - 1 );
     write_variable( tpt, L, lua_gettop( L ) );
 
+    helper_wait_ready( tpt );
     ret_code = transport_read_u8( tpt );
     if( ret_code != 0 )
     {
       // read error and handle it
-      transport_read_u32( tpt ); // Read code (not using here)
-      u32 len = transport_read_u32( tpt );
+      transport_read_varint( tpt ); // Read code (not using here)
+      u32 len = transport_read_varint( tpt );
       char *err_string = ( char * )alloca( len + 1 );
       transport_read_string( tpt, err_string, len );
       err_string[ len ] = 0;
@@ -1066,6 +1425,8 @@ static Helper *helper_append( lua_State *L, Helper *helper, const char *funcname
   h->parent = helper;
   h->nparents = helper->nparents + 1;
   strncpy ( h->funcname, funcname, NUM_FUNCNAME_CHARS );
+  h->path_id = h->path_gen = h->vgen = 0;
+  h->vref = LUA_NOREF;
   return h;
 }
 
@@ -1073,6 +1434,8 @@ static Helper *helper_append( lua_State *L, Helper *helper, const char *funcname
 static int helper_index( lua_State *L )
 {
   const char *s;
+  Helper *parent;
+  luaL_Buffer b;
 
   check_num_args( L, 2 );
   lua_assert( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.helper" ) );
@@ -1083,7 +1446,17 @@ static int helper_index( lua_State *L )
   if ( strlen( s ) > NUM_FUNCNAME_CHARS - 1 )
     return luaL_error( L, errorString( ERR_LONGFNAME ) );
 
-  helper_append( L, ( Helper * )lua_touserdata( L, 1 ), s );
+  parent = ( Helper * )lua_touserdata( L, 1 );
+  luaL_buffinit( L, &b );
+  helper_add_path( &b, parent );
+  luaL_addchar( &b, '.' );
+  luaL_addstring( &b, s );
+  luaL_pushresult( &b );
+  if( !helper_cache_get( L, parent->handle ) )
+  {
+    helper_append( L, parent, s );
+    helper_cache_put( L, parent->handle );
+  }
 
   return 1;
 }
@@ -1095,6 +1468,8 @@ static int helper_close (lua_State *L)
 
   luaL_unref(L, LUA_REGISTRYINDEX, h->pref);
   h->pref = LUA_REFNIL;
+  luaL_unref(L, LUA_REGISTRYINDEX, h->vref);
+  h->vref = LUA_NOREF;
   return 0;
 }
 
@@ -1112,6 +1487,9 @@ static ServerHandle *server_handle_create( lua_State *L )
 
   transport_init( &h->ltpt );
   transport_init( &h->atpt );
+  transport_buffers_init( &h->ltpt );
+  transport_buffers_init( &h->atpt );
+  h->ltpt.paths_ref = h->atpt.paths_ref = LUA_NOREF;
   return h;
 }
 
@@ -1119,6 +1497,19 @@ static void server_handle_shutdown( ServerHandle *h )
 {
   transport_close( &h->ltpt );
   transport_close( &h->atpt );
+  transport_buffers_free( &h->ltpt );
+  transport_buffers_free( &h->atpt );
+}
+
+// __gc for server handles: only release the frame buffers and path cache
+static int server_handle_gc( lua_State *L )
+{
+  ServerHandle *h = ( ServerHandle * )lua_touserdata( L, 1 );
+
+  transport_buffers_free( &h->ltpt );
+  transport_buffers_free( &h->atpt );
+  transport_paths_reset( L, &h->atpt );
+  return 0;
 }
 
 static void server_handle_destroy( ServerHandle *h )
@@ -1173,6 +1564,11 @@ static int rpc_close( lua_State *L )
     {
       Handle *handle = ( Handle * )lua_touserdata( L, 1 );
       transport_close( &handle->tpt );
+      transport_buffers_free( &handle->tpt );
+      handle->read_reply_count = 0;
+      // the responses of the calls in flight will never be read
+      luaL_unref( L, LUA_REGISTRYINDEX, handle->pending_ref );
+      handle->pending_ref = LUA_NOREF;
       return 0;
     }
     if( ismetatable_type( L, 1, "rpc.server_handle" ) )
@@ -1187,28 +1583,303 @@ static int rpc_close( lua_State *L )
 }
 
 
-// rpc_async (handle,)
-//     this sets a handle's asynchronous calling mode (0/nil=off, other=on).
-//     (this is for the client only).
-//     @@@ Before re-enabling, this should be brought up to date with multi-command architecture
+// rpc.invalidate( handle )
+//     drops all the cached helpers, remote path IDs and read-only values of
+//     a handle (or of the handle of the given helper). Needed when the server
+//     itself replaces a global that read-only values were read from.
+static int rpc_invalidate( lua_State *L )
+{
+  Handle *handle;
 
-// static int rpc_async (lua_State *L)
-// {
-//   Handle *handle;
-//   check_num_args( L, 2 );
-//
-//   if ( !lua_isuserdata( L, 1 ) || !ismetatable_type( L, 1, "rpc.handle" ) )
-//     my_lua_error( L, "first arg must be client handle" );
-//
-//   handle = ( Handle * )lua_touserdata( L, 1 );
-//
-//   if ( lua_isnil( L, 2 ) || ( lua_isnumber( L, 2 ) && lua_tonumber( L, 2 ) == 0) )
-//     handle->async = 0;
-//   else
-//     handle->async = 1;
+  check_num_args( L, 1 );
+  if( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.helper" ) )
+    handle = ( ( Helper * )lua_touserdata( L, 1 ) )->handle;
+  else if( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.handle" ) )
+    handle = ( Handle * )lua_touserdata( L, 1 );
+  else
+    return luaL_error( L, "arg must be handle" );
+  luaL_unref( L, LUA_REGISTRYINDEX, handle->cache_ref );
+  handle->cache_ref = LUA_NOREF;
+  handle->path_gen ++;
+  handle->value_gen ++;
+  return 0;
+}
+
+// **************************************************************************
+// asynchronous (pipelined) and batch calls (client side)
 //
-//   return 0;
-// }
+// rpc.async( helper, ... ) sends the call immediately and returns a future
+// without waiting for the response, so many calls can be in flight at the
+// same time. Every async call carries a request ID that the server echoes
+// back; responses are read (in request order) by rpc.wait( future ) or
+// rpc.ready( future ), or before the next synchronous request.
+
+// read the next async response and store its results in the matching future
+static void async_read_response( lua_State *L, Handle *handle )
+{
+  Transport *tpt = &handle->tpt;
+  Future *f;
+  int top = lua_gettop( L );
+  int pending_idx, results, i;
+  u32 id;
+
+  helper_wait_ready( tpt );
+  id = transport_read_varint( tpt );
+  handle->read_reply_count --;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->pending_ref );
+  pending_idx = lua_gettop( L );
+  lua_rawgeti( L, pending_idx, id );
+  results = lua_gettop( L );
+  i = read_call_result( tpt, L );
+  // the future was collected while its call was in flight (or doesn't exist),
+  // drop its results
+  if( ( f = ( Future * )lua_touserdata( L, results ) ) == NULL )
+  {
+    lua_settop( L, top );
+    return;
+  }
+  if( i < 0 )
+    f->state = RPC_FUTURE_ERROR;
+  else
+  {
+    f->state = RPC_FUTURE_DONE;
+    lua_createtable( L, i, 1 );
+    lua_pushinteger( L, i );
+    lua_setfield( L, -2, "n" );
+    for( ; i > 0; i -- )
+    {
+      lua_pushvalue( L, results + i );
+      lua_rawseti( L, -2, i );
+    }
+  }
+  f->rref = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_pushnil( L );
+  lua_rawseti( L, pending_idx, id );
+  lua_settop( L, top );
+}
+
+// rpc.async( helper, ... ) --> future
+static int rpc_async( lua_State *L )
+{
+  struct exception e;
+  Helper *h;
+  Handle *handle;
+  Future *f;
+  Transport *tpt;
+  u32 id;
+  int n = lua_gettop( L );
+
+  h = ( Helper * )luaL_checkudata( L, 1, "rpc.helper" );
+  luaL_argcheck( L, h, 1, "helper expected" );
+  handle = h->handle;
+  tpt = &handle->tpt;
+
+  // create the future and make it findable by its request ID
+  // (the futures are weak values, so that the futures that are not used
+  // anymore and their helper chain and handle can be collected)
+  if( handle->pending_ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    lua_newtable( L );
+    lua_pushliteral( L, "v" );
+    lua_setfield( L, -2, "__mode" );
+    lua_setmetatable( L, -2 );
+    handle->pending_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  id = ++ handle->next_id;
+  f = ( Future * )lua_newuserdata( L, sizeof( Future ) );
+  luaL_getmetatable( L, "rpc.future" );
+  lua_setmetatable( L, -2 );
+  f->handle = handle;
+  f->id = id;
+  f->state = RPC_FUTURE_PENDING;
+  f->rref = LUA_NOREF;
+  lua_pushvalue( L, 1 ); // keep the helper chain (and thus the handle) alive
+  f->href = luaL_ref( L, LUA_REGISTRYINDEX );
+
+  Try
+  {
+    // limit the number of calls in flight, otherwise both sides could block
+    // on full transport buffers
+    if( handle->read_reply_count >= MAX_ASYNC_CALLS )
+      async_read_response( L, handle );
+    transport_write_u8( tpt, RPC_CMD_ACALL );
+    transport_write_varint( tpt, id );
+    write_call( tpt, L, h, 2, n );
+    transport_flush( tpt );
+    handle->read_reply_count ++;
+  }
+  Catch( e )
+  {
+    return generic_catch_handler( L, handle, e );
+  }
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, handle->pending_ref );
+  lua_pushvalue( L, -2 );
+  lua_rawseti( L, -2, id );
+  lua_pop( L, 1 );
+  return 1;
+}
+
+// push the results of a completed future
+static int future_push_results( lua_State *L, Future *f )
+{
+  int i, n;
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, f->rref );
+  if( f->state == RPC_FUTURE_ERROR )
+  {
+    deal_with_error( L, f->handle, lua_tostring( L, -1 ) );
+    return 0;
+  }
+  lua_getfield( L, -1, "n" );
+  n = ( int )lua_tointeger( L, -1 );
+  lua_pop( L, 1 );
+  luaL_checkstack( L, n, "too many results" );
+  for( i = 1; i <= n; i ++ )
+    lua_rawgeti( L, -i, i );
+  return n;
+}
+
+// rpc.wait( future ) --> results of the remote call
+static int rpc_wait( lua_State *L )
+{
+  struct exception e;
+  Future *f = ( Future * )luaL_checkudata( L, 1, "rpc.future" );
+  luaL_argcheck( L, f, 1, "future expected" );
+
+  Try
+  {
+    while( f->state == RPC_FUTURE_PENDING )
+    {
+      if( f->handle->read_reply_count == 0 )
+      {
+        e.errnum = ERR_NODATA;
+        e.type = nonfatal;
+        Throw( e );
+      }
+      async_read_response( L, f->handle );
+    }
+  }
+  Catch( e )
+  {
+    return generic_catch_handler( L, f->handle, e );
+  }
+  return future_push_results( L, f );
+}
+
+// rpc.ready( future ) --> true if the future's results are available
+// (reads the responses that already arrived, doesn't block otherwise)
+static int rpc_ready( lua_State *L )
+{
+  struct exception e;
+  Future *f = ( Future * )luaL_checkudata( L, 1, "rpc.future" );
+  Transport *tpt;
+  luaL_argcheck( L, f, 1, "future expected" );
+
+  tpt = &f->handle->tpt;
+  Try
+  {
+    while( f->state == RPC_FUTURE_PENDING && f->handle->read_reply_count > 0 &&
+           ( transport_buffered( tpt ) || transport_readable( tpt ) ) )
+      async_read_response( L, f->handle );
+  }
+  Catch( e )
+  {
+    return generic_catch_handler( L, f->handle, e );
+  }
+  lua_pushboolean( L, f->state != RPC_FUTURE_PENDING );
+  return 1;
+}
+
+static int future_gc( lua_State *L )
+{
+  Future *f = ( Future * )lua_touserdata( L, 1 );
+
+  luaL_unref( L, LUA_REGISTRYINDEX, f->href );
+  luaL_unref( L, LUA_REGISTRYINDEX, f->rref );
+  f->href = f->rref = LUA_NOREF;
+  return 0;
+}
+
+// rpc.batch( { { helper, ... }, { helper, ... }, ... } ) --> results
+//    evaluates all the calls in a single exchange. The result is a list with
+//    one entry per call: { true, results... } or { false, error_message }
+static int rpc_batch( lua_State *L )
+{
+  struct exception e;
+  Helper *h = NULL;
+  Handle *handle = NULL;
+  Transport *tpt;
+  int i, j, n, nargs, base, nret;
+
+  luaL_checktype( L, 1, LUA_TTABLE );
+  n = lua_objlen( L, 1 );
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_rawgeti( L, 1, i );
+    if( !lua_istable( L, -1 ) )
+      return luaL_error( L, "call %d must be a table", i );
+    lua_rawgeti( L, -1, 1 );
+    if( !lua_isuserdata( L, -1 ) || !ismetatable_type( L, -1, "rpc.helper" ) )
+      return luaL_error( L, "call %d must start with a remote function", i );
+    h = ( Helper * )lua_touserdata( L, -1 );
+    if( handle == NULL )
+      handle = h->handle;
+    else if( h->handle != handle )
+      return luaL_error( L, "all calls must use the same handle" );
+    lua_pop( L, 2 );
+  }
+  lua_settop( L, 1 );
+  lua_createtable( L, n, 0 );
+  if( n == 0 )
+    return 1;
+  tpt = &handle->tpt;
+
+  Try
+  {
+    helper_drain_async( L, handle );
+
+    // send all the calls in a single frame
+    transport_write_u8( tpt, RPC_CMD_BATCH );
+    transport_write_varint( tpt, n );
+    for( i = 1; i <= n; i ++ )
+    {
+      lua_rawgeti( L, 1, i );
+      nargs = lua_objlen( L, -1 );
+      base = lua_gettop( L );
+      luaL_checkstack( L, nargs, "too many arguments" );
+      for( j = 1; j <= nargs; j ++ )
+        lua_rawgeti( L, base, j );
+      write_call( tpt, L, ( Helper * )lua_touserdata( L, base + 1 ), base + 2, base + nargs );
+      lua_settop( L, 2 );
+    }
+
+    // read all results
+    helper_wait_ready( tpt );
+    for( i = 1; i <= n; i ++ )
+    {
+      base = lua_gettop( L );
+      nret = read_call_result( tpt, L );
+      j = nret < 0 ? 1 : nret;
+      lua_createtable( L, j + 1, 0 );
+      lua_pushboolean( L, nret >= 0 );
+      lua_rawseti( L, -2, 1 );
+      for( ; j > 0; j -- )
+      {
+        lua_pushvalue( L, base + j );
+        lua_rawseti( L, -2, j + 1 );
+      }
+      lua_rawseti( L, 2, i );
+      lua_settop( L, base );
+    }
+  }
+  Catch( e )
+  {
+    return generic_catch_handler( L, handle, e );
+  }
+  return 1;
+}
 
 //****************************************************************************
 // lua remote function server
@@ -1224,10 +1895,11 @@ static void read_cmd_call( Transport *tpt, lua_State *L )
   char *token = NULL;
 
   // read function name
-  len = transport_read_u32( tpt ); /* function name string length */
+  read_path( tpt, L );
+  len = ( u32 )lua_strlen( L, -1 );
   funcname = ( char * )alloca( len + 1 );
-  transport_read_string( tpt, funcname, len );
-  funcname[ len ] = 0;
+  memcpy( funcname, lua_tostring( L, -1 ), len + 1 );
+  lua_pop( L, 1 );
 
   // get function
   // @@@ perhaps handle more like variables instead of using a long string?
@@ -1254,7 +1926,7 @@ static void read_cmd_call( Transport *tpt, lua_State *L )
   good_function = LUA_ISCALLABLE( L, -1 );
 
   // read number of arguments
-  nargs = transport_read_u32( tpt );
+  nargs = transport_read_varint( tpt );
 
   // read in each argument, leave it on the stack
   for ( i = 0; i < nargs; i ++ )
@@ -1273,8 +1945,8 @@ static void read_cmd_call( Transport *tpt, lua_State *L )
       const char *errmsg;
       errmsg = lua_tolstring( L, -1, &elen );
       transport_write_u8( tpt, 1 );
-      transport_write_u32( tpt, error_code );
-      transport_write_u32( tpt, ( u32 )elen );
+      transport_write_varint( tpt, error_code );
+      transport_write_varint( tpt, ( u32 )elen );
       transport_write_string( tpt, errmsg, ( int )elen );
     }
     else
@@ -1282,7 +1954,7 @@ static void read_cmd_call( Transport *tpt, lua_State *L )
       // pass the return values back to the caller
       transport_write_u8( tpt, 0 );
       nret = lua_gettop( L ) - stackpos;
-      transport_write_u32( tpt, nret );
+      transport_write_varint( tpt, nret );
       for ( i = 0; i < nret; i ++ )
         write_variable( tpt, L, stackpos + 1 + i );
     }
@@ -1301,8 +1973,8 @@ static void read_cmd_call( Transport *tpt, lua_State *L )
       token = "";
     int errlen = ( int )strlen( msg ) + strlen( token );
     transport_write_u8( tpt, 1 );
-    transport_write_u32( tpt, LUA_ERRRUN );
-    transport_write_u32( tpt, errlen );
+    transport_write_varint( tpt, LUA_ERRRUN );
+    transport_write_varint( tpt, errlen );
     transport_write_string( tpt, msg, ( int )strlen( msg ) );
     transport_write_string( tpt, token, strlen( token ) );
   }
@@ -1316,12 +1988,14 @@ static void read_cmd_get( Transport *tpt, lua_State *L )
   u32 len;
   char *funcname;
   char *token = NULL;
+  int readonly = 0;
 
   // read function name
-  len = transport_read_u32( tpt ); // function name string length
+  read_path( tpt, L );
+  len = ( u32 )lua_strlen( L, -1 );
   funcname = ( char * )alloca( len + 1 );
-  transport_read_string( tpt, funcname, len );
-  funcname[ len ] = 0;
+  memcpy( funcname, lua_tostring( L, -1 ), len + 1 );
+  lua_pop( L, 1 );
 
   // get function
   // @@@ perhaps handle more like variables instead of using a long string?
@@ -1331,12 +2005,15 @@ static void read_cmd_get( Transport *tpt, lua_State *L )
   token = strtok( NULL, "." );
   while( token != NULL )
   {
+    readonly = LUA_ISROTABLE( L, -1 );
     lua_getfield( L, -1, token );
     lua_remove( L, -2 );
     token = strtok( NULL, "." );
   }
 
-  // return top value on stack
+  // return top value on stack, flagged as read-only (cacheable by the
+  // client) if it was read from a rotable
+  transport_write_u8( tpt, ( u8 )readonly );
   write_variable( tpt, L, lua_gettop( L ) );
 
   // empty the stack
@@ -1351,10 +2028,11 @@ static void read_cmd_newindex( Transport *tpt, lua_State *L )
   char *token = NULL;
 
   // read function name
-  len = transport_read_u32( tpt ); // function name string length
+  read_path( tpt, L );
+  len = ( u32 )lua_strlen( L, -1 );
   funcname = ( char * )alloca( len + 1 );
-  transport_read_string( tpt, funcname, len );
-  funcname[ len ] = 0;
+  memcpy( funcname, lua_tostring( L, -1 ), len + 1 );
+  lua_pop( L, 1 );
 
   // get function
   // @@@ perhaps handle more like variables instead of using a long string?
@@ -1389,8 +2067,8 @@ static void read_cmd_newindex( Transport *tpt, lua_State *L )
   //   const char *errmsg;
   //   errmsg = lua_tolstring (L, -1, &len);
   //   transport_write_u8( tpt, 1 );
-  //   transport_write_u32( tpt, error_code );
-  //   transport_write_u32( tpt, len );
+  //   transport_write_varint( tpt, error_code );
+  //   transport_write_varint( tpt, len );
   //   transport_write_string( tpt, errmsg, len );
   // }
 
@@ -1399,6 +2077,25 @@ static void read_cmd_newindex( Transport *tpt, lua_State *L )
 }
 
 
+// async call: same as a call, but the response starts with the request ID
+static void read_cmd_acall( Transport *tpt, lua_State *L )
+{
+  transport_write_varint( tpt, transport_read_varint( tpt ) );
+  read_cmd_call( tpt, L );
+}
+
+
+// batch: a number of calls, the responses are sent in the same order
+static void read_cmd_batch( Transport *tpt, lua_State *L )
+{
+  u32 i, n;
+
+  n = transport_read_varint( tpt );
+  for( i = 0; i < n; i ++ )
+    read_cmd_call( tpt, L );
+}
+
+
 static ServerHandle *rpc_listen_helper( lua_State *L )
 {
   struct exception e;
@@ -1499,13 +2196,23 @@ static void rpc_dispatch_helper( lua_State *L, ServerHandle *handle )
             break;
           case RPC_CMD_CON: //  allow client to renegotiate active connection
             server_negotiate( &handle->atpt );
+            transport_paths_reset( L, &handle->atpt );
             break;
           case RPC_CMD_NEWINDEX: // assign new variable on server
             transport_write_u8( &handle->atpt, RPC_READY );
             read_cmd_newindex( &handle->atpt, L );
             break;
+          case RPC_CMD_ACALL: // pipelined function call
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_acall( &handle->atpt, L );
+            break;
+          case RPC_CMD_BATCH: // several function calls in one exchange
+            transport_write_u8( &handle->atpt, RPC_READY );
+            read_cmd_batch( &handle->atpt, L );
+            break;
           default: // complain and throw exception if unknown command
             transport_write_u8(&handle->atpt, RPC_UNSUPPORTED_CMD );
+            transport_flush( &handle->atpt );
             e.type = nonfatal;
             e.errnum = ERR_COMMAND;
             Throw( e );
@@ -1521,6 +2228,7 @@ static void rpc_dispatch_helper( lua_State *L, ServerHandle *handle )
             Throw( e );
 
           case nonfatal:
+            transport_discard( &handle->atpt );
             handle->link_errs++;
             if ( handle->link_errs > MAX_LINK_ERRS )
             {
@@ -1544,6 +2252,7 @@ static void rpc_dispatch_helper( lua_State *L, ServerHandle *handle )
       {
         case RPC_CMD_CON:
           server_negotiate( &handle->atpt );
+          transport_paths_reset( L, &handle->atpt );
           break;
         default: // connection must be established to issue any other commands
           e.type = nonfatal;
@@ -1551,6 +2260,9 @@ static void rpc_dispatch_helper( lua_State *L, ServerHandle *handle )
           Throw( e ); // remote connection will be closed
       }
     }
+
+    // send the response frame
+    transport_flush( &handle->atpt );
   }
   Catch( e )
   {
@@ -1563,6 +2275,7 @@ static void rpc_dispatch_helper( lua_State *L, ServerHandle *handle )
 
       case nonfatal:
         transport_close( &handle->atpt );
+        transport_discard( &handle->atpt );
         break;
 
       default:
@@ -1591,7 +2304,7 @@ static int rpc_adispatch_helper( lua_State *L, ServerHandle * handle )
 {
   // Check if we have waiting data that we can dispatch on,
   // don't block if we don't have any data
-  if( transport_readable( &handle->atpt ) || transport_readable( &handle->ltpt ) )
+  if( transport_buffered( &handle->atpt ) || transport_readable( &handle->atpt ) || transport_readable( &handle->ltpt ) )
       rpc_dispatch_helper( L, handle );
 
   return 0;
@@ -1675,6 +2388,7 @@ const LUA_REG_TYPE rpc_handle[] =
 {
   { LSTRKEY( "__index" ), LFUNCVAL( handle_index ) },
   { LSTRKEY( "__newindex"), LFUNCVAL( handle_newindex )},
+  { LSTRKEY( "__gc" ), LFUNCVAL( handle_gc ) },
   { LNILKEY, LNILVAL }
 };
 
@@ -1687,8 +2401,15 @@ const LUA_REG_TYPE rpc_helper[] =
   { LNILKEY, LNILVAL }
 };
 
+const LUA_REG_TYPE rpc_future[] =
+{
+  { LSTRKEY( "__gc" ), LFUNCVAL( future_gc ) },
+  { LNILKEY, LNILVAL }
+};
+
 const LUA_REG_TYPE rpc_server_handle[] =
 {
+  { LSTRKEY( "__gc" ), LFUNCVAL( server_handle_gc ) },
   { LNILKEY, LNILVAL }
 };
 
@@ -1702,7 +2423,11 @@ const LUA_REG_TYPE rpc_map[] =
   {  LSTRKEY( "peek" ), LFUNCVAL( rpc_peek ) },
   {  LSTRKEY( "dispatch" ), LFUNCVAL( rpc_dispatch ) },
   {  LSTRKEY( "adispatch" ), LFUNCVAL( rpc_adispatch ) },
-//  {  LSTRKEY( "rpc_async" ), LFUNCVAL( rpc_async ) },
+  {  LSTRKEY( "async" ), LFUNCVAL( rpc_async ) },
+  {  LSTRKEY( "wait" ), LFUNCVAL( rpc_wait ) },
+  {  LSTRKEY( "ready" ), LFUNCVAL( rpc_ready ) },
+  {  LSTRKEY( "batch" ), LFUNCVAL( rpc_batch ) },
+  {  LSTRKEY( "invalidate" ), LFUNCVAL( rpc_invalidate ) },
 #if LUA_OPTIMIZE_MEMORY > 0
 // {  LSTRKEY("mode"), LSTRVAL( LUARPC_MODE ) },
 #endif // #if LUA_OPTIMIZE_MEMORY > 0
@@ -1716,6 +2441,7 @@ LUALIB_API int luaopen_rpc(lua_State *L)
   luaL_rometatable(L, "rpc.helper", (void*)rpc_helper);
   luaL_rometatable(L, "rpc.handle", (void*)rpc_handle);
   luaL_rometatable(L, "rpc.server_handle", (void*)rpc_server_handle);
+  luaL_rometatable(L, "rpc.future", (void*)rpc_future);
 #else
   luaL_register( L, "rpc", rpc_map );
   lua_pushstring( L, LUARPC_MODE );
@@ -1728,6 +2454,10 @@ LUALIB_API int luaopen_rpc(lua_State *L)
   luaL_register( L, NULL, rpc_handle );
 
   luaL_newmetatable( L, "rpc.server_handle" );
+  luaL_register( L, NULL, rpc_server_handle );
+
+  luaL_newmetatable( L, "rpc.future" );
+  luaL_register( L, NULL, rpc_future );
 #endif
   return 1;
 }
@@ -1738,6 +2468,7 @@ static const luaL_reg rpc_handle[] =
 {
   { "__index", handle_index },
   { "__newindex", handle_newindex },
+  { "__gc", handle_gc },
   { NULL, NULL }
 };
 
@@ -1750,8 +2481,15 @@ static const luaL_reg rpc_helper[] =
   { NULL, NULL }
 };
 
+static const luaL_reg rpc_future[] =
+{
+  { "__gc", future_gc },
+  { NULL, NULL }
+};
+
 static const luaL_reg rpc_server_handle[] =
 {
+  { "__gc", server_handle_gc },
   { NULL, NULL }
 };
 
@@ -1765,7 +2503,11 @@ static const luaL_reg rpc_map[] =
   { "peek", rpc_peek },
   { "dispatch", rpc_dispatch },
   { "adispatch", rpc_adispatch },
-//  { "rpc_async", rpc_async },
+  { "async", rpc_async },
+  { "wait", rpc_wait },
+  { "ready", rpc_ready },
+  { "batch", rpc_batch },
+  { "invalidate", rpc_invalidate },
   { NULL, NULL }
 };
 
@@ -1783,6 +2525,10 @@ LUALIB_API int luaopen_rpc(lua_State *L)
   luaL_register( L, NULL, rpc_handle );
 
   luaL_newmetatable( L, "rpc.server_handle" );
+  luaL_register( L, NULL, rpc_server_handle );
+
+  luaL_newmetatable( L, "rpc.future" );
+  luaL_register( L, NULL, rpc_future );
 
   return 1;
 }
@@ -7,6 +7,7 @@
 #include "auxmods.h"
 #include "elua_net.h"
 #include "common.h"
+#include "utils.h"
 #include <stdio.h>
 #include <string.h>
 #include <stddef.h>
@@ -15,6 +16,41 @@
 #include "platform_conf.h"
 #ifdef BUILD_UIP
 
+// Registry key of the table with the strings sent asynchronously (indexed by
+// socket); a string is kept there until the next send on the same socket or
+// until the socket is closed, since uIP reads it from its Lua storage (one
+// segment at a time is still copied to uip_buf, also for retransmissions)
+#define NET_PINNED_KEY        "elua_net_pinned"
+
+// Largest chunk of data given to a single elua_net_send call
+#define NET_MAX_SEND_CHUNK    0x4000
+
+// Pin the value at 'idx' to the socket (or release the pinned value if 'idx' is 0)
+static void net_pin( lua_State *L, int sock, int idx )
+{
+  lua_getfield( L, LUA_REGISTRYINDEX, NET_PINNED_KEY );
+  if( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, NET_PINNED_KEY );
+  }
+  if( idx )
+    lua_pushvalue( L, idx );
+  else
+    lua_pushnil( L );
+  lua_rawseti( L, -2, sock );
+  lua_pop( L, 1 );
+}
+
+// Get a size argument, which must fit in an elua_net_size
+static elua_net_size net_get_size( lua_State *L, int arg, lua_Integer size )
+{
+  luaL_argcheck( L, size >= 0 && size <= ELUA_NET_MAX_SIZE, arg, "size out of range" );
+  return ( elua_net_size )size;
+}
+
 // Lua: sock, remoteip, err = accept( port, [timer_id, timeout] )
 static int net_accept( lua_State *L )
 {
@@ -25,18 +61,38 @@ static int net_accept( lua_State *L )
   int sock;
 
   cmn_get_timeout_data( L, 2, &timer_id, &timeout );
+  remip.ipaddr = 0;
   lua_pushinteger( L, sock = elua_accept( port, timer_id, timeout, &remip ) );
   lua_pushinteger( L, remip.ipaddr );
-  lua_pushinteger( L, elua_net_get_last_err( sock ) );
+  lua_pushinteger( L, sock == -1 ? ELUA_NET_ERR_TIMEDOUT : elua_net_get_last_err( sock ) );
   return 3;
 }
 
-// Lua: sock = socket( type )
+// Lua: res = listen( port )
+static int net_listen( lua_State *L )
+{
+  u16 port = ( u16 )luaL_checkinteger( L, 1 );
+
+  lua_pushinteger( L, elua_net_listen( port ) );
+  return 1;
+}
+
+// Lua: res = unlisten( port )
+static int net_unlisten( lua_State *L )
+{
+  u16 port = ( u16 )luaL_checkinteger( L, 1 );
+
+  lua_pushinteger( L, elua_net_unlisten( port ) );
+  return 1;
+}
+
+// Lua: sock = socket( type, [rxbufsize] )
 static int net_socket( lua_State *L )
 {
   int type = ( int )luaL_checkinteger( L, 1 );
+  elua_net_size rxsize = net_get_size( L, 2, luaL_optinteger( L, 2, 0 ) );
   
-  lua_pushinteger( L, elua_net_socket( type ) );
+  lua_pushinteger( L, elua_net_socket( type, rxsize ) );
   return 1;
 }
 
@@ -46,19 +102,41 @@ static int net_close( lua_State* L )
   int sock = ( int )luaL_checkinteger( L, 1 );
   
   lua_pushinteger( L, elua_net_close( sock ) );
+  // The data of the last asynchronous send is not needed anymore
+  net_pin( L, sock, 0 );
   return 1;
 }
 
-// Lua: res, err = send( sock, str )
+// Lua: res, err = send( sock, str, [async] )
 static int net_send( lua_State* L )
 {
   int sock = ( int )luaL_checkinteger( L, 1 );
+  int async = lua_toboolean( L, 3 );
   const char *buf;
-  size_t len;
+  size_t len, total = 0;
+  elua_net_size res;
     
   luaL_checktype( L, 2, LUA_TSTRING );
   buf = lua_tolstring( L, 2, &len );
-  lua_pushinteger( L, elua_net_send( sock, buf, len ) );
+  if( async )
+  {
+    // Sent without copying, so the string must live until the send is done
+    // (a string too large for a single send is sent partially)
+    if( ( res = elua_net_send_async( sock, buf, UMIN( len, NET_MAX_SEND_CHUNK ) ) ) > 0 )
+      net_pin( L, sock, 2 );
+    lua_pushinteger( L, res );
+  }
+  else
+  {
+    // Send large strings in chunks (elua_net_size is limited)
+    do
+    {
+      res = elua_net_send( sock, buf + total, UMIN( len - total, NET_MAX_SEND_CHUNK ) );
+      if( res > 0 )
+        total += res;
+    } while( res == NET_MAX_SEND_CHUNK && total < len );
+    lua_pushinteger( L, res < 0 && total == 0 ? -1 : ( lua_Integer )total );
+  }
   lua_pushinteger( L, elua_net_get_last_err( sock ) );
   return 2;  
 }
@@ -149,7 +227,7 @@ static int net_recv( lua_State *L )
   luaL_Buffer net_recv_buff;
 
   if( lua_isnumber( L, 2 ) ) // invocation with maxsize
-    maxsize = ( elua_net_size )luaL_checkinteger( L, 2 );
+    maxsize = net_get_size( L, 2, luaL_checkinteger( L, 2 ) );
   else // invocation with line mode
   {
     if( strcmp( luaL_checkstring( L, 2 ), "*l" ) )
@@ -166,6 +244,115 @@ static int net_recv( lua_State *L )
   return 2;
 }
 
+// Lua: res = bind( sock, port )
+static int net_bind( lua_State *L )
+{
+  int sock = ( int )luaL_checkinteger( L, 1 );
+  u16 port = ( u16 )luaL_checkinteger( L, 2 );
+
+  lua_pushinteger( L, elua_net_bind( sock, port ) );
+  return 1;
+}
+
+// Lua: res, err = sendto( sock, str, iptype, port )
+static int net_sendto( lua_State *L )
+{
+  int sock = ( int )luaL_checkinteger( L, 1 );
+  const char *buf;
+  size_t len;
+  elua_net_ip ip;
+  u16 port = ( u16 )luaL_checkinteger( L, 4 );
+
+  luaL_checktype( L, 2, LUA_TSTRING );
+  buf = lua_tolstring( L, 2, &len );
+  ip.ipaddr = ( u32 )luaL_checkinteger( L, 3 );
+  // A datagram can't be split, so it must fit in an elua_net_size
+  lua_pushinteger( L, elua_net_sendto( sock, buf, net_get_size( L, 2, ( lua_Integer )len ), ip, port ) );
+  lua_pushinteger( L, elua_net_get_last_err( sock ) );
+  return 2;
+}
+
+// Lua: data, iptype, port, err = recvfrom( sock, maxsize, [timer_id, timeout] )
+static int net_recvfrom( lua_State *L )
+{
+  int sock = ( int )luaL_checkinteger( L, 1 );
+  elua_net_size maxsize = net_get_size( L, 2, luaL_checkinteger( L, 2 ) );
+  unsigned timer_id = PLATFORM_TIMER_SYS_ID;
+  timer_data_type timeout = PLATFORM_TIMER_INF_TIMEOUT;
+  luaL_Buffer net_recv_buff;
+  elua_net_ip ip;
+  u16 port = 0;
+
+  ip.ipaddr = 0;
+  cmn_get_timeout_data( L, 3, &timer_id, &timeout );
+  luaL_buffinit( L, &net_recv_buff );
+  elua_net_recvfrombuf( sock, &net_recv_buff, maxsize, &ip, &port, timer_id, timeout );
+  luaL_pushresult( &net_recv_buff );
+  lua_pushinteger( L, ip.ipaddr );
+  lua_pushinteger( L, port );
+  lua_pushinteger( L, elua_net_get_last_err( sock ) );
+  return 4;
+}
+
+// Helper for select: add the entries of the table at 'idx' (if any) to 'fds'
+static void net_select_add( lua_State *L, int idx, elua_net_pollfd *fds, u8 events )
+{
+  unsigned i, n;
+
+  if( lua_isnoneornil( L, idx ) )
+    return;
+  n = lua_objlen( L, idx );
+  for( i = 0; i < n; i ++ )
+  {
+    lua_rawgeti( L, idx, i + 1 );
+    fds[ i ].sock = ( int )luaL_checkinteger( L, -1 );
+    fds[ i ].events = events;
+    lua_pop( L, 1 );
+  }
+}
+
+// Helper for select: push a table with the ready entries of 'fds'
+static void net_select_push( lua_State *L, elua_net_pollfd *fds, unsigned n )
+{
+  unsigned i, pos = 1;
+
+  lua_newtable( L );
+  for( i = 0; i < n; i ++ )
+    if( fds[ i ].revents )
+    {
+      lua_pushinteger( L, fds[ i ].sock );
+      lua_rawseti( L, -2, pos ++ );
+    }
+}
+
+// Lua: rsocks, wsocks, ports = select( rsocks, [wsocks], [ports], [timer_id, timeout] )
+// Closed sockets are returned in both 'rsocks' and 'wsocks'
+static int net_select( lua_State *L )
+{
+  unsigned timer_id = PLATFORM_TIMER_SYS_ID;
+  timer_data_type timeout = PLATFORM_TIMER_INF_TIMEOUT;
+  unsigned nr, nw, na, i;
+  elua_net_pollfd *fds;
+
+  for( i = 1; i <= 3; i ++ )
+    if( !lua_isnoneornil( L, i ) )
+      luaL_checktype( L, i, LUA_TTABLE );
+  cmn_get_timeout_data( L, 4, &timer_id, &timeout );
+  nr = lua_isnoneornil( L, 1 ) ? 0 : lua_objlen( L, 1 );
+  nw = lua_isnoneornil( L, 2 ) ? 0 : lua_objlen( L, 2 );
+  na = lua_isnoneornil( L, 3 ) ? 0 : lua_objlen( L, 3 );
+  fds = ( elua_net_pollfd* )lua_newuserdata( L, ( nr + nw + na + 1 ) * sizeof( elua_net_pollfd ) );
+  net_select_add( L, 1, fds, ELUA_NET_EV_READ );
+  net_select_add( L, 2, fds + nr, ELUA_NET_EV_WRITE );
+  net_select_add( L, 3, fds + nr + nw, ELUA_NET_EV_ACCEPT );
+  if( elua_net_poll( fds, nr + nw + na, timer_id, timeout ) == -1 )
+    return luaL_error( L, "network not available" );
+  net_select_push( L, fds, nr );
+  net_select_push( L, fds + nr, nw );
+  net_select_push( L, fds + nr + nw, na );
+  return 3;
+}
+
 // Lua: iptype = lookup( "name" )
 static int net_lookup( lua_State* L )
 {
@@ -177,12 +364,54 @@ static int net_lookup( lua_State* L )
   return 1;
 }
 
+// Lua: handle = lookup_async( "name" )
+static int net_lookup_async( lua_State* L )
+{
+  const char* name = luaL_checkstring( L, 1 );
+
+  lua_pushinteger( L, elua_net_lookup_async( name ) );
+  return 1;
+}
+
+// Lua: iptype = lookup_poll( handle ), nil if the lookup is still in progress
+static int net_lookup_poll( lua_State* L )
+{
+  int handle = luaL_checkinteger( L, 1 );
+  elua_net_ip res;
+
+  if( elua_net_lookup_status( handle, &res ) == ELUA_NET_LOOKUP_PENDING )
+    lua_pushnil( L );
+  else
+    lua_pushinteger( L, res.ipaddr );
+  return 1;
+}
+
+// Lua: statstable = stats( [reset] )
+static int net_stats( lua_State* L )
+{
+  elua_net_stats st;
+
+  elua_net_get_stats( &st, lua_toboolean( L, 1 ) );
+  lua_createtable( L, 0, 4 );
+  lua_pushnumber( L, ( lua_Number )st.isr_max );
+  lua_setfield( L, -2, "isrmax" );
+  lua_pushnumber( L, st.isr_count );
+  lua_setfield( L, -2, "isrcount" );
+  lua_pushnumber( L, st.rx_frames );
+  lua_setfield( L, -2, "rxframes" );
+  lua_pushnumber( L, ( lua_Number )st.rx_time );
+  lua_setfield( L, -2, "rxtime" );
+  return 1;
+}
+
 // Module function map
 #define MIN_OPT_LEVEL 2
 #include "lrodefs.h"
 const LUA_REG_TYPE net_map[] = 
 {
   { LSTRKEY( "accept" ), LFUNCVAL( net_accept ) },
+  { LSTRKEY( "listen" ), LFUNCVAL( net_listen ) },
+  { LSTRKEY( "unlisten" ), LFUNCVAL( net_unlisten ) },
   { LSTRKEY( "packip" ), LFUNCVAL( net_packip ) },
   { LSTRKEY( "unpackip" ), LFUNCVAL( net_unpackip ) },
   { LSTRKEY( "connect" ), LFUNCVAL( net_connect ) },
@@ -190,7 +419,14 @@ const LUA_REG_TYPE net_map[] =
   { LSTRKEY( "close" ), LFUNCVAL( net_close ) },
   { LSTRKEY( "send" ), LFUNCVAL( net_send ) },
   { LSTRKEY( "recv" ), LFUNCVAL( net_recv ) },
+  { LSTRKEY( "bind" ), LFUNCVAL( net_bind ) },
+  { LSTRKEY( "sendto" ), LFUNCVAL( net_sendto ) },
+  { LSTRKEY( "recvfrom" ), LFUNCVAL( net_recvfrom ) },
+  { LSTRKEY( "select" ), LFUNCVAL( net_select ) },
   { LSTRKEY( "lookup" ), LFUNCVAL( net_lookup ) },
+  { LSTRKEY( "lookup_async" ), LFUNCVAL( net_lookup_async ) },
+  { LSTRKEY( "lookup_poll" ), LFUNCVAL( net_lookup_poll ) },
+  { LSTRKEY( "stats" ), LFUNCVAL( net_stats ) },
 #if LUA_OPTIMIZE_MEMORY > 0
   { LSTRKEY( "SOCK_STREAM" ), LNUMVAL( ELUA_NET_SOCK_STREAM ) },
   { LSTRKEY( "SOCK_DGRAM" ), LNUMVAL( ELUA_NET_SOCK_DGRAM ) },
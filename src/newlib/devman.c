@@ -6,6 +6,7 @@
 #include <reent.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include "devman.h"
 #include "genstd.h"
 #include "common.h"
@@ -14,10 +15,135 @@
 static DM_INSTANCE_DATA dm_list[ DM_MAX_DEVICES ];            // list of devices
 static int dm_num_devs;                                       // number of devices
 
+// Hash table of the device names (index in dm_list or -1, open addressing)
+#define DM_HASH_SIZE          ( 2 * DM_MAX_DEVICES )
+static s8 dm_hash_table[ DM_HASH_SIZE ];
+
+// Number of entries in the cache of missing files (0 to disable it)
+#ifndef DM_PATH_CACHE_SIZE
+#define DM_PATH_CACHE_SIZE    8
+#endif
+
+#if DM_PATH_CACHE_SIZE > 0
+// Cache of the files that were not found
+typedef struct
+{
+  s8 devid;                                   // device ID (-1 if the entry is not used)
+  char path[ DM_PATH_CACHE_MAX_PATH + 1 ];    // file name on the device
+} DM_PCACHE_ENTRY;
+static DM_PCACHE_ENTRY dm_pcache[ DM_PATH_CACHE_SIZE ];
+static unsigned dm_pcache_next;               // next entry to replace
+#endif
+
 // "Shared" variables: these can be used by any FS that implements 'ls' via opendir/readdir/closedir
 struct dm_dirent dm_shared_dirent;
 char dm_shared_fname[ DM_MAX_FNAME_LENGTH + 1 ];
 
+// *****************************************************************************
+// Device name hashing
+
+// Case insensitive hash of the first 'len' chars of a device name
+static unsigned dm_hash( const char *name, unsigned len )
+{
+  unsigned h = 0;
+
+  while( len -- )
+    h = h * 31 + tolower( ( unsigned char )*name ++ );
+  return h % DM_HASH_SIZE;
+}
+
+// Rebuild the hash table after the device list was changed
+static void dm_hash_rebuild()
+{
+  int i;
+  unsigned h;
+
+  memset( dm_hash_table, -1, sizeof( dm_hash_table ) );
+  for( i = 0; i < dm_num_devs; i ++ )
+  {
+    for( h = dm_hash( dm_list[ i ].name, strlen( dm_list[ i ].name ) ); dm_hash_table[ h ] != -1; h = ( h + 1 ) % DM_HASH_SIZE );
+    dm_hash_table[ h ] = i;
+  }
+}
+
+// Find a device from the first 'len' chars of its name
+// Returns the index of the device or DM_ERR_NO_DEVICE
+int dm_find_device( const char *name, unsigned len )
+{
+  unsigned h;
+  int i;
+
+  if( dm_num_devs == 0 || len > DM_MAX_DEV_NAME )
+    return DM_ERR_NO_DEVICE;
+  for( h = dm_hash( name, len ); ( i = dm_hash_table[ h ] ) != -1; h = ( h + 1 ) % DM_HASH_SIZE )
+    if( !strncasecmp( name, dm_list[ i ].name, len ) && dm_list[ i ].name[ len ] == '\0' )
+      return i;
+  return DM_ERR_NO_DEVICE;
+}
+
+// *****************************************************************************
+// Cache of missing files
+// Opening a file that doesn't exist can be expensive (the FS needs to scan its
+// whole directory) and happens often (for example 'require' tries all the
+// entries in package.path). The files that were not found on devices with the
+// DM_DEVICE_FLAG_CACHE_MISSING flag are kept here until the device is modified.
+
+#if DM_PATH_CACHE_SIZE > 0
+
+// Returns 1 if 'path' is known to be missing on device 'devid', 0 otherwise
+int dm_pcache_is_missing( int devid, const char *path )
+{
+  unsigned i;
+
+  for( i = 0; i < DM_PATH_CACHE_SIZE; i ++ )
+    if( dm_pcache[ i ].devid == devid && !strcmp( dm_pcache[ i ].path, path ) )
+      return 1;
+  return 0;
+}
+
+// Remember that 'path' was not found on device 'devid'
+void dm_pcache_add_missing( int devid, const char *path )
+{
+  if( ( dm_list[ devid ].pdev->flags & DM_DEVICE_FLAG_CACHE_MISSING ) == 0 || strlen( path ) > DM_PATH_CACHE_MAX_PATH )
+    return;
+  if( dm_pcache_is_missing( devid, path ) )
+    return;
+  dm_pcache[ dm_pcache_next ].devid = devid;
+  strcpy( dm_pcache[ dm_pcache_next ].path, path );
+  dm_pcache_next = ( dm_pcache_next + 1 ) % DM_PATH_CACHE_SIZE;
+}
+
+// Forget the missing files of device 'devid' (of all devices if 'devid' is -1)
+// This must be called before a file can be created on the device
+void dm_pcache_invalidate( int devid )
+{
+  unsigned i;
+
+  for( i = 0; i < DM_PATH_CACHE_SIZE; i ++ )
+    if( devid == -1 || dm_pcache[ i ].devid == devid )
+      dm_pcache[ i ].devid = -1;
+}
+
+#else // #if DM_PATH_CACHE_SIZE > 0
+
+int dm_pcache_is_missing( int devid, const char *path )
+{
+  return 0;
+}
+
+void dm_pcache_add_missing( int devid, const char *path )
+{
+}
+
+void dm_pcache_invalidate( int devid )
+{
+}
+
+#endif // #if DM_PATH_CACHE_SIZE > 0
+
+// *****************************************************************************
+// Device registration
+
 // Register a device
 // Returns the index of the device in the device table
 int dm_register( const char *name, void *pdata, const DM_DEVICE *pdev )
@@ -32,19 +158,21 @@ int dm_register( const char *name, void *pdata, const DM_DEVICE *pdev )
     return DM_ERR_INVALID_NAME;
   
   // Check if the device is not already registered
-  for( i = 0; i < dm_num_devs; i ++ )
-    if( !strcasecmp( name, dm_list[ i ].name ) )
-      return DM_ERR_ALREADY_REGISTERED;
+  if( dm_find_device( name, strlen( name ) ) != DM_ERR_NO_DEVICE )
+    return DM_ERR_ALREADY_REGISTERED;
   
   // Check for space
   if( dm_num_devs == DM_MAX_DEVICES )
     return DM_ERR_NO_SPACE;
     
   // Register it now
+  i = dm_num_devs;
   dm_list[ i ].name = name;
   dm_list[ i ].pdata = pdata;
   dm_list[ i ].pdev = pdev;
   dm_num_devs ++;
+  dm_hash_rebuild();
+  dm_pcache_invalidate( -1 );
   return i;
 }
 
@@ -80,16 +208,15 @@ int dm_unregister( const char* name )
     return DM_ERR_INVALID_NAME;
       
   // Check if the device is already registered
-  for( i = 0; i < dm_num_devs; i ++ )
-    if( !strcasecmp( name, dm_list[ i ].name ) )
-      break;
-  if( i == dm_num_devs )
+  if( ( i = dm_find_device( name, strlen( name ) ) ) == DM_ERR_NO_DEVICE )
     return DM_ERR_NOT_REGISTERED;
   
   // Remove it
   if( i != dm_num_devs - 1 )
     memmove( dm_list + i, dm_list + i + 1, sizeof( DM_INSTANCE_DATA ) * ( dm_num_devs - i - 1 ) );
   dm_num_devs --;
+  dm_hash_rebuild();
+  dm_pcache_invalidate( -1 );
   return DM_OK;
 }
 
@@ -213,3 +340,18 @@ const char* dm_getaddr( int fd )
   return pinst->pdev->p_getaddr_r( _REENT, DM_GET_FD( fd ), pinst->pdata );
 }
 
+
+int dm_ioctl( int fd, int req, void *arg )
+{
+  const DM_INSTANCE_DATA *pinst;
+
+  // Find device, check ioctl function
+  pinst = dm_get_instance_at( DM_GET_DEVID( fd ) );
+  if( !pinst || pinst->pdev->p_ioctl_r == NULL )
+  {
+    _REENT->_errno = ENOSYS;
+    return -1;
+  }
+
+  return pinst->pdev->p_ioctl_r( _REENT, DM_GET_FD( fd ), req, arg, pinst->pdata );
+}
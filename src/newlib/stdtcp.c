@@ -34,7 +34,10 @@ static _ssize_t std_read( struct _reent *r, int fd, void* vptr, size_t len, void
   actsize = 0;
   while( 1 )
   {
-    pktsize = elua_net_recv( sock, lptr, len, -1, 0, 0 );
+    pktsize = elua_net_recv( sock, lptr, len, -1, 0, PLATFORM_TIMER_INF_TIMEOUT );
+    // Connection closed
+    if( pktsize <= 0 )
+      return actsize;
     // Check EOF
     for( j = 0; j < pktsize; j ++ )
       if( lptr[ j ] == STD_CTRLZ_CODE )
@@ -69,9 +72,8 @@ static _ssize_t std_write( struct _reent *r, int fd, const void* vptr, size_t le
   // Get (and wait for) socket
   while( ( sock = elua_net_get_telnet_socket() ) == - 1 );  
   
-  // Send data
-  elua_net_send( sock, vptr, len );
-  return len;
+  // Send data (buffered in the TELNET output ring)
+  return elua_net_telnet_write( vptr, len );
 }
 
 // Set send/recv functions
@@ -94,7 +96,9 @@ static const DM_DEVICE std_device =
   NULL,                 // readdir
   NULL,                 // closedir
   NULL,                 // getaddr
-  NULL                  // mkdir
+  NULL,                 // mkdir
+  NULL,                 // ioctl
+  0                     // flags
 };
 
 
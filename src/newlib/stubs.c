@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include "devman.h"
 #include "ioctl.h"
 #include "platform.h"
@@ -27,9 +28,7 @@
 static int find_dm_entry( const char* name, char **pactname )
 {
   int i;
-  const DM_INSTANCE_DATA* pinst;
   const char* preal;
-  char tempname[ DM_MAX_DEV_NAME + 1 ];
   
   // Sanity check for name
   if( name == NULL || *name == '\0' || *name != '/' )
@@ -40,25 +39,18 @@ static int find_dm_entry( const char* name, char **pactname )
   if( preal == NULL )
   {
     // This shortcut allows to register the "/" filesystem and use it like "/file.ext"
-    strcpy( tempname, "/" );
+    i = dm_find_device( "/", 1 );
     preal = name;
   }
   else
   {
     if( ( preal - name > DM_MAX_DEV_NAME ) || ( preal - name == 1 ) ) // name too short/too long
       return -1;
-    memcpy( tempname, name, preal - name );
-    tempname[ preal - name ] = '\0';
+    i = dm_find_device( name, preal - name );
   }
     
   // Find device
-  for( i = 0; i < dm_get_num_devices(); i ++ )
-  {
-    pinst = dm_get_instance_at( i );
-    if( !strcasecmp( tempname, pinst->name ) )
-      break;
-  }
-  if( i == dm_get_num_devices() )
+  if( i == DM_ERR_NO_DEVICE )
     return -1;
     
   // Find the actual first char of the name
@@ -89,10 +81,27 @@ int _open_r( struct _reent *r, const char *name, int flags, int mode )
     r->_errno = ENOSYS;
     return -1;   
   }
+
+  // A file that can't be created by this call might be known to be missing already,
+  // otherwise the missing files of the device are forgotten (the file might be created)
+  if( ( flags & ( O_ACCMODE | O_CREAT | O_TRUNC ) ) == O_RDONLY )
+  {
+    if( dm_pcache_is_missing( devid, actname ) )
+    {
+      r->_errno = ENOENT;
+      return -1;
+    }
+  }
+  else
+    dm_pcache_invalidate( devid );
   
   // Device found, call its function
   if( ( res = pinst->pdev->p_open_r( r, actname, flags, mode, pinst->pdata ) ) < 0 )
+  {
+    if( r->_errno == ENOENT && ( flags & ( O_ACCMODE | O_CREAT | O_TRUNC ) ) == O_RDONLY )
+      dm_pcache_add_missing( devid, actname );
     return res;
+  }
   return DM_MAKE_DESC( devid, res );
 }
 
@@ -201,6 +210,7 @@ int _mkdir_r( struct _reent *r, const char *path, mkdir_mode_t mode )
     r->_errno = EPERM;
     return -1;
   }
+  dm_pcache_invalidate( devid );
 
   // Device found, call its function
   return pinst->pdev->p_mkdir_r( r, actname - 1, mode, pinst->pdata );
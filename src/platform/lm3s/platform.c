@@ -1085,12 +1085,15 @@ static int eth_timer_fired;
 
 void platform_eth_send_packet( const void* src, u32 size )
 {
-  MAP_EthernetPacketPut( ETH_BASE, uip_buf, uip_len );
+  MAP_EthernetPacketPut( ETH_BASE, ( unsigned char* )src, size );
 }
 
 u32 platform_eth_get_packet_nb( void* buf, u32 maxlen )
 {
-  return MAP_EthernetPacketGetNonBlocking( ETH_BASE, uip_buf, sizeof( uip_buf ) );
+  long len = MAP_EthernetPacketGetNonBlocking( ETH_BASE, buf, maxlen );
+
+  // A negative result means the frame didn't fit in the buffer (and was dropped)
+  return len > 0 ? ( u32 )len : 0;
 }
 
 void platform_eth_force_interrupt()
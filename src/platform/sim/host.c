@@ -8,6 +8,13 @@
 #define __NR_close            6
 #define __NR_gettimeofday     78
 #define __NR_lseek            19
+#define __NR_getpid           20
+#define __NR_kill             37
+#define __NR_fcntl            55
+#define __NR_setitimer        104
+#define __NR_rt_sigreturn     173
+#define __NR_rt_sigaction     174
+#define __NR_rt_sigprocmask   175
 
 int host_errno = 0;
 
@@ -19,6 +26,16 @@ int host_errno = 0;
 	return (type) (res); \
 } while(0)
 
+#define _syscall0(type,name) \
+type host_##name(void) \
+{ \
+long __res; \
+__asm__ volatile ("int $0x80" \
+        : "=a" (__res) \
+        : "0" (__NR_##name)); \
+__syscall_return(type,__res); \
+}
+
 #define _syscall1(type,name,type1,arg1) \
 type host_##name(type1 arg1) \
 { \
@@ -51,6 +68,17 @@ __asm__ volatile ("int $0x80" \
 __syscall_return(type,__res); \
 }
 
+#define _syscall4(type,name,type1,arg1,type2,arg2,type3,arg3,type4,arg4) \
+type host_##name(type1 arg1,type2 arg2,type3 arg3,type4 arg4) \
+{ \
+long __res; \
+__asm__ volatile ("int $0x80" \
+        : "=a" (__res) \
+        : "0" (__NR_##name),"b" ((long)(arg1)),"c" ((long)(arg2)), \
+                  "d" ((long)(arg3)),"S" ((long)(arg4))); \
+__syscall_return(type,__res); \
+}
+
 #define _syscall6(type,name,type1,arg1,type2,arg2,type3,arg3,type4,arg4, \
           type5,arg5,type6,arg6) \
 type host_##name (type1 arg1,type2 arg2,type3 arg3,type4 arg4,type5 arg5,type6 arg6) \
@@ -72,4 +100,16 @@ _syscall1(void, exit, int, status);
 _syscall1(int, close, int, status);
 _syscall2(int, gettimeofday, struct timeval*, tv, struct timezone*, tz);
 _syscall3(long, lseek, int, fd, long, offset, int, whence );
+_syscall3(int, fcntl, int, fd, int, cmd, long, arg);
+_syscall0(int, getpid);
+_syscall2(int, kill, int, pid, int, sig);
+_syscall3(int, setitimer, int, which, const struct host_itimerval*, value, struct host_itimerval*, ovalue);
+_syscall4(int, rt_sigaction, int, sig, const struct host_sigaction*, act, struct host_sigaction*, oact, size_t, sigsetsize);
+_syscall4(int, rt_sigprocmask, int, how, const host_sigset_t*, set, host_sigset_t*, oset, size_t, sigsetsize);
 
+// Signal handler return trampoline (used as "sa_restorer")
+__asm__( ".text\n"
+         ".globl host_sigreturn\n"
+         "host_sigreturn:\n"
+         "  movl $173, %eax\n"
+         "  int $0x80\n" );
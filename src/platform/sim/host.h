@@ -31,9 +31,51 @@ long host_lseek( int fd, long pos, int whence );
 
 #define MAP_FAILED (void *)(-1)
 
+// Flags for "fcntl"
+#define HOST_F_GETFL      3
+#define HOST_F_SETFL      4
+#define HOST_F_SETOWN     8
+#define HOST_O_NONBLOCK   04000
+#define HOST_O_ASYNC      020000
+
+// Signals
+#define HOST_SIGALRM      14
+#define HOST_SIGIO        29
+#define HOST_SIG_BLOCK    0
+#define HOST_SIG_UNBLOCK  1
+#define HOST_SA_RESTORER  0x04000000
+#define HOST_SA_RESTART   0x10000000
+#define HOST_ITIMER_REAL  0
+
+typedef struct
+{
+  unsigned long sig[ 2 ];
+} host_sigset_t;
+
+struct host_sigaction
+{
+  void ( *handler )( int );
+  unsigned long flags;
+  void ( *restorer )( void );
+  host_sigset_t mask;
+};
+
+struct host_itimerval
+{
+  struct timeval interval;
+  struct timeval value;
+};
+
 void *host_mmap2(void *addr, size_t length, int prot, int flags, int fd, off_t pgoffset);
 int host_gettimeofday( struct timeval *tv, struct timezone *tz );
 void host_exit(int status);
+int host_fcntl( int fd, int cmd, long arg );
+int host_getpid( void );
+int host_kill( int pid, int sig );
+int host_setitimer( int which, const struct host_itimerval *value, struct host_itimerval *ovalue );
+int host_rt_sigaction( int sig, const struct host_sigaction *act, struct host_sigaction *oact, size_t sigsetsize );
+int host_rt_sigprocmask( int how, const host_sigset_t *set, host_sigset_t *oset, size_t sigsetsize );
+void host_sigreturn( void );
 
 #endif // _HOST_H
 
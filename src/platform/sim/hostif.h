@@ -38,5 +38,21 @@ long hostif_lseek( int fd, long pos, int whence );
 // Get time
 s64 hostif_gettime();
 
+// Enable/disable the simulated interrupts, returns 1 if they were enabled before
+int hostif_int_enable( int enable );
+
+// Trigger the network interrupt
+void hostif_int_trigger();
+
+// Initialize the network interface and the interrupts (network and periodic
+// timer) that call 'handler'; returns -1 if no network interface is available
+int hostif_eth_init( void ( *handler )( int ) );
+
+// Send an Ethernet frame
+int hostif_eth_send( const void *buf, unsigned size );
+
+// Receive an Ethernet frame (non-blocking), returns its size or 0 if no frame is available
+unsigned hostif_eth_recv( void *buf, unsigned maxsize );
+
 #endif // __HOSTIO_H__
 
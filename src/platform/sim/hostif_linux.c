@@ -78,3 +78,64 @@ s64 hostif_gettime()
   return ( s64 )tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+// ****************************************************************************
+// Simulated network interface
+// Ethernet frames are exchanged with the host (simeth) over a datagram socket
+// inherited on HOSTIF_ETH_FD. The interrupts are implemented with signals:
+// SIGIO when a frame is received and SIGALRM for the periodic timer.
+
+#define HOSTIF_ETH_FD         3
+#define HOSTIF_TICK_US        10000
+
+static const host_sigset_t hostif_int_mask = { { ( 1UL << ( HOST_SIGALRM - 1 ) ) | ( 1UL << ( HOST_SIGIO - 1 ) ), 0 } };
+
+int hostif_int_enable( int enable )
+{
+  host_sigset_t old;
+
+  host_rt_sigprocmask( enable ? HOST_SIG_UNBLOCK : HOST_SIG_BLOCK, &hostif_int_mask, &old, sizeof( host_sigset_t ) );
+  return ( old.sig[ 0 ] & hostif_int_mask.sig[ 0 ] ) == 0;
+}
+
+void hostif_int_trigger()
+{
+  host_kill( host_getpid(), HOST_SIGIO );
+}
+
+int hostif_eth_init( void ( *handler )( int ) )
+{
+  struct host_sigaction sa;
+  struct host_itimerval it;
+  int flags;
+
+  if( ( flags = host_fcntl( HOSTIF_ETH_FD, HOST_F_GETFL, 0 ) ) == -1 )
+    return -1;
+  // Install the handler (reads from the console are restarted after it runs)
+  memset( &sa, 0, sizeof( sa ) );
+  sa.handler = handler;
+  sa.flags = HOST_SA_RESTART | HOST_SA_RESTORER;
+  sa.restorer = host_sigreturn;
+  sa.mask = hostif_int_mask;
+  host_rt_sigaction( HOST_SIGIO, &sa, NULL, sizeof( host_sigset_t ) );
+  host_rt_sigaction( HOST_SIGALRM, &sa, NULL, sizeof( host_sigset_t ) );
+  // Get SIGIO when a frame is received
+  host_fcntl( HOSTIF_ETH_FD, HOST_F_SETOWN, host_getpid() );
+  host_fcntl( HOSTIF_ETH_FD, HOST_F_SETFL, flags | HOST_O_NONBLOCK | HOST_O_ASYNC );
+  // Start the periodic timer
+  it.interval.tv_sec = it.value.tv_sec = 0;
+  it.interval.tv_usec = it.value.tv_usec = HOSTIF_TICK_US;
+  host_setitimer( HOST_ITIMER_REAL, &it, NULL );
+  return 0;
+}
+
+int hostif_eth_send( const void *buf, unsigned size )
+{
+  return ( int )host_write( HOSTIF_ETH_FD, buf, ( size_t )size );
+}
+
+unsigned hostif_eth_recv( void *buf, unsigned maxsize )
+{
+  ssize_t res = host_read( HOSTIF_ETH_FD, buf, ( size_t )maxsize );
+
+  return res > 0 ? ( unsigned )res : 0;
+}
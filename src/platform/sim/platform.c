@@ -14,6 +14,12 @@
 // Platform specific includes
 #include "hostif.h"
 
+#ifdef BUILD_UIP
+#include "elua_uip.h"
+#include "uip_arp.h"
+#include "uip-conf.h"
+#endif
+
 // ****************************************************************************
 // Terminal support code
 
@@ -82,6 +88,72 @@ static int kb_read( timer_data_type to )
   }
 }
 
+// ****************************************************************************
+// Simulated Ethernet (see hostif_eth_init)
+
+#ifdef BUILD_UIP
+
+static int sim_eth_enabled;
+static int sim_eth_rx_pending;
+static s64 sim_eth_last_time;
+
+// Called on the network and timer "interrupts"
+static void sim_eth_int_handler( int sig )
+{
+  // Process all the frames received so far (with ELUA_NET_DEFERRED the main
+  // loop stops reading when its frame pool is full)
+  do
+  {
+    sim_eth_rx_pending = 0;
+    elua_uip_mainloop();
+  } while( sim_eth_rx_pending );
+}
+
+static void sim_eth_init()
+{
+  // Locally administered MAC address
+  static struct uip_eth_addr sim_eth_addr = { { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 } };
+  int old_status;
+
+  old_status = platform_cpu_set_global_interrupts( PLATFORM_CPU_DISABLE );
+  if( hostif_eth_init( sim_eth_int_handler ) == 0 )
+  {
+    sim_eth_enabled = 1;
+    sim_eth_last_time = hostif_gettime();
+    elua_uip_init( &sim_eth_addr );
+  }
+  platform_cpu_set_global_interrupts( old_status );
+}
+
+void platform_eth_send_packet( const void* src, u32 size )
+{
+  hostif_eth_send( src, size );
+}
+
+u32 platform_eth_get_packet_nb( void* buf, u32 maxlen )
+{
+  u32 size = hostif_eth_recv( buf, maxlen );
+
+  sim_eth_rx_pending = size > 0;
+  return size;
+}
+
+void platform_eth_force_interrupt()
+{
+  if( sim_eth_enabled )
+    hostif_int_trigger();
+}
+
+u32 platform_eth_get_elapsed_time()
+{
+  u32 ms = ( u32 )( ( hostif_gettime() - sim_eth_last_time ) / 1000 );
+
+  sim_eth_last_time += ( s64 )ms * 1000;
+  return ms;
+}
+
+#endif // #ifdef BUILD_UIP
+
 // ****************************************************************************
 // Platform initialization (low-level and full)
 
@@ -115,6 +187,10 @@ int platform_init()
 
   term_clrscr();
   term_gotoxy( 1, 1 );
+
+#ifdef BUILD_UIP
+  sim_eth_init();
+#endif
  
   // All done
   return PLATFORM_OK;
@@ -160,16 +236,18 @@ timer_data_type platform_timer_read_sys()
 }
 
 // ****************************************************************************
-// "Dummy" CPU functions
-
+// CPU functions (the interrupts are simulated with host signals)
 
 int platform_cpu_set_global_interrupts( int status )
 {
-  return 0;
+  return hostif_int_enable( status == PLATFORM_CPU_ENABLE ) ? PLATFORM_CPU_ENABLE : PLATFORM_CPU_DISABLE;
 }
 
 int platform_cpu_get_global_interrupts()
 {
-  return 0;
+  int status = hostif_int_enable( PLATFORM_CPU_DISABLE );
+
+  hostif_int_enable( status );
+  return status ? PLATFORM_CPU_ENABLE : PLATFORM_CPU_DISABLE;
 }
 
@@ -17,7 +17,12 @@
 #define BUILD_TERM
 //#define BUILD_RFS
 #define BUILD_WOFS
+#define WOFS_ENABLE_COMPACTION
 #define BUILD_MMCFS
+// Two simulated SD cards ('sdcard.img' as /mmc and 'sdcard1.img' as /mmc1)
+#define MMCFS_NUM_CARDS 2
+#define MMCFS_MAX_FDS   8
+#define BUILD_UIP
 
 #define TERM_LINES    25
 #define TERM_COLS     80
@@ -27,12 +32,19 @@
 // *****************************************************************************
 // Auxiliary libraries that will be compiled for this platform
 
+#ifdef BUILD_UIP
+#define NETLINE  _ROM( AUXLIB_NET, luaopen_net, net_map )
+#else
+#define NETLINE
+#endif
+
 #define LUA_PLATFORM_LIBS_ROM\
   _ROM( AUXLIB_PD, luaopen_pd, pd_map )\
   _ROM( LUA_MATHLIBNAME, luaopen_math, math_map )\
   _ROM( AUXLIB_TERM, luaopen_term, term_map )\
   _ROM( AUXLIB_ELUA, luaopen_elua, elua_map )\
   _ROM( AUXLIB_TMR, luaopen_tmr, tmr_map )\
+  NETLINE\
 
 // Bogus defines for common.c
 #define CON_UART_ID           0
@@ -41,6 +53,28 @@
 // *****************************************************************************
 // Configuration data
 
+// Static TCP/IP configuration (the network is available only when the
+// simulator is started by simeth, which bridges it to a host TAP interface)
+#define ELUA_CONF_IPADDR0     192
+#define ELUA_CONF_IPADDR1     168
+#define ELUA_CONF_IPADDR2     10
+#define ELUA_CONF_IPADDR3     2
+
+#define ELUA_CONF_NETMASK0    255
+#define ELUA_CONF_NETMASK1    255
+#define ELUA_CONF_NETMASK2    255
+#define ELUA_CONF_NETMASK3    0
+
+#define ELUA_CONF_DEFGW0      192
+#define ELUA_CONF_DEFGW1      168
+#define ELUA_CONF_DEFGW2      10
+#define ELUA_CONF_DEFGW3      1
+
+#define ELUA_CONF_DNS0        192
+#define ELUA_CONF_DNS1        168
+#define ELUA_CONF_DNS2        10
+#define ELUA_CONF_DNS3        1
+
 // Virtual timers (0 if not used)
 #define VTMR_NUM_TIMERS       0
 
@@ -163,6 +163,12 @@ typedef struct dhcpc_state uip_udp_appstate_t;
 #define UIP_UDP_APPCALL             elua_uip_udp_appcall
 #endif
 
+//
+// UIP_CONF_APPWINDOW: the receive window advertised for a connection
+// (the free space in its eLua receive buffer)
+//
+#define UIP_CONF_APPWINDOW          elua_uip_rx_window
+
 #define CLOCK_SECOND                1000000UL
 
 #endif // __UIP_CONF_H_
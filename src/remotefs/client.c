@@ -28,14 +28,87 @@ static p_rfsc_send rfsc_send;
 static p_rfsc_recv rfsc_recv;
 static timer_data_type rfsc_timeout;
 
+// Datagram mode data: requests are built in the TX buffer and responses are 
+// received in the RX buffer (so a retransmission always finds the request
+// intact), then the two are swapped. rfsc_buffer always points after the
+// sequence header of the TX buffer.
+static u8 *rfsc_dgram_tx;
+static u8 *rfsc_dgram_rx;
+static u32 rfsc_dgram_size;
+static u32 rfsc_seq;
+static ELUARPC_RTO_DATA rfsc_rto;
+
 // ****************************************************************************
 // Client helpers
 
+// Datagram version: the request is sent with a sequence header and 
+// retransmitted with an adaptive timeout until the response with the same
+// sequence number arrives. Stale responses (to earlier retransmissions) are
+// discarded.
+static int rfsch_dgram_send_request_read_response()
+{
+  u16 temp16, reqsize;
+  u32 readbytes, seq;
+  unsigned retries = 0;
+  timer_data_type start;
+  u8 *ptemp;
+
+  if( eluarpc_get_packet_size( rfsc_buffer, &reqsize ) == ELUARPC_ERR )
+  {
+    RFSDEBUG( "[RFS] get packet size error\n" );
+    return CLIENT_ERR;
+  }
+  // Start from an unpredictable sequence number, so that the first requests
+  // after a reset are not taken by the server as retransmissions of the last
+  // request it executed before the reset
+  if( rfsc_seq == 0 )
+    rfsc_seq = ( u32 )platform_timer_read_sys();
+  eluarpc_write_seq( rfsc_dgram_tx, ++ rfsc_seq );
+  reqsize += ELUARPC_SEQ_HEADER_SIZE;
+  while( 1 )
+  {
+    start = platform_timer_read_sys();
+    if( rfsc_send( rfsc_dgram_tx, reqsize ) != reqsize )
+    {
+      RFSDEBUG( "[RFS] rfsc_send error\n" );
+      return CLIENT_ERR;
+    }
+    while( 1 )
+    {
+      readbytes = rfsc_recv( rfsc_dgram_rx, rfsc_dgram_size, rfsc_rto.rto );
+      if( readbytes == 0 )
+        break;
+      if( readbytes < ELUARPC_SEQ_HEADER_SIZE + ELUARPC_START_OFFSET || eluarpc_read_seq( rfsc_dgram_rx, &seq ) == ELUARPC_ERR || seq != rfsc_seq )
+        continue;
+      if( eluarpc_get_packet_size( rfsc_dgram_rx + ELUARPC_SEQ_HEADER_SIZE, &temp16 ) == ELUARPC_ERR || temp16 != readbytes - ELUARPC_SEQ_HEADER_SIZE )
+        continue;
+      // Karn's algorithm: only sample the RTT of requests sent once
+      if( retries == 0 )
+        eluarpc_rto_sample( &rfsc_rto, ( u32 )platform_timer_get_diff_crt( PLATFORM_TIMER_SYS_ID, start ) );
+      ptemp = rfsc_dgram_tx;
+      rfsc_dgram_tx = rfsc_dgram_rx;
+      rfsc_dgram_rx = ptemp;
+      rfsc_buffer = rfsc_dgram_tx + ELUARPC_SEQ_HEADER_SIZE;
+      return CLIENT_OK;
+    }
+    // Timeout: back off and retransmit
+    if( ++ retries > ELUARPC_MAX_RETRIES )
+    {
+      RFSDEBUG( "[RFS] no response after %u retries\n", retries - 1 );
+      return CLIENT_ERR;
+    }
+    eluarpc_rto_backoff( &rfsc_rto );
+  }
+}
+
 static int rfsch_send_request_read_response()
 {
   u16 temp16;
   u32 readbytes;
 
+  if( rfsc_dgram_tx )
+    return rfsch_dgram_send_request_read_response();
+
 #ifndef ELUA_CPU_LINUX
   // Empty receive buffer
   while( rfsc_recv( rfsc_buffer, 1, 0 ) == 1 );
@@ -82,6 +155,22 @@ void rfsc_setup( u8 *pbuf, p_rfsc_send rfsc_send_func, p_rfsc_recv rfsc_recv_fun
   rfsc_send = rfsc_send_func;
   rfsc_recv = rfsc_recv_func;
   rfsc_timeout = timeout;
+  rfsc_dgram_tx = rfsc_dgram_rx = NULL;
+}
+
+// Setup for an unreliable datagram transport. Both buffers must be 'size' 
+// bytes long; packets are built ELUARPC_SEQ_HEADER_SIZE bytes into them.
+// The receive function must return a single datagram per call (0 on timeout).
+void rfsc_setup_datagram( u8 *ptxbuf, u8 *prxbuf, u32 size, p_rfsc_send rfsc_send_func, p_rfsc_recv rfsc_recv_func )
+{
+  rfsc_dgram_tx = ptxbuf;
+  rfsc_dgram_rx = prxbuf;
+  rfsc_dgram_size = size;
+  rfsc_buffer = ptxbuf + ELUARPC_SEQ_HEADER_SIZE;
+  rfsc_send = rfsc_send_func;
+  rfsc_recv = rfsc_recv_func;
+  rfsc_seq = 0;
+  eluarpc_rto_init( &rfsc_rto );
 }
 
 void rfsc_set_timeout( timer_data_type timeout )
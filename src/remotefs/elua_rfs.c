@@ -9,6 +9,7 @@
 #include "client.h"
 #include "sermux.h"
 #include "buf.h"
+#include "elua_net.h"
 #include <fcntl.h>
 #ifdef ELUA_SIMULATOR
 #include "hostif.h"
@@ -31,7 +32,15 @@
 // size of the serial buffer). A complete packet must fit in RFS_BUFFER_SIZE
 // bytes. Computed this to be large enough for a WRITE request.
 #define RFS_REAL_BUFFER_SIZE      ( ( 1 << RFS_BUFFER_SIZE ) - ELUARPC_WRITE_REQUEST_EXTRA )
-static u8 rfs_buffer[ 1 << RFS_BUFFER_SIZE ];
+#ifdef RFS_UDP_PORT
+// UDP datagrams have a sequence header before the packet (see rfsc_setup_datagram)
+// and the responses are received in a second buffer
+#define RFS_BUFFER_LEN            ( ELUARPC_SEQ_HEADER_SIZE + ( 1 << RFS_BUFFER_SIZE ) )
+static u8 rfs_rx_buffer[ RFS_BUFFER_LEN ];
+#else
+#define RFS_BUFFER_LEN            ( 1 << RFS_BUFFER_SIZE )
+#endif
+static u8 rfs_buffer[ RFS_BUFFER_LEN ];
 
 #ifdef ELUA_SIMULATOR
 static int rfs_read_fd, rfs_write_fd;
@@ -126,7 +135,7 @@ static int rfs_closedir_r( struct _reent *r, void *d, void *pdata )
 // ****************************************************************************
 // Remote FS serial transport functions
 
-#ifdef RFS_UART_ID
+#if defined( RFS_UART_ID ) && !defined( RFS_UDP_PORT )
 static u32 rfs_send( const u8 *p, u32 size )
 {
   unsigned i;
@@ -156,7 +165,7 @@ static u32 rfs_recv( u8 *p, u32 size, timer_data_type timeout )
 // ****************************************************************************
 // Remote FS pipe transport functions (used only in simulator)
 
-#ifdef ELUA_CPU_LINUX
+#if defined( ELUA_CPU_LINUX ) && !defined( RFS_UDP_PORT )
 static u32 rfs_send( const u8 *p, u32 size )
 {
   return ( u32 )hostif_write( rfs_write_fd, p, size );
@@ -169,6 +178,35 @@ static u32 rfs_recv( u8 *p, u32 size, timer_data_type timeout )
 }
 #endif
 
+// ****************************************************************************
+// Remote FS UDP transport functions (datagram mode with retransmissions)
+
+#ifdef RFS_UDP_PORT
+static int rfs_udp_socket = -1;
+static elua_net_ip rfs_udp_server;
+
+static u32 rfs_send( const u8 *p, u32 size )
+{
+  elua_net_size res = elua_net_sendto( rfs_udp_socket, p, ( elua_net_size )size, rfs_udp_server, RFS_UDP_PORT );
+
+  return res < 0 ? 0 : ( u32 )res;
+}
+
+// Return a single datagram from the RFS server (0 on timeout). Datagrams from
+// other hosts are ignored (and restart the timeout).
+static u32 rfs_recv( u8 *p, u32 size, timer_data_type timeout )
+{
+  elua_net_ip from;
+  u16 port;
+  elua_net_size res;
+
+  while( ( res = elua_net_recvfrom( rfs_udp_socket, p, ( elua_net_size )size, &from, &port, RFS_TIMER_ID, timeout ) ) > 0 )
+    if( from.ipaddr == rfs_udp_server.ipaddr && port == RFS_UDP_PORT )
+      return ( u32 )res;
+  return 0;
+}
+#endif
+
 // Our remote file system device descriptor structure
 static const DM_DEVICE rfs_device = 
 {
@@ -181,12 +219,26 @@ static const DM_DEVICE rfs_device =
   rfs_readdir_r,        // readdir
   rfs_closedir_r,       // closedir
   NULL,                 // getaddr
-  NULL                  // mkdir
+  NULL,                 // mkdir
+  NULL,                 // ioctl
+  0                     // flags
 };
 
 int remotefs_init()
 {
-#ifdef ELUA_CPU_LINUX 
+#if defined( RFS_UDP_PORT )
+  rfs_udp_server.ipbytes[ 0 ] = RFS_UDP_IPADDR0;
+  rfs_udp_server.ipbytes[ 1 ] = RFS_UDP_IPADDR1;
+  rfs_udp_server.ipbytes[ 2 ] = RFS_UDP_IPADDR2;
+  rfs_udp_server.ipbytes[ 3 ] = RFS_UDP_IPADDR3;
+  // Room for a response and a stale copy of it (from a retransmission)
+  if( ( rfs_udp_socket = elua_net_socket( ELUA_NET_SOCK_DGRAM, 2 * RFS_BUFFER_LEN ) ) == -1 )
+  {
+    printf( "WARNING: unable to create the RFS UDP socket\n" );
+    return DM_ERR_INIT;
+  }
+  rfsc_setup_datagram( rfs_buffer, rfs_rx_buffer, RFS_BUFFER_LEN, rfs_send, rfs_recv );
+#elif defined( ELUA_CPU_LINUX )
   // Open our read/write pipes
   rfs_read_fd = hostif_open( RFS_SRV_WRITE_PIPE, O_RDONLY, 0 );
   rfs_write_fd = hostif_open( RFS_SRV_READ_PIPE, O_WRONLY, 0 );
@@ -205,7 +257,9 @@ int remotefs_init()
     return DM_ERR_INIT;
   } 
 #endif
+#ifndef RFS_UDP_PORT
   rfsc_setup( rfs_buffer, rfs_send, rfs_recv, RFS_TIMEOUT );
+#endif
   return dm_register( "/rfs", NULL, &rfs_device );
 }
 
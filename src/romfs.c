@@ -2,6 +2,8 @@
 #include "romfs.h"
 #include "type.h"
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <errno.h>
 #include "devman.h"
 #include "romfiles.h"
@@ -15,33 +17,122 @@
 #include "platform_conf.h"
 #if defined( BUILD_ROMFS ) || defined( BUILD_WOFS )
 
-#define TOTAL_MAX_FDS   8
+// Maximum number of files opened at the same time on all ROMFS/WOFS instances
+#ifndef ROMFS_MAX_FDS
+#define ROMFS_MAX_FDS   8
+#endif
 // DO NOT CHANGE THE ROMFS ALIGNMENT.
 // UNLESS YOU _LIKE_ TO WATCH THE WORLD BURN.
 #define ROMFS_ALIGN     4
 
 #define fsmin( x , y ) ( ( x ) < ( y ) ? ( x ) : ( y ) )
 
-static FD fd_table[ TOTAL_MAX_FDS ];
+static FD fd_table[ ROMFS_MAX_FDS ];
 static int romfs_num_fd;
 #ifdef ELUA_CPU_LINUX
 static int wofs_sim_fd;
+static int wofs_sim_cut;
+static u8 wofs_sim_cut_flags;
 #define WOFS_FNAME    "/tmp/wofs.dat"
+#define WOFS_CUT_FNAME  "/tmp/wofs.cut"
 #define WOFS_SIZE     (256 * 1024)
+#define WOFS_SIM_SECTOR_SIZE  4096
 #endif
 
 #define WOFS_END_MARKER_CHAR  0xFF
 #define WOFS_DEL_FIELD_SIZE   ( ROMFS_ALIGN )
 #define WOFS_FILE_DELETED     0xAA
+// A file left opened in write mode (power failure) is marked with this value
+// instead, its bits are a subset of WOFS_FILE_DELETED (see WOFS_EXTENT_NONE)
+#define WOFS_FILE_RECOVERED   0x2A
 
 // Length of the 'file size' field for both ROMFS/WOFS
 #define ROMFS_SIZE_LEN        4
 
+// Several WOFS files can be opened in write mode at the same time. Only the
+// file created last can grow up to the end of WOFS, the others are limited to
+// the space reserved for them when the next file is created: WOFS_WRITE_EXTENT
+// more bytes. The unused part of this space is marked as a deleted file (a
+// "filler" with an empty name) when the file is closed.
+#ifndef WOFS_WRITE_EXTENT
+#define WOFS_WRITE_EXTENT     2048
+#endif
+#if ( WOFS_WRITE_EXTENT % ROMFS_ALIGN ) != 0
+#error "WOFS_WRITE_EXTENT must be a multiple of ROMFS_ALIGN"
+#endif
+#define WOFS_FILLER_SIZE      ( ROMFS_ALIGN + WOFS_DEL_FIELD_SIZE + ROMFS_SIZE_LEN )
+
+// A file opened in write mode doesn't have a size until it's closed. When its
+// space is limited by a newer file, the end of this space is recorded in the
+// last 3 bytes of its 'deleted' field (in ROMFS_ALIGN units from the field), so
+// the files after it can still be found if it's never closed (power failure).
+// Such files are marked with WOFS_FILE_RECOVERED when WOFS is mounted and their
+// end is recorded in the same way, since a partially written size can't be
+// fixed. The extent of the other files is ignored (it's not updated when the
+// files are moved by the compaction).
+#define WOFS_EXTENT_NONE      0xFFFFFF
+#if WOFS_DEL_FIELD_SIZE < 4
+#error "The WOFS 'deleted' field must be at least 4 bytes long"
+#endif
+#define WOFS_NO_LIMIT         0xFFFFFFFF
+
+// Maximum size of a file header (name, alignment, deleted flag and size)
+#define ROMFS_MAX_HDR_SIZE    ( DM_MAX_FNAME_LENGTH + 1 + ROMFS_ALIGN - 1 + WOFS_DEL_FIELD_SIZE + ROMFS_SIZE_LEN )
+
+// Directory index (see romfs.h)
+#define ROMFS_INDEX_MAGIC       "\0IDX"
+#define ROMFS_INDEX_MAGIC_ZT    'Z'     // last char of the magic if the file data is zero terminated
+#define ROMFS_INDEX_HDR_SIZE    8
+#define ROMFS_INDEX_ENTRY_SIZE  8
+// The WOFS index grows by this many entries at a time
+#define WOFS_INDEX_GROW         16
+
+// Block cache for the FS instances that are not directly accessible by the CPU
+// (enabled by default only for the simulator's WOFS)
+#ifndef ROMFS_CACHE_BLOCKS
+#if defined( ELUA_CPU_LINUX ) && defined( BUILD_WOFS )
+#define ROMFS_CACHE_BLOCKS      4
+#else
+#define ROMFS_CACHE_BLOCKS      0
+#endif
+#endif
+#ifndef ROMFS_CACHE_BLOCK_SIZE
+#define ROMFS_CACHE_BLOCK_SIZE  512
+#endif
+#if ( ROMFS_CACHE_BLOCK_SIZE & ( ROMFS_CACHE_BLOCK_SIZE - 1 ) ) != 0
+#error "ROMFS_CACHE_BLOCK_SIZE must be a power of 2"
+#endif
+
+// Size of the write buffer of a file opened in write mode on WOFS. Small writes
+// are coalesced in this buffer, which is written to the FS when it's full (or
+// when the file is closed). Must be a power of 2 and a multiple of the flash
+// write unit.
+#ifndef WOFS_WRITE_BUF_SIZE
+#if defined( INTERNAL_FLASH_WRITE_UNIT_SIZE ) && INTERNAL_FLASH_WRITE_UNIT_SIZE > 32
+#define WOFS_WRITE_BUF_SIZE         INTERNAL_FLASH_WRITE_UNIT_SIZE
+#else
+#define WOFS_WRITE_BUF_SIZE         32
+#endif
+#endif
+#if ( WOFS_WRITE_BUF_SIZE & ( WOFS_WRITE_BUF_SIZE - 1 ) ) != 0
+#error "WOFS_WRITE_BUF_SIZE must be a power of 2"
+#endif
+#define WOFS_WRITE_BUF_MASK         ( WOFS_WRITE_BUF_SIZE - 1 )
+
+// WOFS write statistics: bytes written to files and number of write (program)
+// operations sent to the FS
+static u32 wofs_stat_written, wofs_stat_program;
+
+// WOFS compaction runs when a file is created and less than this percent of WOFS is free
+#ifndef WOFS_COMPACT_FREE_PERCENT
+#define WOFS_COMPACT_FREE_PERCENT   10
+#endif
+
 static int romfs_find_empty_fd()
 {
   int i;
   
-  for( i = 0; i < TOTAL_MAX_FDS; i ++ )
+  for( i = 0; i < ROMFS_MAX_FDS; i ++ )
     if( fd_table[ i ].baseaddr == 0xFFFFFFFF &&
         fd_table[ i ].offset == 0xFFFFFFFF &&
         fd_table[ i ].size == 0xFFFFFFFF )
@@ -55,13 +146,106 @@ static void romfs_close_fd( int fd )
   fd_table[ fd ].flags = 0;
 }
 
+// ****************************************************************************
+// Block cache for non-direct FS instances
+
+#if ROMFS_CACHE_BLOCKS > 0
+typedef struct
+{
+  const FSDATA *pfs;
+  u32 addr;
+  u8 data[ ROMFS_CACHE_BLOCK_SIZE ];
+} ROMFS_CACHE_BLOCK;
+
+static ROMFS_CACHE_BLOCK romfs_cache[ ROMFS_CACHE_BLOCKS ];
+static unsigned romfs_cache_next;
+
+// Return the cached block that contains 'addr', reading it from the FS if needed
+static const u8* romfsh_cache_get( u32 addr, const FSDATA *pfs )
+{
+  ROMFS_CACHE_BLOCK *pb;
+  unsigned i;
+
+  addr &= ~( ROMFS_CACHE_BLOCK_SIZE - 1 );
+  for( i = 0; i < ROMFS_CACHE_BLOCKS; i ++ )
+    if( romfs_cache[ i ].pfs == pfs && romfs_cache[ i ].addr == addr )
+      return romfs_cache[ i ].data;
+  // Not cached, replace the blocks in round robin order
+  pb = romfs_cache + romfs_cache_next;
+  romfs_cache_next = ( romfs_cache_next + 1 ) % ROMFS_CACHE_BLOCKS;
+  pfs->readf( pb->data, addr, fsmin( ROMFS_CACHE_BLOCK_SIZE, pfs->max_size - addr ), pfs );
+  pb->pfs = pfs;
+  pb->addr = addr;
+  return pb->data;
+}
+
+// Drop all the cached blocks of 'pfs'
+static void romfsh_cache_invalidate( const FSDATA *pfs )
+{
+  unsigned i;
+
+  for( i = 0; i < ROMFS_CACHE_BLOCKS; i ++ )
+    if( romfs_cache[ i ].pfs == pfs )
+      romfs_cache[ i ].pfs = NULL;
+}
+#else // #if ROMFS_CACHE_BLOCKS > 0
+#define romfsh_cache_invalidate( pfs )
+#endif // #if ROMFS_CACHE_BLOCKS > 0
+
+// Helper function: read data from a non-direct FS
+static u32 romfsh_read( void *to, u32 addr, u32 size, const FSDATA *pfs )
+{
+#if ROMFS_CACHE_BLOCKS > 0
+  u8 *pto = ( u8* )to;
+  u32 left = size, chunk;
+
+  // Large reads don't go through the cache
+  if( size >= ROMFS_CACHE_BLOCK_SIZE )
+    return pfs->readf( to, addr, size, pfs );
+  while( left > 0 )
+  {
+    chunk = fsmin( left, ROMFS_CACHE_BLOCK_SIZE - ( addr & ( ROMFS_CACHE_BLOCK_SIZE - 1 ) ) );
+    memcpy( pto, romfsh_cache_get( addr, pfs ) + ( addr & ( ROMFS_CACHE_BLOCK_SIZE - 1 ) ), chunk );
+    pto += chunk;
+    addr += chunk;
+    left -= chunk;
+  }
+  return size;
+#else
+  return pfs->readf( to, addr, size, pfs );
+#endif
+}
+
+// Helper function: write data to the FS, keeping the cached blocks up to date
+static u32 romfsh_write( const void *from, u32 toaddr, u32 size, const FSDATA *pfs )
+{
+#if ROMFS_CACHE_BLOCKS > 0
+  ROMFS_CACHE_BLOCK *pb;
+  u32 start, end;
+  unsigned i;
+
+  for( i = 0, pb = romfs_cache; i < ROMFS_CACHE_BLOCKS; i ++, pb ++ )
+  {
+    if( pb->pfs != pfs )
+      continue;
+    start = toaddr > pb->addr ? toaddr : pb->addr;
+    end = fsmin( toaddr + size, pb->addr + ROMFS_CACHE_BLOCK_SIZE );
+    // Programming can only clear bits, like the flash does
+    for( ; start < end; start ++ )
+      pb->data[ start - pb->addr ] &= ( ( const u8* )from )[ start - toaddr ];
+  }
+#endif
+  wofs_stat_program ++;
+  return pfs->writef( from, toaddr, size, pfs );
+}
+
 // Helper function: read a byte from the FS
 static u8 romfsh_read8( u32 addr, const FSDATA *pfs )
 {
   u8 temp;
   if( pfs->flags & ROMFS_FS_FLAG_DIRECT )
     return pfs->pbase[ addr ];
-  pfs->readf( &temp, addr, 1, pfs );
+  romfsh_read( &temp, addr, 1, pfs );
   return temp;
 }
 
@@ -71,67 +255,767 @@ static int romfsh_is_wofs( const FSDATA* pfs )
   return ( pfs->flags & ROMFS_FS_FLAG_WO ) != 0;
 }
 
-// Open the given file, returning one of FS_FILE_NOT_FOUND, FS_FILE_ALREADY_OPENED
-// or FS_FILE_OK
-static u8 romfs_open_file( const char* fname, FD* pfd, FSDATA *pfs, u32 *plast, u32 *pnameaddr )
+// ****************************************************************************
+// WOFS write buffer
+// The buffer of a file holds the data of the current WOFS_WRITE_BUF_SIZE block
+// of the FS (data at address 'addr' is kept at 'addr & WOFS_WRITE_BUF_MASK')
+// that was not written yet, so full blocks are always written with a single
+// aligned write operation.
+
+// Write the buffered data of a file to the FS
+static void wofsh_flush( FD *pfd, const FSDATA *pfs )
+{
+  u32 addr = pfd->baseaddr + pfd->flushed;
+
+  if( pfd->flushed == pfd->size )
+    return;
+  romfsh_write( pfd->pwbuf + ( addr & WOFS_WRITE_BUF_MASK ), addr, pfd->size - pfd->flushed, pfs );
+  pfd->flushed = pfd->size;
+}
+
+// Append data to a file with a write buffer
+static void wofsh_write_buffered( FD *pfd, const u8 *pdata, u32 size, const FSDATA *pfs )
+{
+  u32 addr, n;
+
+  while( size > 0 )
+  {
+    addr = pfd->baseaddr + pfd->size;
+    if( ( addr & WOFS_WRITE_BUF_MASK ) == 0 && size >= WOFS_WRITE_BUF_SIZE )
+    {
+      // Aligned full blocks are written directly
+      n = size & ~WOFS_WRITE_BUF_MASK;
+      romfsh_write( pdata, addr, n, pfs );
+      pfd->flushed += n;
+    }
+    else
+    {
+      n = fsmin( size, WOFS_WRITE_BUF_SIZE - ( addr & WOFS_WRITE_BUF_MASK ) );
+      memcpy( pfd->pwbuf + ( addr & WOFS_WRITE_BUF_MASK ), pdata, n );
+    }
+    pfd->size += n;
+    pdata += n;
+    size -= n;
+    // Write the buffer at the end of the block
+    if( ( ( addr + n ) & WOFS_WRITE_BUF_MASK ) == 0 )
+      wofsh_flush( pfd, pfs );
+  }
+}
+
+// Helper function: read a little endian 32-bit number from the FS
+static u32 romfsh_read32( u32 addr, const FSDATA *pfs )
+{
+  u8 temp[ 4 ];
+  const u8 *p = temp;
+
+  if( pfs->flags & ROMFS_FS_FLAG_DIRECT )
+    p = pfs->pbase + addr;
+  else
+    romfsh_read( temp, addr, 4, pfs );
+  return p[ 0 ] + ( p[ 1 ] << 8 ) + ( p[ 2 ] << 16 ) + ( ( u32 )p[ 3 ] << 24 );
+}
+
+// Helper function: return true if a WOFS file doesn't have a valid size (it
+// wasn't closed, or writing its size was interrupted)
+#define wofsh_bad_size( data, size, pfs ) ( ( size ) == 0xFFFFFFFF || ( size ) > ( pfs )->max_size - ( data ) )
+
+// Helper function: read the header of the file at 'addr' with a single access.
+// Returns the file name (if 'fsname' is not NULL), the address of the file
+// data, the file size and the 'deleted' flag, and the address of the next file
+static u32 romfsh_read_header( u32 addr, const FSDATA *pfs, char *fsname, u32 *pdata, u32 *psize, int *pdeleted )
+{
+  u8 hdr[ ROMFS_MAX_HDR_SIZE ];
+  const u8 *p = hdr;
+  u32 j, extent;
+  int recovered = 0;
+
+  if( pfs->flags & ROMFS_FS_FLAG_DIRECT )
+    p = pfs->pbase + addr;
+  else
+    romfsh_read( hdr, addr, fsmin( ROMFS_MAX_HDR_SIZE, pfs->max_size - addr ), pfs );
+  // Read file name
+  for( j = 0; j < DM_MAX_FNAME_LENGTH && p[ j ]; j ++ );
+  if( fsname )
+  {
+    memcpy( fsname, p, j );
+    fsname[ j ] = '\0';
+  }
+  // 'addr + j' now points at the '0' byte, round to a multiple of ROMFS_ALIGN
+  j = ( ( addr + j + 1 + ROMFS_ALIGN - 1 ) & ~( ROMFS_ALIGN - 1 ) ) - addr;
+  // WOFS has an additional WOFS_DEL_FIELD_SIZE bytes before the size as an indication for "file deleted"
+  *pdeleted = 0;
+  extent = WOFS_EXTENT_NONE;
+  if( romfsh_is_wofs( pfs ) )
+  {
+    recovered = p[ j ] == WOFS_FILE_RECOVERED;
+    *pdeleted = p[ j ] == WOFS_FILE_DELETED || recovered;
+    extent = p[ j + 1 ] + ( p[ j + 2 ] << 8 ) + ( ( u32 )p[ j + 3 ] << 16 );
+    if( extent != WOFS_EXTENT_NONE )
+      extent = addr + j + extent * ROMFS_ALIGN;
+    j += WOFS_DEL_FIELD_SIZE;
+  }
+  // And read the size
+  *psize = p[ j ] + ( p[ j + 1 ] << 8 ) + ( p[ j + 2 ] << 16 ) + ( ( u32 )p[ j + 3 ] << 24 );
+  *pdata = addr + j + ROMFS_SIZE_LEN;
+  // A file without a valid size ends at its recorded extent (if any), a
+  // recovered WOFS file too, unless its extent was partially written (then
+  // it has a size, see wofs_recover)
+  if( extent != WOFS_EXTENT_NONE && ( wofsh_bad_size( *pdata, *psize, pfs ) || ( recovered && extent > *pdata && extent <= pfs->max_size ) ) )
+    return extent;
+  // Move to next file
+  j = *pdata + *psize;
+  if( pfs->flags & ROMFS_FS_FLAG_ZEROTERM )
+    j ++;
+  // On WOFS, all file names must begin at a multiple of ROMFS_ALIGN
+  if( romfsh_is_wofs( pfs ) )
+    j = ( j + ROMFS_ALIGN - 1 ) & ~( ROMFS_ALIGN - 1 );
+  return j;
+}
+
+// Helper function: hash a file name for the directory index
+// This must match the hash function in mkfs.py and utils/mkfs.lua
+static u32 romfsh_hash( const char *name )
+{
+  u32 h = 0;
+  unsigned i;
+
+  for( i = 0; i < DM_MAX_FNAME_LENGTH && name[ i ]; i ++ )
+    h = h * 31 + ( u8 )tolower( ( u8 )name[ i ] );
+  return h;
+}
+
+// Helper function: return the hash and the file address of the index entry 'i'
+static u32 romfsh_index_entry( const FSDATA *pfs, u32 i, u32 *paddr )
+{
+  if( pfs->pindex )
+  {
+    *paddr = pfs->pindex[ i ].addr;
+    return pfs->pindex[ i ].hash;
+  }
+  i = ROMFS_INDEX_HDR_SIZE + i * ROMFS_INDEX_ENTRY_SIZE;
+  *paddr = romfsh_read32( i + 4, pfs );
+  return romfsh_read32( i, pfs );
+}
+
+// Helper function: return the position of the first index entry with the given hash
+static u32 romfsh_index_lower( const FSDATA *pfs, u32 hash )
+{
+  u32 lo = 0, hi = pfs->nindex, mid, addr;
+
+  while( lo < hi )
+  {
+    mid = ( lo + hi ) / 2;
+    if( romfsh_index_entry( pfs, mid, &addr ) < hash )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Helper function: check if the file at 'addr' is 'fname' and fill 'pfd' if so
+static int romfsh_match_file( const char *fname, u32 addr, FD *pfd, const FSDATA *pfs, u32 *pnext, u32 *pnameaddr )
 {
-  u32 i, j, n;
   char fsname[ DM_MAX_FNAME_LENGTH + 1 ];
-  u32 fsize;
+  u32 fsize, data;
   int is_deleted;
-  
-  // Look for the file
-  i = 0;
-  while( 1 )
+
+  *pnext = romfsh_read_header( addr, pfs, fsname, &data, &fsize, &is_deleted );
+  if( is_deleted || strncasecmp( fname, fsname, DM_MAX_FNAME_LENGTH ) )
+    return 0;
+  pfd->baseaddr = data;
+  pfd->offset = 0;
+  pfd->size = fsize;
+  if( pnameaddr )
+    *pnameaddr = addr;
+  return 1;
+}
+
+// Open the given file, returning one of FS_FILE_NOT_FOUND or FS_FILE_OK
+static u8 romfs_open_file( const char* fname, FD* pfd, FSDATA *pfs, u32 *pnameaddr )
+{
+  u32 i, addr, next, hash;
+
+  if( romfs_fs_is_flag_set( pfs, ROMFS_FS_FLAG_INDEX ) )
+  {
+    // Only check the files with the same name hash
+    hash = romfsh_hash( fname );
+    for( i = romfsh_index_lower( pfs, hash ); i < pfs->nindex; i ++ )
+    {
+      if( romfsh_index_entry( pfs, i, &addr ) != hash )
+        break;
+      if( romfsh_match_file( fname, addr, pfd, pfs, &next, pnameaddr ) )
+        return FS_FILE_OK;
+    }
+    return FS_FILE_NOT_FOUND;
+  }
+  // No index, look at all the files
+  for( addr = pfs->first; romfsh_read8( addr, pfs ) != WOFS_END_MARKER_CHAR; addr = next )
+    if( romfsh_match_file( fname, addr, pfd, pfs, &next, pnameaddr ) )
+      return FS_FILE_OK;
+  return FS_FILE_NOT_FOUND;
+}
+
+// Return the address of the end marker of the FS
+static u32 romfs_get_end( const FSDATA *pfs )
+{
+  u32 addr, data, size;
+  int is_deleted;
+
+  for( addr = pfs->first; romfsh_read8( addr, pfs ) != WOFS_END_MARKER_CHAR; )
+    addr = romfsh_read_header( addr, pfs, NULL, &data, &size, &is_deleted );
+  return addr;
+}
+
+// ****************************************************************************
+// WOFS files opened in write mode
+
+// Return the file opened in write mode that can grow up to the end of WOFS
+// (the one created last) or NULL if there isn't one
+static FD* wofsh_get_last_writer()
+{
+  unsigned i;
+
+  for( i = 0; i < ROMFS_MAX_FDS; i ++ )
+    if( ( fd_table[ i ].flags & ( ROMFS_FILE_FLAG_WRITE | ROMFS_FILE_FLAG_APPEND ) ) && fd_table[ i ].resend == WOFS_NO_LIMIT )
+      return fd_table + i;
+  return NULL;
+}
+
+// Return the address where a new file can be created. If a file opened in
+// write mode must be limited to make room for the new file, it's returned
+// in 'pplast'
+static u32 wofsh_get_free( const FSDATA *pfs, FD **pplast )
+{
+  FD *plast;
+
+  *pplast = NULL;
+  if( pfs->nwriters == 0 )
+    return romfs_get_end( pfs );
+  if( ( plast = wofsh_get_last_writer() ) == NULL )
+    return pfs->wend;
+  *pplast = plast;
+  return ( ( plast->baseaddr + plast->size + ROMFS_ALIGN - 1 ) & ~( ROMFS_ALIGN - 1 ) ) + WOFS_WRITE_EXTENT + WOFS_FILLER_SIZE;
+}
+
+// Record the end of the space reserved for a file opened in write mode (see WOFS_EXTENT_NONE)
+// Only the 3 extent bytes are written, the flag byte might already be WOFS_FILE_DELETED
+static void wofsh_write_extent( const FD *pfd, const FSDATA *pfs )
+{
+  u8 field[ 3 ];
+  u32 addr = pfd->baseaddr - ROMFS_SIZE_LEN - WOFS_DEL_FIELD_SIZE;
+  u32 extent = ( pfd->resend - addr ) / ROMFS_ALIGN;
+
+  if( extent >= WOFS_EXTENT_NONE )
+    return;
+  field[ 0 ] = extent & 0xFF;
+  field[ 1 ] = ( extent >> 8 ) & 0xFF;
+  field[ 2 ] = ( extent >> 16 ) & 0xFF;
+  romfsh_write( field, addr + 1, 3, pfs );
+}
+
+// Mark the unused space in [addr, end) as a deleted file with an empty name
+static void wofsh_write_filler( u32 addr, u32 end, const FSDATA *pfs )
+{
+  u8 hdr[ WOFS_FILLER_SIZE ];
+  u32 size = end - addr - WOFS_FILLER_SIZE;
+
+  memset( hdr, 0xFF, WOFS_FILLER_SIZE );
+  hdr[ 0 ] = '\0';
+  hdr[ ROMFS_ALIGN ] = WOFS_FILE_DELETED;
+  hdr[ ROMFS_ALIGN + WOFS_DEL_FIELD_SIZE ] = size & 0xFF;
+  hdr[ ROMFS_ALIGN + WOFS_DEL_FIELD_SIZE + 1 ] = ( size >> 8 ) & 0xFF;
+  hdr[ ROMFS_ALIGN + WOFS_DEL_FIELD_SIZE + 2 ] = ( size >> 16 ) & 0xFF;
+  hdr[ ROMFS_ALIGN + WOFS_DEL_FIELD_SIZE + 3 ] = ( size >> 24 ) & 0xFF;
+  romfsh_write( hdr, addr, WOFS_FILLER_SIZE, pfs );
+}
+
+// Look for a directory index at the beginning of a ROMFS image
+static void romfs_index_init( FSDATA *pfs )
+{
+  unsigned i;
+
+  pfs->first = 0;
+  if( pfs->max_size < ROMFS_INDEX_HDR_SIZE )
+    return;
+  for( i = 0; i < ROMFS_INDEX_HDR_SIZE / 2 - 1; i ++ )
+    if( romfsh_read8( i, pfs ) != ( u8 )ROMFS_INDEX_MAGIC[ i ] )
+      return;
+  if( romfsh_read8( i, pfs ) == ROMFS_INDEX_MAGIC_ZT )
+    romfs_fs_set_flag( pfs, ROMFS_FS_FLAG_ZEROTERM );
+  else if( romfsh_read8( i, pfs ) != ( u8 )ROMFS_INDEX_MAGIC[ i ] )
+    return;
+  pfs->nindex = romfsh_read32( ROMFS_INDEX_HDR_SIZE / 2, pfs );
+  pfs->first = ROMFS_INDEX_HDR_SIZE + pfs->nindex * ROMFS_INDEX_ENTRY_SIZE;
+  romfs_fs_set_flag( pfs, ROMFS_FS_FLAG_INDEX );
+}
+
+// ****************************************************************************
+// WOFS directory index (kept in RAM)
+
+// Drop the index, lookups fall back to scanning the whole FS
+static void wofs_index_free( FSDATA *pfs )
+{
+  free( pfs->pindex );
+  pfs->pindex = NULL;
+  pfs->nindex = pfs->indexsize = 0;
+  romfs_fs_clear_flag( pfs, ROMFS_FS_FLAG_INDEX );
+}
+
+// Add the file 'name' at address 'addr' to the index
+static void wofs_index_add( FSDATA *pfs, const char *name, u32 addr )
+{
+  ROMFS_INDEX_ENTRY *pnew;
+  u32 hash = romfsh_hash( name ), i;
+
+  if( !romfs_fs_is_flag_set( pfs, ROMFS_FS_FLAG_INDEX ) )
+    return;
+  if( pfs->nindex == pfs->indexsize )
   {
-    if( romfsh_read8( i, pfs ) == WOFS_END_MARKER_CHAR )
+    if( ( pnew = realloc( pfs->pindex, ( pfs->indexsize + WOFS_INDEX_GROW ) * sizeof( ROMFS_INDEX_ENTRY ) ) ) == NULL )
     {
-      *plast = i;
-      return FS_FILE_NOT_FOUND;
+      wofs_index_free( pfs );
+      return;
     }
-    // Read file name
-    n = i;
-    for( j = 0; j < DM_MAX_FNAME_LENGTH; j ++ )
+    pfs->pindex = pnew;
+    pfs->indexsize += WOFS_INDEX_GROW;
+  }
+  // Keep the entries sorted by hash
+  i = romfsh_index_lower( pfs, hash );
+  memmove( pfs->pindex + i + 1, pfs->pindex + i, ( pfs->nindex - i ) * sizeof( ROMFS_INDEX_ENTRY ) );
+  pfs->pindex[ i ].hash = hash;
+  pfs->pindex[ i ].addr = addr;
+  pfs->nindex ++;
+}
+
+// Remove the file 'name' at address 'addr' from the index
+static void wofs_index_remove( FSDATA *pfs, const char *name, u32 addr )
+{
+  u32 hash = romfsh_hash( name ), i, a;
+
+  if( !romfs_fs_is_flag_set( pfs, ROMFS_FS_FLAG_INDEX ) )
+    return;
+  for( i = romfsh_index_lower( pfs, hash ); i < pfs->nindex; i ++ )
+  {
+    if( romfsh_index_entry( pfs, i, &a ) != hash )
+      break;
+    if( a == addr )
     {
-      fsname[ j ] = romfsh_read8( i + j, pfs );
-      if( fsname[ j ] == 0 )
-         break;
+      memmove( pfs->pindex + i, pfs->pindex + i + 1, ( pfs->nindex - i - 1 ) * sizeof( ROMFS_INDEX_ENTRY ) );
+      pfs->nindex --;
+      return;
     }
-    // ' i + j' now points at the '0' byte
-    j = i + j + 1;
-    // Round to a multiple of ROMFS_ALIGN
-    j = ( j + ROMFS_ALIGN - 1 ) & ~( ROMFS_ALIGN - 1 );
-    // WOFS has an additional WOFS_DEL_FIELD_SIZE bytes before the size as an indication for "file deleted"
-    if( romfsh_is_wofs( pfs ) )
+  }
+}
+
+#ifdef BUILD_WOFS
+// Build the index by scanning the WOFS once
+static void wofs_index_build( FSDATA *pfs )
+{
+  char fsname[ DM_MAX_FNAME_LENGTH + 1 ];
+  u32 addr, next, data, size;
+  int is_deleted;
+
+  wofs_index_free( pfs );
+  romfs_fs_set_flag( pfs, ROMFS_FS_FLAG_INDEX );
+  for( addr = pfs->first; romfsh_read8( addr, pfs ) != WOFS_END_MARKER_CHAR; addr = next )
+  {
+    next = romfsh_read_header( addr, pfs, fsname, &data, &size, &is_deleted );
+    if( !is_deleted )
+      wofs_index_add( pfs, fsname, addr );
+  }
+}
+
+#endif // #ifdef BUILD_WOFS
+
+// ****************************************************************************
+// WOFS recovery after a power failure
+
+#ifdef BUILD_WOFS
+// Mark the files that were left opened in write mode (power failure) with
+// WOFS_FILE_RECOVERED and record their end. A file with a recorded extent ends
+// at its extent, the last file created ends at the last programmed byte before
+// 'end'. The end is recorded in the extent bytes if they are still erased.
+// If they were partially written (power failure while a newer file was being
+// created, so this is the last file) the size is written instead, since its
+// field is still erased in this case. Everything is written in an order that
+// can be repeated if the recovery itself is interrupted.
+static void wofs_recover( FSDATA *pfs, u32 end )
+{
+  u8 field[ 4 ];
+  u32 addr, next, data, size, extent, recorded;
+  int deleted;
+
+  for( addr = pfs->first; romfsh_read8( addr, pfs ) != WOFS_END_MARKER_CHAR; addr = next )
+  {
+    next = romfsh_read_header( addr, pfs, NULL, &data, &size, &deleted );
+    field[ 0 ] = romfsh_read8( data - ROMFS_SIZE_LEN - WOFS_DEL_FIELD_SIZE, pfs );
+    // Skip the files already recovered (a partially written extent points past the end)
+    if( !wofsh_bad_size( data, size, pfs ) || ( field[ 0 ] == WOFS_FILE_RECOVERED && next > addr && next <= end ) )
+      continue;
+    if( next <= data || next > end )
     {
-      is_deleted = romfsh_read8( j, pfs ) == WOFS_FILE_DELETED;
-      j += WOFS_DEL_FIELD_SIZE;
+      // No extent, so this is the last file
+      for( next = end; next > data && romfsh_read8( next - 1, pfs ) == WOFS_END_MARKER_CHAR; next -- );
+      next = ( next + ROMFS_ALIGN - 1 ) & ~( ROMFS_ALIGN - 1 );
     }
-    else
-      is_deleted = 0;
-    // And read the size
-    fsize = romfsh_read8( j, pfs ) + ( romfsh_read8( j + 1, pfs ) << 8 );
-    fsize += ( romfsh_read8( j + 2, pfs ) << 16 ) + ( romfsh_read8( j + 3, pfs ) << 24 );
-    j += ROMFS_SIZE_LEN;
-    if( !strncasecmp( fname, fsname, DM_MAX_FNAME_LENGTH ) && !is_deleted )
+    addr = data - ROMFS_SIZE_LEN - WOFS_DEL_FIELD_SIZE;
+    extent = ( next - addr ) / ROMFS_ALIGN;
+    if( extent >= WOFS_EXTENT_NONE )
+      break;
+    if( field[ 0 ] != WOFS_FILE_RECOVERED )
     {
-      // Found the file
-      pfd->baseaddr = j;
-      pfd->offset = 0;
-      pfd->size = fsize;
-      if( pnameaddr )
-        *pnameaddr = n;
-      return FS_FILE_OK;
+      field[ 0 ] = WOFS_FILE_RECOVERED;
+      romfsh_write( field, addr, 1, pfs );
+    }
+    recorded = romfsh_read8( addr + 1, pfs ) + ( romfsh_read8( addr + 2, pfs ) << 8 ) + ( ( u32 )romfsh_read8( addr + 3, pfs ) << 16 );
+    if( recorded == WOFS_EXTENT_NONE )
+    {
+      field[ 0 ] = extent & 0xFF;
+      field[ 1 ] = ( extent >> 8 ) & 0xFF;
+      field[ 2 ] = ( extent >> 16 ) & 0xFF;
+      romfsh_write( field, addr + 1, 3, pfs );
+    }
+    else if( recorded != extent )
+    {
+      size = next - data;
+      field[ 0 ] = size & 0xFF;
+      field[ 1 ] = ( size >> 8 ) & 0xFF;
+      field[ 2 ] = ( size >> 16 ) & 0xFF;
+      field[ 3 ] = ( size >> 24 ) & 0xFF;
+      romfsh_write( field, data - ROMFS_SIZE_LEN, ROMFS_SIZE_LEN, pfs );
     }
-    // Move to next file
-    i = j + fsize;
-    // On WOFS, all file names must begin at a multiple of ROMFS_ALIGN
-    if( romfsh_is_wofs( pfs ) )
-      i = ( i + ROMFS_ALIGN - 1 ) & ~( ROMFS_ALIGN - 1 );
   }
-  *plast = 0;
-  return FS_FILE_NOT_FOUND;
 }
+#endif // #ifdef BUILD_WOFS
+
+// ****************************************************************************
+// WOFS compaction (see romfs.h for an overview)
+
+#if defined( BUILD_WOFS ) && defined( WOFS_ENABLE_COMPACTION )
+
+#define WOFS_JREC_MAGIC       0x57470001UL
+#define WOFS_JREC_LAST        0xFFFFFFFFUL
+#define WOFS_COPY_BUF_SIZE    64
+
+// Compaction journal record, also used as the state of the compaction
+typedef struct
+{
+  u32 magic;                      // WOFS_JREC_MAGIC
+  u32 dest;                       // start of the sector built in the swap sector
+  u32 used;                       // number of bytes used in the swap sector
+  u32 sum;                        // checksum of the used bytes of the swap sector
+  u32 src;                        // address of the next byte to move
+  u32 left;                       // bytes left to move from the current file (WOFS_JREC_LAST if done)
+  u32 end;                        // end of the FS before compaction
+  u32 check;                      // checksum of the fields above
+} WOFS_JREC;
+
+// Address of the next free journal record
+static u32 wofs_journal_next;
+
+// Read from the FS (direct or not)
+static void wofsh_read( void *to, u32 addr, u32 size, const FSDATA *pfs )
+{
+  if( pfs->flags & ROMFS_FS_FLAG_DIRECT )
+    memcpy( to, pfs->pbase + addr, size );
+  else
+    romfsh_read( to, addr, size, pfs );
+}
+
+// Return the checksum of 'size' bytes of the FS starting at 'addr'
+static u32 wofsh_sum( u32 addr, u32 size, const FSDATA *pfs )
+{
+  u8 buf[ WOFS_COPY_BUF_SIZE ];
+  u32 sum = 0, n, i;
+
+  while( size > 0 )
+  {
+    n = fsmin( size, WOFS_COPY_BUF_SIZE );
+    wofsh_read( buf, addr, n, pfs );
+    for( i = 0; i < n; i ++ )
+      sum = ( ( sum << 5 ) | ( sum >> 27 ) ) + buf[ i ];
+    addr += n;
+    size -= n;
+  }
+  return sum;
+}
+
+// Copy 'size' bytes from 'from' to 'to' inside the FS
+static void wofsh_copy( u32 to, u32 from, u32 size, const FSDATA *pfs )
+{
+  u8 buf[ WOFS_COPY_BUF_SIZE ];
+  u32 n;
+
+  while( size > 0 )
+  {
+    n = fsmin( size, WOFS_COPY_BUF_SIZE );
+    wofsh_read( buf, from, n, pfs );
+    romfsh_write( buf, to, n, pfs );
+    from += n;
+    to += n;
+    size -= n;
+  }
+}
+
+// Erase all the sectors that start in [start, end)
+static int wofsh_erase( u32 start, u32 end, const FSDATA *pfs )
+{
+  u32 sstart, ssize;
+  int res = 1;
+
+  while( start < end && res )
+  {
+    res = pfs->erasef( start, pfs ) == PLATFORM_OK;
+    pfs->sectorf( start, &sstart, &ssize, pfs );
+    start = sstart + ssize;
+  }
+  romfsh_cache_invalidate( pfs );
+  return res;
+}
+
+// Return the checksum of a journal record
+static u32 wofsh_jrec_check( const WOFS_JREC *prec )
+{
+  const u32 *p = ( const u32* )prec;
+  u32 check = 0;
+  unsigned i;
+
+  for( i = 0; i < sizeof( WOFS_JREC ) / sizeof( u32 ) - 1; i ++ )
+    check = ( ( check << 7 ) | ( check >> 25 ) ) ^ p[ i ];
+  return ~check;
+}
+
+// Find the last valid record in the journal (returns 0 if there isn't one)
+// Also finds the first free journal record and if the journal is blank. The
+// whole journal is checked, since an interrupted journal erase can leave
+// records after blank ones
+static int wofs_journal_scan( WOFS_JREC *prec, int *pblank, const FSDATA *pfs )
+{
+  WOFS_JREC rec;
+  unsigned i;
+  u32 addr;
+  int found = 0;
+
+  *pblank = 1;
+  wofs_journal_next = pfs->journal;
+  for( addr = pfs->journal; addr + sizeof( WOFS_JREC ) <= pfs->swap; addr += sizeof( WOFS_JREC ) )
+  {
+    wofsh_read( &rec, addr, sizeof( WOFS_JREC ), pfs );
+    for( i = 0; i < sizeof( WOFS_JREC ) && ( ( u8* )&rec )[ i ] == 0xFF; i ++ );
+    if( i == sizeof( WOFS_JREC ) )
+      continue;
+    *pblank = 0;
+    wofs_journal_next = addr + sizeof( WOFS_JREC );
+    // Records that were only partially written are ignored
+    if( rec.magic == WOFS_JREC_MAGIC && rec.check == wofsh_jrec_check( &rec ) )
+    {
+      memcpy( prec, &rec, sizeof( WOFS_JREC ) );
+      found = 1;
+    }
+  }
+  return found;
+}
+
+// Append a record to the journal
+static int wofs_journal_add( WOFS_JREC *prec, const FSDATA *pfs )
+{
+  if( wofs_journal_next + sizeof( WOFS_JREC ) > pfs->swap )
+    return 0;
+  prec->magic = WOFS_JREC_MAGIC;
+  prec->check = wofsh_jrec_check( prec );
+  romfsh_write( prec, wofs_journal_next, sizeof( WOFS_JREC ), pfs );
+  wofs_journal_next += sizeof( WOFS_JREC );
+  return 1;
+}
+
+// Move the content of the swap sector to its destination
+static int wofs_compact_move( const WOFS_JREC *prec, const FSDATA *pfs )
+{
+  if( !wofsh_erase( prec->dest, prec->dest + 1, pfs ) )
+    return 0;
+  wofsh_copy( prec->dest, pfs->swap, prec->used, pfs );
+  return 1;
+}
+
+// Build the sector that starts at 'prec->dest' in the swap sector, record it
+// in the journal, then move it to its destination
+static int wofs_compact_sector( WOFS_JREC *prec, const FSDATA *pfs )
+{
+  u32 start, size, n, next, data, fsize;
+  int deleted;
+
+  pfs->sectorf( prec->dest, &start, &size, pfs );
+  if( !wofsh_erase( pfs->swap, pfs->swap + 1, pfs ) )
+    return 0;
+  prec->used = 0;
+  while( prec->used < size && prec->left != WOFS_JREC_LAST )
+  {
+    if( prec->left == 0 )
+    {
+      // Get the next file, skip it if it was deleted. A file without a size
+      // can't be skipped (it wasn't recovered), so it's dropped with the rest
+      if( romfsh_read8( prec->src, pfs ) == WOFS_END_MARKER_CHAR )
+      {
+        prec->left = WOFS_JREC_LAST;
+        break;
+      }
+      next = romfsh_read_header( prec->src, pfs, NULL, &data, &fsize, &deleted );
+      if( deleted && next > prec->src )
+        prec->src = next;
+      else if( wofsh_bad_size( data, fsize, pfs ) )
+        prec->left = WOFS_JREC_LAST;
+      else
+        prec->left = next - prec->src;
+      continue;
+    }
+    n = fsmin( prec->left, size - prec->used );
+    wofsh_copy( pfs->swap + prec->used, prec->src, n, pfs );
+    prec->used += n;
+    prec->src += n;
+    prec->left -= n;
+  }
+  prec->sum = wofsh_sum( pfs->swap, prec->used, pfs );
+  if( !wofs_journal_add( prec, pfs ) )
+    return 0;
+  return wofs_compact_move( prec, pfs );
+}
+
+// Continue the compaction after the sector in 'prec' was moved
+static int wofs_compact_run( WOFS_JREC *prec, const FSDATA *pfs )
+{
+  u32 start, size;
+
+  while( prec->left != WOFS_JREC_LAST )
+  {
+    pfs->sectorf( prec->dest, &start, &size, pfs );
+    prec->dest = start + size;
+    if( !wofs_compact_sector( prec, pfs ) )
+      return 0;
+  }
+  // Erase the old data after the last sector, then the journal
+  pfs->sectorf( prec->dest, &start, &size, pfs );
+  if( !wofsh_erase( start + size, prec->end, pfs ) || !wofsh_erase( pfs->journal, pfs->swap, pfs ) )
+    return 0;
+  wofs_journal_next = pfs->journal;
+  return 1;
+}
+
+// Reclaim the space used by the deleted files. This moves files, so it can
+// only run when no file is opened.
+// Returns 1 if files were moved, 0 if there was nothing to do, -1 for error
+static int wofs_compact_fs( FSDATA *pfs )
+{
+  WOFS_JREC rec;
+  u32 addr, next, data, fsize, start, size, first = 0xFFFFFFFF;
+  int deleted, res;
+
+  if( !romfs_fs_is_flag_set( pfs, ROMFS_FS_FLAG_COMPACT ) || romfs_num_fd > 0 )
+    return -1;
+  // Find the first deleted file and the end of the FS
+  for( addr = pfs->first; romfsh_read8( addr, pfs ) != WOFS_END_MARKER_CHAR; addr = next )
+  {
+    next = romfsh_read_header( addr, pfs, NULL, &data, &fsize, &deleted );
+    if( next <= addr || ( !deleted && wofsh_bad_size( data, fsize, pfs ) ) )
+    {
+      // Unknown size, erase everything up to the journal
+      first = fsmin( first, addr );
+      addr = pfs->max_size;
+      break;
+    }
+    if( deleted )
+      first = fsmin( first, addr );
+  }
+  if( first == 0xFFFFFFFF )
+    return 0;
+  rec.end = addr;
+  // Start with the sector of the first deleted file
+  pfs->sectorf( first, &start, &size, pfs );
+  rec.dest = rec.src = start;
+  rec.left = 0;
+  for( addr = pfs->first; addr < start; addr = next )
+    if( ( next = romfsh_read_header( addr, pfs, NULL, &data, &fsize, &deleted ) ) > start )
+    {
+      rec.left = next - start;
+      break;
+    }
+  romfs_fs_set_flag( pfs, ROMFS_FS_FLAG_COMPACTING );
+  res = wofs_compact_sector( &rec, pfs ) && wofs_compact_run( &rec, pfs ) ? 1 : -1;
+  romfs_fs_clear_flag( pfs, ROMFS_FS_FLAG_COMPACTING );
+  wofs_index_build( pfs );
+  return res;
+}
+
+// Reserve the swap sector and the journal sectors at the end of the FS and
+// complete an interrupted compaction
+static void wofs_compact_init( FSDATA *pfs )
+{
+  WOFS_JREC rec;
+  u32 start, size, swapsize, addr, nsect = 0;
+  int blank;
+
+  romfs_fs_clear_flag( pfs, ROMFS_FS_FLAG_COMPACT );
+  // The swap sector is the last one and it must be at least as large as any other sector
+  pfs->sectorf( pfs->max_size - 1, &pfs->swap, &swapsize, pfs );
+  for( addr = 0; addr < pfs->swap; addr = start + size, nsect ++ )
+  {
+    pfs->sectorf( addr, &start, &size, pfs );
+    if( size > swapsize )
+      return;
+  }
+  // The journal needs one record for each sector before it
+  for( pfs->journal = pfs->swap; nsect > 0 && ( pfs->swap - pfs->journal ) / sizeof( WOFS_JREC ) < nsect; nsect -- )
+    pfs->sectorf( pfs->journal - 1, &pfs->journal, &size, pfs );
+  if( nsect == 0 )
+    return;
+  if( wofs_journal_scan( &rec, &blank, pfs ) )
+  {
+    // A compaction was interrupted, complete it
+    pfs->max_size = pfs->journal;
+    romfs_fs_set_flag( pfs, ROMFS_FS_FLAG_COMPACT | ROMFS_FS_FLAG_COMPACTING );
+    if( wofsh_sum( pfs->swap, rec.used, pfs ) == rec.sum )
+      wofs_compact_move( &rec, pfs );
+    else if( wofsh_sum( rec.dest, rec.used, pfs ) != rec.sum )
+    {
+      // Stale journal (the compaction was completed), only erase the journal
+      rec.left = WOFS_JREC_LAST;
+      rec.end = 0;
+    }
+    wofs_compact_run( &rec, pfs );
+    romfs_fs_clear_flag( pfs, ROMFS_FS_FLAG_COMPACTING );
+    return;
+  }
+  // Recover the files left opened before looking for the end of WOFS. If the
+  // journal isn't blank, it's not part of the files.
+  wofs_recover( pfs, blank ? pfs->max_size : pfs->journal );
+  // WOFS can't be compacted if it already uses the reserved sectors (it was
+  // created without compaction support)
+  if( romfs_get_end( pfs ) >= pfs->journal )
+    return;
+  if( !blank )
+    wofsh_erase( pfs->journal, pfs->swap, pfs );
+  pfs->max_size = pfs->journal;
+  romfs_fs_set_flag( pfs, ROMFS_FS_FLAG_COMPACT );
+}
+
+#endif // #if defined( BUILD_WOFS ) && defined( WOFS_ENABLE_COMPACTION )
+
+#ifdef BUILD_WOFS
+// Prepare WOFS for use: complete an interrupted compaction, recover the files
+// that were not closed and build the index
+static void wofs_mount( FSDATA *pfs, u32 size )
+{
+  pfs->max_size = size;
+#ifdef WOFS_ENABLE_COMPACTION
+  wofs_compact_init( pfs );
+#endif
+  wofs_recover( pfs, pfs->max_size );
+  wofs_index_build( pfs );
+}
+#endif // #ifdef BUILD_WOFS
+
+// ****************************************************************************
+// Device functions
 
 static int romfs_open_r( struct _reent *r, const char *path, int flags, int mode, void *pdata )
 {
@@ -142,14 +1026,15 @@ static int romfs_open_r( struct _reent *r, const char *path, int flags, int mode
   int exists;
   u8 lflags = ROMFS_FILE_FLAG_READ;
   u32 firstfree, nameaddr;
+  FD *plast;
 
-  if( romfs_num_fd == TOTAL_MAX_FDS )
+  if( romfs_num_fd == ROMFS_MAX_FDS )
   {
     r->_errno = ENFILE;
     return -1;
   }
   // Does the file exist?
-  exists = romfs_open_file( path, &tempfs, pfsdata, &firstfree, &nameaddr ) == FS_FILE_OK;
+  exists = romfs_open_file( path, &tempfs, pfsdata, &nameaddr ) == FS_FILE_OK;
   // Now interpret "flags" to set file flags and to check if we should create the file
   if( flags & O_CREAT )
   {
@@ -188,41 +1073,53 @@ static int romfs_open_r( struct _reent *r, const char *path, int flags, int mode
     r->_errno = EACCES;
     return -1;
   }
-  if( ( lflags & ( ROMFS_FILE_FLAG_WRITE | ROMFS_FILE_FLAG_APPEND ) ) && romfs_fs_is_flag_set( pfsdata, ROMFS_FS_FLAG_WRITING ) )
-  {
-    // At most one file can be opened in write mode at any given time on WOFS
-    r->_errno = EROFS;
-    return -1;
-  }
   // Do we need to create the file ?
   if( must_create )
   {
+#ifdef WOFS_ENABLE_COMPACTION
+    // Reclaim the space used by the deleted files if WOFS is getting full
+    if( romfs_num_fd == 0 )
+    {
+      firstfree = romfs_get_end( pfsdata );
+      if( pfsdata->max_size - firstfree < pfsdata->max_size / 100 * WOFS_COMPACT_FREE_PERCENT && wofs_compact_fs( pfsdata ) != 0 )
+        exists = romfs_open_file( path, &tempfs, pfsdata, &nameaddr ) == FS_FILE_OK;
+    }
+#endif
     if( exists )
     {
-      // Invalidate the file first by changing WOFS_DEL_FIELD_SIZE bytes before
-      // the file length to WOFS_FILE_DELETED
-      u8 tempb[] = { WOFS_FILE_DELETED, 0xFF, 0xFF, 0xFF };
-      pfsdata->writef( tempb, tempfs.baseaddr - ROMFS_SIZE_LEN - WOFS_DEL_FIELD_SIZE, WOFS_DEL_FIELD_SIZE, pfsdata );
+      // Invalidate the file first by changing the first byte of the 'deleted'
+      // field to WOFS_FILE_DELETED (the extent bytes after it are left alone,
+      // the file might still be opened in write mode)
+      u8 tempb = WOFS_FILE_DELETED;
+      romfsh_write( &tempb, tempfs.baseaddr - ROMFS_SIZE_LEN - WOFS_DEL_FIELD_SIZE, 1, pfsdata );
+      wofs_index_remove( pfsdata, path, nameaddr );
     }
-    // Find the last available position by asking romfs_open_file to look for a file
-    // with an invalid name
-    romfs_open_file( "\1", &tempfs, pfsdata, &firstfree, NULL );
+    // Find the last available position
+    firstfree = wofsh_get_free( pfsdata, &plast );
     // Is there enough space on the FS for another file?
-    if( pfsdata->max_size - firstfree + 1 < strlen( path ) + 1 + WOFS_MIN_NEEDED_SIZE + WOFS_DEL_FIELD_SIZE )
+    if( firstfree > pfsdata->max_size || pfsdata->max_size - firstfree + 1 < strlen( path ) + 1 + WOFS_MIN_NEEDED_SIZE + WOFS_DEL_FIELD_SIZE )
     {
       r->_errno = ENOSPC;
       return -1;
     }
+    // The file created before this one (if still opened) can't grow past the new file
+    if( plast )
+    {
+      plast->resend = firstfree;
+      wofsh_write_extent( plast, pfsdata );
+    }
     // Write the name of the file
-    pfsdata->writef( path, firstfree, strlen( path ) + 1, pfsdata );
+    romfsh_write( path, firstfree, strlen( path ) + 1, pfsdata );
+    wofs_index_add( pfsdata, path, firstfree );
     firstfree += strlen( path ) + 1; // skip over the name
     // Align to a multiple of ROMFS_ALIGN
     firstfree = ( firstfree + ROMFS_ALIGN - 1 ) & ~( ROMFS_ALIGN - 1 );
     firstfree += ROMFS_SIZE_LEN + WOFS_DEL_FIELD_SIZE; // skip over the size and the deleted flags area
     tempfs.baseaddr = firstfree;
     tempfs.offset = tempfs.size = 0;
-    // Set the "writing" flag on the FS to indicate that there is a file opened in write mode
+    // Set the "writing" flag on the FS to indicate that there are files opened in write mode
     romfs_fs_set_flag( pfsdata, ROMFS_FS_FLAG_WRITING );
+    pfsdata->nwriters ++;
   }
   else // File must exist (and was found in the previous 'romfs_open_file' call)
   {
@@ -234,6 +1131,12 @@ static int romfs_open_r( struct _reent *r, const char *path, int flags, int mode
   }
   // Find a free FD and copy the descriptor information
   tempfs.flags = lflags;
+  tempfs.pwbuf = NULL;
+  tempfs.flushed = tempfs.size;
+  tempfs.resend = WOFS_NO_LIMIT;
+  // If there isn't enough memory for the write buffer, the file is written directly
+  if( must_create )
+    tempfs.pwbuf = ( u8* )malloc( WOFS_WRITE_BUF_SIZE );
   i = romfs_find_empty_fd();
   memcpy( fd_table + i, &tempfs, sizeof( FD ) );
   romfs_num_fd ++;
@@ -245,18 +1148,32 @@ static int romfs_close_r( struct _reent *r, int fd, void *pdata )
   FD* pfd = fd_table + fd;
   FSDATA *pfsdata = ( FSDATA* )pdata;
   u8 temp[ ROMFS_SIZE_LEN ];
+  u32 end;
 
   if( pfd->flags & ( ROMFS_FILE_FLAG_WRITE | ROMFS_FILE_FLAG_APPEND ) )
   {
+    if( pfd->pwbuf )
+    {
+      wofsh_flush( pfd, pfsdata );
+      free( pfd->pwbuf );
+    }
+    // Write the filler first, so the file can still be skipped using its
+    // extent if the size can't be written
+    end = ( pfd->baseaddr + pfd->size + ROMFS_ALIGN - 1 ) & ~( ROMFS_ALIGN - 1 );
+    if( pfd->resend == WOFS_NO_LIMIT )
+      pfsdata->wend = end;
+    else
+      wofsh_write_filler( end, pfd->resend, pfsdata );
     // Write back the size
     temp[ 0 ] = pfd->size & 0xFF;
     temp[ 1 ] = ( pfd->size >> 8 ) & 0xFF;
     temp[ 2 ] = ( pfd->size >> 16 ) & 0xFF;
     temp[ 3 ] = ( pfd->size >> 24 ) & 0xFF;
-    pfsdata->writef( temp, pfd->baseaddr - ROMFS_SIZE_LEN, ROMFS_SIZE_LEN, pfsdata );
-    // Clear the "writing" flag on the FS instance to allow other files to be opened
-    // in write mode
-    romfs_fs_clear_flag( pfsdata, ROMFS_FS_FLAG_WRITING );
+    romfsh_write( temp, pfd->baseaddr - ROMFS_SIZE_LEN, ROMFS_SIZE_LEN, pfsdata );
+    // Clear the "writing" flag on the FS instance if this was the last file
+    // opened in write mode
+    if( -- pfsdata->nwriters == 0 )
+      romfs_fs_clear_flag( pfsdata, ROMFS_FS_FLAG_WRITING );
   }
   romfs_close_fd( fd );
   romfs_num_fd --;
@@ -267,6 +1184,7 @@ static _ssize_t romfs_write_r( struct _reent *r, int fd, const void* ptr, size_t
 {
   FD* pfd = fd_table + fd;
   FSDATA *pfsdata = ( FSDATA* )pdata;
+  u32 limit;
 
   if( ( pfd->flags & ( ROMFS_FILE_FLAG_WRITE | ROMFS_FILE_FLAG_APPEND ) ) == 0 )
   {
@@ -281,12 +1199,21 @@ static _ssize_t romfs_write_r( struct _reent *r, int fd, const void* ptr, size_t
     return 0;
   // Check if we have enough space left on the device. Always keep 1 byte for the final 0xFF
   // and ROMFS_ALIGN - 1 bytes for aligning the contents of the file data in the worst case
-  // scenario (so ROMFS_ALIGN bytes in total)
-  if( pfd->baseaddr + pfd->size + len > pfsdata->max_size - ROMFS_ALIGN )
-    len = pfsdata->max_size - ( pfd->baseaddr + pfd->size ) - ROMFS_ALIGN;
-  pfsdata->writef( ptr, pfd->offset + pfd->baseaddr, len, pfsdata );
+  // scenario (so ROMFS_ALIGN bytes in total). If another file was created after this one,
+  // keep enough space for the filler after the file.
+  limit = pfd->resend == WOFS_NO_LIMIT ? pfsdata->max_size - ROMFS_ALIGN : pfd->resend - WOFS_FILLER_SIZE;
+  if( pfd->baseaddr + pfd->size + len > limit )
+    len = limit - ( pfd->baseaddr + pfd->size );
+  if( pfd->pwbuf )
+    wofsh_write_buffered( pfd, ( const u8* )ptr, len, pfsdata );
+  else
+  {
+    romfsh_write( ptr, pfd->offset + pfd->baseaddr, len, pfsdata );
+    pfd->size += len;
+    pfd->flushed = pfd->size;
+  }
   pfd->offset += len;
-  pfd->size += len;
+  wofs_stat_written += len;
   return len;
 }
 
@@ -301,10 +1228,12 @@ static _ssize_t romfs_read_r( struct _reent *r, int fd, void* ptr, size_t len, v
     r->_errno = EBADF;
     return -1;
   }
+  if( pfd->pwbuf )
+    wofsh_flush( pfd, pfsdata );
   if( pfsdata->flags & ROMFS_FS_FLAG_DIRECT )
     memcpy( ptr, pfsdata->pbase + pfd->offset + pfd->baseaddr, actlen );
   else
-    actlen = pfsdata->readf( ptr, pfd->offset + pfd->baseaddr, actlen, pfsdata );
+    actlen = romfsh_read( ptr, pfd->offset + pfd->baseaddr, actlen, pfsdata );
   pfd->offset += actlen;
   return actlen;
 }
@@ -344,9 +1273,11 @@ static u32 romfs_dir_data = 0;
 // opendir
 static void* romfs_opendir_r( struct _reent *r, const char* dname, void *pdata )
 {
+  FSDATA *pfsdata = ( FSDATA* )pdata;
+
   if( !dname || strlen( dname ) == 0 || ( strlen( dname ) == 1 && !strcmp( dname, "/" ) ) )
   {
-    romfs_dir_data = 0;
+    romfs_dir_data = pfsdata->first;
     return &romfs_dir_data;
   }
   return NULL;
@@ -359,36 +1290,21 @@ static struct dm_dirent* romfs_readdir_r( struct _reent *r, void *d, void *pdata
 {
   u32 off = *( u32* )d;
   struct dm_dirent *pent = &dm_shared_dirent;
-  unsigned j;
   FSDATA *pfsdata = ( FSDATA* )pdata;
+  u32 data;
   int is_deleted;
  
   while( 1 )
   {
     if( romfsh_read8( off, pfsdata ) == WOFS_END_MARKER_CHAR )
       return NULL;
-    j = 0;
-    while( ( dm_shared_fname[ j ++ ] = romfsh_read8( off ++, pfsdata ) ) != '\0' );
-    pent->fname = dm_shared_fname;
-    off = ( off + ROMFS_ALIGN - 1 ) & ~( ROMFS_ALIGN - 1 );
-    if( romfsh_is_wofs( pfsdata ) )
-    {
-      is_deleted = romfsh_read8( off, pfsdata ) == WOFS_FILE_DELETED;
-      off += WOFS_DEL_FIELD_SIZE;
-    }
-    else
-      is_deleted = 0;
-    pent->fsize = romfsh_read8( off, pfsdata ) + ( romfsh_read8( off + 1, pfsdata ) << 8 );
-    pent->fsize += ( romfsh_read8( off + 2, pfsdata ) << 16 ) + ( romfsh_read8( off + 3, pfsdata ) << 24 );
-    pent->ftime = 0;
-    pent->flags = 0;
-    off += ROMFS_SIZE_LEN;
-    off += pent->fsize;
-    if( romfsh_is_wofs( pfsdata ) )
-      off = ( off + ROMFS_ALIGN - 1 ) & ~( ROMFS_ALIGN - 1 );
+    off = romfsh_read_header( off, pfsdata, dm_shared_fname, &data, &pent->fsize, &is_deleted );
     if( !is_deleted )
       break;
   }
+  pent->fname = dm_shared_fname;
+  pent->ftime = 0;
+  pent->flags = 0;
   *( u32* )d = off;
   return pent;
 }
@@ -406,12 +1322,38 @@ static const char* romfs_getaddr_r( struct _reent *r, int fd, void *pdata )
   FD* pfd = fd_table + fd;
   FSDATA *pfsdata = ( FSDATA* )pdata;
 
+  if( pfd->pwbuf )
+    wofsh_flush( pfd, pfsdata );
   if( pfsdata->flags & ROMFS_FS_FLAG_DIRECT )
     return ( const char* )pfsdata->pbase + pfd->baseaddr;
   else
     return NULL;
 }
 
+// ioctl
+static int romfs_ioctl_r( struct _reent *r, int fd, int req, void *arg, void *pdata )
+{
+  FD* pfd = fd_table + fd;
+  FSDATA *pfsdata = ( FSDATA* )pdata;
+  DM_MAP_INFO *pmap = ( DM_MAP_INFO* )arg;
+
+  if( req != DM_IOCTL_MAP )
+  {
+    r->_errno = EINVAL;
+    return -1;
+  }
+  // Only the files of a zero terminated, directly accessible ROMFS can be mapped
+  // (WOFS files can be moved by compaction)
+  if( ( pfsdata->flags & ( ROMFS_FS_FLAG_DIRECT | ROMFS_FS_FLAG_ZEROTERM | ROMFS_FS_FLAG_WO ) ) != ( ROMFS_FS_FLAG_DIRECT | ROMFS_FS_FLAG_ZEROTERM ) )
+  {
+    r->_errno = ENOSYS;
+    return -1;
+  }
+  pmap->addr = ( const char* )pfsdata->pbase + pfd->baseaddr;
+  pmap->size = pfd->size;
+  return 0;
+}
+
 // ****************************************************************************
 // Our ROMFS device descriptor structure
 // These functions apply to both ROMFS and WOFS
@@ -427,18 +1369,23 @@ static const DM_DEVICE romfs_device =
   romfs_readdir_r,      // readdir
   romfs_closedir_r,     // closedir
   romfs_getaddr_r,      // getaddr
-  NULL                  // mkdir
+  NULL,                 // mkdir
+  romfs_ioctl_r,        // ioctl
+  DM_DEVICE_FLAG_CACHE_MISSING // flags
 };
 
 // ****************************************************************************
 // ROMFS instance descriptor
 
-static const FSDATA romfs_fsdata =
+// This must NOT be a const!
+static FSDATA romfs_fsdata =
 {
   ( u8* )romfiles_fs,
   ROMFS_FS_FLAG_DIRECT,
   NULL,
   NULL,
+  NULL,
+  NULL,
   sizeof( romfiles_fs )
 };
 
@@ -452,10 +1399,92 @@ static u32 sim_wofs_read( void *to, u32 fromaddr, u32 size, const void *pdata )
   return hostif_read( wofs_sim_fd, to, size );
 }
 
+// Simulated power cut: the simulator exits during the flash operation number
+// 'wofs_sim_cut' of the next compaction (read from WOFS_CUT_FNAME at startup).
+// If WOFS_CUT_FNAME contains 'w' followed by the number, the flash operations
+// done while files are opened in write mode are counted instead.
+static int sim_wofs_power_cut( const void *pdata )
+{
+  const FSDATA *pfsdata = ( const FSDATA* )pdata;
+
+  return wofs_sim_cut > 0 && romfs_fs_is_flag_set( pfsdata, wofs_sim_cut_flags ) && -- wofs_sim_cut == 0;
+}
+
+// Write 'size' bytes, ANDed with the existing data like a flash write
+static void sim_wofs_program( const u8 *pfrom, u32 toaddr, u32 size )
+{
+  u8 temp[ 256 ];
+  u32 chunk, i;
+
+  while( size > 0 )
+  {
+    chunk = fsmin( size, sizeof( temp ) );
+    hostif_lseek( wofs_sim_fd, ( long )toaddr, SEEK_SET );
+    hostif_read( wofs_sim_fd, temp, chunk );
+    for( i = 0; i < chunk; i ++ )
+      temp[ i ] &= pfrom[ i ];
+    hostif_lseek( wofs_sim_fd, ( long )toaddr, SEEK_SET );
+    hostif_write( wofs_sim_fd, temp, chunk );
+    pfrom += chunk;
+    toaddr += chunk;
+    size -= chunk;
+  }
+}
+
 static u32 sim_wofs_write( const void *from, u32 toaddr, u32 size, const void *pdata )
 {
-  hostif_lseek( wofs_sim_fd, ( long )toaddr, SEEK_SET );
-  return hostif_write( wofs_sim_fd, from, size );
+  if( sim_wofs_power_cut( pdata ) )
+  {
+    // Only a part of the data gets written
+    sim_wofs_program( ( const u8* )from, toaddr, size / 2 );
+    printf( "SIM_WOFS: power cut\n" );
+    hostif_exit();
+  }
+  sim_wofs_program( ( const u8* )from, toaddr, size );
+  return size;
+}
+
+static int sim_wofs_erase( u32 addr, const void *pdata )
+{
+  u8 temp[ 256 ];
+  unsigned i;
+
+  if( sim_wofs_power_cut( pdata ) )
+  {
+    printf( "SIM_WOFS: power cut\n" );
+    hostif_exit();
+  }
+  memset( temp, WOFS_END_MARKER_CHAR, sizeof( temp ) );
+  hostif_lseek( wofs_sim_fd, ( long )( addr & ~( WOFS_SIM_SECTOR_SIZE - 1 ) ), SEEK_SET );
+  for( i = 0; i < WOFS_SIM_SECTOR_SIZE; i += sizeof( temp ) )
+    hostif_write( wofs_sim_fd, temp, sizeof( temp ) );
+  return PLATFORM_OK;
+}
+
+static u32 sim_wofs_sector( u32 addr, u32 *pstart, u32 *psize, const void *pdata )
+{
+  *pstart = addr & ~( WOFS_SIM_SECTOR_SIZE - 1 );
+  *psize = WOFS_SIM_SECTOR_SIZE;
+  return addr / WOFS_SIM_SECTOR_SIZE;
+}
+
+// Read (and consume) the power cut counter from WOFS_CUT_FNAME
+static void sim_wofs_read_cut()
+{
+  char buf[ 16 ];
+  int fd, len;
+
+  if( ( fd = hostif_open( WOFS_CUT_FNAME, 2, 0666 ) ) == -1 )
+    return;
+  len = hostif_read( fd, buf, sizeof( buf ) - 1 );
+  buf[ len > 0 ? len : 0 ] = '\0';
+  wofs_sim_cut_flags = buf[ 0 ] == 'w' ? ROMFS_FS_FLAG_WRITING : ROMFS_FS_FLAG_COMPACTING;
+  wofs_sim_cut = atoi( buf[ 0 ] == 'w' ? buf + 1 : buf );
+  memset( buf, ' ', sizeof( buf ) );
+  buf[ 0 ] = '0';
+  hostif_lseek( fd, 0, SEEK_SET );
+  hostif_write( fd, buf, len > 0 ? len : 1 );
+  hostif_close( fd );
 }
 
 // This must NOT be a const!
@@ -465,6 +1494,8 @@ static FSDATA wofs_sim_fsdata =
   ROMFS_FS_FLAG_WO,
   sim_wofs_read,
   sim_wofs_write,
+  sim_wofs_erase,
+  sim_wofs_sector,
   WOFS_SIZE
 };
 
@@ -478,6 +1509,8 @@ int wofs_format()
   u8 temp = WOFS_END_MARKER_CHAR;
   for( i = 0; i < WOFS_SIZE; i ++ )
     hostif_write( wofs_sim_fd, &temp, 1 );
+  romfsh_cache_invalidate( &wofs_sim_fsdata );
+  wofs_mount( &wofs_sim_fsdata, WOFS_SIZE );
   return 1;
 }
 
@@ -495,6 +1528,24 @@ static u32 sim_wofs_write( const void *from, u32 toaddr, u32 size, const void *p
   return platform_flash_write( from, toaddr, size );
 }
 
+static int wofs_flash_erase( u32 addr, const void *pdata )
+{
+  const FSDATA *pfsdata = ( const FSDATA* )pdata;
+
+  return platform_flash_erase_sector( platform_flash_get_sector_of_address( addr + ( u32 )pfsdata->pbase ) );
+}
+
+static u32 wofs_flash_sector( u32 addr, u32 *pstart, u32 *psize, const void *pdata )
+{
+  const FSDATA *pfsdata = ( const FSDATA* )pdata;
+  u32 start, end, sect;
+
+  sect = platform_flash_get_sector_bounds( addr + ( u32 )pfsdata->pbase, &start, &end );
+  *pstart = start - ( u32 )pfsdata->pbase;
+  *psize = end - start + 1;
+  return sect;
+}
+
 // This must NOT be a const!
 static FSDATA wofs_fsdata =
 {
@@ -502,35 +1553,59 @@ static FSDATA wofs_fsdata =
   ROMFS_FS_FLAG_WO | ROMFS_FS_FLAG_DIRECT,
   NULL,
   sim_wofs_write,
+  wofs_flash_erase,
+  wofs_flash_sector,
   0
 };
 
+// Total size of the flash available to WOFS
+#define WOFS_FLASH_SIZE       ( INTERNAL_FLASH_SIZE - ( ( u32 )wofs_fsdata.pbase - INTERNAL_FLASH_START_ADDRESS ) )
+
 // WOFS formatting function
 // Returns 1 if OK, 0 for error
 int wofs_format()
 {
   u32 sect_first, sect_last;
-  FD tempfd;
+  int res = 1;
 
   platform_flash_get_first_free_block_address( &sect_first );
   // Get the first free address in WOFS. We use this address to compute the last block that we need to
   // erase, instead of simply erasing everything from sect_first to the last Flash page. 
-  romfs_open_file( "\1", &tempfd, &wofs_fsdata, &sect_last, NULL );
+  sect_last = romfs_get_end( &wofs_fsdata );
   sect_last = platform_flash_get_sector_of_address( sect_last + ( u32 )wofs_fsdata.pbase );
   while( sect_first <= sect_last )
     if( platform_flash_erase_sector( sect_first ++ ) == PLATFORM_ERR )
-      return 0;
-  return 1;
+    {
+      res = 0;
+      break;
+    }
+#ifdef WOFS_ENABLE_COMPACTION
+  // Also erase the compaction journal
+  if( res && romfs_fs_is_flag_set( ( &wofs_fsdata ), ROMFS_FS_FLAG_COMPACT ) )
+    res = wofsh_erase( wofs_fsdata.journal, wofs_fsdata.swap, &wofs_fsdata );
+#endif
+  wofs_mount( &wofs_fsdata, WOFS_FLASH_SIZE );
+  return res;
 }
 
 #endif // #ifdef BUILD_WOFS
 
+#ifdef BUILD_WOFS
+// Return the number of bytes written to WOFS files and the number of write
+// operations used to write them to the flash
+void wofs_get_stats( u32 *pwritten, u32 *pprogram )
+{
+  *pwritten = wofs_stat_written;
+  *pprogram = wofs_stat_program;
+}
+#endif // #ifdef BUILD_WOFS
+
 // Initialize both ROMFS and WOFS as needed
 int romfs_init()
 {
   unsigned i;
 
-  for( i = 0; i < TOTAL_MAX_FDS; i ++ )
+  for( i = 0; i < ROMFS_MAX_FDS; i ++ )
   {
     memset( fd_table + i, 0xFF, sizeof( FD ) );
     fd_table[ i ].flags = 0;
@@ -548,16 +1623,19 @@ int romfs_init()
     hostif_close( wofs_sim_fd );
     wofs_sim_fd = hostif_open( WOFS_FNAME, 2, 0666 );
   }
+  sim_wofs_read_cut();
+  wofs_mount( &wofs_sim_fsdata, WOFS_SIZE );
   dm_register( "/wo", ( void* )&wofs_sim_fsdata, &romfs_device );
 #endif // #if defined( ELUA_CPU_LINUX ) && defined( BUILD_WOFS )
 #if defined( BUILD_WOFS ) && !defined( ELUA_CPU_LINUX )
   // Get the start address and size of WOFS and register it
   wofs_fsdata.pbase = ( u8* )platform_flash_get_first_free_block_address( NULL );
-  wofs_fsdata.max_size = INTERNAL_FLASH_SIZE - ( ( u32 )wofs_fsdata.pbase - INTERNAL_FLASH_START_ADDRESS );
+  wofs_mount( &wofs_fsdata, WOFS_FLASH_SIZE );
   dm_register( "/wo", &wofs_fsdata, &romfs_device );
 #endif // ifdef BUILD_WOFS
 #ifdef BUILD_ROMFS
   // Register the ROM filesystem
+  romfs_index_init( &romfs_fsdata );
   dm_register( "/rom", ( void* )&romfs_fsdata, &romfs_device );
 #endif // #ifdef BUILD_ROMFS
   return 0;
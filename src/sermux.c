@@ -0,0 +1,136 @@
+// Serial multiplexer packet mode (shared by eLua and the mux program)
+
+#include "type.h"
+#include "sermux.h"
+
+// Frame receiver states
+enum
+{
+  SERMUX_RXS_IDLE,
+  SERMUX_RXS_CMD,
+  SERMUX_RXS_SID,
+  SERMUX_RXS_LEN,
+  SERMUX_RXS_DATA,
+  SERMUX_RXS_CRCH,
+  SERMUX_RXS_CRCL,
+  SERMUX_RXS_SYNC
+};
+
+// *****************************************************************************
+// CRC16 (CCITT, same polynomial as XMODEM)
+
+static u16 sermux_crc16_byte( u16 crc, u8 data )
+{
+  unsigned j;
+
+  crc ^= ( u16 )data << 8;
+  for( j = 0; j < 8; j ++ )
+  {
+    if( crc & 0x8000 )
+      crc = ( crc << 1 ) ^ 0x1021;
+    else
+      crc = crc << 1;
+  }
+  return crc;
+}
+
+u16 sermux_crc16( u16 crc, const u8 *p, unsigned size )
+{
+  while( size -- )
+    crc = sermux_crc16_byte( crc, *p ++ );
+  return crc;
+}
+
+// Write a frame header for 'size' bytes of data (1 to SERMUX_FRAME_MAX_SIZE)
+// The CRC must be computed starting with phdr + 2
+unsigned sermux_frame_header( u8 *phdr, u8 sid, unsigned size )
+{
+  phdr[ 0 ] = SERMUX_ESCAPE_CHAR;
+  phdr[ 1 ] = SERMUX_CMD_FRAME;
+  phdr[ 2 ] = sid;
+  phdr[ 3 ] = ( u8 )size;
+  return SERMUX_FRAME_HEADER_SIZE;
+}
+
+// *****************************************************************************
+// Frame receiver
+
+void sermux_rx_init( SERMUX_FRAME_RX *prx )
+{
+  prx->state = SERMUX_RXS_IDLE;
+}
+
+// Feed a byte to the receiver. Returns SERMUX_RX_FRAME when a frame with a 
+// valid CRC was received, SERMUX_RX_RAW for a byte that is not part of the 
+// packet protocol (the peer is in the byte oriented mode) and SERMUX_RX_NONE 
+// when more data is needed. After an error the receiver drops everything up 
+// to the next escape char.
+int sermux_rx_byte( SERMUX_FRAME_RX *prx, u8 data )
+{
+  switch( prx->state )
+  {
+    case SERMUX_RXS_IDLE:
+    case SERMUX_RXS_SYNC:
+      if( data == SERMUX_ESCAPE_CHAR )
+        prx->state = SERMUX_RXS_CMD;
+      else if( prx->state == SERMUX_RXS_IDLE )
+        return SERMUX_RX_RAW;
+      break;
+
+    case SERMUX_RXS_CMD:
+      prx->state = SERMUX_RXS_IDLE;
+      if( data == SERMUX_CMD_PACKET_REQ )
+        return SERMUX_RX_REQ;
+      else if( data == SERMUX_CMD_PACKET_ACK )
+        return SERMUX_RX_ACK;
+      else if( data != SERMUX_CMD_FRAME )
+      {
+        prx->state = SERMUX_RXS_SYNC;
+        return SERMUX_RX_ERROR;
+      }
+      prx->crc = SERMUX_CRC_INIT;
+      prx->state = SERMUX_RXS_SID;
+      break;
+
+    case SERMUX_RXS_SID:
+      prx->sid = data;
+      prx->crc = sermux_crc16_byte( prx->crc, data );
+      prx->state = SERMUX_RXS_LEN;
+      break;
+
+    case SERMUX_RXS_LEN:
+      if( data == 0 || data > SERMUX_FRAME_MAX_SIZE )
+      {
+        prx->state = SERMUX_RXS_SYNC;
+        return SERMUX_RX_ERROR;
+      }
+      prx->len = data;
+      prx->pos = 0;
+      prx->crc = sermux_crc16_byte( prx->crc, data );
+      prx->state = SERMUX_RXS_DATA;
+      break;
+
+    case SERMUX_RXS_DATA:
+      prx->data[ prx->pos ++ ] = data;
+      prx->crc = sermux_crc16_byte( prx->crc, data );
+      if( prx->pos == prx->len )
+        prx->state = SERMUX_RXS_CRCH;
+      break;
+
+    case SERMUX_RXS_CRCH:
+      prx->rxcrc = ( u16 )data << 8;
+      prx->state = SERMUX_RXS_CRCL;
+      break;
+
+    case SERMUX_RXS_CRCL:
+      if( ( prx->rxcrc | data ) != prx->crc )
+      {
+        prx->state = SERMUX_RXS_SYNC;
+        return SERMUX_RX_CRC_ERROR;
+      }
+      prx->state = SERMUX_RXS_IDLE;
+      return SERMUX_RX_FRAME;
+  }
+  return SERMUX_RX_NONE;
+}
+
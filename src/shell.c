@@ -68,9 +68,11 @@ static void shell_help( int argc, char **argv )
   printf( "  ls or dir   - lists filesystems files and sizes\n" );
   printf( "  cat or type - lists file contents\n" );
   printf( "  lua [args]  - run Lua with the given arguments\n" );
-  printf( "  recv [path] - receive a file via XMODEM. If path is given save it there, otherwise run it.\n");
+  printf( "  recv [-g] [path] - receive a file via XMODEM/YMODEM. If path is given save it there, otherwise run it.\n");
+  printf( "                     -g: streaming YMODEM-g transfer (needs a path)\n");
   printf( "  cp <src> <dst> - copy source file 'src' to 'dst'\n" );
   printf( "  wofmt       - format the internal WOFS\n" );
+  printf( "  wostat      - print the WOFS write statistics\n" );
   printf( "  ver         - print eLua version\n" );
 }
 
@@ -83,22 +85,77 @@ static void shell_lua( int argc, char **argv )
 }
 
 // 'recv' handler
+#ifdef BUILD_XMODEM
+// Sink used to write the received file directly to its destination
+static int shell_recv_sink( const u8 *pdata, unsigned size, void *psink )
+{
+  return fwrite( pdata, 1, size, ( FILE* )psink ) == size ? 0 : XMODEM_ERROR_WRITE;
+}
+#endif // #ifdef BUILD_XMODEM
+
 static void shell_recv( int argc, char **argv )
 {
 #ifndef BUILD_XMODEM
   printf( "XMODEM support not compiled, unable to recv\n" );
 #else // #ifndef BUILD_XMODEM
 
-  char *p;
   long actsize;
   lua_State* L;
+  int flags = 0;
+  const char *path = NULL;
+  FILE *foutput;
 
+  if( argc > 1 && !strcmp( argv[ 1 ], "-g" ) )
+  {
+    flags = XMODEM_FLAG_STREAMING;
+    argc --;
+    argv ++;
+  }
   if( argc > 2 )
   {
-    printf( "Usage: recv [path]\n" );
+    printf( "Usage: recv [-g] [path]\n" );
+    return;
+  }
+  if( argc == 2 )
+    path = argv[ 1 ];
+  else if( flags )
+  {
+    printf( "Streaming mode (-g) needs a file name\n" );
     return;
   }
 
+  // we've received an argument, write the file directly to it
+  if( path )
+  {
+    if( ( foutput = fopen( path, "wb" ) ) == NULL )
+    {
+      printf( "unable to open file %s\n", path );
+      return;
+    }
+    printf( "Waiting for file ... " );
+    actsize = xmodem_receive_stream( shell_recv_sink, foutput, flags );
+    // The last data is written when the file is closed, so this can fail too
+    if( fclose( foutput ) != 0 && actsize >= 0 )
+      actsize = XMODEM_ERROR_WRITE;
+    if( actsize >= 0 )
+    {
+      printf( "done, got %u bytes\nreceived and saved as %s\n", ( unsigned )actsize, path );
+      return;
+    }
+    if( actsize == XMODEM_ERROR_WRITE )
+      printf( "unable to save file %s (no space left on target?)\n", path );
+    else
+      printf( "XMODEM error\n" );
+    // Don't leave a partial file behind (the file systems can't remove files,
+    // so it's truncated to 0 bytes instead)
+    if( ( foutput = fopen( path, "wb" ) ) != NULL && fclose( foutput ) == 0 )
+      printf( "the partial file %s was truncated to 0 bytes\n", path );
+    else
+      printf( "the partial file %s might be incomplete\n", path );
+    return;
+  }
+
+  // no arg, receive the file in memory and run it with lua.
   if( ( shell_prog = malloc( XMODEM_INITIAL_BUFFER_SIZE ) ) == NULL )
   {
     printf( "Unable to allocate memory\n" );
@@ -115,48 +172,22 @@ static void shell_recv( int argc, char **argv )
       printf( "XMODEM error\n" );
     return;
   }
-  // Eliminate the XMODEM padding bytes
-  p = shell_prog + actsize - 1;
-  while( *p == '\x1A' )
-    p --;
-  p ++;
-  printf( "done, got %u bytes\n", ( unsigned )( p - shell_prog ) );          
+  printf( "done, got %u bytes\n", ( unsigned )actsize );          
   
-  // we've received an argument, try saving it to a file
-  if( argc == 2 )
+  if( ( L = lua_open() ) == NULL )
   {
-    FILE *foutput = fopen( argv[ 1 ], "w" );
-    size_t file_sz = p - shell_prog;
-    if( foutput == NULL )
-    {
-      printf( "unable to open file %s\n", argv[ 1 ] );
-      free( shell_prog );
-      shell_prog = NULL;
-      return;
-    }
-    if( fwrite( shell_prog, sizeof( char ), file_sz, foutput ) == file_sz )
-      printf( "received and saved as %s\n", argv[ 1 ] );
-    else
-      printf( "unable to save file %s (no space left on target?)\n", argv[ 1 ] );
-    fclose( foutput );
+    printf( "Unable to create Lua state\n" );
+    free( shell_prog );
+    shell_prog = NULL;
+    return;
   }
-  else // no arg, running the file with lua.
-  {
-    if( ( L = lua_open() ) == NULL )
-    {
-      printf( "Unable to create Lua state\n" );
-      free( shell_prog );
-      shell_prog = NULL;
-      return;
-    }
-    luaL_openlibs( L );
-    if( luaL_loadbuffer( L, shell_prog, p - shell_prog, "xmodem" ) != 0 )
+  luaL_openlibs( L );
+  if( luaL_loadbuffer( L, shell_prog, actsize, "xmodem" ) != 0 )
+    printf( "Error: %s\n", lua_tostring( L, -1 ) );
+  else
+    if( lua_pcall( L, 0, LUA_MULTRET, 0 ) != 0 )
       printf( "Error: %s\n", lua_tostring( L, -1 ) );
-    else
-      if( lua_pcall( L, 0, LUA_MULTRET, 0 ) != 0 )
-        printf( "Error: %s\n", lua_tostring( L, -1 ) );
-    lua_close( L );
-  }
+  lua_close( L );
   free( shell_prog );
   shell_prog = NULL;
 #endif // #ifndef BUILD_XMODEM
@@ -386,6 +417,19 @@ static void shell_wofmt( int argc, char **argv )
 #endif // #ifndef BUILD_WOFS
 }
 
+// 'wostat' handler
+static void shell_wostat( int argc, char **argv )
+{
+#ifndef BUILD_WOFS
+  printf( "WOFS not enabled.\n" );
+#else // #ifndef BUILD_WOFS
+  u32 written, program;
+
+  wofs_get_stats( &written, &program );
+  printf( "%u bytes written to WOFS files, %u flash write operations\n", ( unsigned )written, ( unsigned )program );
+#endif // #ifndef BUILD_WOFS
+}
+
 // mkdir handler
 static void shell_mkdir( int argc, char **argv )
 {
@@ -412,6 +456,7 @@ static const SHELL_COMMAND shell_commands[] =
   { "type", shell_cat },
   { "cp", shell_cp },
   { "wofmt", shell_wofmt },
+  { "wostat", shell_wostat },
   { "mkdir", shell_mkdir },
   { NULL, NULL }
 };
@@ -118,15 +118,31 @@ struct namemap {
   u8_t retries;
   u8_t seqno;
   u8_t err;
-  char name[32];
+  u32 ttl;
+  char name[RESOLV_NAME_SIZE];
   uip_ipaddr_t ipaddr;
 };
 
-#ifndef UIP_CONF_RESOLV_ENTRIES
-#define RESOLV_ENTRIES 4
-#else /* UIP_CONF_RESOLV_ENTRIES */
+#if defined( ELUA_NET_DNS_CACHE_SIZE )
+#define RESOLV_ENTRIES ELUA_NET_DNS_CACHE_SIZE
+#elif defined( UIP_CONF_RESOLV_ENTRIES )
 #define RESOLV_ENTRIES UIP_CONF_RESOLV_ENTRIES
-#endif /* UIP_CONF_RESOLV_ENTRIES */
+#else
+#define RESOLV_ENTRIES 4
+#endif
+
+/** \internal Limits (in seconds) for the lifetime of cached answers.
+    Failed lookups are remembered for RESOLV_NEG_TTL seconds. */
+#ifdef ELUA_NET_DNS_MAX_TTL
+#define RESOLV_MAX_TTL ELUA_NET_DNS_MAX_TTL
+#else
+#define RESOLV_MAX_TTL 3600
+#endif
+#ifdef ELUA_NET_DNS_NEG_TTL
+#define RESOLV_NEG_TTL ELUA_NET_DNS_NEG_TTL
+#else
+#define RESOLV_NEG_TTL 30
+#endif
 
 
 static struct namemap names[RESOLV_ENTRIES];
@@ -184,6 +200,7 @@ check_entries(void)
         if(--namemapptr->tmr == 0) {
           if(++namemapptr->retries == MAX_RETRIES) {
             namemapptr->state = STATE_ERROR;
+            namemapptr->ttl = RESOLV_NEG_TTL;
             resolv_found(namemapptr->name, NULL);
             continue;
           }
@@ -269,6 +286,7 @@ newdata(void)
     /* Check for error. If so, call callback to inform. */
     if(namemapptr->err != 0) {
       namemapptr->state = STATE_ERROR;
+      namemapptr->ttl = RESOLV_NEG_TTL;
       resolv_found(namemapptr->name, NULL);
       return;
     }
@@ -314,6 +332,13 @@ newdata(void)
            we want. */
         namemapptr->ipaddr[0] = ans->ipaddr[0];
         namemapptr->ipaddr[1] = ans->ipaddr[1];
+        namemapptr->ttl = ((u32)htons(ans->ttl[0]) << 16) | htons(ans->ttl[1]);
+        if(namemapptr->ttl > RESOLV_MAX_TTL) {
+          namemapptr->ttl = RESOLV_MAX_TTL;
+        } else if(namemapptr->ttl == 0) {
+          /* Keep the answer long enough for the caller to use it */
+          namemapptr->ttl = 1;
+        }
         
         resolv_found(namemapptr->name, namemapptr->ipaddr);
         return;
@@ -322,6 +347,10 @@ newdata(void)
       }
       --nanswers;
     }
+    /* No address in the answer */
+    namemapptr->state = STATE_ERROR;
+    namemapptr->ttl = RESOLV_NEG_TTL;
+    resolv_found(namemapptr->name, NULL);
   }
 
 }
@@ -346,30 +375,57 @@ resolv_appcall(void)
 /**
  * Queues a name so that a question for the name will be sent out.
  *
+ * If the name is already in the cache (answered, failed or still being
+ * asked) no new question is sent.
+ *
  * \param name The hostname that is to be queried.
+ *
+ * \return A handle for resolv_status(), or -1 if the name is too long
+ * or all the entries are waiting for answers.
  */
 /*---------------------------------------------------------------------------*/
-void
+int
 resolv_query(char *name)
 {
   static u8_t i;
   static u8_t lseq, lseqi;
   register struct namemap *nameptr;
-      
-  lseq = lseqi = 0;
+
+  if(strlen(name) >= RESOLV_NAME_SIZE) {
+    return -1;
+  }
+
+  for(i = 0; i < RESOLV_ENTRIES; ++i) {
+    nameptr = &names[i];
+    if(nameptr->state != STATE_UNUSED &&
+       strcmp(name, nameptr->name) == 0) {
+      return RESOLV_HANDLE(i, nameptr->seqno);
+    }
+  }
+
+  lseq = 0;
+  lseqi = RESOLV_ENTRIES;
   
   for(i = 0; i < RESOLV_ENTRIES; ++i) {
     nameptr = &names[i];
     if(nameptr->state == STATE_UNUSED) {
       break;
     }
-    if(seqno - nameptr->seqno > lseq) {
+    /* Replace the oldest entry, but never one that is still waiting
+       for an answer. */
+    if(nameptr->state == STATE_NEW || nameptr->state == STATE_ASKING) {
+      continue;
+    }
+    if(lseqi == RESOLV_ENTRIES || seqno - nameptr->seqno > lseq) {
       lseq = seqno - nameptr->seqno;
       lseqi = i;
     }
   }
 
   if(i == RESOLV_ENTRIES) {
+    if(lseqi == RESOLV_ENTRIES) {
+      return -1;
+    }
     i = lseqi;
     nameptr = &names[i];
   }
@@ -380,6 +436,61 @@ resolv_query(char *name)
   nameptr->state = STATE_NEW;
   nameptr->seqno = seqno;
   ++seqno;
+  return RESOLV_HANDLE(i, nameptr->seqno);
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Get the state of a query started with resolv_query().
+ *
+ * \param handle The handle returned by resolv_query().
+ * \param ipaddr A pointer to a 4-byte array that receives the IP address
+ * of the hostname when the query is done.
+ *
+ * \return RESOLV_STATUS_PENDING, RESOLV_STATUS_DONE or RESOLV_STATUS_ERROR.
+ * A query whose entry was reused or expired is reported as an error.
+ */
+/*---------------------------------------------------------------------------*/
+u8_t
+resolv_status(int handle, u16_t *ipaddr)
+{
+  struct namemap *nameptr;
+  u8_t i = handle & 0xff;
+
+  if(handle < 0 || i >= RESOLV_ENTRIES) {
+    return RESOLV_STATUS_ERROR;
+  }
+  nameptr = &names[i];
+  if(nameptr->seqno != (u8_t)(handle >> 8)) {
+    return RESOLV_STATUS_ERROR;
+  }
+  switch(nameptr->state) {
+  case STATE_NEW:
+  case STATE_ASKING:
+    return RESOLV_STATUS_PENDING;
+  case STATE_DONE:
+    uip_ipaddr_copy(ipaddr, nameptr->ipaddr);
+    return RESOLV_STATUS_DONE;
+  }
+  return RESOLV_STATUS_ERROR;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * Age the cached answers. Must be called once every second.
+ */
+/*---------------------------------------------------------------------------*/
+void
+resolv_timer(void)
+{
+  static u8_t i;
+  register struct namemap *nameptr;
+
+  for(i = 0; i < RESOLV_ENTRIES; ++i) {
+    nameptr = &names[i];
+    if((nameptr->state == STATE_DONE || nameptr->state == STATE_ERROR) &&
+       --nameptr->ttl == 0) {
+      nameptr->state = STATE_UNUSED;
+    }
+  }
 }
 /*---------------------------------------------------------------------------*/
 /**
@@ -457,7 +568,7 @@ resolv_init(void)
   static u8_t i;
   
   for(i = 0; i < RESOLV_ENTRIES; ++i) {
-    names[i].state = STATE_DONE;
+    names[i].state = STATE_UNUSED;
   }
 
 }
@@ -480,4 +591,8 @@ void resolv_conf( void *dnsserver )
 {
 }
 
+void resolv_timer()
+{
+}
+
 #endif // #ifdef BUILD_DNS
@@ -59,12 +59,29 @@
  */
 void resolv_found(char *name, u16_t *ipaddr);
 
+/** The maximum length of a hostname (including the terminating zero). */
+#ifdef ELUA_NET_DNS_NAME_SIZE
+#define RESOLV_NAME_SIZE ELUA_NET_DNS_NAME_SIZE
+#else
+#define RESOLV_NAME_SIZE 64
+#endif
+
+/* Query handles: entry index and the entry's sequence number. */
+#define RESOLV_HANDLE(i, seq) ((int)(i) | ((int)(seq) << 8))
+
+/* Return values of resolv_status(). */
+#define RESOLV_STATUS_PENDING 0
+#define RESOLV_STATUS_DONE    1
+#define RESOLV_STATUS_ERROR   2
+
 /* Functions. */
 void resolv_conf(u16_t *dnsserver);
 u16_t *resolv_getserver(void);
 void resolv_init(void);
 u16_t *resolv_lookup(char *name);
-void resolv_query(char *name);
+int resolv_query(char *name);
+u8_t resolv_status(int handle, u16_t *ipaddr);
+void resolv_timer(void);
 
 void resolv_appcall( void );
 
@@ -180,6 +180,8 @@ u8_t uip_forced_poll;   // 1 if forcing the polling, 0 if the polling is not for
 #if UIP_UDP
 struct uip_udp_conn *uip_udp_conn;
 struct uip_udp_conn uip_udp_conns[UIP_UDP_CONNS];
+uip_ipaddr_t uip_udp_dest_ipaddr;
+u16_t uip_udp_dest_port;
 #endif /* UIP_UDP */
 
 static u16_t ipid;           /* Ths ipid variable is an increasing
@@ -402,6 +404,80 @@ uip_udpchksum(void)
 #endif /* UIP_UDP_CHECKSUMS */
 #endif /* UIP_ARCH_CHKSUM */
 /*---------------------------------------------------------------------------*/
+#if UIP_TCP
+#if UIP_CONNS > 255
+#error "UIP_CONNS must be at most 255"
+#endif
+/* The CLOSED connections are kept in a FIFO, so a connection that was just
+   closed is reused as late as possible. */
+static u8_t uip_free_conns[UIP_CONNS];
+static u8_t uip_free_head, uip_free_count;
+
+static void
+uip_conn_free(struct uip_conn *conn)
+{
+  if(conn->tcpstateflags != UIP_CLOSED) {
+    conn->tcpstateflags = UIP_CLOSED;
+    uip_free_conns[(uip_free_head + uip_free_count++) % UIP_CONNS] = (u8_t)(conn - uip_conns);
+  }
+}
+
+static struct uip_conn *
+uip_conn_alloc(void)
+{
+  struct uip_conn *conn;
+
+  if(uip_free_count == 0) {
+    return 0;
+  }
+  conn = &uip_conns[uip_free_conns[uip_free_head]];
+  uip_free_head = (uip_free_head + 1) % UIP_CONNS;
+  --uip_free_count;
+  return conn;
+}
+
+/* When there are no CLOSED connections, the oldest connection in TIME_WAIT
+   is reused. Thanks to Eddie C. Dost for a very nice algorithm for the 
+   TIME_WAIT search. */
+static struct uip_conn *
+uip_conn_alloc_time_wait(void)
+{
+  struct uip_conn *conn = 0;
+
+  for(c = 0; c < UIP_CONNS; ++c) {
+    if(uip_conns[c].tcpstateflags == UIP_TIME_WAIT) {
+      if(conn == 0 ||
+         uip_conns[c].timer > conn->timer) {
+        conn = &uip_conns[c];
+      }
+    }
+  }
+  return conn;
+}
+
+/* Reserve a connection for a later call to uip_connect_socket() */
+int
+uip_conn_reserve(void)
+{
+  struct uip_conn *conn;
+
+  if((conn = uip_conn_alloc()) == 0) {
+    return -1;
+  }
+  conn->tcpstateflags = UIP_RESERVED;
+  return (int)(conn - uip_conns);
+}
+
+/* Release a connection reserved with uip_conn_reserve() */
+void
+uip_conn_release(int conn)
+{
+  if(uip_conns[conn].tcpstateflags == UIP_RESERVED) {
+    uip_conn_free(&uip_conns[conn]);
+  }
+}
+#endif /* UIP_TCP */
+/*---------------------------------------------------------------------------*/
 void
 uip_init(void)
 {
@@ -409,8 +485,10 @@ uip_init(void)
   for(c = 0; c < UIP_LISTENPORTS; ++c) {
     uip_listenports[c] = 0;
   }
+  uip_free_head = uip_free_count = 0;
   for(c = 0; c < UIP_CONNS; ++c) {
-    uip_conns[c].tcpstateflags = UIP_CLOSED;
+    uip_conns[c].tcpstateflags = UIP_RESERVED;
+    uip_conn_free(&uip_conns[c]);
   }
 #endif /* UIP_TCP */
 #if UIP_ACTIVE_OPEN
@@ -482,23 +560,12 @@ uip_prepare_conn( struct uip_conn* conn, uip_ipaddr_t *ripaddr, u16_t rport )
 struct uip_conn *
 uip_connect(uip_ipaddr_t *ripaddr, u16_t rport)
 {
-  register struct uip_conn *conn, *cconn;
+  register struct uip_conn *conn;
   
   uip_find_unused_port();
   
-  conn = 0;
-  for(c = 0; c < UIP_CONNS; ++c) {
-    cconn = &uip_conns[c];
-    if(cconn->tcpstateflags == UIP_CLOSED) {
-      conn = cconn;
-      break;
-    }
-    if(cconn->tcpstateflags == UIP_TIME_WAIT) {
-      if(conn == 0 ||
-         cconn->timer > conn->timer) {
-        conn = cconn;
-      }
-    }
+  if((conn = uip_conn_alloc()) == 0) {
+    conn = uip_conn_alloc_time_wait();
   }
 
   if(conn == 0) {
@@ -798,7 +865,7 @@ uip_process(u8_t flag)
        uip_connr->tcpstateflags == UIP_FIN_WAIT_2)) {
       ++(uip_connr->timer);
       if(uip_connr->timer == UIP_TIME_WAIT_TIMEOUT) {
-        uip_connr->tcpstateflags = UIP_CLOSED;
+        uip_conn_free(uip_connr);
       }
     } else if(uip_connr->tcpstateflags != UIP_CLOSED && uip_connr->tcpstateflags != UIP_RESERVED) {
       /* If the connection has outstanding data, we increase the
@@ -810,7 +877,7 @@ uip_process(u8_t flag)
              ((uip_connr->tcpstateflags == UIP_SYN_SENT ||
                uip_connr->tcpstateflags == UIP_SYN_RCVD) &&
               uip_connr->nrtx == UIP_MAXSYNRTX)) {
-            uip_connr->tcpstateflags = UIP_CLOSED;
+            uip_conn_free(uip_connr);
 
             /* We call UIP_APPCALL() with uip_flags set to
                UIP_TIMEDOUT to inform the application that the
@@ -1228,10 +1295,16 @@ uip_process(u8_t flag)
   UDPBUF->udpchksum = 0;
 
   BUF->srcport  = uip_udp_conn->lport;
-  BUF->destport = uip_udp_conn->rport;
-
   uip_ipaddr_copy(BUF->srcipaddr, uip_hostaddr);
-  uip_ipaddr_copy(BUF->destipaddr, uip_udp_conn->ripaddr);
+  if(uip_udp_dest_port != 0) {
+    /* Destination given by uip_udp_sendto() */
+    BUF->destport = uip_udp_dest_port;
+    uip_ipaddr_copy(BUF->destipaddr, uip_udp_dest_ipaddr);
+    uip_udp_dest_port = 0;
+  } else {
+    BUF->destport = uip_udp_conn->rport;
+    uip_ipaddr_copy(BUF->destipaddr, uip_udp_conn->ripaddr);
+  }
    
   uip_appdata = &uip_buf[UIP_LLH_LEN + UIP_IPUDPH_LEN];
 
@@ -1355,22 +1428,11 @@ uip_process(u8_t flag)
  found_listen:
   /* First we check if there are any connections avaliable. Unused
      connections are kept in the same table as used connections, but
-     unused ones have the tcpstate set to CLOSED. Also, connections in
-     TIME_WAIT are kept track of and we'll use the oldest one if no
-     CLOSED connections are found. Thanks to Eddie C. Dost for a very
-     nice algorithm for the TIME_WAIT search. */
-  uip_connr = 0;
-  for(c = 0; c < UIP_CONNS; ++c) {
-    if(uip_conns[c].tcpstateflags == UIP_CLOSED) {
-      uip_connr = &uip_conns[c];
-      break;
-    }
-    if(uip_conns[c].tcpstateflags == UIP_TIME_WAIT) {
-      if(uip_connr == 0 ||
-         uip_conns[c].timer > uip_connr->timer) {
-        uip_connr = &uip_conns[c];
-      }
-    }
+     unused ones have the tcpstate set to CLOSED (and are also kept in
+     a free list). Also, connections in TIME_WAIT are kept track of and
+     we'll use the oldest one if no CLOSED connections are found. */
+  if((uip_connr = uip_conn_alloc()) == 0) {
+    uip_connr = uip_conn_alloc_time_wait();
   }
 
   if(uip_connr == 0) {
@@ -1470,7 +1532,7 @@ uip_process(u8_t flag)
      sequence number of this reset is wihtin our advertised window
      before we accept the reset. */
   if(BUF->flags & TCP_RST) {
-    uip_connr->tcpstateflags = UIP_CLOSED;
+    uip_conn_free(uip_connr);
     UIP_LOG("tcp: got reset, aborting connection.");
     uip_flags = UIP_ABORT;
     UIP_APPCALL();
@@ -1632,7 +1694,7 @@ uip_process(u8_t flag)
     uip_flags = UIP_ABORT;
     UIP_APPCALL();
     /* The connection is closed after we send the RST */
-    uip_conn->tcpstateflags = UIP_CLOSED;
+    uip_conn_free(uip_conn);
     goto reset;
 #endif /* UIP_ACTIVE_OPEN */
     
@@ -1648,7 +1710,8 @@ uip_process(u8_t flag)
     state. We require that there is no outstanding data; otherwise the
     sequence numbers will be screwed up. */
 
-    if(BUF->flags & TCP_FIN && !(uip_connr->tcpstateflags & UIP_STOPPED)) {
+    if(BUF->flags & TCP_FIN && !(uip_connr->tcpstateflags & UIP_STOPPED) &&
+       uip_len <= UIP_APPWINDOW(uip_connr)) {
       if(uip_outstanding(uip_connr)) {
         goto drop;
       }
@@ -1691,8 +1754,10 @@ uip_process(u8_t flag)
        by setting the UIP_NEWDATA flag and update the sequence number
        we acknowledge. If the application has stopped the dataflow
        using uip_stop(), we must not accept any data packets from the
-       remote host. */
-    if(uip_len > 0 && !(uip_connr->tcpstateflags & UIP_STOPPED)) {
+       remote host. Data that doesn't fit the advertised window is
+       dropped, the remote host will retransmit it. */
+    if(uip_len > 0 && !(uip_connr->tcpstateflags & UIP_STOPPED) &&
+       uip_len <= UIP_APPWINDOW(uip_connr)) {
       uip_flags |= UIP_NEWDATA;
       uip_add_rcv_nxt(uip_len);
     }
@@ -1740,7 +1805,7 @@ uip_process(u8_t flag)
       
       if(uip_flags & UIP_ABORT) {
         uip_slen = 0;
-        uip_connr->tcpstateflags = UIP_CLOSED;
+        uip_conn_free(uip_connr);
         BUF->flags = TCP_RST | TCP_ACK;
         goto tcp_send_nodata;
       }
@@ -1813,7 +1878,7 @@ uip_process(u8_t flag)
     /* We can close this connection if the peer has acknowledged our
        FIN. This is indicated by the UIP_ACKDATA flag. */
     if(uip_flags & UIP_ACKDATA) {
-      uip_connr->tcpstateflags = UIP_CLOSED;
+      uip_conn_free(uip_connr);
       uip_flags = UIP_CLOSE;
       UIP_APPCALL();
     }
@@ -1913,8 +1978,8 @@ uip_process(u8_t flag)
        window so that the remote host will stop sending data. */
     BUF->wnd[0] = BUF->wnd[1] = 0;
   } else {
-    BUF->wnd[0] = ((UIP_RECEIVE_WINDOW) >> 8);
-    BUF->wnd[1] = ((UIP_RECEIVE_WINDOW) & 0xff);
+    BUF->wnd[0] = ((UIP_APPWINDOW(uip_connr)) >> 8);
+    BUF->wnd[1] = ((UIP_APPWINDOW(uip_connr)) & 0xff);
   }
 
  tcp_send_noconn:
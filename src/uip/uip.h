@@ -309,11 +309,15 @@ void uip_setipid(u16_t id);
                                uip_conns[conn].tcpstateflags != UIP_RESERVED )
 
 /**
- * Reserve a connection (for a later call to connect) and check if connection
- * is reserved
+ * Reserve a free connection (for a later call to uip_connect_socket()),
+ * release a reserved connection and check if connection is reserved
  *
+ * uip_conn_reserve() returns the connection ID or -1 if there are no free
+ * connections. Free connections are kept in a list, so this doesn't scan
+ * the connection table.
  */
-#define uip_conn_reserve(conn) (uip_conns[conn].tcpstateflags = UIP_RESERVED)
+int uip_conn_reserve(void);
+void uip_conn_release(int conn);
 #define uip_conn_is_reserved(conn) (uip_conns[conn].tcpstateflags == UIP_RESERVED)
 
 /**
@@ -816,6 +820,22 @@ struct uip_udp_conn *uip_udp_new(uip_ipaddr_t *ripaddr, u16_t rport);
  */
 #define uip_udp_send(len) uip_send((char *)uip_appdata, len)
 
+/**
+ * Send a UDP datagram of length len to the given remote IP address and
+ * port, instead of the remote address and port of the connection.
+ *
+ * This is used for unconnected sockets (that receive from any host).
+ *
+ * \param len The length of the data in the uip_buf buffer.
+ * \param addr The IP address of the remote host.
+ * \param port The remote port number, in network byte order.
+ *
+ * \hideinitializer
+ */
+#define uip_udp_sendto(len, addr, port) do { uip_ipaddr_copy(uip_udp_dest_ipaddr, addr); \
+                                             uip_udp_dest_port = port; \
+                                             uip_udp_send(len); } while(0)
+
 /** @} */
 
 /* uIP convenience and converting functions. */
@@ -1243,6 +1263,12 @@ struct uip_udp_conn {
  */
 extern struct uip_udp_conn *uip_udp_conn;
 extern struct uip_udp_conn uip_udp_conns[UIP_UDP_CONNS];
+
+/**
+ * The destination of the datagram sent by uip_udp_sendto().
+ */
+extern uip_ipaddr_t uip_udp_dest_ipaddr;
+extern u16_t uip_udp_dest_port;
 #endif /* UIP_UDP */
 
 /**
@@ -330,6 +330,21 @@
 #define UIP_RECEIVE_WINDOW UIP_CONF_RECEIVE_WINDOW
 #endif
 
+/**
+ * The window advertised for a given connection.
+ *
+ * An application that buffers received data can use this to advertise
+ * the free space in its buffer. Data that doesn't fit the window is
+ * not acknowledged.
+ *
+ * \hideinitializer
+ */
+#ifdef UIP_CONF_APPWINDOW
+#define UIP_APPWINDOW(conn) UIP_CONF_APPWINDOW(conn)
+#else
+#define UIP_APPWINDOW(conn) UIP_RECEIVE_WINDOW
+#endif
+
 /**
  * How long a connection should stay in the TIME_WAIT state.
  *
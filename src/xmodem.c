@@ -39,15 +39,18 @@
 #ifdef BUILD_XMODEM
 
 #define PXM_ACKET_SIZE    128
+#define PXM_ACKET_SIZE_1K 1024
 static p_xm_send_func xmodem_out_func;
 static p_xm_recv_func xmodem_in_func;
 
 // Line control codes
 #define XM_SOH  0x01
+#define XM_STX  0x02
 #define XM_ACK  0x06
 #define XM_NAK  0x15
 #define XM_CAN  0x18
 #define XM_EOT  0x04
+#define XM_PAD  0x1A
 
 // Arguments to xmodem_flush
 #define XMODEM_FLUSH_ONLY       0
@@ -56,6 +59,9 @@ static p_xm_recv_func xmodem_in_func;
 // Delay in "flush packet" mode
 #define XMODEM_PXM_ACKET_DELAY     10000UL
 
+// File size when not known (XMODEM or YMODEM header without size)
+#define XMODEM_NO_SIZE          0xFFFFFFFFUL
+
 void xmodem_init( p_xm_send_func send_func, p_xm_recv_func recv_func )
 {
   xmodem_out_func = send_func;
@@ -63,39 +69,24 @@ void xmodem_init( p_xm_send_func send_func, p_xm_recv_func recv_func )
 }
 
 // Utility function: flush the receive buffer
+// When cancelling, XM_CAN is sent first, so that a streaming sender stops sending
 static void xmodem_flush( int how )
 {
-  while( xmodem_in_func( XMODEM_PXM_ACKET_DELAY ) != -1 );
   if( how == XMODEM_FLUSH_AND_XM_CAN )
   {
     xmodem_out_func( XM_CAN );
     xmodem_out_func( XM_CAN );
     xmodem_out_func( XM_CAN );
   }
+  while( xmodem_in_func( XMODEM_PXM_ACKET_DELAY ) != -1 );
 }
 
-// This private function receives a x-modem record to the pointer and
-// returns 1 on success and 0 on error
-static int xmodem_get_record( unsigned char blocknum, unsigned char *pbuf )
+// CRC16 (CCITT) of a data block
+static unsigned xmodem_crc( const unsigned char *pbuf, unsigned size )
 {
-  unsigned chk, j, size;
-  int ch;
-  
-  // Read packet
-  for( j = 0; j < PXM_ACKET_SIZE + 4; j ++ )
-  {
-    if( ( ch = xmodem_in_func( XMODEM_TIMEOUT ) ) == -1 )
-      goto err;
-    pbuf[ j ] = ( unsigned char )ch;
-  }
+  unsigned chk = 0, j;
 
-  // Check block number
-  if( *pbuf ++ != blocknum )
-    goto err;
-  if( *pbuf ++ != ( unsigned char )~blocknum )
-    goto err;
-  // Check CRC
-  for( size = chk = 0; size < PXM_ACKET_SIZE; size++, pbuf ++ ) 
+  for( ; size > 0; size --, pbuf ++ ) 
   {
     chk = chk ^ *pbuf << 8;
     for( j = 0; j < 8; j ++ ) 
@@ -106,79 +97,255 @@ static int xmodem_get_record( unsigned char blocknum, unsigned char *pbuf )
         chk = chk << 1;
     }
   }
-  chk &= 0xFFFF;
-  if( *pbuf ++ != ( ( chk >> 8 ) & 0xFF ) )
-    goto err;
-  if( *pbuf ++ != ( chk & 0xFF ) )
-    goto err;
-  return 1;
+  return chk & 0xFFFF;
+}
+
+// This private function receives a x-modem record with 'size' data bytes
+// (the part after SOH/STX) to the pointer and returns its block number
+// on success and -1 on error
+static int xmodem_get_record( unsigned char *pbuf, unsigned size )
+{
+  unsigned chk, j;
+  int ch;
   
-err:
-  xmodem_out_func( XM_NAK );
+  // Read packet
+  for( j = 0; j < size + 4; j ++ )
+  {
+    if( ( ch = xmodem_in_func( XMODEM_TIMEOUT ) ) == -1 )
+      return -1;
+    pbuf[ j ] = ( unsigned char )ch;
+  }
+
+  // Check block number
+  if( pbuf[ 0 ] != ( unsigned char )~pbuf[ 1 ] )
+    return -1;
+  // Check CRC
+  chk = xmodem_crc( pbuf + 2, size );
+  if( pbuf[ size + 2 ] != ( ( chk >> 8 ) & 0xFF ) || pbuf[ size + 3 ] != ( chk & 0xFF ) )
+    return -1;
+  return pbuf[ 0 ];
+}
+
+// Send a block of data to the sink, without the padding after the end of the file.
+// The padding is removed using the file size (YMODEM) or, for the last block of
+// a XMODEM file, by removing the trailing XM_PAD bytes.
+// Returns 0 on success or the error code returned by the sink
+static int xmodem_write( p_xm_sink_func sink, void *pdata, const unsigned char *pbuf, unsigned size, int last, u32 filesize, u32 *ptotal )
+{
+  int res;
+
+  if( filesize != XMODEM_NO_SIZE )
+  {
+    if( *ptotal >= filesize )
+      size = 0;
+    else if( size > filesize - *ptotal )
+      size = filesize - *ptotal;
+  }
+  else if( last )
+    while( size > 0 && pbuf[ size - 1 ] == XM_PAD )
+      size --;
+  if( size > 0 && ( res = sink( pbuf, size, pdata ) ) != 0 )
+    return res;
+  *ptotal += size;
   return 0;
 }
 
-// This global function receives a x-modem transmission consisting of
-// (potentially) several blocks.  Returns the number of bytes received or
-// an error code an error
-long xmodem_receive( char **dest )
+// Receive the YMODEM "end of batch" header (a header with an empty file name)
+// Only one file is received, the transfer of other files is cancelled
+static void xmodem_end_batch( char startch )
 {
-  int starting = 1, ch;
-  unsigned char packnum = 1, buf[ PXM_ACKET_SIZE + 4 ];
+  unsigned char buf[ PXM_ACKET_SIZE + 4 ];
   unsigned retries = XMODEM_RETRY_LIMIT;
-  u32 limit = XMODEM_INITIAL_BUFFER_SIZE, size = 0;
+  int ch;
+
+  while( retries-- )
+  {
+    xmodem_out_func( startch );
+    if( ( ch = xmodem_in_func( XMODEM_TIMEOUT ) ) != XM_SOH )
+      continue;
+    if( xmodem_get_record( buf, PXM_ACKET_SIZE ) != 0 )
+    {
+      xmodem_out_func( XM_NAK );
+      continue;
+    }
+    if( buf[ 2 ] == '\0' )
+      xmodem_out_func( XM_ACK );
+    else
+      xmodem_flush( XMODEM_FLUSH_AND_XM_CAN );
+    return;
+  }
+}
+
+// This global function receives a XMODEM (128 or 1K blocks) or YMODEM
+// transmission and sends the data to 'sink' as soon as it is received.
+// With XMODEM_FLAG_STREAMING the data is requested with 'G' instead of 'C'
+// (YMODEM-g): the sender doesn't wait for an ACK after each block and any
+// error cancels the transfer.
+// Returns the number of bytes received or an error code
+long xmodem_receive_stream( p_xm_sink_func sink, void *pdata, int flags )
+{
+  int starting = 1, ymodem = 0, ch, res;
+  int streaming = ( flags & XMODEM_FLAG_STREAMING ) != 0;
+  char startch = streaming ? 'G' : 'C';
+  unsigned char packnum = 1, *pbuf, *pheld, *ptemp;
+  unsigned retries = XMODEM_RETRY_LIMIT, size, heldsize = 0;
+  u32 total = 0, filesize = XMODEM_NO_SIZE;
   void *p;
+
+  // Two packet buffers: the last data block is written only when the next one
+  // arrives (or at the end of the transfer, without the padding)
+  if( ( p = malloc( 2 * ( PXM_ACKET_SIZE_1K + 4 ) ) ) == NULL )
+    return XMODEM_ERROR_OUTOFMEM;
+  pbuf = ( unsigned char* )p;
+  pheld = pbuf + PXM_ACKET_SIZE_1K + 4;
   
   while( retries-- ) 
   {
     if( starting )
-      xmodem_out_func( 'C' );
-    if( ( ( ch = xmodem_in_func( XMODEM_TIMEOUT ) ) == -1 ) || ( ch != XM_SOH && ch != XM_EOT && ch != XM_CAN ) )
+      xmodem_out_func( startch );
+    if( ( ( ch = xmodem_in_func( XMODEM_TIMEOUT ) ) == -1 ) || ( ch != XM_SOH && ch != XM_STX && ch != XM_EOT && ch != XM_CAN ) )
+    {
+      if( streaming && !starting )
+        break;
       continue;
+    }
     if( ch == XM_EOT ) 
     {
-      // End of transmission
+      // End of transmission, write the last block
+      if( heldsize && ( res = xmodem_write( sink, pdata, pheld + 2, heldsize, 1, filesize, &total ) ) != 0 )
+      {
+        xmodem_flush( XMODEM_FLUSH_AND_XM_CAN );
+        free( p );
+        return res;
+      }
       xmodem_out_func( XM_ACK );
+      if( ymodem )
+        xmodem_end_batch( startch );
       xmodem_flush( XMODEM_FLUSH_ONLY );
-      return size;
+      free( p );
+      return total;
     }
     else if( ch == XM_CAN )
     {
       // The remote part ended the transmission
       xmodem_out_func( XM_ACK );
       xmodem_flush( XMODEM_FLUSH_ONLY );
+      free( p );
       return XMODEM_ERROR_REMOTECANCEL;      
     }
-    starting = 0;
+    size = ch == XM_STX ? PXM_ACKET_SIZE_1K : PXM_ACKET_SIZE;
     
     // Get XMODEM packet
-    if( !xmodem_get_record( packnum, buf ) )
+    if( ( res = xmodem_get_record( pbuf, size ) ) == -1 )
+    {
+      if( streaming && !starting )
+        break;
+      xmodem_out_func( XM_NAK );
       continue; // allow for retransmission
-    xmodem_flush( XMODEM_FLUSH_ONLY );      
+    }
+    if( starting && res == 0 )
+    {
+      // YMODEM header: file name, then the file size in decimal
+      ymodem = 1;
+      if( pbuf[ 2 ] == '\0' )
+      {
+        // Empty batch
+        xmodem_out_func( XM_ACK );
+        free( p );
+        return 0;
+      }
+      pbuf[ size + 1 ] = '\0';
+      ptemp = pbuf + 2 + strlen( ( char* )pbuf + 2 ) + 1;
+      if( *ptemp >= '0' && *ptemp <= '9' )
+        filesize = strtoul( ( char* )ptemp, NULL, 10 );
+      if( !streaming )
+        xmodem_out_func( XM_ACK );
+      retries = XMODEM_RETRY_LIMIT;
+      continue; // the sender waits for another 'C'/'G'
+    }
+    if( !starting && !streaming && res == ( unsigned char )( packnum - 1 ) )
+    {
+      // Retransmission of the previous block (our ACK was lost)
+      xmodem_out_func( XM_ACK );
+      continue;
+    }
+    if( res != packnum )
+    {
+      xmodem_flush( XMODEM_FLUSH_AND_XM_CAN );
+      free( p );
+      return XMODEM_ERROR_OUTOFSYNC;
+    }
+    starting = 0;
     retries = XMODEM_RETRY_LIMIT;
     packnum ++;
       
-    // Got a valid packet
-    if( size + PXM_ACKET_SIZE > limit )
+    // Got a valid packet, write the previous one (the sender waits for our ACK
+    // in the meantime, except when streaming)
+    if( heldsize && ( res = xmodem_write( sink, pdata, pheld + 2, heldsize, 0, filesize, &total ) ) != 0 )
     {
-      limit += XMODEM_INCREMENT_AMMOUNT;
-      if( ( p = realloc( *dest, limit ) ) == NULL )
-      {
-        // Not enough memory, force cancel and return
-        xmodem_flush( XMODEM_FLUSH_AND_XM_CAN );
-        return XMODEM_ERROR_OUTOFMEM;
-      }
-      *dest = ( char* )p;
-    }    
-    // Acknowledge and consume packet
-    xmodem_out_func( XM_ACK );
-    memcpy( *dest + size, buf + 2, PXM_ACKET_SIZE );
-    size += PXM_ACKET_SIZE;
+      xmodem_flush( XMODEM_FLUSH_AND_XM_CAN );
+      free( p );
+      return res;
+    }
+    if( !streaming )
+    {
+      xmodem_flush( XMODEM_FLUSH_ONLY );
+      // Acknowledge packet
+      xmodem_out_func( XM_ACK );
+    }
+    // Keep the packet until the next one arrives
+    ptemp = pheld;
+    pheld = pbuf;
+    pbuf = ptemp;
+    heldsize = size;
   }
   
-  // Exceeded retry count
+  // Exceeded retry count (or error while streaming)
   xmodem_flush( XMODEM_FLUSH_AND_XM_CAN );
-  return XMODEM_ERROR_RETRYEXCEED;
+  free( p );
+  return streaming && !starting ? XMODEM_ERROR_STREAM : XMODEM_ERROR_RETRYEXCEED;
+}
+
+// Sink used to receive a file in memory
+typedef struct
+{
+  char *pdest;
+  u32 size;
+  u32 limit;
+} XMODEM_MEM_SINK;
+
+static int xmodem_mem_sink( const u8 *pdata, unsigned size, void *psink )
+{
+  XMODEM_MEM_SINK *pm = ( XMODEM_MEM_SINK* )psink;
+  void *p;
+
+  if( pm->size + size > pm->limit )
+  {
+    pm->limit += size > XMODEM_INCREMENT_AMMOUNT ? size : XMODEM_INCREMENT_AMMOUNT;
+    if( ( p = realloc( pm->pdest, pm->limit ) ) == NULL )
+      return XMODEM_ERROR_OUTOFMEM;
+    pm->pdest = ( char* )p;
+  }
+  memcpy( pm->pdest + pm->size, pdata, size );
+  pm->size += size;
+  return 0;
+}
+
+// This global function receives a x-modem transmission in memory.
+// '*dest' must be a buffer of XMODEM_INITIAL_BUFFER_SIZE bytes allocated with
+// malloc, it is reallocated as needed. Returns the number of bytes received or
+// an error code an error
+long xmodem_receive( char **dest )
+{
+  XMODEM_MEM_SINK sink;
+  long res;
+
+  sink.pdest = *dest;
+  sink.size = 0;
+  sink.limit = XMODEM_INITIAL_BUFFER_SIZE;
+  res = xmodem_receive_stream( xmodem_mem_sink, &sink, 0 );
+  *dest = sink.pdest;
+  return res;
 }
 
 #else // #ifdef BUILD_XMODEM
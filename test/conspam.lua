@@ -0,0 +1,10 @@
+-- Console output load, used with "simeth bench" (see doc/en/simeth.txt)
+-- Prints a lot of lines on the console, then a marker line.
+-- Copy it to romfs/ before building the image. "simeth bench" runs it as 'lua /rom/conspam.lua [<lines>]'.
+
+local lines = tonumber( ( ... ) ) or 2000
+
+for i = 1, lines do
+  print( string.format( "%6d the quick brown fox jumps over the lazy dog", i ) )
+end
+print "conspam: done"
@@ -0,0 +1,33 @@
+-- File system benchmark: measures the time needed to open a file in a directory with many files.
+-- Usage: 'lua /rom/fsbench.lua [dir [count]]' (defaults: /wo, 200 files)
+-- For /wo the files are created by the script the first time it runs. For /rom generate them
+-- before building the image, for example with:
+--   for i in $(seq 1 500); do echo "return $i" > romfs/file$i.lua; done
+
+local dir, count = arg[ 1 ] or "/wo", tonumber( arg[ 2 ] ) or 200
+
+local function existing( i ) return string.format( "%s/file%d.lua", dir, i ) end
+local function missing( i ) return string.format( "%s/none%d.lua", dir, i ) end
+
+if dir == "/wo" then
+  for i = 1, count do
+    local f = io.open( existing( i ), "rb" )
+    if not f then
+      f = io.open( existing( i ), "wb" )
+      f:write( "return " .. i )
+    end
+    f:close()
+  end
+end
+
+-- Returns the average time (in us) needed to open (and close) the files given by 'fname'
+local function bench( fname )
+  local start = tmr.read( tmr.SYS_TIMER )
+  for i = 1, count do
+    local f = io.open( fname( i ), "rb" )
+    if f then f:close() end
+  end
+  return tmr.gettimediff( tmr.SYS_TIMER, start, tmr.read( tmr.SYS_TIMER ) ) / count
+end
+
+print( string.format( "%s, %d files: %d us per open, %d us per failed open", dir, count, bench( existing ), bench( missing ) ) )
@@ -0,0 +1,17 @@
+-- io.mapfile test. Usage: 'lua /rom/mapfile.lua [file]' (default: this file)
+-- Maps a ROMFS file as a read-only string, checks it against the content read with file:read
+-- and prints the RAM used by io.mapfile (only the string header for a ROMFS file).
+
+local fname = arg[ 1 ] or "/rom/mapfile.lua"
+
+collectgarbage( "collect" )
+local before = collectgarbage( "count" )
+local mapped = assert( io.mapfile( fname ) )
+local used = collectgarbage( "count" ) - before
+
+-- Read the file in small chunks for comparison
+local f, chunks = assert( io.open( fname, "rb" ) ), {}
+for c in function() return f:read( 64 ) end do chunks[ #chunks + 1 ] = c end
+f:close()
+print( string.format( "%s: %d bytes, %.2f KB of RAM used by io.mapfile", fname, #mapped, used ) )
+print( mapped == table.concat( chunks ) and "MAPFILE OK" or "MAPFILE content mismatch" )
@@ -0,0 +1,45 @@
+-- MMC/SD file system benchmark: sequential and random throughput on /mmc.
+-- Usage: 'lua /rom/mmcbench.lua [size]' (default size: 256KB)
+-- Compare the results with different MMCFS_CACHE_LINES/MMCFS_CACHE_LINE_SECTORS settings.
+-- On the simulator, the card is the 'sdcard.img' file (a FAT image) in the current directory.
+
+local size = tonumber( arg[ 1 ] ) or 256 * 1024
+local fname = "/mmc/bench.dat"
+
+local function now() return tmr.read( tmr.SYS_TIMER ) end
+local function report( name, start, bytes )
+  local us = tmr.gettimediff( tmr.SYS_TIMER, start, now() )
+  print( string.format( "%-24s %8d bytes in %8d us (%d KB/s)", name, bytes, us, us > 0 and bytes * 1000000 / ( us * 1024 ) or 0 ) )
+end
+
+local block = string.rep( "0123456789abcdef", 4 )
+
+-- Sequential write, 64 bytes at a time
+local f = assert( io.open( fname, "wb" ) )
+local start = now()
+for i = 1, size / #block do f:write( block ) end
+f:close()
+report( "sequential write", start, size )
+
+-- Sequential read, 64 bytes at a time
+f = assert( io.open( fname, "rb" ) )
+start = now()
+local total = 0
+while true do
+  local data = f:read( #block )
+  if not data then break end
+  total = total + #data
+end
+f:close()
+report( "sequential read", start, total )
+
+-- Random reads, 32 bytes at random offsets
+f = assert( io.open( fname, "rb" ) )
+start = now()
+total = 0
+for i = 1, 500 do
+  f:seek( "set", math.random( 0, size - 32 ) )
+  total = total + #f:read( 32 )
+end
+f:close()
+report( "random read", start, total )
@@ -0,0 +1,47 @@
+-- Multiple MMC/SD cards test (MMCFS_NUM_CARDS > 1). Usage: 'lua /rom/mmcmulti.lua [ncards]'
+-- Keeps several files open at the same time on all the cards (/mmc, /mmc1, ...), writes them
+-- interleaved, appends to them and checks their content. On the simulator the cards are the
+-- 'sdcard.img' and 'sdcard1.img' files (FAT images) in the current directory.
+
+local ncards = tonumber( arg[ 1 ] ) or 2
+local nfiles, nlines = 3, 100
+
+local function card( c ) return c == 0 and "/mmc" or "/mmc" .. c end
+local function fname( c, i ) return string.format( "%s/multi%d.txt", card( c ), i ) end
+local function line( c, i, l ) return string.format( "card %d file %d line %d\n", c, i, l ) end
+
+-- Open all the files at the same time
+local files = {}
+for c = 0, ncards - 1 do
+  for i = 1, nfiles do
+    files[ #files + 1 ] = { c = c, i = i, f = assert( io.open( fname( c, i ), "wb" ) ) }
+  end
+end
+
+-- Interleaved writes
+for l = 1, nlines do
+  for _, e in ipairs( files ) do assert( e.f:write( line( e.c, e.i, l ) ) ) end
+end
+for _, e in ipairs( files ) do e.f:close() end
+
+-- Append a last line to each file
+for _, e in ipairs( files ) do
+  local f = assert( io.open( fname( e.c, e.i ), "ab" ) )
+  assert( f:write( line( e.c, e.i, nlines + 1 ) ) )
+  f:close()
+end
+
+-- Check the content of the files
+local bad = 0
+for _, e in ipairs( files ) do
+  local f = assert( io.open( fname( e.c, e.i ), "rb" ) )
+  local data = f:read( "*a" )
+  f:close()
+  local exp = {}
+  for l = 1, nlines + 1 do exp[ l ] = line( e.c, e.i, l ) end
+  if data ~= table.concat( exp ) then
+    print( fname( e.c, e.i ) .. ": bad content" )
+    bad = bad + 1
+  end
+end
+print( bad == 0 and "MMC OK" or string.format( "%d bad file(s)", bad ) )
@@ -0,0 +1,43 @@
+-- Network echo server, used with "simeth bench" (see doc/en/simeth.txt)
+-- Echoes everything received on a TCP port and on an UDP port.
+-- Copy it to romfs/ before building the image and start it with 'lua /rom/netbench.lua'.
+
+local tcp_port, udp_port = 5000, 5001
+
+local usock = net.socket( net.SOCK_DGRAM )
+if net.bind( usock, udp_port ) ~= 0 then
+  print "Unable to bind the UDP socket"
+  return
+end
+local clients = {}
+print( string.format( "Echo server on TCP port %d and UDP port %d", tcp_port, udp_port ) )
+net.stats( true )
+
+while true do
+  local rsocks = { usock }
+  for s in pairs( clients ) do table.insert( rsocks, s ) end
+  local r, _, a = net.select( rsocks, nil, { tcp_port } )
+  if #a > 0 then
+    local s = net.accept( tcp_port, nil, net.NO_TIMEOUT )
+    if s ~= -1 then clients[ s ] = true end
+  end
+  for _, s in ipairs( r ) do
+    if s == usock then
+      local data, ip, port = net.recvfrom( usock, 1024, nil, net.NO_TIMEOUT )
+      if #data > 0 then net.sendto( usock, data, ip, port ) end
+    else
+      local data, err = net.recv( s, 1024, nil, net.NO_TIMEOUT )
+      if #data > 0 then net.send( s, data ) end
+      if err ~= net.ERR_OK and err ~= net.ERR_TIMEOUT then
+        net.close( s )
+        clients[ s ] = nil
+        -- Show the CPU cost of the test when the last client is gone
+        if next( clients ) == nil then
+          local st = net.stats( true )
+          print( string.format( "%d frames, %.1f us/frame, longest interrupt %d us", st.rxframes, 
+            st.rxframes > 0 and st.rxtime / st.rxframes or 0, st.isrmax ) )
+        end
+      end
+    end
+  end
+end
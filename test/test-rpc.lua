@@ -4,16 +4,26 @@ end
 
 rpc.on_error (error_handler);
 
-slave,err = rpc.connect ("/dev/tty.usbserial-FTE3HV7L");
+-- Usage: luarpc test-rpc.lua [port [desktop]]
+-- To run against a desktop server instead of a board, create a pty pair
+-- (for example with 'socat -d -d pty,raw,echo=0 pty,raw,echo=0'), start
+-- the server on one end with luarpc -e "rpc.server('/dev/pts/N')" and run
+-- this test on the other end with 'desktop' as the second argument.
+port = arg and arg[1] or "/dev/tty.usbserial-FTE3HV7L"
+desktop = arg and arg[2] == "desktop"
+
+slave,err = rpc.connect (port);
 -- slave,err = rpc.connect ("/dev/tty.usbserial-ftCYPMYJ");
 -- slave,err = rpc.connect("/dev/tty.usbserial-04110857B")
 -- slave,err = rpc.connect("/dev/tty.usbserial-A9005fG0")
 --slave,err = rpc.connect ("/dev/ttys0");
 
-print("Platform: " .. slave.pd.platform())
-print("CPU: " .. slave.pd.cpu())
-print("Board: " .. slave.pd.board())
-print("CPU Clock: " .. slave.cpu.clock()/1000000 .. " MHz")
+if not desktop then
+  print("Platform: " .. slave.pd.platform())
+  print("CPU: " .. slave.pd.cpu())
+  print("Board: " .. slave.pd.board())
+  print("CPU Clock: " .. slave.cpu.clock()/1000000 .. " MHz")
+end
 
 function mirror( input ) return input end
 function squareval(x) return x*x end
@@ -54,6 +64,71 @@ for idx,val in ipairs(a) do
   assert(val.x:get() == tval, "missing parent helper")
 end
 
+-- cached helpers and remote paths
+local m = slave.mirror
+assert(m == slave.mirror, "helper not cached")
+rpc.invalidate(slave)
+assert(m(7) == 7, "call with old helper after invalidation failed")
+assert(slave.mirror(8) == 8, "call after invalidation failed")
+if not desktop then
+  -- values read from rotables are fetched only once
+  assert(slave.pio.OUTPUT:get() == slave.pio.OUTPUT:get(), "read-only value cache failed")
+end
+
+-- async (pipelined) calls
+local f1 = rpc.async(slave.string.byte, "AB", 1, 2)
+local f2 = rpc.async(slave.mirror, { 3 })
+assert(rpc.wait(f2)[1] == 3, "async table return failed")
+local r1, r2 = rpc.wait(f1)
+assert(r1 == 65 and r2 == 66, "async multiple return failed")
+assert(rpc.ready(f1), "completed future not ready")
+local f3 = rpc.async(slave.mirror, 4)
+assert(slave.mirror(5) == 5, "sync call after async failed")
+assert(rpc.wait(f3) == 4, "async result lost by sync call")
+for i = 1, 5 do rpc.async(slave.mirror, i) end
+collectgarbage()
+assert(slave.mirror(6) == 6, "results of collected futures not dropped")
+
+-- batch calls
+local res = rpc.batch{ { slave.mirror, 6 }, { slave.squareval_undefined, 1 }, { slave.string.rep, "ab", 2 } }
+assert(res[1][1] == true and res[1][2] == 6, "batch call failed")
+assert(res[2][1] == false, "batch error not reported")
+assert(res[3][2] == "abab", "batch nested call failed")
+
+-- benchmark: synchronous vs pipelined vs batch, reported as wall clock time per call.
+-- os.clock() can't be used (it counts only the CPU time of this process, not the time
+-- spent waiting for the server) and os.time() counts whole seconds, so each mode starts
+-- on a second boundary and runs rounds of 'nround' calls until 'mintime' seconds passed.
+-- The error is at most one round.
+local nround = desktop and 1000 or 50
+local mintime = desktop and 2 or 5
+local function bench(name, round)
+  local t = os.time()
+  while os.time() == t do end
+  t = os.time()
+  local n = 0
+  repeat
+    round()
+    n = n + nround
+  until os.difftime(os.time(), t) >= mintime
+  local elapsed = os.difftime(os.time(), t)
+  print(string.format("%-6s %6d calls in %ds, %8.1f us/call", name, n, elapsed, elapsed * 1e6 / n))
+end
+bench("sync", function()
+  for i = 1, nround do assert(slave.mirror(i) == i) end
+end)
+bench("async", function()
+  local futures = {}
+  for i = 1, nround do futures[i] = rpc.async(slave.mirror, i) end
+  for i = 1, nround do assert(rpc.wait(futures[i]) == i) end
+end)
+bench("batch", function()
+  local calls = {}
+  for i = 1, nround do calls[i] = { slave.mirror, i } end
+  local res = rpc.batch(calls)
+  for i = 1, nround do assert(res[i][2] == i) end
+end)
+
 print("Memory Used: " .. slave.collectgarbage("count") .. " kB")
 
 -- adc = slave.adc
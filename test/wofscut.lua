@@ -0,0 +1,125 @@
+-- WOFS power failure test with several files opened for writing. Usage: 'lua /rom/wofscut.lua [write|check] [log]'
+-- 'write' keeps two files opened for writing while other files are created and closed (some files are also
+-- opened again with truncation while still opened), 'check' verifies that all the closed files are still
+-- there and complete and that new files can be created.
+-- 'write' records which files must exist in 'log' (default: /mmc/wofscut.log) before and after each
+-- operation that changes this, 'check' reads it back. The log must not be on WOFS.
+-- On the simulator, if /tmp/wofs.cut contains 'w' followed by a number N, the simulator exits during
+-- the N-th flash operation done while files are opened for writing. For example:
+--   for n in $(seq 1 300); do echo w$n > /tmp/wofs.cut; <run 'wofscut.lua write'>; <run 'wofscut.lua check'>; done
+
+local mode = arg[ 1 ] or "write"
+local logname = arg[ 2 ] or "/mmc/wofscut.log"
+local nversions = 200
+
+-- The content of a file depends on its name and version, which are also stored at the beginning of the file
+local function content( name, v )
+  local t = {}
+  for i = 0, 49 + ( v * 37 ) % 700 do t[ #t + 1 ] = string.char( 65 + ( v + i ) % 26 ) end
+  return string.format( "%s:%d:", name, v ) .. table.concat( t )
+end
+
+-- All the names used by the test
+local function names()
+  local t = {}
+  for _, dir in ipairs{ "a", "b", "c" } do
+    for i = 0, 4 do t[ #t + 1 ] = string.format( "/wo/cut%s%d", dir, i ) end
+  end
+  return t
+end
+
+-- Expected state of each file: 'must' (the file was closed) and the versions it can have.
+-- Every change is appended to the log: "<name> <must> [<version>]"
+local expected = {}
+local function expect( name, must, v )
+  expected[ name ] = { must = must, v = v }
+  local f = assert( io.open( logname, "a" ) )
+  f:write( string.format( "%s %d %s\n", name, must and 1 or 0, v or "" ) )
+  f:close()
+end
+
+-- Open a file with truncation (the old copy might survive if the power fails during the open)
+local function topen( name )
+  local old = expected[ name ]
+  expect( name, false, old and old.must and old.v )
+  local f = assert( io.open( name, "wb" ) )
+  expect( name, false )
+  return f
+end
+
+-- Close a file: it must exist with version 'v' afterwards
+local function tclose( f, name, v )
+  expect( name, false, v )
+  f:close()
+  expect( name, true, v )
+end
+
+local function check()
+  local bad, n = 0, 0
+  for _, name in ipairs( names() ) do
+    local e = expected[ name ] or { must = false }
+    local f = io.open( name, "rb" )
+    if f then
+      local data = f:read( "*a" )
+      f:close()
+      local v = tonumber( data:match( "^[^:]+:(%d+):" ) )
+      if not v or data ~= content( name, v ) then
+        print( name .. ": bad content" )
+        bad = bad + 1
+      elseif v ~= e.v then
+        print( string.format( "%s: unexpected version %d", name, v ) )
+        bad = bad + 1
+      end
+      n = n + 1
+    elseif e.must then
+      print( string.format( "%s: closed file (version %d) is missing", name, e.v ) )
+      bad = bad + 1
+    end
+  end
+  return bad, n
+end
+
+if mode == "check" then
+  for l in io.lines( logname ) do
+    local name, must, v = l:match( "^(%S+) (%d) ?(%d*)" )
+    expected[ name ] = { must = must == "1", v = tonumber( v ) }
+  end
+  local bad, n = check()
+  -- A new file must not overwrite the existing ones
+  local f = assert( io.open( "/wo/cutnew", "wb" ) )
+  assert( f:write( content( "/wo/cutnew", 1 ) ) )
+  f:close()
+  bad = bad + check()
+  print( bad == 0 and string.format( "WOFS OK (%d files)", n ) or string.format( "%d bad file(s)", bad ) )
+else
+  assert( io.open( logname, "w" ) ):close()
+  for v = 1, nversions do
+    local na, nb, nc = "/wo/cuta" .. v % 3, "/wo/cutb" .. v % 4, "/wo/cutc" .. v % 5
+    local da, db, dc = content( na, v ), content( nb, v ), content( nc, v )
+    local fa = topen( na )
+    fa:write( da:sub( 1, math.floor( #da / 2 ) ) )
+    -- Open the same file again while it's still opened for writing: its first copy is deleted
+    local fa2
+    if v % 4 == 0 then
+      fa2 = topen( na )
+      fa2:write( da:sub( 1, math.floor( #da / 2 ) ) )
+    end
+    local fb = topen( nb )
+    fa:write( da:sub( math.floor( #da / 2 ) + 1 ) )
+    if fa2 then fa2:write( da:sub( math.floor( #da / 2 ) + 1 ) ) end
+    fb:write( db:sub( 1, math.floor( #db / 3 ) ) )
+    -- Created and closed while the other two files are still opened for writing
+    local fc = topen( nc )
+    fc:write( dc )
+    tclose( fc, nc, v )
+    fb:write( db:sub( math.floor( #db / 3 ) + 1 ) )
+    if fa2 then
+      fa:close()
+      tclose( fa2, na, v )
+    else
+      tclose( fa, na, v )
+    end
+    tclose( fb, nb, v )
+  end
+  print( check() == 0 and "WOFS OK" or "WOFS corrupted" )
+end
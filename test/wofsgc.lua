@@ -0,0 +1,47 @@
+-- WOFS compaction test (WOFS_ENABLE_COMPACTION). Usage: 'lua /rom/wofsgc.lua [fill|check]'
+-- 'fill' keeps overwriting a few files in /wo until WOFS is compacted, 'check' verifies their
+-- content. Power failures can be simulated on the simulator: if /tmp/wofs.cut contains a number N,
+-- the simulator exits during the N-th flash operation of the next compaction. For example:
+--   for n in $(seq 1 300); do echo $n > /tmp/wofs.cut; <run 'wofsgc.lua fill'>; <run 'wofsgc.lua check'>; done
+-- (the interrupted compaction is completed when the simulator starts again)
+
+local mode = arg[ 1 ] or "fill"
+local nfiles, maxwrites = 8, 2000
+
+local function fname( i ) return string.format( "/wo/gc%d.txt", i ) end
+
+-- The content of a file depends on its version, which is also stored at the beginning of the file
+local function content( i, v )
+  return string.format( "%d\n", v ) .. string.rep( string.char( 65 + ( i + v ) % 26 ), 300 + ( i * 97 + v * 31 ) % 1500 )
+end
+
+local function check()
+  local bad = 0
+  for i = 1, nfiles do
+    local f = io.open( fname( i ), "rb" )
+    if f then
+      local data = f:read( "*a" )
+      f:close()
+      local v = tonumber( data:match( "^(%d+)\n" ) )
+      if not v or data ~= content( i, v ) then
+        print( fname( i ) .. ": bad content" )
+        bad = bad + 1
+      end
+    end
+  end
+  return bad
+end
+
+if mode == "check" then
+  local bad = check()
+  print( bad == 0 and "WOFS OK" or string.format( "%d bad file(s)", bad ) )
+else
+  for v = 1, maxwrites do
+    local i = v % nfiles + 1
+    local f = assert( io.open( fname( i ), "wb" ) )
+    local data = content( i, v )
+    assert( f:write( data ) )
+    f:close()
+  end
+  print( check() == 0 and "WOFS OK" or "WOFS corrupted" )
+end
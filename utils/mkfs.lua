@@ -13,6 +13,17 @@ local maxlen = 30
 local _fcnt = 0
 local alignment = 4
 local outfile
+local idxmagic = { 0, 73, 68, 90 } -- "\0IDZ" (index, file data followed by a '\0')
+
+-- Name hash used by the directory index (must match romfsh_hash in src/romfs.c)
+local function _hash( fname )
+  local h = 0
+  fname = fname:lower()
+  for i = 1, #fname do
+    h = ( h * 31 + fname:byte( i ) ) % 4294967296
+  end
+  return h
+end
 
 -- Line output function
 local function _add_data( data, outfile, moredata )
@@ -32,6 +43,14 @@ local function _add_data( data, outfile, moredata )
   end
 end
 
+-- Write a 32-bit little endian number
+local function _add_u32( data, outfile )
+  for i = 1, 4 do
+    _add_data( data % 256, outfile )
+    data = math.floor( data / 256 )
+  end
+end
+
 -- dirname - the directory where the files are located.
 -- outname - the name of the C output
 -- flist - list of files
@@ -53,6 +72,7 @@ function mkfs( dirname, outname, flist, mode, compcmd )
   _crtline = '  '
   _numdata = 0
   _bytecnt = 0
+  local files = {}
 
   -- Generate headers
   outfile:write( "// Generated by mkfs.lua\n// DO NOT MODIFY\n\n" )
@@ -116,32 +136,57 @@ function mkfs( dirname, outname, flist, mode, compcmd )
         if fextpart == ".lua" and mode ~= "verbatim" then
           os.remove( newname )
         end
-        -- Write name, size, id, numpars
-        _fcnt = 0
-        for i = 1, #fname do
-          _add_data( fname:byte( i ), outfile )
-        end
-        _add_data( 0, outfile ) -- ASCIIZ
-        local plen = string.pack( "<i", #filedata )
-         -- Round to a multiple of 'alignment'
-        while _bytecnt % alignment ~= 0 do
-          _add_data( 0, outfile )
-        end
-        -- Write size
-        _add_data( plen:byte( 1 ), outfile )
-        _add_data( plen:byte( 2 ), outfile )
-        _add_data( plen:byte( 3 ), outfile )
-        _add_data( plen:byte( 4 ), outfile )
-       -- Then write the rest of the file
-        for i = 1, #filedata do
-          _add_data( filedata:byte( i ), outfile )
-        end
-        -- Report
-        print( sf( "Encoded file %s (%d bytes real size, %d bytes encoded size)", fname, #filedata, _fcnt ) )
+        table.insert( files, { name = fname, data = filedata } )
       end
     end
   end
-    
+
+  -- Compute the offset of each file header, then write the directory index
+  -- (magic, number of entries, then (hash, offset) pairs sorted by hash)
+  local offset = #idxmagic + 4 + 8 * #files
+  local index = {}
+  for _, f in ipairs( files ) do
+    table.insert( index, { hash = _hash( f.name ), offset = offset } )
+    offset = offset + #f.name + 1
+    offset = offset + ( alignment - offset % alignment ) % alignment
+    offset = offset + 4 + #f.data + 1
+  end
+  table.sort( index, function( a, b )
+    if a.hash ~= b.hash then return a.hash < b.hash end
+    return a.offset < b.offset
+  end )
+  for _, v in ipairs( idxmagic ) do
+    _add_data( v, outfile )
+  end
+  _add_u32( #index, outfile )
+  for _, e in ipairs( index ) do
+    _add_u32( e.hash, outfile )
+    _add_u32( e.offset, outfile )
+  end
+
+  -- Write the files: name, size, data
+  for _, f in ipairs( files ) do
+    local fname, filedata = f.name, f.data
+    _fcnt = 0
+    for i = 1, #fname do
+      _add_data( fname:byte( i ), outfile )
+    end
+    _add_data( 0, outfile ) -- ASCIIZ
+     -- Round to a multiple of 'alignment'
+    while _bytecnt % alignment ~= 0 do
+      _add_data( 0, outfile )
+    end
+    -- Write size
+    _add_u32( #filedata, outfile )
+    -- Then write the rest of the file
+    for i = 1, #filedata do
+      _add_data( filedata:byte( i ), outfile )
+    end
+    _add_data( 0, outfile ) -- terminator (not part of the file)
+    -- Report
+    print( sf( "Encoded file %s (%d bytes real size, %d bytes encoded size)", fname, #filedata, _fcnt ) )
+  end
+
   -- All done, write the final "0xFF" (terminator)
   _add_data( 0xFF, outfile, false )
   outfile:write( "};\n\n#endif\n" );